@@ -8,8 +8,11 @@
 #include "operations.h"
 
 #include "debug.h"
+#include "utils.h"
 #include <glog/logging.h>
 
+#include <ATen/detail/CUDAHooksInterface.h>
+
 namespace common {
 
 torch::Tensor repeat2d(torch::Tensor data, at::IntList sizes) {
@@ -183,7 +186,22 @@ scatterSum2d(torch::Tensor positions, torch::Tensor data, at::IntList sizes) {
   }
 }
 
-torch::Tensor makeBatch(ag::tensor_list const& lst, double pad) {
+torch::Tensor emptyPinned(at::IntList sizes, at::TensorOptions options) {
+  static bool const haveGpu = gpuAvailable();
+  options = options.device(torch::kCPU);
+  if (!haveGpu) {
+    return torch::empty(sizes, options);
+  }
+  // Like Tensor::pin_memory(), but without copying data to the new tensor
+  auto allocator = at::detail::getCUDAHooks().getPinnedMemoryAllocator();
+  auto tensor =
+      at::getNonVariableType(
+          at::Backend::CPU, at::typeMetaToScalarType(options.dtype()))
+          .tensorWithAllocator(sizes, allocator);
+  return torch::autograd::make_variable(tensor, false);
+}
+
+torch::Tensor makeBatch(ag::tensor_list const& lst, double pad, bool pinned) {
   auto batchSize = lst.size();
   if (batchSize < 1) {
     throw std::runtime_error("makeBatch: Batch cannot have 0 elements");
@@ -198,13 +216,21 @@ torch::Tensor makeBatch(ag::tensor_list const& lst, double pad) {
       sizes[j] = std::max(sizes[j], elemSize[j]);
     }
   }
-  if (!sizeMismatch) {
+  if (!sizeMismatch && !pinned) {
     // if all the elements have the same size, we use stack, which is faster
     return at::stack(lst);
   }
   sizes.insert(sizes.begin(), batchSize);
 
-  auto batch = torch::empty(sizes, lst[0].options()).fill_(pad);
+  torch::Tensor batch;
+  if (pinned) {
+    batch = emptyPinned(sizes, lst[0].options());
+    if (sizeMismatch) {
+      batch.fill_(pad);
+    }
+  } else {
+    batch = torch::empty(sizes, lst[0].options()).fill_(pad);
+  }
 
   for (auto i = 0U; i < batchSize; i++) {
     auto slice = batch[i];
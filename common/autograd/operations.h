@@ -51,6 +51,13 @@ torch::Tensor repeat2d(torch::Tensor data, at::IntList sizes);
 torch::Tensor
 scatterSum2d(torch::Tensor positions, torch::Tensor data, at::IntList sizes);
 
+/**
+ * Allocates an uninitialized CPU tensor in page-locked memory, which speeds up
+ * (and permits asynchronous) copies to the GPU. If no GPU is available, regular
+ * memory is used instead.
+ */
+torch::Tensor emptyPinned(at::IntList sizes, at::TensorOptions options = {});
+
 /**
  * Equivalent to a stack along dim 0 of the input, but with the values
  * padded correct so the size is rectangular
@@ -58,8 +65,11 @@ scatterSum2d(torch::Tensor positions, torch::Tensor data, at::IntList sizes);
  * For example, if the list has size [(6, 2), (5, 2), (7, 3)]
  * The result is a tensor of (3, 7, 3)
  *
+ * If pinned is true, the batch will be gathered directly into page-locked
+ * memory (see emptyPinned()).
  **/
-torch::Tensor makeBatch(ag::tensor_list const&, double pad = 0);
+torch::Tensor
+makeBatch(ag::tensor_list const&, double pad = 0, bool pinned = false);
 
 /**
  * This function works similarly as makeBatch but handles more input types.
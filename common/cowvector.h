@@ -0,0 +1,179 @@
+/*
+ * Copyright (c) 2017-present, Facebook, Inc.
+ *
+ * This source code is licensed under the MIT license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <initializer_list>
+#include <memory>
+#include <utility>
+#include <vector>
+
+namespace common {
+
+/**
+ * A vector with copy-on-write semantics.
+ *
+ * Copies share their storage until one of them is modified, which makes
+ * copying cheap. Any non-const access is considered a modification and will
+ * copy the storage first if it is shared. Hence, pointers and iterators
+ * obtained via non-const access stay valid until the vector is resized or
+ * copied from; use const access wherever possible to avoid needless copies.
+ *
+ * Empty vectors do not allocate any storage. Like with std::vector, distinct
+ * instances may be used from different threads.
+ */
+template <typename T>
+class CowVector {
+ public:
+  using value_type = T;
+  using size_type = size_t;
+  using iterator = T*;
+  using const_iterator = T const*;
+  using reference = T&;
+  using const_reference = T const&;
+
+  CowVector() = default;
+  CowVector(std::initializer_list<T> init)
+      : CowVector(init.begin(), init.end()) {}
+  template <typename It>
+  CowVector(It first, It last) {
+    if (first != last) {
+      data_ = std::make_shared<std::vector<T>>(first, last);
+    }
+  }
+  explicit CowVector(std::vector<T> v) {
+    if (!v.empty()) {
+      data_ = std::make_shared<std::vector<T>>(std::move(v));
+    }
+  }
+
+  size_t size() const {
+    return data_ ? data_->size() : 0;
+  }
+  bool empty() const {
+    return size() == 0;
+  }
+  /// Returns whether storage is shared with another CowVector
+  bool shared() const {
+    return data_ && data_.use_count() > 1;
+  }
+
+  T const* data() const {
+    return cdata();
+  }
+  T const* begin() const {
+    return cdata();
+  }
+  T const* end() const {
+    return cdata() + size();
+  }
+  T const* cbegin() const {
+    return begin();
+  }
+  T const* cend() const {
+    return end();
+  }
+  T const& operator[](size_t i) const {
+    return (*data_)[i];
+  }
+  T const& front() const {
+    return data_->front();
+  }
+  T const& back() const {
+    return data_->back();
+  }
+
+  T* data() {
+    return data_ ? mut().data() : nullptr;
+  }
+  T* begin() {
+    return data();
+  }
+  T* end() {
+    return data() + size();
+  }
+  T& operator[](size_t i) {
+    return mut()[i];
+  }
+  T& front() {
+    return mut().front();
+  }
+  T& back() {
+    return mut().back();
+  }
+
+  void reserve(size_t n) {
+    mut().reserve(n);
+  }
+  void resize(size_t n) {
+    if (n != size()) {
+      mut().resize(n);
+    }
+  }
+  void clear() {
+    data_.reset();
+  }
+  void push_back(T const& value) {
+    mut().push_back(value);
+  }
+  void push_back(T&& value) {
+    mut().push_back(std::move(value));
+  }
+  template <typename... Args>
+  T& emplace_back(Args&&... args) {
+    auto& v = mut();
+    v.emplace_back(std::forward<Args>(args)...);
+    return v.back();
+  }
+  template <typename... Args>
+  T* emplace(T const* pos, Args&&... args) {
+    // Compute the offset before making the storage unique
+    auto offset = pos - cdata();
+    auto& v = mut();
+    auto it = v.emplace(v.begin() + offset, std::forward<Args>(args)...);
+    return v.data() + (it - v.begin());
+  }
+  T* insert(T const* pos, T const& value) {
+    return emplace(pos, value);
+  }
+  T* erase(T const* pos) {
+    return erase(pos, pos + 1);
+  }
+  T* erase(T const* first, T const* last) {
+    auto offset = first - cdata();
+    auto count = last - first;
+    auto& v = mut();
+    auto it = v.erase(v.begin() + offset, v.begin() + offset + count);
+    return v.data() + (it - v.begin());
+  }
+  void pop_back() {
+    mut().pop_back();
+  }
+
+  /// Copy of the contents as a std::vector
+  std::vector<T> vec() const {
+    return data_ ? *data_ : std::vector<T>();
+  }
+
+ private:
+  T const* cdata() const {
+    return data_ ? data_->data() : nullptr;
+  }
+  /// Returns storage that is not shared with any other instance
+  std::vector<T>& mut() {
+    if (!data_) {
+      data_ = std::make_shared<std::vector<T>>();
+    } else if (data_.use_count() > 1) {
+      data_ = std::make_shared<std::vector<T>>(*data_);
+    }
+    return *data_;
+  }
+
+  std::shared_ptr<std::vector<T>> data_;
+};
+
+} // namespace common
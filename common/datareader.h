@@ -7,16 +7,24 @@
 
 #pragma once
 
+#include "datashard.h"
 #include "rand.h"
+#include "samplestore.h"
 #include "serialization.h"
 #include "zstdstream.h"
 
 #include <glog/logging.h>
 
+#include <algorithm>
 #include <chrono>
+#include <fstream>
 #include <future>
+#include <iterator>
 #include <map>
+#include <numeric>
+#include <optional>
 #include <queue>
+#include <random>
 #include <thread>
 
 namespace common {
@@ -44,11 +52,20 @@ auto const DataReader_NoopF = [] {};
  * accessed, or because decerialization failed), the iterator will print a
  * message via glog but otherwise resume operation as usual.
  *
+ * Alternatively, data can be read from shard files (see ShardWriter). In this
+ * case, all records of all shards will be returned in order. Reader threads
+ * will instruct the kernel to read ahead in the shard they're working on.
+ *
+ * Data can also be read from memory-mapped sample stores (see SampleStore),
+ * optionally in a given order of samples across all stores.
+ *
  * You will probably want to use this via DataReader<T>.
  */
 template <typename T>
 class DataReaderIterator {
   static size_t constexpr kMaxBatchesInQueue = 4;
+  /// Number of shard records or stored samples to read ahead
+  static size_t constexpr kReadahead = 64;
 
  public:
   DataReaderIterator(
@@ -62,14 +79,40 @@ class DataReaderIterator {
         batchSize_(batchSize),
         numThreads_(numThreads),
         init_(init) {
-    pos_ = 0;
-    threadPos_ = 0;
-    maxQueueSize_ = kMaxBatchesInQueue * batchSize_;
+    size_ = paths_.size();
+    start();
+  }
 
-    // Start reader threads
-    for (size_t i = 0; i < numThreads_; i++) {
-      threads_.emplace_back(&DataReaderIterator::read, this);
+  DataReaderIterator(
+      std::vector<std::shared_ptr<ShardReader>> shards,
+      size_t numThreads,
+      size_t batchSize,
+      DataReaderThreadInitF init = DataReader_NoopF)
+      : batchSize_(batchSize),
+        numThreads_(numThreads),
+        shards_(std::move(shards)),
+        init_(init) {
+    initSources(shards_);
+    start();
+  }
+
+  /// If non-empty, order specifies the positions of the samples to read
+  DataReaderIterator(
+      std::vector<std::shared_ptr<SampleStore>> stores,
+      std::vector<size_t> order,
+      size_t numThreads,
+      size_t batchSize,
+      DataReaderThreadInitF init = DataReader_NoopF)
+      : batchSize_(batchSize),
+        numThreads_(numThreads),
+        stores_(std::move(stores)),
+        order_(std::move(order)),
+        init_(init) {
+    initSources(stores_);
+    if (!order_.empty() && order_.size() != size_) {
+      throw std::invalid_argument("Sample order does not match data size");
     }
+    start();
   }
 
   ~DataReaderIterator();
@@ -79,17 +122,44 @@ class DataReaderIterator {
   std::vector<T> next();
 
  private:
+  template <typename S>
+  void initSources(S const& sources) {
+    size_ = 0;
+    for (auto const& source : sources) {
+      sourceOffsets_.push_back(size_);
+      size_ += source->size();
+    }
+  }
+
+  void start() {
+    pos_ = 0;
+    threadPos_ = 0;
+    maxQueueSize_ = kMaxBatchesInQueue * batchSize_;
+
+    // Start reader threads
+    for (size_t i = 0; i < numThreads_; i++) {
+      threads_.emplace_back(&DataReaderIterator::read, this);
+    }
+  }
+
   /// Read data from files (to be run in a thread)
   void read();
+  /// Read a single datum from a file, shard or sample store
+  T readDatum(size_t pos, std::string& source);
 
  private:
   std::vector<std::string> paths_;
   std::string prefix_;
   size_t batchSize_;
   size_t numThreads_;
+  std::vector<std::shared_ptr<ShardReader>> shards_;
+  std::vector<std::shared_ptr<SampleStore>> stores_;
+  std::vector<size_t> sourceOffsets_; // position of first datum of each source
+  std::vector<size_t> order_;
+  size_t size_; // total number of data
   size_t pos_;
   size_t threadPos_;
-  std::map<size_t, std::future<T>> dataQueue_; // key is offset in paths_
+  std::map<size_t, std::future<T>> dataQueue_; // key is position of datum
   size_t maxQueueSize_;
   std::mutex mutex_;
   std::condition_variable prodCV_;
@@ -209,10 +279,36 @@ class DataReader {
         fn_(transform),
         init_(init) {}
 
-  /// Shuffle the list of paths.
+  /// Treat paths as shard files (see ShardWriter) rather than separate files
+  /// containing one datum each.
+  void setSharded(bool sharded) {
+    sharded_ = sharded;
+  }
+
+  /// Treat paths as sample stores (see SampleStoreWriter). Stores will be
+  /// mapped once and re-used by all iterators.
+  void setMapped(bool mapped) {
+    mapped_ = mapped;
+  }
+
+  /// Shuffle the list of paths. For shards, this will only shuffle the order
+  /// in which shards are read. For sample stores, all samples are shuffled
+  /// since random access is cheap.
   void shuffle() {
-    std::shuffle(
-        paths_.begin(), paths_.end(), Rand::makeRandEngine<std::mt19937>());
+    auto rengine = Rand::makeRandEngine<std::mt19937>();
+    std::shuffle(paths_.begin(), paths_.end(), rengine);
+    if (mapped_) {
+      openStores();
+      if (order_.empty()) {
+        size_t size = 0;
+        for (auto const& store : stores_) {
+          size += store->size();
+        }
+        order_.resize(size);
+        std::iota(order_.begin(), order_.end(), 0);
+      }
+      std::shuffle(order_.begin(), order_.end(), rengine);
+    }
   }
 
   /// Create an iterator that provides multi-threaded data access.
@@ -222,8 +318,7 @@ class DataReader {
       typename std::enable_if_t<
           std::is_same<FF, DataReader_NoTransform>::value,
           bool> = true) {
-    return std::make_unique<DataReaderIterator<T>>(
-        paths_, numThreads_, batchSize_, pathPrefix_, init_);
+    return makeIterator();
   }
 
   /// Create an iterator that provides multi-threaded data access.
@@ -233,20 +328,41 @@ class DataReader {
       typename std::enable_if_t<
           !std::is_same<FF, DataReader_NoTransform>::value,
           bool> = true) {
-    return makeDataReaderTransform(
-        std::make_unique<DataReaderIterator<T>>(
-            paths_, numThreads_, batchSize_, pathPrefix_, init_),
-        fn_,
-        init_);
+    return makeDataReaderTransform(makeIterator(), fn_, init_);
   }
 
  protected:
+  void openStores() {
+    if (!stores_.empty()) {
+      return;
+    }
+    stores_ = openSampleStores(paths_, pathPrefix_);
+  }
+
+  std::unique_ptr<DataReaderIterator<T>> makeIterator() {
+    if (mapped_) {
+      openStores();
+      return std::make_unique<DataReaderIterator<T>>(
+          stores_, order_, numThreads_, batchSize_, init_);
+    }
+    if (sharded_) {
+      return std::make_unique<DataReaderIterator<T>>(
+          openShards(paths_, pathPrefix_), numThreads_, batchSize_, init_);
+    }
+    return std::make_unique<DataReaderIterator<T>>(
+        paths_, numThreads_, batchSize_, pathPrefix_, init_);
+  }
+
   std::vector<std::string> paths_;
   std::string pathPrefix_;
   size_t batchSize_;
   size_t numThreads_;
   F fn_;
   DataReaderThreadInitF init_;
+  bool sharded_ = false;
+  bool mapped_ = false;
+  std::vector<std::shared_ptr<SampleStore>> stores_;
+  std::vector<size_t> order_; // empty unless shuffled
 };
 
 template <typename T>
@@ -272,6 +388,213 @@ auto makeDataReader(
       paths, numThreads, batchSize, transform, pathPrefix, init);
 }
 
+/// Creates a DataReader for shard files
+template <typename T>
+auto makeShardDataReader(
+    std::vector<std::string> paths,
+    size_t numThreads,
+    size_t batchSize,
+    std::string pathPrefix = std::string(),
+    DataReaderThreadInitF init = DataReader_NoopF) {
+  auto reader = DataReader<T>(paths, numThreads, batchSize, pathPrefix, init);
+  reader.setSharded(true);
+  return reader;
+}
+
+/// Creates a DataReader for sample stores
+template <typename T>
+auto makeSampleStoreDataReader(
+    std::vector<std::string> paths,
+    size_t numThreads,
+    size_t batchSize,
+    std::string pathPrefix = std::string(),
+    DataReaderThreadInitF init = DataReader_NoopF) {
+  auto reader = DataReader<T>(paths, numThreads, batchSize, pathPrefix, init);
+  reader.setMapped(true);
+  return reader;
+}
+
+/**
+ * A multi-threaded reader that emits data in random order as soon as it is
+ * available, for any number of epochs.
+ *
+ * Contrary to DataReaderIterator, data is not returned in the order of the
+ * given paths. Reader threads place data into a shuffle buffer of bounded
+ * size, and next() draws random elements from it as soon as a full batch is
+ * available. A file that is slow to read will thus only occupy a single
+ * buffer slot instead of stalling the consumer, and memory usage is bounded
+ * by the buffer size (including data that is currently being read).
+ *
+ * Reader threads are started once and re-used for all epochs. Call
+ * `startEpoch()` to start iterating over the data; the order in which data
+ * is read is determined by the seed and the epoch number. The batches drawn
+ * from the buffer depend on the timing of the reader threads, though. For
+ * reproducible batches, see `setReproducible()`.
+ *
+ * Data can be read from files or shards (see ShardWriter). The time spent in
+ * reading and decoding data is tracked for every thread; see `stats()`.
+ *
+ * Usage example with 4 threads, batch size 32 and a buffer of 1024 elements:
+ ```
+auto reader = makeShuffleDataReader<MyDatumType>(fileList, 4, 32, 1024, seed);
+for (auto epoch = 0; epoch < numEpochs; epoch++) {
+  reader->startEpoch(epoch);
+  while (reader->hasNext()) {
+    auto batch = reader->next();
+    // Do work
+  }
+}
+ ```
+ */
+template <typename T>
+class ShuffleDataReader {
+ public:
+  struct ThreadStats {
+    size_t numRead = 0;
+    size_t numErrors = 0;
+    /// Time spent reading raw data from disk
+    double readMs = 0;
+    /// Time spent in decompression and decerealization
+    double decodeMs = 0;
+  };
+
+  ShuffleDataReader(
+      std::vector<std::string> paths,
+      size_t numThreads,
+      size_t batchSize,
+      size_t bufferSize,
+      uint64_t seed,
+      std::string prefix = std::string(),
+      DataReaderThreadInitF init = DataReader_NoopF)
+      : paths_(std::move(paths)),
+        prefix_(std::move(prefix)),
+        size_(paths_.size()),
+        batchSize_(batchSize),
+        bufferSize_(bufferSize),
+        seed_(seed) {
+    start(numThreads, init);
+  }
+
+  ShuffleDataReader(
+      std::vector<std::shared_ptr<ShardReader>> shards,
+      size_t numThreads,
+      size_t batchSize,
+      size_t bufferSize,
+      uint64_t seed,
+      DataReaderThreadInitF init = DataReader_NoopF)
+      : shards_(std::move(shards)),
+        size_(0),
+        batchSize_(batchSize),
+        bufferSize_(bufferSize),
+        seed_(seed) {
+    for (auto const& shard : shards_) {
+      shardOffsets_.push_back(size_);
+      size_ += shard->size();
+    }
+    start(numThreads, init);
+  }
+
+  ~ShuffleDataReader();
+  ShuffleDataReader(ShuffleDataReader const&) = delete;
+  ShuffleDataReader& operator=(ShuffleDataReader const&) = delete;
+
+  /// Starts a new pass over the data. Data that has not been consumed in the
+  /// previous epoch will be discarded, even if `epoch` is the same.
+  void startEpoch(size_t epoch);
+
+  /// Make next() wait until the buffer is full (or all data of the epoch has
+  /// been read) so that the candidates for every batch do not depend on the
+  /// timing of the reader threads. With a single thread, the resulting
+  /// batches are then fully determined by seed and epoch. This comes at the
+  /// cost of waiting for the slowest read of every batch.
+  void setReproducible(bool reproducible) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    reproducible_ = reproducible;
+  }
+
+  bool hasNext();
+
+  std::vector<T> next();
+
+  /// Total number of data per epoch
+  size_t size() const {
+    return size_;
+  }
+
+  /// Returns cumulative statistics for each reader thread
+  std::vector<ThreadStats> stats();
+
+ private:
+  void start(size_t numThreads, DataReaderThreadInitF init);
+  /// Read data (to be run in a thread)
+  void read(size_t threadIndex, DataReaderThreadInitF init);
+  /// Read the raw bytes of a datum from a file or shard
+  std::vector<char> readRaw(size_t pos, std::string& source);
+
+  std::vector<std::string> paths_;
+  std::string prefix_;
+  std::vector<std::shared_ptr<ShardReader>> shards_;
+  std::vector<size_t> shardOffsets_; // position of first record of each shard
+  size_t size_; // total number of data
+  size_t batchSize_;
+  size_t bufferSize_;
+  uint64_t seed_;
+
+  std::mt19937 rengine_;
+  bool started_ = false;
+  size_t generation_ = 0; // incremented for every call to startEpoch()
+  std::vector<size_t> order_; // read order for current epoch
+  size_t threadPos_ = 0; // next position in order_ to be read
+  size_t numDone_ = 0; // number of data of current epoch read or failed
+  size_t numInFlight_ = 0; // number of data currently being read
+  bool reproducible_ = false;
+  std::vector<T> buffer_;
+  std::vector<ThreadStats> stats_;
+  bool stop_ = false;
+  std::mutex mutex_;
+  std::condition_variable prodCV_;
+  std::condition_variable consumerCV_;
+  std::vector<std::thread> threads_;
+};
+
+template <typename T>
+auto makeShuffleDataReader(
+    std::vector<std::string> paths,
+    size_t numThreads,
+    size_t batchSize,
+    size_t bufferSize,
+    uint64_t seed,
+    std::string pathPrefix = std::string(),
+    DataReaderThreadInitF init = DataReader_NoopF) {
+  return std::make_unique<ShuffleDataReader<T>>(
+      std::move(paths),
+      numThreads,
+      batchSize,
+      bufferSize,
+      seed,
+      std::move(pathPrefix),
+      init);
+}
+
+/// Creates a ShuffleDataReader for shard files
+template <typename T>
+auto makeShardShuffleDataReader(
+    std::vector<std::string> paths,
+    size_t numThreads,
+    size_t batchSize,
+    size_t bufferSize,
+    uint64_t seed,
+    std::string pathPrefix = std::string(),
+    DataReaderThreadInitF init = DataReader_NoopF) {
+  return std::make_unique<ShuffleDataReader<T>>(
+      openShards(paths, pathPrefix),
+      numThreads,
+      batchSize,
+      bufferSize,
+      seed,
+      init);
+}
+
 /**************** IMPLEMENTATIONS ********************/
 
 template <typename T>
@@ -280,9 +603,9 @@ DataReaderIterator<T>::~DataReaderIterator() {
     // Move iterator to end and clear results queue so that threads can
     // finish  their current operation.
     std::lock_guard<std::mutex> lock(mutex_);
-    maxQueueSize_ = std::max(maxQueueSize_, paths_.size() - threadPos_);
+    maxQueueSize_ = std::max(maxQueueSize_, size_ - threadPos_);
     dataQueue_.clear();
-    threadPos_ = paths_.size();
+    threadPos_ = size_;
   }
   prodCV_.notify_all();
 
@@ -294,18 +617,18 @@ DataReaderIterator<T>::~DataReaderIterator() {
 template <typename T>
 bool DataReaderIterator<T>::hasNext() {
   std::unique_lock<std::mutex> lock(mutex_);
-  return (!dataQueue_.empty() || threadPos_ < paths_.size());
+  return (!dataQueue_.empty() || threadPos_ < size_);
 }
 
 template <typename T>
 std::vector<T> DataReaderIterator<T>::next() {
   std::unique_lock<std::mutex> lock(mutex_);
-  if (dataQueue_.empty() && threadPos_ >= paths_.size()) {
+  if (dataQueue_.empty() && threadPos_ >= size_) {
     throw std::runtime_error("Data iterator is already at end");
   }
 
   std::vector<T> batch;
-  while (pos_ < paths_.size() && batch.size() < batchSize_) {
+  while (pos_ < size_ && batch.size() < batchSize_) {
     auto curPos = pos_++;
 
     int numAttempts = 0;
@@ -354,7 +677,7 @@ void DataReaderIterator<T>::read() {
     { // Critical section interacting with producer and consumer queue
       std::unique_lock<std::mutex> lock(mutex_);
       while (true) {
-        if (threadPos_ >= paths_.size()) {
+        if (threadPos_ >= size_) {
           done = true;
           break;
         }
@@ -376,24 +699,12 @@ void DataReaderIterator<T>::read() {
       break;
     }
 
-    std::string filePath;
-    auto const& curPath = paths_[curPos];
-    if (!prefix_.empty() && !curPath.empty() && curPath[0] != '/') {
-      filePath = prefix_ + "/" + curPath;
-    } else {
-      filePath = curPath;
-    }
-
     // Read data, fulfill promise from above
+    std::string source;
     try {
-      VLOG(4) << "Reading data from " << filePath;
-      zstd::ifstream is(filePath);
-      cereal::BinaryInputArchive archive(is);
-      T d;
-      archive(d);
-      dataPromise.set_value(std::move(d));
+      dataPromise.set_value(readDatum(curPos, source));
     } catch (std::exception const& e) {
-      VLOG(0) << "Invalid data file " << filePath << ", skipping (" << e.what()
+      VLOG(0) << "Invalid data file " << source << ", skipping (" << e.what()
               << ")";
       try {
         dataPromise.set_exception(std::current_exception());
@@ -411,6 +722,46 @@ void DataReaderIterator<T>::read() {
   threadsDone_.insert(std::this_thread::get_id());
 }
 
+template <typename T>
+T DataReaderIterator<T>::readDatum(size_t pos, std::string& source) {
+  if (shards_.empty() && stores_.empty()) {
+    auto const& curPath = paths_[pos];
+    if (!prefix_.empty() && !curPath.empty() && curPath[0] != '/') {
+      source = prefix_ + "/" + curPath;
+    } else {
+      source = curPath;
+    }
+
+    VLOG(4) << "Reading data from " << source;
+    zstd::ifstream is(source);
+    cereal::BinaryInputArchive archive(is);
+    T d;
+    archive(d);
+    return d;
+  }
+
+  if (!order_.empty()) {
+    pos = order_[pos];
+  }
+  auto it =
+      std::upper_bound(sourceOffsets_.begin(), sourceOffsets_.end(), pos) - 1;
+  auto index = it - sourceOffsets_.begin();
+  auto record = pos - *it;
+  auto readFrom = [&](auto const& src) {
+    source = src->path() + ":" + std::to_string(record);
+    // Reading ahead only makes sense if we're reading sequentially
+    if (order_.empty() && record % kReadahead == 0) {
+      src->prefetch(record, 2 * kReadahead);
+    }
+    VLOG(4) << "Reading data from " << source;
+    return src->template read<T>(record);
+  };
+  if (!shards_.empty()) {
+    return readFrom(shards_[index]);
+  }
+  return readFrom(stores_[index]);
+}
+
 template <typename T, typename F>
 DataReaderTransform<T, F>::~DataReaderTransform() {
   {
@@ -466,4 +817,197 @@ void DataReaderTransform<T, F>::run() {
   done_ = true;
 }
 
+template <typename T>
+ShuffleDataReader<T>::~ShuffleDataReader() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  prodCV_.notify_all();
+  consumerCV_.notify_all();
+
+  for (auto& thread : threads_) {
+    thread.join();
+  }
+}
+
+template <typename T>
+void ShuffleDataReader<T>::start(
+    size_t numThreads,
+    DataReaderThreadInitF init) {
+  if (batchSize_ == 0 || bufferSize_ < batchSize_) {
+    throw std::invalid_argument(
+        "Shuffle buffer needs to hold at least one batch");
+  }
+  buffer_.reserve(bufferSize_);
+  stats_.resize(numThreads);
+  for (size_t i = 0; i < numThreads; i++) {
+    threads_.emplace_back(&ShuffleDataReader::read, this, i, init);
+  }
+}
+
+template <typename T>
+void ShuffleDataReader<T>::startEpoch(size_t epoch) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::seed_seq seq{uint32_t(seed_),
+                      uint32_t(seed_ >> 32),
+                      uint32_t(epoch),
+                      uint32_t(uint64_t(epoch) >> 32)};
+    rengine_.seed(seq);
+    order_.resize(size_);
+    std::iota(order_.begin(), order_.end(), 0);
+    std::shuffle(order_.begin(), order_.end(), rengine_);
+
+    // Reads of the previous epoch that are still in flight will be discarded
+    // once they finish
+    started_ = true;
+    generation_++;
+    threadPos_ = 0;
+    numDone_ = 0;
+    buffer_.clear();
+  }
+  prodCV_.notify_all();
+}
+
+template <typename T>
+bool ShuffleDataReader<T>::hasNext() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return started_ && (numDone_ < size_ || !buffer_.empty());
+}
+
+template <typename T>
+std::vector<T> ShuffleDataReader<T>::next() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (!started_ || (numDone_ >= size_ && buffer_.empty())) {
+    throw std::runtime_error("Data reader is already at end");
+  }
+
+  // In reproducible mode, waiting for a full buffer makes the set of
+  // candidates for this batch independent of the timing of the reader threads
+  auto minSize = reproducible_ ? bufferSize_ : batchSize_;
+  consumerCV_.wait(
+      lock, [&] { return buffer_.size() >= minSize || numDone_ >= size_; });
+
+  std::vector<T> batch;
+  batch.reserve(std::min(batchSize_, buffer_.size()));
+  while (batch.size() < batchSize_ && !buffer_.empty()) {
+    auto i = std::uniform_int_distribution<size_t>(
+        0, buffer_.size() - 1)(rengine_);
+    batch.push_back(std::move(buffer_[i]));
+    if (i != buffer_.size() - 1) {
+      buffer_[i] = std::move(buffer_.back());
+    }
+    buffer_.pop_back();
+  }
+
+  prodCV_.notify_all();
+  return batch;
+}
+
+template <typename T>
+std::vector<typename ShuffleDataReader<T>::ThreadStats>
+ShuffleDataReader<T>::stats() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return stats_;
+}
+
+template <typename T>
+void ShuffleDataReader<T>::read(
+    size_t threadIndex,
+    DataReaderThreadInitF init) {
+  using hires_clock = std::chrono::steady_clock;
+  using ms = std::chrono::duration<double, std::milli>;
+  init();
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    // Only read if there's space for the result in the buffer
+    prodCV_.wait(lock, [&] {
+      return stop_ ||
+          (started_ && threadPos_ < size_ &&
+           buffer_.size() + numInFlight_ < bufferSize_);
+    });
+    if (stop_) {
+      break;
+    }
+    auto pos = order_[threadPos_++];
+    auto generation = generation_;
+    numInFlight_++;
+    lock.unlock();
+
+    std::string source;
+    std::optional<T> datum;
+    double readMs = 0, decodeMs = 0;
+    try {
+      auto start = hires_clock::now();
+      auto data = readRaw(pos, source);
+      auto mid = hires_clock::now();
+      readMs = ms(mid - start).count();
+
+      VLOG(4) << "Decoding data from " << source;
+      IMembuf buf(data);
+      zstd::istream is(&buf);
+      cereal::BinaryInputArchive archive(is);
+      datum.emplace();
+      archive(*datum);
+      decodeMs = ms(hires_clock::now() - mid).count();
+    } catch (std::exception const& e) {
+      VLOG(0) << "Invalid data file " << source << ", skipping (" << e.what()
+              << ")";
+      datum.reset();
+    }
+
+    lock.lock();
+    numInFlight_--;
+    auto& stats = stats_[threadIndex];
+    stats.readMs += readMs;
+    stats.decodeMs += decodeMs;
+    if (datum) {
+      stats.numRead++;
+    } else {
+      stats.numErrors++;
+    }
+    if (generation == generation_) {
+      if (datum) {
+        buffer_.push_back(std::move(*datum));
+      }
+      numDone_++;
+      consumerCV_.notify_all();
+    } else {
+      // Stale read from a previous epoch; there's space in the buffer again
+      prodCV_.notify_one();
+    }
+  }
+}
+
+template <typename T>
+std::vector<char> ShuffleDataReader<T>::readRaw(
+    size_t pos,
+    std::string& source) {
+  if (!shards_.empty()) {
+    auto it =
+        std::upper_bound(shardOffsets_.begin(), shardOffsets_.end(), pos) - 1;
+    auto& shard = shards_[it - shardOffsets_.begin()];
+    auto record = pos - *it;
+    source = shard->path() + ":" + std::to_string(record);
+    VLOG(4) << "Reading data from " << source;
+    return shard->readRaw(record);
+  }
+
+  auto const& curPath = paths_[pos];
+  if (!prefix_.empty() && !curPath.empty() && curPath[0] != '/') {
+    source = prefix_ + "/" + curPath;
+  } else {
+    source = curPath;
+  }
+  VLOG(4) << "Reading data from " << source;
+  std::ifstream is(source, std::ios_base::in | std::ios_base::binary);
+  if (!is) {
+    throw std::runtime_error("Cannot open file");
+  }
+  return std::vector<char>(
+      std::istreambuf_iterator<char>(is), std::istreambuf_iterator<char>());
+}
+
 } // namespace common
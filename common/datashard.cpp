@@ -0,0 +1,278 @@
+/*
+ * Copyright (c) 2017-present, Facebook, Inc.
+ *
+ * This source code is licensed under the MIT license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "datashard.h"
+
+// Shards are only supported on POSIX systems
+#ifndef WITHOUT_POSIX
+
+#include <fmt/format.h>
+#include <glog/logging.h>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <limits>
+#include <system_error>
+
+namespace common {
+
+namespace {
+// "CPIDSHRD" in little-endian byte order
+uint64_t constexpr kShardMagic = 0x4452485344495043ULL;
+size_t constexpr kFooterSize = 3 * sizeof(uint64_t);
+
+void putLE(std::vector<char>& buf, uint64_t v, size_t bytes) {
+  for (size_t i = 0; i < bytes; i++) {
+    buf.push_back(char((v >> (8 * i)) & 0xFF));
+  }
+}
+
+uint64_t getLE(char const* p, size_t bytes) {
+  uint64_t v = 0;
+  for (size_t i = 0; i < bytes; i++) {
+    v |= uint64_t(uint8_t(p[i])) << (8 * i);
+  }
+  return v;
+}
+
+void preadAll(int fd, char* dest, size_t size, uint64_t offset) {
+  while (size > 0) {
+    auto n = ::pread(fd, dest, size, offset);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::system_error(errno, std::system_category());
+    } else if (n == 0) {
+      throw std::runtime_error("Unexpected end of file");
+    }
+    dest += n;
+    size -= n;
+    offset += n;
+  }
+}
+} // namespace
+
+ShardWriter::ShardWriter(std::string path)
+    : path_(std::move(path)),
+      os_(path_, std::ios_base::out | std::ios_base::binary) {
+  if (!os_) {
+    throw std::runtime_error("Cannot open " + path_ + " for writing");
+  }
+}
+
+ShardWriter::~ShardWriter() {
+  try {
+    close();
+  } catch (std::exception const& e) {
+    LOG(ERROR) << "Error closing shard " << path_ << ": " << e.what();
+  }
+}
+
+void ShardWriter::append(char const* data, size_t size) {
+  if (closed_) {
+    throw std::runtime_error("Cannot append to closed shard " + path_);
+  }
+  if (size > std::numeric_limits<uint32_t>::max()) {
+    throw std::runtime_error(fmt::format("Record too large: {} bytes", size));
+  }
+  std::vector<char> prefix;
+  putLE(prefix, size, sizeof(uint32_t));
+  os_.write(prefix.data(), prefix.size());
+  os_.write(data, size);
+  if (!os_) {
+    throw std::runtime_error("Error writing to " + path_);
+  }
+  offsets_.push_back(pos_);
+  pos_ += prefix.size() + size;
+}
+
+void ShardWriter::close() {
+  if (closed_) {
+    return;
+  }
+  closed_ = true;
+  std::vector<char> buf;
+  buf.reserve(offsets_.size() * sizeof(uint64_t) + kFooterSize);
+  for (auto offset : offsets_) {
+    putLE(buf, offset, sizeof(uint64_t));
+  }
+  putLE(buf, kShardMagic, sizeof(uint64_t));
+  putLE(buf, offsets_.size(), sizeof(uint64_t));
+  putLE(buf, pos_, sizeof(uint64_t));
+  os_.write(buf.data(), buf.size());
+  os_.close();
+  if (!os_) {
+    throw std::runtime_error("Error writing index to " + path_);
+  }
+}
+
+ShardReader::ShardReader(std::string path) : path_(std::move(path)) {
+  fd_ = ::open(path_.c_str(), O_RDONLY);
+  if (fd_ < 0) {
+    throw std::system_error(errno, std::system_category(), path_);
+  }
+  struct stat st;
+  if (::fstat(fd_, &st) != 0) {
+    auto err = errno;
+    ::close(fd_);
+    throw std::system_error(err, std::system_category(), path_);
+  }
+  ::posix_fadvise(fd_, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  try {
+    if (!readIndex(st.st_size)) {
+      LOG(WARNING) << "No valid index found in " << path_
+                   << ", scanning records";
+      scanIndex(st.st_size);
+    }
+  } catch (...) {
+    ::close(fd_);
+    throw;
+  }
+}
+
+ShardReader::~ShardReader() {
+  if (fd_ >= 0) {
+    ::close(fd_);
+  }
+}
+
+std::vector<char> ShardReader::readRaw(size_t i) const {
+  if (i >= size()) {
+    throw std::out_of_range(
+        fmt::format("Record {} out of range for {}", i, path_));
+  }
+  auto offset = offsets_[i] + sizeof(uint32_t);
+  std::vector<char> data(offsets_[i + 1] - offset);
+  preadAll(fd_, data.data(), data.size(), offset);
+  return data;
+}
+
+void ShardReader::prefetch(size_t first, size_t count) const {
+  if (first >= size() || count == 0) {
+    return;
+  }
+  auto last = std::min(first + count, size());
+  ::posix_fadvise(
+      fd_,
+      offsets_[first],
+      offsets_[last] - offsets_[first],
+      POSIX_FADV_WILLNEED);
+}
+
+bool ShardReader::readIndex(uint64_t fileSize) {
+  if (fileSize < kFooterSize) {
+    return false;
+  }
+  char footer[kFooterSize];
+  preadAll(fd_, footer, kFooterSize, fileSize - kFooterSize);
+  auto magic = getLE(footer, sizeof(uint64_t));
+  auto numRecords = getLE(footer + sizeof(uint64_t), sizeof(uint64_t));
+  auto indexOffset = getLE(footer + 2 * sizeof(uint64_t), sizeof(uint64_t));
+  if (magic != kShardMagic ||
+      indexOffset + numRecords * sizeof(uint64_t) + kFooterSize != fileSize) {
+    return false;
+  }
+
+  std::vector<char> index(numRecords * sizeof(uint64_t));
+  preadAll(fd_, index.data(), index.size(), indexOffset);
+  offsets_.resize(numRecords + 1);
+  for (size_t i = 0; i < numRecords; i++) {
+    offsets_[i] =
+        getLE(index.data() + i * sizeof(uint64_t), sizeof(uint64_t));
+  }
+  offsets_[numRecords] = indexOffset;
+  return true;
+}
+
+void ShardReader::scanIndex(uint64_t fileSize) {
+  offsets_.clear();
+  uint64_t pos = 0;
+  char prefix[sizeof(uint32_t)];
+  while (pos + sizeof(prefix) <= fileSize) {
+    preadAll(fd_, prefix, sizeof(prefix), pos);
+    auto size = getLE(prefix, sizeof(prefix));
+    if (pos + sizeof(prefix) + size > fileSize) {
+      LOG(WARNING) << "Truncated record at offset " << pos << " in " << path_;
+      break;
+    }
+    offsets_.push_back(pos);
+    pos += sizeof(prefix) + size;
+  }
+  offsets_.push_back(pos);
+}
+
+std::vector<std::shared_ptr<ShardReader>> openShards(
+    std::vector<std::string> const& paths,
+    std::string const& prefix) {
+  std::vector<std::shared_ptr<ShardReader>> shards;
+  shards.reserve(paths.size());
+  for (auto const& path : paths) {
+    std::string filePath = path;
+    if (!prefix.empty() && !path.empty() && path[0] != '/') {
+      filePath = prefix + "/" + path;
+    }
+    try {
+      shards.push_back(std::make_shared<ShardReader>(filePath));
+    } catch (std::exception const& e) {
+      LOG(WARNING) << "Cannot open shard " << filePath << ", skipping ("
+                   << e.what() << ")";
+    }
+  }
+  return shards;
+}
+
+std::vector<std::string> packShards(
+    std::vector<std::string> const& paths,
+    std::string const& outputPrefix,
+    size_t recordsPerShard,
+    std::string const& prefix) {
+  if (recordsPerShard == 0) {
+    throw std::invalid_argument("Need at least one record per shard");
+  }
+  std::vector<std::string> shardPaths;
+  std::unique_ptr<ShardWriter> writer;
+  std::vector<char> data;
+  for (auto const& path : paths) {
+    std::string filePath = path;
+    if (!prefix.empty() && !path.empty() && path[0] != '/') {
+      filePath = prefix + "/" + path;
+    }
+    std::ifstream is(filePath, std::ios_base::in | std::ios_base::binary);
+    if (!is) {
+      LOG(WARNING) << "Cannot read " << filePath << ", skipping";
+      continue;
+    }
+    data.assign(
+        std::istreambuf_iterator<char>(is), std::istreambuf_iterator<char>());
+    if (is.bad()) {
+      LOG(WARNING) << "Error reading " << filePath << ", skipping";
+      continue;
+    }
+
+    if (writer == nullptr || writer->size() >= recordsPerShard) {
+      if (writer) {
+        writer->close();
+      }
+      shardPaths.push_back(
+          fmt::format("{}-{:05d}.shard", outputPrefix, shardPaths.size()));
+      writer = std::make_unique<ShardWriter>(shardPaths.back());
+    }
+    writer->append(data);
+  }
+  if (writer) {
+    writer->close();
+  }
+  return shardPaths;
+}
+
+} // namespace common
+
+#endif // WITHOUT_POSIX
@@ -0,0 +1,148 @@
+/*
+ * Copyright (c) 2017-present, Facebook, Inc.
+ *
+ * This source code is licensed under the MIT license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include "serialization.h"
+#include "zstdstream.h"
+
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace common {
+
+/**
+ * Packed shard files hold a sequence of records, i.e. serialized data, in a
+ * single file.
+ *
+ * Records are stored back-to-back, each prefixed by its size as a 32-bit
+ * integer. Upon closing, the writer appends an index with the offsets of all
+ * records and a fixed-size footer pointing to the index:
+ *
+ *   [size0][record0][size1][record1]...[offset0]...[offsetN][footer]
+ *
+ * All integers are stored in little-endian byte order. Shards without a
+ * valid footer (e.g. because the writer crashed) can still be read; the index
+ * will then be reconstructed by scanning the file.
+ *
+ * Records written with ShardWriter::write() are individual zstd frames
+ * containing cereal binary archives, i.e. the same format that DataReader
+ * expects for separate files.
+ */
+class ShardWriter {
+ public:
+  explicit ShardWriter(std::string path);
+  ~ShardWriter();
+
+  /// Serializes and compresses a datum and appends it as a new record
+  template <typename T>
+  void write(T const& datum) {
+    OMembuf buf;
+    {
+      zstd::ostream os(&buf);
+      cereal::BinaryOutputArchive archive(os);
+      archive(datum);
+    }
+    auto& data = buf.data();
+    append(data.data(), data.size());
+  }
+
+  /// Appends a record as-is
+  void append(char const* data, size_t size);
+  void append(std::vector<char> const& data) {
+    append(data.data(), data.size());
+  }
+
+  size_t size() const {
+    return offsets_.size();
+  }
+
+  /// Writes the index; no more records can be appended afterwards
+  void close();
+
+ private:
+  std::string path_;
+  std::ofstream os_;
+  std::vector<uint64_t> offsets_;
+  uint64_t pos_ = 0;
+  bool closed_ = false;
+};
+
+/**
+ * Provides random access to the records of a shard file.
+ *
+ * Records are read with pread(), so concurrent calls to read() from multiple
+ * threads are fine.
+ */
+class ShardReader {
+ public:
+  explicit ShardReader(std::string path);
+  ~ShardReader();
+  ShardReader(ShardReader const&) = delete;
+  ShardReader& operator=(ShardReader const&) = delete;
+
+  std::string const& path() const {
+    return path_;
+  }
+  size_t size() const {
+    return offsets_.empty() ? 0 : offsets_.size() - 1;
+  }
+
+  /// Returns the raw bytes of the i-th record
+  std::vector<char> readRaw(size_t i) const;
+
+  /// Decompresses (if necessary) and deserializes the i-th record
+  template <typename T>
+  T read(size_t i) const {
+    auto data = readRaw(i);
+    IMembuf buf(data);
+    zstd::istream is(&buf);
+    cereal::BinaryInputArchive archive(is);
+    T d;
+    archive(d);
+    return d;
+  }
+
+  /// Hints the kernel to read records [first, first+count) into the page cache
+  void prefetch(size_t first, size_t count) const;
+
+ private:
+  bool readIndex(uint64_t fileSize);
+  void scanIndex(uint64_t fileSize);
+
+  std::string path_;
+  int fd_ = -1;
+  /// Record i spans [offsets_[i], offsets_[i+1]), including its size prefix
+  std::vector<uint64_t> offsets_;
+};
+
+/**
+ * Opens the shards at the given paths. Relative paths will be resolved with
+ * respect to prefix if it's not empty. Shards that cannot be opened are
+ * skipped with a warning.
+ */
+std::vector<std::shared_ptr<ShardReader>> openShards(
+    std::vector<std::string> const& paths,
+    std::string const& prefix = std::string());
+
+/**
+ * Packs data stored in separate files (as read by DataReader) into shards of
+ * up to recordsPerShard records each.
+ *
+ * File contents are copied verbatim. Shards will be written to
+ * `<outputPrefix>-<number>.shard`, and their paths are returned. Files that
+ * cannot be read are skipped with a warning.
+ */
+std::vector<std::string> packShards(
+    std::vector<std::string> const& paths,
+    std::string const& outputPrefix,
+    size_t recordsPerShard,
+    std::string const& prefix = std::string());
+
+} // namespace common
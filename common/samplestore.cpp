@@ -0,0 +1,274 @@
+/*
+ * Copyright (c) 2017-present, Facebook, Inc.
+ *
+ * This source code is licensed under the MIT license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "samplestore.h"
+
+// Sample stores are only supported on POSIX systems
+#ifndef WITHOUT_POSIX
+
+#include <fmt/format.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <system_error>
+
+namespace common {
+
+namespace {
+// "CPIDSMPL" in little-endian byte order
+uint64_t constexpr kStoreMagic = 0x4C504D5344495043ULL;
+size_t constexpr kFooterSize = 3 * sizeof(uint64_t);
+size_t constexpr kIndexEntrySize = 4 * sizeof(uint64_t);
+
+struct TensorInfo {
+  int32_t typeId;
+  std::vector<int64_t> sizes;
+  uint64_t offset = 0;
+
+  template <typename Archive>
+  void serialize(Archive& ar) {
+    ar(typeId, sizes, offset);
+  }
+};
+} // namespace
+
+struct SampleStore::Mapping {
+  char* data = nullptr;
+  size_t size = 0;
+
+  ~Mapping() {
+    if (data != nullptr) {
+      ::munmap(data, size);
+    }
+  }
+};
+
+SampleStoreWriter::SampleStoreWriter(std::string path)
+    : path_(std::move(path)),
+      os_(path_, std::ios_base::out | std::ios_base::binary) {
+  if (!os_) {
+    throw std::runtime_error("Cannot open " + path_ + " for writing");
+  }
+}
+
+SampleStoreWriter::~SampleStoreWriter() {
+  try {
+    close();
+  } catch (std::exception const& e) {
+    LOG(ERROR) << "Error closing sample store " << path_ << ": " << e.what();
+  }
+}
+
+void SampleStoreWriter::append(
+    std::vector<torch::Tensor> const& tensors,
+    std::vector<char> const& data) {
+  if (closed_) {
+    throw std::runtime_error("Cannot append to closed sample store " + path_);
+  }
+
+  auto begin = pos_;
+  std::vector<TensorInfo> infos;
+  infos.reserve(tensors.size());
+  for (auto const& tensor : tensors) {
+    TensorInfo info;
+    if (!tensor.defined()) {
+      info.typeId = ag::detail::scalarTypeId(torch::Dtype::Undefined);
+      infos.push_back(std::move(info));
+      continue;
+    }
+    auto contig = tensor.cpu().contiguous();
+    info.typeId =
+        ag::detail::scalarTypeId(torch::typeMetaToScalarType(contig.dtype()));
+    info.sizes = contig.sizes().vec();
+    pad();
+    info.offset = pos_;
+    auto size = contig.numel() * contig.type().elementSizeInBytes();
+    os_.write(static_cast<char const*>(contig.data_ptr()), size);
+    pos_ += size;
+    infos.push_back(std::move(info));
+  }
+
+  OMembuf buf;
+  {
+    std::ostream os(&buf);
+    cereal::BinaryOutputArchive archive(os);
+    archive(infos);
+  }
+  auto infoOffset = pos_;
+  os_.write(buf.data().data(), buf.data().size());
+  pos_ += buf.data().size();
+  auto dataOffset = pos_;
+  os_.write(data.data(), data.size());
+  pos_ += data.size();
+  if (!os_) {
+    throw std::runtime_error("Error writing to " + path_);
+  }
+  index_.push_back({begin, infoOffset, dataOffset, pos_});
+}
+
+void SampleStoreWriter::close() {
+  if (closed_) {
+    return;
+  }
+  closed_ = true;
+  pad();
+  auto indexOffset = pos_;
+  for (auto const& entry : index_) {
+    os_.write(reinterpret_cast<char const*>(entry.data()), kIndexEntrySize);
+  }
+  uint64_t footer[3] = {kStoreMagic, index_.size(), indexOffset};
+  os_.write(reinterpret_cast<char const*>(footer), kFooterSize);
+  os_.close();
+  if (!os_) {
+    throw std::runtime_error("Error writing index to " + path_);
+  }
+}
+
+void SampleStoreWriter::pad() {
+  static char const zeros[kAlignment] = {};
+  auto n = (kAlignment - pos_ % kAlignment) % kAlignment;
+  os_.write(zeros, n);
+  pos_ += n;
+}
+
+SampleStore::SampleStore(std::string path)
+    : path_(std::move(path)), mapping_(std::make_shared<Mapping>()) {
+  auto fd = ::open(path_.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw std::system_error(errno, std::system_category(), path_);
+  }
+  struct stat st;
+  if (::fstat(fd, &st) != 0) {
+    auto err = errno;
+    ::close(fd);
+    throw std::system_error(err, std::system_category(), path_);
+  }
+  if (size_t(st.st_size) < kFooterSize) {
+    ::close(fd);
+    throw std::runtime_error("Not a sample store: " + path_);
+  }
+
+  // Private mapping so that tensors can be modified in-place
+  auto addr = ::mmap(
+      nullptr,
+      st.st_size,
+      PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_NORESERVE,
+      fd,
+      0);
+  auto err = errno;
+  ::close(fd);
+  if (addr == MAP_FAILED) {
+    throw std::system_error(err, std::system_category(), path_);
+  }
+  mapping_->data = static_cast<char*>(addr);
+  mapping_->size = st.st_size;
+
+  uint64_t footer[3];
+  std::memcpy(footer, mapping_->data + st.st_size - kFooterSize, kFooterSize);
+  auto numSamples = footer[1];
+  auto indexOffset = footer[2];
+  if (footer[0] != kStoreMagic ||
+      indexOffset + numSamples * kIndexEntrySize + kFooterSize !=
+          uint64_t(st.st_size)) {
+    throw std::runtime_error("Invalid sample store index in " + path_);
+  }
+  index_.resize(numSamples);
+  for (size_t i = 0; i < numSamples; i++) {
+    std::memcpy(
+        index_[i].data(),
+        mapping_->data + indexOffset + i * kIndexEntrySize,
+        kIndexEntrySize);
+  }
+}
+
+SampleStore::~SampleStore() {}
+
+std::vector<torch::Tensor> SampleStore::tensorsAt(
+    size_t i,
+    std::string_view& data) const {
+  if (i >= size()) {
+    throw std::out_of_range(
+        fmt::format("Sample {} out of range for {}", i, path_));
+  }
+  auto const& entry = index_[i];
+  std::vector<TensorInfo> infos;
+  {
+    IMembuf buf(std::string_view(
+        mapping_->data + entry[1], entry[2] - entry[1]));
+    std::istream is(&buf);
+    cereal::BinaryInputArchive archive(is);
+    archive(infos);
+  }
+  data = std::string_view(mapping_->data + entry[2], entry[3] - entry[2]);
+
+  // Tensors keep the mapping alive via their deleter
+  auto mapping = mapping_;
+  auto deleter = [mapping](void*) {};
+  std::vector<torch::Tensor> tensors;
+  tensors.reserve(infos.size());
+  for (auto const& info : infos) {
+    auto type = ag::detail::scalarTypeFromId(info.typeId);
+    if (type == torch::Dtype::Undefined) {
+      tensors.emplace_back();
+      continue;
+    }
+    uint64_t size = at::elementSize(type);
+    for (auto s : info.sizes) {
+      size *= s;
+    }
+    if (info.offset < entry[0] || info.offset + size > entry[1]) {
+      throw std::runtime_error(
+          fmt::format("Corrupt sample {} in {}", i, path_));
+    }
+    tensors.push_back(torch::from_blob(
+        mapping_->data + info.offset,
+        info.sizes,
+        deleter,
+        torch::TensorOptions().dtype(type)));
+  }
+  return tensors;
+}
+
+void SampleStore::prefetch(size_t first, size_t count) const {
+  if (first >= size() || count == 0) {
+    return;
+  }
+  auto last = std::min(first + count, size()) - 1;
+  // madvise() requires a page-aligned address
+  static auto const pageSize = uint64_t(::sysconf(_SC_PAGESIZE));
+  auto begin = index_[first][0] / pageSize * pageSize;
+  ::madvise(mapping_->data + begin, index_[last][3] - begin, MADV_WILLNEED);
+}
+
+std::vector<std::shared_ptr<SampleStore>> openSampleStores(
+    std::vector<std::string> const& paths,
+    std::string const& prefix) {
+  std::vector<std::shared_ptr<SampleStore>> stores;
+  stores.reserve(paths.size());
+  for (auto const& path : paths) {
+    std::string filePath = path;
+    if (!prefix.empty() && !path.empty() && path[0] != '/') {
+      filePath = prefix + "/" + path;
+    }
+    try {
+      stores.push_back(std::make_shared<SampleStore>(filePath));
+    } catch (std::exception const& e) {
+      LOG(WARNING) << "Cannot open sample store " << filePath << ", skipping ("
+                   << e.what() << ")";
+    }
+  }
+  return stores;
+}
+
+} // namespace common
+
+#endif // WITHOUT_POSIX
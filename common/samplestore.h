@@ -0,0 +1,220 @@
+/*
+ * Copyright (c) 2017-present, Facebook, Inc.
+ *
+ * This source code is licensed under the MIT license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include "serialization.h"
+#include "zstdstream.h"
+
+#include <autogradpp/autograd.h>
+#include <glog/logging.h>
+
+#include <array>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace common {
+
+/**
+ * Sample stores hold a sequence of samples in a single file that is
+ * memory-mapped for reading.
+ *
+ * Contrary to shards (see ShardWriter), tensor data is not cerealized. The
+ * tensors of each sample are stored as plain contiguous arrays, aligned to
+ * kAlignment bytes and in native byte order. Reading a sample decerealizes its
+ * remaining members and then sets its tensors to views into the mapped file,
+ * i.e. tensor data is never copied. Since mapped pages are backed by the page
+ * cache, samples that are read repeatedly (e.g. once per epoch) don't add to
+ * the resident memory of the process.
+ *
+ * Sample types need to provide a member function that calls a given function
+ * on each of their tensors, always in the same order:
+ ```
+  template <typename F>
+  void forEachTensor(F&& f) {
+    f(features.tensor);
+    f(target);
+  }
+ ```
+ * Tensors that can be reached more than once (e.g. via a shared_ptr that is
+ * cerealized only once) will be stored once.
+ *
+ * Tensors obtained from a store share memory with all other reads of the same
+ * sample. The mapping is private, so in-place modifications won't be written
+ * back to the file, but they will be visible to subsequent reads from the same
+ * store. Clone tensors that you want to modify.
+ */
+class SampleStoreWriter {
+ public:
+  static size_t constexpr kAlignment = 64;
+
+  explicit SampleStoreWriter(std::string path);
+  ~SampleStoreWriter();
+
+  /// Appends a sample. Its tensors are detached while the sample is being
+  /// cerealized and will be restored afterwards.
+  template <typename T>
+  void write(T& sample) {
+    std::vector<torch::Tensor> tensors;
+    sample.forEachTensor([&](torch::Tensor& t) {
+      tensors.push_back(t);
+      t = torch::Tensor();
+    });
+    auto restore = [&] {
+      size_t i = 0;
+      sample.forEachTensor([&](torch::Tensor& t) {
+        if (tensors[i].defined()) {
+          t = tensors[i];
+        }
+        i++;
+      });
+    };
+
+    OMembuf buf;
+    try {
+      std::ostream os(&buf);
+      cereal::BinaryOutputArchive archive(os);
+      archive(sample);
+    } catch (...) {
+      restore();
+      throw;
+    }
+    restore();
+    append(tensors, buf.data());
+  }
+
+  /// Appends a sample that consists of the given tensors and cerealized data
+  void append(
+      std::vector<torch::Tensor> const& tensors,
+      std::vector<char> const& data);
+
+  size_t size() const {
+    return index_.size();
+  }
+
+  /// Writes the index; no more samples can be appended afterwards
+  void close();
+
+ private:
+  void pad();
+
+  std::string path_;
+  std::ofstream os_;
+  std::vector<std::array<uint64_t, 4>> index_;
+  uint64_t pos_ = 0;
+  bool closed_ = false;
+};
+
+/**
+ * Provides random access to the samples in a sample store file.
+ *
+ * The file is memory-mapped once and stays mapped for as long as the store or
+ * any tensor obtained from it is alive. read() can be called concurrently
+ * from multiple threads.
+ */
+class SampleStore {
+ public:
+  explicit SampleStore(std::string path);
+  ~SampleStore();
+  SampleStore(SampleStore const&) = delete;
+  SampleStore& operator=(SampleStore const&) = delete;
+
+  std::string const& path() const {
+    return path_;
+  }
+  size_t size() const {
+    return index_.size();
+  }
+
+  /// Decerealizes the i-th sample; tensors will be views into the mapping
+  template <typename T>
+  T read(size_t i) const {
+    std::string_view data;
+    auto tensors = tensorsAt(i, data);
+    IMembuf buf(data);
+    std::istream is(&buf);
+    cereal::BinaryInputArchive archive(is);
+    T d;
+    archive(d);
+
+    size_t j = 0;
+    d.forEachTensor([&](torch::Tensor& t) {
+      if (j >= tensors.size()) {
+        throw std::runtime_error("Tensor count mismatch in " + path_);
+      }
+      if (tensors[j].defined()) {
+        t = tensors[j];
+      }
+      j++;
+    });
+    if (j != tensors.size()) {
+      throw std::runtime_error("Tensor count mismatch in " + path_);
+    }
+    return d;
+  }
+
+  /// Hints the kernel to page in samples [first, first+count)
+  void prefetch(size_t first, size_t count) const;
+
+ private:
+  struct Mapping;
+
+  /// Returns the tensors of the i-th sample and sets data to the cerealized
+  /// remainder
+  std::vector<torch::Tensor> tensorsAt(size_t i, std::string_view& data) const;
+
+  std::string path_;
+  std::shared_ptr<Mapping> mapping_;
+  /// Begin, tensor info offset, data offset and end of each sample
+  std::vector<std::array<uint64_t, 4>> index_;
+};
+
+/**
+ * Opens the sample stores at the given paths. Relative paths will be resolved
+ * with respect to prefix if it's not empty. Stores that cannot be opened are
+ * skipped with a warning.
+ */
+std::vector<std::shared_ptr<SampleStore>> openSampleStores(
+    std::vector<std::string> const& paths,
+    std::string const& prefix = std::string());
+
+/**
+ * Converts data stored in separate files (as read by DataReader) to a sample
+ * store. Files that cannot be read are skipped with a warning. Returns the
+ * number of samples written.
+ */
+template <typename T>
+size_t writeSampleStore(
+    std::vector<std::string> const& paths,
+    std::string const& outputPath,
+    std::string const& prefix = std::string()) {
+  SampleStoreWriter writer(outputPath);
+  for (auto const& path : paths) {
+    std::string filePath = path;
+    if (!prefix.empty() && !path.empty() && path[0] != '/') {
+      filePath = prefix + "/" + path;
+    }
+    T d;
+    try {
+      zstd::ifstream is(filePath);
+      cereal::BinaryInputArchive archive(is);
+      archive(d);
+    } catch (std::exception const& e) {
+      LOG(WARNING) << "Cannot read " << filePath << ", skipping (" << e.what()
+                   << ")";
+      continue;
+    }
+    writer.write(d);
+  }
+  writer.close();
+  return writer.size();
+}
+
+} // namespace common
@@ -0,0 +1,279 @@
+/*
+ * Copyright (c) 2017-present, Facebook, Inc.
+ *
+ * This source code is licensed under the MIT license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace common {
+
+/**
+ * An associative container for a small number of entries.
+ *
+ * Entries are kept in insertion order in a flat array and looked up with a
+ * linear scan. The first N entries are stored inline, i.e. without any heap
+ * allocation; larger maps move their entries to a heap-allocated vector. Once
+ * a map reaches kIndexThreshold entries, lookups go through an index of entry
+ * positions sorted by key instead, so keys need to be ordered by std::less.
+ *
+ * The interface follows std::unordered_map, but note that iterators are
+ * invalidated by insertions and removals.
+ */
+template <typename K, typename V, size_t N = 1>
+class SmallMap {
+  static_assert(
+      std::is_trivially_copyable<K>::value &&
+          std::is_trivially_copyable<V>::value,
+      "SmallMap requires trivially copyable keys and values");
+  static_assert(N > 0, "SmallMap requires inline storage");
+
+ public:
+  using key_type = K;
+  using mapped_type = V;
+  using value_type = std::pair<K, V>;
+  using size_type = size_t;
+  using iterator = value_type*;
+  using const_iterator = value_type const*;
+
+  /// Minimum number of entries for which lookups use a sorted index
+  static size_t constexpr kIndexThreshold = 16;
+
+  SmallMap() = default;
+  SmallMap(std::initializer_list<value_type> init) {
+    for (auto const& entry : init) {
+      emplace(entry.first, entry.second);
+    }
+  }
+  template <typename It>
+  SmallMap(It first, It last) {
+    for (; first != last; ++first) {
+      emplace(first->first, first->second);
+    }
+  }
+  SmallMap(SmallMap const& other) {
+    *this = other;
+  }
+  SmallMap(SmallMap&& other) noexcept {
+    *this = std::move(other);
+  }
+  SmallMap& operator=(SmallMap const& other) {
+    if (this != &other) {
+      std::copy(other.inline_, other.inline_ + other.size_, inline_);
+      size_ = other.size_;
+      heap_ = other.heap_ ? std::make_unique<Heap>(*other.heap_) : nullptr;
+    }
+    return *this;
+  }
+  SmallMap& operator=(SmallMap&& other) noexcept {
+    if (this != &other) {
+      std::copy(other.inline_, other.inline_ + other.size_, inline_);
+      size_ = other.size_;
+      heap_ = std::move(other.heap_);
+      other.size_ = 0;
+    }
+    return *this;
+  }
+
+  size_t size() const {
+    return heap_ ? heap_->entries.size() : size_;
+  }
+  bool empty() const {
+    return size() == 0;
+  }
+
+  iterator begin() {
+    return heap_ ? heap_->entries.data() : inline_;
+  }
+  iterator end() {
+    return begin() + size();
+  }
+  const_iterator begin() const {
+    return heap_ ? heap_->entries.data() : inline_;
+  }
+  const_iterator end() const {
+    return begin() + size();
+  }
+  const_iterator cbegin() const {
+    return begin();
+  }
+  const_iterator cend() const {
+    return end();
+  }
+
+  iterator find(K const& key) {
+    return begin() + (std::as_const(*this).find(key) - cbegin());
+  }
+  const_iterator find(K const& key) const {
+    if (heap_ && !heap_->index.empty()) {
+      auto it = heap_->lowerBound(key);
+      if (it != heap_->index.end() && heap_->entries[*it].first == key) {
+        return begin() + *it;
+      }
+      return end();
+    }
+    return std::find_if(begin(), end(), [&](value_type const& entry) {
+      return entry.first == key;
+    });
+  }
+  size_t count(K const& key) const {
+    return find(key) != end() ? 1 : 0;
+  }
+  V& at(K const& key) {
+    auto it = find(key);
+    if (it == end()) {
+      throw std::out_of_range("SmallMap::at: no such key");
+    }
+    return it->second;
+  }
+  V const& at(K const& key) const {
+    auto it = find(key);
+    if (it == end()) {
+      throw std::out_of_range("SmallMap::at: no such key");
+    }
+    return it->second;
+  }
+  V& operator[](K const& key) {
+    return emplace(key, V()).first->second;
+  }
+
+  /// Inserts a new entry unless the key is already present
+  std::pair<iterator, bool> emplace(K const& key, V const& value) {
+    auto it = find(key);
+    if (it != end()) {
+      return std::make_pair(it, false);
+    }
+    if (heap_) {
+      heap_->emplace(key, value);
+      return std::make_pair(&heap_->entries.back(), true);
+    }
+    if (size_ < N) {
+      inline_[size_] = value_type(key, value);
+      return std::make_pair(&inline_[size_++], true);
+    }
+    // Move to heap storage
+    heap_ = std::make_unique<Heap>();
+    heap_->entries.reserve(2 * N);
+    heap_->entries.assign(inline_, inline_ + size_);
+    heap_->emplace(key, value);
+    size_ = 0;
+    return std::make_pair(&heap_->entries.back(), true);
+  }
+  std::pair<iterator, bool> insert(value_type const& entry) {
+    return emplace(entry.first, entry.second);
+  }
+
+  iterator erase(const_iterator pos) {
+    auto offset = pos - begin();
+    if (heap_) {
+      heap_->erase(offset);
+      if (heap_->entries.size() <= N) {
+        // Back to inline storage
+        std::copy(heap_->entries.begin(), heap_->entries.end(), inline_);
+        size_ = heap_->entries.size();
+        heap_.reset();
+      }
+    } else {
+      std::copy(inline_ + offset + 1, inline_ + size_, inline_ + offset);
+      size_--;
+    }
+    return begin() + offset;
+  }
+  iterator erase(iterator pos) {
+    return erase(const_iterator(pos));
+  }
+  /// Removes the entry with the given key, if present. This is a template so
+  /// that erase(nullptr) is not ambiguous for pointer keys.
+  template <typename Key>
+  size_t erase(Key const& key) {
+    auto it = find(key);
+    if (it == end()) {
+      return 0;
+    }
+    erase(const_iterator(it));
+    return 1;
+  }
+  void clear() {
+    heap_.reset();
+    size_ = 0;
+  }
+
+  bool operator==(SmallMap const& other) const {
+    if (size() != other.size()) {
+      return false;
+    }
+    for (auto const& entry : *this) {
+      auto it = other.find(entry.first);
+      if (it == other.end() || !(it->second == entry.second)) {
+        return false;
+      }
+    }
+    return true;
+  }
+  bool operator!=(SmallMap const& other) const {
+    return !(*this == other);
+  }
+
+ private:
+  /// Heap storage for maps with more than N entries
+  struct Heap {
+    std::vector<value_type> entries;
+    /// Positions in entries sorted by key; empty below kIndexThreshold
+    std::vector<uint32_t> index;
+
+    typename std::vector<uint32_t>::const_iterator lowerBound(
+        K const& key) const {
+      return std::lower_bound(
+          index.begin(), index.end(), key, [&](uint32_t pos, K const& k) {
+            return std::less<K>()(entries[pos].first, k);
+          });
+    }
+
+    /// Appends a new entry; the key must not be present yet
+    void emplace(K const& key, V const& value) {
+      entries.emplace_back(key, value);
+      uint32_t pos = entries.size() - 1;
+      if (!index.empty()) {
+        index.insert(lowerBound(key), pos);
+      } else if (entries.size() >= kIndexThreshold) {
+        index.resize(entries.size());
+        for (uint32_t i = 0; i < index.size(); i++) {
+          index[i] = i;
+        }
+        std::sort(index.begin(), index.end(), [&](uint32_t a, uint32_t b) {
+          return std::less<K>()(entries[a].first, entries[b].first);
+        });
+      }
+    }
+
+    void erase(size_t offset) {
+      if (!index.empty()) {
+        index.erase(lowerBound(entries[offset].first));
+        for (auto& pos : index) {
+          if (pos > offset) {
+            pos--;
+          }
+        }
+      }
+      entries.erase(entries.begin() + offset);
+    }
+  };
+
+  value_type inline_[N];
+  /// Number of inline entries; zero if entries are stored in heap_
+  uint32_t size_ = 0;
+  std::unique_ptr<Heap> heap_;
+};
+
+} // namespace common
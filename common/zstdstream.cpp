@@ -196,7 +196,8 @@ istream::~istream() {
   }
 }
 
-ostream::ostream(std::streambuf* sbuf) : std::ostream(new ostreambuf(sbuf)) {
+ostream::ostream(std::streambuf* sbuf, int level)
+    : std::ostream(new ostreambuf(sbuf, level)) {
   exceptions(std::ios_base::badbit);
 }
 
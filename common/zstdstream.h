@@ -139,7 +139,7 @@ class istream : public std::istream {
  */
 class ostream : public std::ostream {
  public:
-  ostream(std::streambuf* sbuf);
+  ostream(std::streambuf* sbuf, int level = cstream::defaultLevel);
   virtual ~ostream();
 };
 
@@ -124,6 +124,11 @@ void A2C::doUpdate(
   common::assertSize("discounted_reward", discounted_reward, {batchSize});
 
   common::assertSize("notterminal", notTerminal, {returnsLength_, batchSize});
+  // Mean absolute advantage per sequence, for prioritized replay
+  torch::Tensor tdError;
+  if (sampleWeights_.defined()) {
+    tdError = torch::zeros({batchSize}, V.options());
+  }
   for (int i = (int)seq.size() - 2; i >= 0; --i) {
     auto currentFrame = std::static_pointer_cast<BatchedFrame>(seq[i]);
     ag::Variant const& currentOut = currentFrame->forwarded_state;
@@ -134,7 +139,15 @@ void A2C::doUpdate(
     discounted_reward =
         (discounted_reward * discount_ * notTerminal[i]) + currentFrame->reward;
 
-    auto valueLoss = at::smooth_l1_loss(currentV, discounted_reward);
+    torch::Tensor valueLoss;
+    if (sampleWeights_.defined()) {
+      valueLoss = (at::smooth_l1_loss(
+                       currentV, discounted_reward, at::Reduction::None) *
+                   sampleWeights_)
+                      .mean();
+    } else {
+      valueLoss = at::smooth_l1_loss(currentV, discounted_reward);
+    }
     totValueLoss = totValueLoss + valueLoss;
 
     // LOG(INFO) << "discounted " << discounted_reward;
@@ -142,6 +155,10 @@ void A2C::doUpdate(
     auto advantage =
         discounted_reward - currentV.detach().set_requires_grad(false);
     common::assertSize("advantage", advantage, {batchSize});
+    if (sampleWeights_.defined()) {
+      tdError.add_(advantage.abs());
+      advantage = advantage * sampleWeights_;
+    }
 
     {
       MetricsContext::Timer batchTimer(metricsContext_, "a2c:policyLoss");
@@ -155,6 +172,9 @@ void A2C::doUpdate(
     MetricsContext::Timer batchTimer(metricsContext_, "a2c:Backward");
     (totValueLoss + policy_ratio_ * totPolicyLoss).backward();
   }
+  if (tdError.defined()) {
+    updatePriorities(tdError / float(seq.size() - 1));
+  }
 
   doOptimStep();
 }
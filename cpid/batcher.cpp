@@ -8,12 +8,22 @@
 #include "batcher.h"
 #include "common/autograd.h"
 #include "common/utils.h"
+#include <algorithm>
 #include <chrono>
 #include <fmt/format.h>
 #include <shared_mutex>
 
 namespace cpid {
 
+namespace {
+// Weight of new observations for the moving averages of the adaptive policy
+double constexpr kEwmaAlpha = 0.1;
+
+double ewma(double avg, double value) {
+  return avg > 0 ? (1 - kEwmaAlpha) * avg + kEwmaAlpha * value : value;
+}
+} // namespace
+
 AsyncBatcher::AsyncBatcher(
     ag::Container model,
     int batchSize,
@@ -48,6 +58,15 @@ void AsyncBatcher::startBatching(int batchSize) {
   batchSize_ = batchSize;
   consumeThreadStarted_ = true;
   shouldStop_.store(false);
+  stopForwarding_ = false;
+  {
+    std::unique_lock lk(modelMutex_);
+    replicas_.assign(numForwardThreads_, nullptr);
+    replicaVersions_.assign(numForwardThreads_, 0);
+  }
+  for (auto i = 0; i < numForwardThreads_; i++) {
+    forwardThreads_.emplace_back(&AsyncBatcher::forwardThread, this, i);
+  }
   consumeThread_ = std::thread(&AsyncBatcher::consumeThread, this);
 }
 
@@ -55,11 +74,37 @@ void AsyncBatcher::stopBatching() {
   if (consumeThread_.joinable()) {
     shouldStop_.store(true);
     batchReadyCV_.notify_all();
+    forwardCV_.notify_all();
     consumeThread_.join();
+    // Forward threads process remaining batches before exiting
+    {
+      std::lock_guard<std::mutex> lock(forwardMutex_);
+      stopForwarding_ = true;
+    }
+    forwardCV_.notify_all();
+    for (auto& thread : forwardThreads_) {
+      thread.join();
+    }
+    forwardThreads_.clear();
     consumeThreadStarted_ = false;
   }
 }
 
+void AsyncBatcher::setInferencePool(int numThreads, bool replicate) {
+  if (numThreads < 0) {
+    throw std::runtime_error("Number of forward threads must be non-negative");
+  }
+  bool restart = consumeThreadStarted_;
+  if (restart) {
+    stopBatching();
+  }
+  numForwardThreads_ = numThreads;
+  replicateModel_ = replicate;
+  if (restart) {
+    startBatching(batchSize_);
+  }
+}
+
 ag::Variant AsyncBatcher::batchedForward(ag::Variant state) {
   if (!consumeThreadStarted_) {
     throw std::runtime_error(
@@ -73,8 +118,18 @@ ag::Variant AsyncBatcher::batchedForward(ag::Variant state) {
     priority_lock accessLock(accessMutex_, shouldConsume() ? 0 : 2);
     accessLock.lock();
 
+    auto now = Clock::now();
+    if (lastArrival_ != Clock::time_point()) {
+      arrivalIntervalUs_ = ewma(
+          arrivalIntervalUs_,
+          std::chrono::duration<double, std::micro>(now - lastArrival_)
+              .count());
+    }
+    lastArrival_ = now;
+
     replies_.push_back(myPromise);
     queries_.emplace_back(std::move(state));
+    arrivals_.push_back(now);
     querySize_ = queries_.size();
 
     if (replies_.size() != queries_.size()) {
@@ -92,12 +147,62 @@ bool AsyncBatcher::shouldConsume() {
   return querySize_.load() >= size_t(batchSize_);
 }
 
+void AsyncBatcher::setBatchingPolicy(BatchingPolicy policy) {
+  if (policy.maxWait.count() < 0) {
+    throw std::runtime_error("Maximum wait time must be non-negative");
+  }
+  {
+    priority_lock accessLock(accessMutex_, 0);
+    accessLock.lock();
+    policy_ = policy;
+    if (!policy_.adaptive) {
+      currentWaitUs_ = policy_.maxWait.count();
+    }
+  }
+  batchReadyCV_.notify_all();
+}
+
+AsyncBatcher::BatchingPolicy AsyncBatcher::batchingPolicy() {
+  priority_lock accessLock(accessMutex_, 0);
+  accessLock.lock();
+  return policy_;
+}
+
+void AsyncBatcher::setMetricsContext(std::shared_ptr<MetricsContext> metrics) {
+  priority_lock accessLock(accessMutex_, 0);
+  accessLock.lock();
+  metrics_ = std::move(metrics);
+}
+
+std::chrono::microseconds AsyncBatcher::computeWait(size_t targetSize) const {
+  auto forwardLatencyUs = forwardLatencyUs_.load();
+  if (!policy_.adaptive || arrivalIntervalUs_ <= 0 || forwardLatencyUs <= 0) {
+    return policy_.maxWait;
+  }
+  // Expected time until the batch is full. Waiting for longer than a forward
+  // takes is not worth it, though: the added latency would exceed the time
+  // saved by forwarding fewer batches.
+  auto missing = targetSize - std::min(targetSize, queries_.size());
+  auto waitUs = std::min(missing * arrivalIntervalUs_, forwardLatencyUs);
+  return std::min(
+      policy_.maxWait, std::chrono::microseconds(int64_t(waitUs)));
+}
+
 void AsyncBatcher::consumeThread() {
   typedef std::chrono::high_resolution_clock clock_;
   typedef std::chrono::duration<double, std::ratio<1>> second_;
   common::setCurrentThreadName("asyncbatcher");
   auto lastOverloadedAlert = clock_::now();
   while (true) {
+    if (!forwardThreads_.empty()) {
+      // Assemble the next batch once the previous one has been picked up by a
+      // forward thread. Until then, queries keep accumulating.
+      std::unique_lock<std::mutex> lock(forwardMutex_);
+      forwardCV_.wait(lock, [&] {
+        return shouldStop_.load() || forwardQueue_.empty();
+      });
+    }
+
     // create the lock, but doesn't actually lock
     priority_lock accessLock(accessMutex_, 1);
     accessLock.lock();
@@ -109,6 +214,25 @@ void AsyncBatcher::consumeThread() {
       return;
     }
 
+    // Give the batch some time to fill up, measured from the arrival of its
+    // oldest query
+    auto targetSize = size_t(batchSize_);
+    if (policy_.targetBatchSize > 0) {
+      targetSize = std::min(targetSize, size_t(policy_.targetBatchSize));
+    }
+    if (queries_.size() < targetSize) {
+      auto wait = computeWait(targetSize);
+      currentWaitUs_ = wait.count();
+      if (wait.count() > 0) {
+        batchReadyCV_.wait_until(accessLock, arrivals_.front() + wait, [&] {
+          return shouldStop_.load() || queries_.size() >= targetSize;
+        });
+        if (shouldStop_.load()) {
+          return;
+        }
+      }
+    }
+
     if (queries_.size() > 5 * (size_t)batchSize_ &&
         std::chrono::duration_cast<second_>(clock_::now() - lastOverloadedAlert)
                 .count() > 5.0f) {
@@ -118,47 +242,128 @@ void AsyncBatcher::consumeThread() {
     }
 
     auto todoSize = std::min((size_t)batchSize_, queries_.size());
-    decltype(queries_) queries;
-    decltype(replies_) replies;
+    Batch batch;
+    batch.queries.reserve(todoSize);
+    batch.replies.reserve(todoSize);
+    batch.arrivals.assign(arrivals_.begin(), arrivals_.begin() + todoSize);
     for (auto i = 0U; i < todoSize; i++) {
-      queries.emplace_back(std::move(queries_[i]));
-      replies.emplace_back(std::move(replies_[i]));
+      batch.queries.emplace_back(std::move(queries_[i]));
+      batch.replies.emplace_back(std::move(replies_[i]));
     }
     std::move(queries_.begin() + todoSize, queries_.end(), queries_.begin());
     std::move(replies_.begin() + todoSize, replies_.end(), replies_.begin());
+    arrivals_.erase(arrivals_.begin(), arrivals_.begin() + todoSize);
     queries_.resize(queries_.size() - todoSize);
     replies_.resize(replies_.size() - todoSize);
 
     querySize_ = queries_.size();
+    batch.metrics = metrics_;
     accessLock.unlock();
 
     try {
-      ag::Variant input = this->makeBatch(queries);
+      MetricsContext::Timer batchTimer(batch.metrics, "batcher:make_batch");
+      batch.input = this->makeBatch(batch.queries);
+    } catch (...) {
+      for (auto& reply : batch.replies) {
+        reply->set_exception(std::current_exception());
+      }
+      continue;
+    }
+
+    if (forwardThreads_.empty()) {
+      forwardBatch(batch, 0);
+    } else {
+      {
+        std::lock_guard<std::mutex> lock(forwardMutex_);
+        forwardQueue_.push_back(std::move(batch));
+      }
+      forwardCV_.notify_all();
+    }
+  }
+}
+
+void AsyncBatcher::forwardThread(size_t index) {
+  common::setCurrentThreadName(fmt::format("asyncbatcher{}", index));
+  while (true) {
+    Batch batch;
+    {
+      std::unique_lock<std::mutex> lock(forwardMutex_);
+      forwardCV_.wait(lock, [&] {
+        return stopForwarding_ || !forwardQueue_.empty();
+      });
+      if (forwardQueue_.empty()) {
+        return;
+      }
+      batch = std::move(forwardQueue_.front());
+      forwardQueue_.pop_front();
+    }
+    // There's room for the next batch now
+    forwardCV_.notify_all();
+    forwardBatch(batch, index);
+  }
+}
+
+void AsyncBatcher::forwardBatch(Batch& batch, size_t replica) {
+  try {
+    auto start = Clock::now();
+    std::vector<ag::Variant> replies_values;
+    {
+      MetricsContext::Timer forwardTimer(batch.metrics, "batcher:forward");
       ag::Variant out;
       {
         torch::NoGradGuard g_;
         std::shared_lock modelLock(modelMutex_);
-        out = model_->forward(input);
+        out = replicaModel(replica)->forward(batch.input);
       }
 
-      auto replies_values = this->unBatch(out);
+      replies_values = this->unBatch(out);
+    }
+    auto end = Clock::now();
+    forwardLatencyUs_ = ewma(
+        forwardLatencyUs_.load(),
+        std::chrono::duration<double, std::micro>(end - start).count());
+
+    auto& replies = batch.replies;
+    if (replies.size() != replies_values.size()) {
+      LOG(FATAL) << "The batch size of the reply (" << replies_values.size()
+                 << ") doesn't match the expected batch size ("
+                 << replies.size() << ")";
+    }
 
-      if (replies.size() != replies_values.size()) {
-        LOG(FATAL) << "The batch size of the reply (" << replies_values.size()
-                   << ") doesn't match the expected batch size ("
-                   << replies.size() << ")";
+    if (batch.metrics) {
+      std::vector<float> latencies;
+      latencies.reserve(batch.arrivals.size());
+      for (auto const& arrival : batch.arrivals) {
+        latencies.push_back(
+            std::chrono::duration<float, std::milli>(end - arrival).count());
       }
+      batch.metrics->pushEvent("batcher:batch_size", replies.size());
+      batch.metrics->pushEvents("batcher:latency_ms", std::move(latencies));
+    }
 
-      lastBatchSize_ = queries.size();
-      for (size_t i = 0; i < replies.size(); ++i) {
-        replies[i]->set_value(std::move(replies_values[i]));
-      }
-    } catch (...) {
-      for (size_t i = 0; i < replies.size(); ++i) {
-        replies[i]->set_exception(std::current_exception());
-      }
+    lastBatchSize_ = replies.size();
+    for (size_t i = 0; i < replies.size(); ++i) {
+      replies[i]->set_value(std::move(replies_values[i]));
     }
+  } catch (...) {
+    for (auto& reply : batch.replies) {
+      reply->set_exception(std::current_exception());
+    }
+  }
+}
+
+ag::Container AsyncBatcher::replicaModel(size_t replica) {
+  // Requires a shared lock on modelMutex_. Each forward thread only touches
+  // its own replica, so replicas can be refreshed concurrently.
+  if (!replicateModel_ || replica >= replicas_.size()) {
+    return model_;
   }
+  auto version = modelVersion_.load();
+  if (replicaVersions_[replica] != version || !replicas_[replica]) {
+    replicas_[replica] = ag::clone(model_);
+    replicaVersions_[replica] = version;
+  }
+  return replicas_[replica];
 }
 
 std::vector<ag::Variant> AsyncBatcher::unBatch(const ag::Variant& out) {
@@ -184,6 +389,9 @@ ag::Variant AsyncBatcher::makeBatch(const std::vector<ag::Variant>& queries) {
 void AsyncBatcher::setModel(ag::Container newModel) {
   std::unique_lock lk(modelMutex_);
   model_ = newModel;
+  // Replicas will be re-created for the next forward
+  modelVersion_++;
+  std::fill(replicas_.begin(), replicas_.end(), nullptr);
 }
 
 std::shared_lock<std::shared_mutex> AsyncBatcher::sharedLockModel() {
@@ -191,7 +399,10 @@ std::shared_lock<std::shared_mutex> AsyncBatcher::sharedLockModel() {
 }
 
 std::unique_lock<std::shared_mutex> AsyncBatcher::lockModel() {
-  return std::unique_lock(modelMutex_);
+  std::unique_lock lk(modelMutex_);
+  // The model may be modified in-place, so replicas need to be refreshed
+  modelVersion_++;
+  return lk;
 }
 
 // ========= SubBatchAsyncBatcher
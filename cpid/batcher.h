@@ -6,7 +6,11 @@
  */
 
 #pragma once
+#include "metrics.h"
 #include "prioritymutex.h"
+#include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <future>
 #include <glog/logging.h>
 #include <memory>
@@ -21,11 +25,28 @@ namespace cpid {
 
 class AsyncBatcher {
  public:
+  using Clock = std::chrono::steady_clock;
+
+  /** Determines when incomplete batches are forwarded.
+   * By default, queued queries are forwarded immediately, which results in
+   * small batches if queries arrive at a high rate from many threads.
+   */
+  struct BatchingPolicy {
+    /// Maximum time a query waits for its batch to fill up
+    std::chrono::microseconds maxWait{0};
+    /// A batch is forwarded as soon as this many queries are queued. Values
+    /// <= 0 or larger than the batch size refer to the batch size.
+    int targetBatchSize = 0;
+    /// If true, the wait time is tuned from the observed query arrival rate
+    /// and forward latency, with maxWait as an upper bound
+    bool adaptive = false;
+  };
+
   /** Construct a batcher
    * @param model is the model used for forwarding
    * @param batchSize is the maximal size of a batch. A forward will occur when
-   * that many inputs have been collected. If the consumer waits for more than
-   * 200ms for a batch, it will try to forward an incomplete batch
+   * that many inputs have been collected. Incomplete batches are forwarded
+   * according to the batching policy, see setBatchingPolicy()
    * @param padValue This is the value used to pad the inputs to the same size
    * @param stipOutput: when true, any negative value in the output tensors will
    * be masked out
@@ -51,7 +72,8 @@ class AsyncBatcher {
 
   /** Changes the model to be used for forwarding. This operation has
    * high priority, but if a forward is about to be executed with the old model,
-   * it may be executed before the effective model switch */
+   * it may be executed before the effective model switch.
+   * If model replicas are used, all of them are switched at once. */
   void setModel(ag::Container newModel);
 
   /** Get a shared lock on the model */
@@ -61,6 +83,21 @@ class AsyncBatcher {
    * forward is being executed */
   std::unique_lock<std::shared_mutex> lockModel();
 
+  /** Forwards batches on a pool of threads.
+   * By default, the consumer thread assembles a batch, forwards it and
+   * distributes the results before assembling the next batch. With a pool,
+   * the consumer thread only assembles batches (makeBatch) and up to
+   * numThreads forwards and unBatch calls run concurrently, overlapping with
+   * the assembly of the next batch.
+   * If replicate is true, each thread forwards with its own copy of the
+   * model. Replicas are re-created on the first forward after setModel() or
+   * lockModel(). Otherwise, all threads share a single model, which has to
+   * support concurrent forwards.
+   * This restarts batching and should be called before issuing queries. A
+   * value of 0 restores the default behavior.
+   */
+  void setInferencePool(int numThreads, bool replicate = false);
+
   /** Given an output of the model, retrieve the replies for all the
    * element of the batch.
    * It will mask out any negative element of the reply tensor (that allows to
@@ -90,11 +127,47 @@ class AsyncBatcher {
     return lastBatchSize_;
   }
 
+  void setBatchingPolicy(BatchingPolicy policy);
+  BatchingPolicy batchingPolicy();
+
+  /** Current time that queries wait for their batch to fill up. With an
+   * adaptive policy, this is updated whenever a batch is assembled.
+   */
+  std::chrono::microseconds currentWait() const {
+    return std::chrono::microseconds(currentWaitUs_.load());
+  }
+
+  /** Records statistics for every forward:
+   * - batcher:batch_size: number of queries in the batch (event)
+   * - batcher:latency_ms: time from queuing to reply per query (events)
+   * - batcher:make_batch: time for makeBatch (interval)
+   * - batcher:forward: time for forward and unBatch (interval)
+   */
+  void setMetricsContext(std::shared_ptr<MetricsContext> metrics);
+
  protected:
   void startBatching(int batchSize);
   void stopBatching();
 
+  /// A batch that is ready to be forwarded
+  struct Batch {
+    std::vector<ag::Variant> queries;
+    std::vector<std::shared_ptr<std::promise<ag::Variant>>> replies;
+    std::vector<Clock::time_point> arrivals;
+    std::shared_ptr<MetricsContext> metrics;
+    ag::Variant input;
+  };
+
   void consumeThread();
+  void forwardThread(size_t index);
+  /// Runs the model on a batch and fulfills its replies
+  void forwardBatch(Batch& batch, size_t replica);
+  /// Returns the model for the given forward thread. Requires a shared lock
+  /// on modelMutex_.
+  ag::Container replicaModel(size_t replica);
+  /// Returns the time to wait for the current batch to fill up. Requires
+  /// accessMutex_ to be held.
+  std::chrono::microseconds computeWait(size_t targetSize) const;
 
   ag::Container model_;
   bool consumeThreadStarted_ = false;
@@ -114,6 +187,31 @@ class AsyncBatcher {
   std::atomic_size_t querySize_; // To make TSAN happy
   std::vector<ag::Variant> queries_;
   std::vector<std::shared_ptr<std::promise<ag::Variant>>> replies_;
+  std::vector<Clock::time_point> arrivals_;
+
+  // Protected by accessMutex_
+  BatchingPolicy policy_;
+  std::shared_ptr<MetricsContext> metrics_;
+  Clock::time_point lastArrival_;
+  /// Moving average of time between queries
+  double arrivalIntervalUs_ = 0;
+  /// Moving average of forward duration (including unBatch)
+  std::atomic<double> forwardLatencyUs_{0};
+  std::atomic<int64_t> currentWaitUs_{0};
+
+  // Inference pool
+  int numForwardThreads_ = 0;
+  bool replicateModel_ = false;
+  std::vector<std::thread> forwardThreads_;
+  std::deque<Batch> forwardQueue_;
+  std::mutex forwardMutex_;
+  std::condition_variable forwardCV_;
+  bool stopForwarding_ = false;
+  // Protected by modelMutex_; forward threads may re-create their own replica
+  // while holding a shared lock
+  std::vector<ag::Container> replicas_;
+  std::vector<uint64_t> replicaVersions_;
+  std::atomic<uint64_t> modelVersion_{0};
 
   std::thread consumeThread_;
   std::atomic<bool> shouldStop_{false};
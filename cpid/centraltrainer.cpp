@@ -264,6 +264,15 @@ void CentralTrainer::dequeueEpisodes() {
 bool CentralTrainer::episodeClientEnqueue(EpisodeData const& epData) {
   if (client_) {
     client_->enqueue(epData);
+    if (metricsContext_) {
+      for (auto const& [endpoint, stats] : client_->endpointStats()) {
+        metricsContext_->setCounter(
+            fmt::format("episodeserver/{}/queue_depth", endpoint),
+            stats.queueDepth);
+        metricsContext_->setCounter(
+            fmt::format("episodeserver/{}/credit", endpoint), stats.credit);
+      }
+    }
     return true;
   }
   return false;
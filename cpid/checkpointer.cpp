@@ -9,10 +9,17 @@
 #include "distributed.h"
 #include "trainer.h"
 #include <common/assert.h>
+#include <common/checksum.h>
 #include <common/fsutils.h>
+#include <common/serialization.h>
 #include <fmt/format.h>
 #include <visdom/visdom.h>
 
+#include <condition_variable>
+#include <fstream>
+#include <mutex>
+#include <thread>
+
 auto const vopts = &visdom::makeOpts;
 constexpr const auto vappend = visdom::UpdateMethod::Append;
 constexpr const auto vnone = visdom::UpdateMethod::None;
@@ -20,8 +27,125 @@ namespace cpid {
 namespace dist = distributed;
 namespace fsutils = common::fsutils;
 
+namespace {
+using NamedTensors = std::vector<std::pair<std::string, torch::Tensor>>;
+using Digests = std::unordered_map<std::string, std::vector<uint8_t>>;
+
+std::shared_ptr<std::vector<char>> serializeTrainer(
+    std::shared_ptr<Trainer> trainer) {
+  common::OMembuf buf;
+  {
+    std::ostream os(&buf);
+    ag::save(os, trainer.get());
+  }
+  return std::make_shared<std::vector<char>>(buf.takeData());
+}
+
+/// Copies model parameters and buffers to host memory
+NamedTensors snapshotTensors(ag::Container model) {
+  torch::NoGradGuard guard;
+  NamedTensors tensors;
+  auto copy = [&](std::string const& name, torch::Tensor const& t) {
+    tensors.emplace_back(
+        name, t.is_cuda() ? t.detach().cpu() : t.detach().clone());
+  };
+  for (auto& it : model->named_parameters()) {
+    copy(it.key(), it.value());
+  }
+  for (auto& it : model->named_buffers()) {
+    copy(it.key(), it.value());
+  }
+  return tensors;
+}
+
+std::vector<uint8_t> tensorDigest(torch::Tensor const& t) {
+  auto contig = t.contiguous();
+  return common::md5sum(
+      contig.data_ptr(), contig.numel() * contig.type().elementSizeInBytes());
+}
+
+/// Writes to a temporary file first so that readers never see partial files
+void writeFileAtomic(std::string const& path, std::vector<char> const& data) {
+  auto tmp = path + ".tmp";
+  std::ofstream os(tmp, std::ios::binary);
+  os.write(data.data(), data.size());
+  os.close();
+  if (!os) {
+    fsutils::rmrf(tmp);
+    throw std::runtime_error("Error writing checkpoint " + tmp);
+  }
+  fsutils::mv(tmp, path);
+}
+} // namespace
+
+/**
+ * Runs checkpoint jobs, either on the calling thread or on a background
+ * thread. Also keeps track of the model digests of the last full checkpoint
+ * for delta checkpoints. Shared between copies of a Checkpointer.
+ */
+struct Checkpointer::Writer {
+  using Job = std::function<void(Digests&)>;
+
+  ~Writer() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stop = true;
+    }
+    cv.notify_all();
+    if (thread.joinable()) {
+      thread.join();
+    }
+  }
+
+  void run(Job fn, bool async) {
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [&] { return job == nullptr; });
+    if (!async) {
+      fn(digests);
+      return;
+    }
+    job = std::move(fn);
+    if (!thread.joinable()) {
+      thread = std::thread(&Writer::loop, this);
+    }
+    cv.notify_all();
+  }
+
+  void wait() {
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [&] { return job == nullptr; });
+  }
+
+  void loop() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+      cv.wait(lock, [&] { return stop || job != nullptr; });
+      if (job == nullptr) {
+        return;
+      }
+      // The job stays set while running so that run() and wait() block
+      lock.unlock();
+      try {
+        job(digests);
+      } catch (std::exception const& e) {
+        LOG(ERROR) << "Error writing checkpoint: " << e.what();
+      }
+      lock.lock();
+      job = nullptr;
+      cv.notify_all();
+    }
+  }
+
+  std::thread thread;
+  std::mutex mutex;
+  std::condition_variable cv;
+  Job job;
+  bool stop = false;
+  Digests digests;
+};
+
 Checkpointer::Checkpointer(std::shared_ptr<Trainer> trainer)
-    : trainer_(trainer) {
+    : trainer_(trainer), writer_(std::make_shared<Writer>()) {
   lastEpochStamp_ = hires_clock::now();
 }
 
@@ -250,36 +374,49 @@ void Checkpointer::onEpoch(int updateCount) {
     metrics->clear();
   }
   if (dist::globalContext()->rank == 0) {
-    checkpointTrainer("latest");
+    std::vector<std::string> suffixes = {"latest"};
+    std::vector<std::string> expired;
+    bool latestAsDelta = fullCheckpointInterval_ > 1 &&
+        numLatestCheckpoints_++ % fullCheckpointInterval_ != 0;
+    bool shouldSave = false;
+    double newPerf = 0;
     if (compareMetric_ != "") {
-      bool should_save = false;
-      double new_perf = 0;
       if (means.count(compareMetric_) == 0) {
         LOG(WARNING) << "Warning: the comparison metric " << compareMetric_
                      << " seems unavailable.";
       } else {
-        new_perf = means[compareMetric_];
+        newPerf = means[compareMetric_];
       }
       if (fsutils::exists(checkpointPath_ + "perf.txt")) {
         std::ifstream old_perf_f(checkpointPath_ + "perf.txt");
         float old_perf;
         old_perf_f >> old_perf;
-        should_save = old_perf < new_perf;
+        shouldSave = old_perf < newPerf;
       } else {
-        should_save = true;
+        shouldSave = true;
       }
-      if (should_save) {
-        std::string suffix = std::to_string(new_perf);
+      if (shouldSave) {
+        std::string suffix = std::to_string(newPerf);
         while (
             fsutils::exists(checkpointPath_ + "trainer_" + suffix + ".bin")) {
           suffix += "_" + std::to_string(updateCount / epochLength_);
         }
-        checkpointTrainer(suffix);
-        checkpointTrainer("best");
-        std::ofstream perf_f(checkpointPath_ + "perf.txt");
-        perf_f << new_perf << std::endl;
+        suffixes.push_back(suffix);
+        suffixes.push_back("best");
+        perfCheckpoints_.push_back(
+            checkpointPath_ + "trainer_" + suffix + ".bin");
+        while (maxCheckpoints_ > 0 &&
+               perfCheckpoints_.size() > size_t(maxCheckpoints_)) {
+          expired.push_back(perfCheckpoints_.front());
+          perfCheckpoints_.pop_front();
+        }
       }
     }
+    writeCheckpoints(suffixes, latestAsDelta, std::move(expired));
+    if (shouldSave) {
+      std::ofstream perf_f(checkpointPath_ + "perf.txt");
+      perf_f << newPerf << std::endl;
+    }
   }
 }
 
@@ -301,15 +438,115 @@ std::string const& Checkpointer::checkpointPath() const {
 }
 
 void Checkpointer::checkpointTrainer(std::string const& suffix) {
-  std::string path = checkpointPath_ + "trainer_" + suffix + ".bin";
-  checkpointTrainer(trainer_, path);
+  writeCheckpoints({suffix});
 }
 
 void Checkpointer::checkpointTrainer(
     std::shared_ptr<Trainer> trainer,
     std::string const& filename) {
-  fsutils::rmrf(filename);
-  ag::save(filename, trainer.get());
+  auto tmp = filename + ".tmp";
+  ag::save(tmp, trainer.get());
+  fsutils::mv(tmp, filename);
+}
+
+void Checkpointer::waitForCheckpoints() {
+  writer_->wait();
+}
+
+void Checkpointer::loadDelta(
+    std::shared_ptr<Trainer> trainer,
+    std::string const& filename) {
+  std::unordered_map<std::string, torch::Tensor> tensors;
+  {
+    std::ifstream is(filename, std::ios::binary);
+    if (!is) {
+      throw std::runtime_error("Cannot open " + filename);
+    }
+    cereal::BinaryInputArchive archive(is);
+    archive(tensors);
+  }
+
+  torch::NoGradGuard guard;
+  auto model = trainer->model();
+  auto params = model->named_parameters();
+  auto buffers = model->named_buffers();
+  for (auto& it : tensors) {
+    auto* dest = params.find(it.first);
+    if (dest == nullptr) {
+      dest = buffers.find(it.first);
+    }
+    if (dest == nullptr) {
+      throw std::runtime_error(
+          fmt::format("Unknown tensor {} in {}", it.first, filename));
+    }
+    dest->copy_(it.second);
+  }
+}
+
+void Checkpointer::writeCheckpoints(
+    std::vector<std::string> const& suffixes,
+    bool latestAsDelta,
+    std::vector<std::string> expired) {
+  auto path = [&](std::string const& suffix) {
+    return checkpointPath_ + "trainer_" + suffix + ".bin";
+  };
+  auto latestPath = path("latest");
+  auto deltaPath = checkpointPath_ + "trainer_latest.delta.bin";
+  bool trackDeltas = fullCheckpointInterval_ > 1 &&
+      std::find(suffixes.begin(), suffixes.end(), "latest") != suffixes.end();
+
+  // Take snapshots on the calling thread; everything else is left to the
+  // writer
+  std::vector<std::string> fullPaths;
+  for (auto const& suffix : suffixes) {
+    if (suffix != "latest" || !latestAsDelta) {
+      fullPaths.push_back(path(suffix));
+    }
+  }
+  std::shared_ptr<std::vector<char>> data;
+  if (!fullPaths.empty()) {
+    data = serializeTrainer(trainer_);
+  }
+  NamedTensors tensors;
+  if (trackDeltas) {
+    tensors = snapshotTensors(trainer_->model());
+  }
+
+  auto job = [=](Digests& digests) {
+    for (auto const& p : fullPaths) {
+      if (p == latestPath) {
+        // A delta of the previous full checkpoint would be invalid now
+        fsutils::rmrf(deltaPath);
+      }
+      writeFileAtomic(p, *data);
+    }
+    if (trackDeltas && latestAsDelta) {
+      std::unordered_map<std::string, torch::Tensor> changed;
+      for (auto const& it : tensors) {
+        auto digest = digests.find(it.first);
+        if (digest == digests.end() ||
+            digest->second != tensorDigest(it.second)) {
+          changed.emplace(it.first, it.second);
+        }
+      }
+      common::OMembuf buf;
+      {
+        std::ostream os(&buf);
+        cereal::BinaryOutputArchive archive(os);
+        archive(changed);
+      }
+      writeFileAtomic(deltaPath, buf.data());
+    } else if (trackDeltas) {
+      digests.clear();
+      for (auto const& it : tensors) {
+        digests[it.first] = tensorDigest(it.second);
+      }
+    }
+    for (auto const& p : expired) {
+      fsutils::rmrf(p);
+    }
+  };
+  writer_->run(std::move(job), asyncCheckpoints_);
 }
 
 } // namespace cpid
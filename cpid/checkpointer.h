@@ -9,6 +9,9 @@
 
 #include <autogradpp/autograd.h>
 
+#include <deque>
+#include <memory>
+
 namespace visdom {
 class Visdom;
 }
@@ -30,6 +33,15 @@ class Checkpointer {
       std::shared_ptr<Trainer> trainer,
       std::string const& filename = "trainer_final.bin");
 
+  /// Blocks until all checkpoints have been written to disk
+  void waitForCheckpoints();
+
+  /// Applies a delta checkpoint (see fullCheckpointInterval) to the model of
+  /// a trainer that has been loaded from the matching full checkpoint
+  static void loadDelta(
+      std::shared_ptr<Trainer> trainer,
+      std::string const& filename);
+
   /// Returns the path where the latest model would be saved. (It's not
   /// guaranteed that one have been saved yet)
   std::string getModelPath() const;
@@ -61,6 +73,26 @@ class Checkpointer {
   Checkpointer& checkpointPath(std::string const& path);
   std::string const& checkpointPath() const;
 
+  /**
+   * If true, checkpoints are written to disk by a background thread. The
+   * trainer is still serialized on the calling thread, but into host memory,
+   * so that training only stalls for the duration of the device-to-host copy.
+   * At most one checkpoint is pending at any time.
+   */
+  TORCH_ARG(bool, asyncCheckpoints) = false;
+
+  /**
+   * If > 1, only every n-th epoch will write a full trainer_latest.bin. Other
+   * epochs write trainer_latest.delta.bin instead, which contains the model
+   * parameters and buffers that changed since the last full checkpoint (but no
+   * optimizer state). Use loadDelta() to apply it.
+   */
+  TORCH_ARG(int, fullCheckpointInterval) = 1;
+
+  /// Maximum number of performance-based checkpoints to keep. Older ones
+  /// written by this checkpointer will be removed. Zero means no limit.
+  TORCH_ARG(int, maxCheckpoints) = 0;
+
   /// Metrics used to assess preformance of a model
   /// Disables performance based checkpoints if empty
   TORCH_ARG(std::string, compareMetric) = "";
@@ -104,10 +136,19 @@ class Checkpointer {
       std::unordered_map<std::string, float> mins,
       std::unordered_map<std::string, float> maxs);
   void reduceMetrics(std::vector<float>& values);
+  void writeCheckpoints(
+      std::vector<std::string> const& suffixes,
+      bool latestAsDelta = false,
+      std::vector<std::string> expired = {});
   std::shared_ptr<Trainer> trainer_;
 
   std::vector<std::string> visdomLines_;
   hires_clock::time_point lastEpochStamp_;
   int lastEpochUpdateNum_ = 0;
+
+  struct Writer;
+  std::shared_ptr<Writer> writer_;
+  int numLatestCheckpoints_ = 0;
+  std::deque<std::string> perfCheckpoints_;
 };
 } // namespace cpid
@@ -15,6 +15,10 @@
 
 #include <fmt/format.h>
 #include <glog/logging.h>
+#include <torch/csrc/autograd/function.h>
+
+#include <algorithm>
+#include <mutex>
 
 #ifdef HAVE_C10D
 #include <c10d/FileStore.hpp>
@@ -49,6 +53,56 @@ namespace {
 std::shared_ptr<cpid::distributed::Context> globalContext_;
 std::once_flag contextInitialized_;
 int cudaDeviceNumber = 0;
+
+/// Groups tensors of the same type and device into buckets of up to
+/// bucketBytes, keeping their order. Larger tensors get a bucket of their own.
+std::vector<std::vector<size_t>> makeBuckets(
+    std::vector<torch::Tensor> const& tensors,
+    size_t bucketBytes) {
+  std::vector<std::vector<size_t>> buckets;
+  // Index and size of the bucket that is currently filled for each type
+  std::vector<std::pair<size_t, size_t>> open;
+  for (size_t i = 0; i < tensors.size(); i++) {
+    auto const& t = tensors[i];
+    size_t bytes = t.numel() * t.type().elementSizeInBytes();
+    auto it = std::find_if(open.begin(), open.end(), [&](auto const& o) {
+      auto const& first = tensors[buckets[o.first].front()];
+      return first.dtype() == t.dtype() && first.device() == t.device();
+    });
+    if (it != open.end() && it->second + bytes > bucketBytes) {
+      open.erase(it);
+      it = open.end();
+    }
+    if (it == open.end()) {
+      buckets.emplace_back();
+      open.emplace_back(buckets.size() - 1, 0);
+      it = open.end() - 1;
+    }
+    buckets[it->first].push_back(i);
+    it->second += bytes;
+  }
+  return buckets;
+}
+
+/// Copies consecutive slices of a flat tensor to the given tensors
+void unflatten(torch::Tensor const& flat, std::vector<torch::Tensor>& tensors) {
+  int64_t offset = 0;
+  for (auto& t : tensors) {
+    t.copy_(flat.narrow(0, offset, t.numel()).view_as(t));
+    offset += t.numel();
+  }
+}
+
+struct GradReadyHook : torch::autograd::FunctionPostHook {
+  std::function<void()> func_;
+  GradReadyHook(std::function<void()> func) : func_(std::move(func)) {}
+  torch::autograd::variable_list operator()(
+      torch::autograd::variable_list const& outputs,
+      torch::autograd::variable_list const&) override {
+    func_();
+    return outputs;
+  }
+};
 } // namespace
 
 namespace cpid {
@@ -107,6 +161,11 @@ void Work::wait() {
       work->wait();
     }
   }
+  if (onFinish_) {
+    auto onFinish = std::move(onFinish_);
+    onFinish_ = nullptr;
+    onFinish();
+  }
 }
 
 const std::exception_ptr Work::exception() const {
@@ -152,7 +211,7 @@ void Work::add(Work&& other) {
     works_.push_back(std::move(work));
   }
   other.works_.clear();
-  auto func = [tof = this->onFinish_, oof = other.onFinish_]() {
+  auto func = [tof = this->onFinish_, oof = std::move(other.onFinish_)]() {
     if (tof) {
       tof();
     }
@@ -161,6 +220,7 @@ void Work::add(Work&& other) {
     }
   };
   onFinish_ = func;
+  other.onFinish_ = nullptr;
 }
 
 void init() {
@@ -323,12 +383,38 @@ Work Context::allreduce(torch::Tensor x, ReduceOp op) {
 #endif
 }
 
-Work Context::allreduceGradients(ag::Container const& model, ReduceOp op) {
+Work Context::allreduceGradients(
+    ag::Container const& model,
+    ReduceOp op,
+    size_t bucketBytes) {
+  if (size == 1) {
+    return Work();
+  }
+  std::vector<torch::Tensor> grads;
+  auto params = model->parameters();
+  for (auto it = params.rbegin(); it != params.rend(); ++it) {
+    if (it->grad().defined()) {
+      grads.push_back(it->grad());
+    }
+  }
+
   Work work;
-  for (auto& p : model->parameters()) {
-    if (p.grad().defined()) {
-      work.add(this->allreduce(p.grad(), op));
+  for (auto const& bucket : makeBuckets(grads, bucketBytes)) {
+    if (bucket.size() == 1) {
+      work.add(this->allreduce(grads[bucket[0]], op));
+      continue;
+    }
+    std::vector<torch::Tensor> tensors, views;
+    for (auto i : bucket) {
+      tensors.push_back(grads[i]);
+      views.push_back(grads[i].contiguous().view(-1));
     }
+    auto flat = torch::cat(views);
+    auto bucketWork = this->allreduce(flat, op);
+    bucketWork.onFinish_ = [flat, tensors]() mutable {
+      unflatten(flat, tensors);
+    };
+    work.add(std::move(bucketWork));
   }
   return work;
 }
@@ -440,6 +526,152 @@ Context::Context(
 }
 #endif
 
+struct GradientReducer::State {
+  struct Bucket {
+    std::vector<size_t> params;
+    torch::Tensor flat;
+    // Half-precision copy of flat if gradients are compressed
+    torch::Tensor comm;
+    size_t pending = 0;
+  };
+
+  std::shared_ptr<Context> context;
+  std::vector<torch::Tensor> params;
+  std::vector<size_t> bucketOf;
+  std::vector<int64_t> offsetOf;
+  std::vector<bool> ready;
+  std::vector<Bucket> buckets;
+  std::vector<Work> works;
+  size_t nextBucket = 0;
+  std::mutex mutex;
+  // Variables only hold weak references to their gradient accumulators
+  std::vector<std::shared_ptr<torch::autograd::Function>> accumulators;
+
+  torch::Tensor slice(size_t i) {
+    return buckets[bucketOf[i]]
+        .flat.narrow(0, offsetOf[i], params[i].numel())
+        .view_as(params[i]);
+  }
+
+  // Requires mutex to be held
+  void markReady(size_t i) {
+    if (ready[i]) {
+      return;
+    }
+    ready[i] = true;
+    torch::NoGradGuard guard;
+    auto grad = params[i].grad();
+    if (grad.defined()) {
+      slice(i).copy_(grad);
+    } else {
+      slice(i).zero_();
+    }
+    buckets[bucketOf[i]].pending--;
+
+    // Launch in order so that collectives match up across workers
+    while (nextBucket < buckets.size() && buckets[nextBucket].pending == 0) {
+      auto& bucket = buckets[nextBucket++];
+      if (bucket.comm.defined()) {
+        bucket.flat.div_(context->size);
+        bucket.comm.copy_(bucket.flat);
+        works.push_back(context->allreduce(bucket.comm));
+      } else {
+        works.push_back(context->allreduce(bucket.flat));
+      }
+    }
+  }
+};
+
+GradientReducer::GradientReducer(
+    ag::Container model,
+    size_t bucketBytes,
+    bool compress,
+    std::shared_ptr<Context> context)
+    : state_(std::make_shared<State>()) {
+  state_->context = context ? context : globalContext();
+  auto params = model->parameters();
+  for (auto it = params.rbegin(); it != params.rend(); ++it) {
+    if (it->requires_grad()) {
+      state_->params.push_back(*it);
+    }
+  }
+  state_->bucketOf.resize(state_->params.size());
+  state_->offsetOf.resize(state_->params.size());
+  state_->ready.resize(state_->params.size());
+  for (auto const& indices : makeBuckets(state_->params, bucketBytes)) {
+    State::Bucket bucket;
+    int64_t numel = 0;
+    for (auto i : indices) {
+      state_->bucketOf[i] = state_->buckets.size();
+      state_->offsetOf[i] = numel;
+      bucket.params.push_back(i);
+      numel += state_->params[i].numel();
+    }
+    auto options = state_->params[indices[0]].options().requires_grad(false);
+    bucket.flat = torch::zeros({numel}, options);
+    if (compress && bucket.flat.is_floating_point()) {
+      bucket.comm = torch::zeros({numel}, options.dtype(at::kHalf));
+    }
+    bucket.pending = indices.size();
+    state_->buckets.push_back(std::move(bucket));
+  }
+  if (state_->context->size == 1) {
+    return;
+  }
+
+  std::weak_ptr<State> weak = state_;
+  for (size_t i = 0; i < state_->params.size(); i++) {
+    auto& var = torch::autograd::as_variable_ref(state_->params[i]);
+    auto accumulator = var.grad_accumulator();
+    accumulator->add_post_hook(std::make_unique<GradReadyHook>([weak, i]() {
+      if (auto state = weak.lock()) {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        state->markReady(i);
+      }
+    }));
+    state_->accumulators.push_back(std::move(accumulator));
+  }
+}
+
+GradientReducer::~GradientReducer() {}
+
+void GradientReducer::wait() {
+  auto& s = *state_;
+  if (s.context->size == 1) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(s.mutex);
+  for (size_t i = 0; i < s.params.size(); i++) {
+    s.markReady(i);
+  }
+  for (auto& work : s.works) {
+    work.wait();
+  }
+  s.works.clear();
+
+  torch::NoGradGuard guard;
+  for (auto& bucket : s.buckets) {
+    if (bucket.comm.defined()) {
+      bucket.flat.copy_(bucket.comm);
+      bucket.flat.mul_(s.context->size);
+    }
+    for (auto i : bucket.params) {
+      auto& grad = s.params[i].grad();
+      if (!grad.defined()) {
+        grad = torch::zeros_like(s.params[i]);
+      }
+      grad.copy_(s.slice(i));
+    }
+    bucket.pending = bucket.params.size();
+  }
+  std::fill(s.ready.begin(), s.ready.end(), false);
+  s.nextBucket = 0;
+}
+
+size_t GradientReducer::numBuckets() const {
+  return state_->buckets.size();
+}
+
 template <typename T, IsTorchDType<T>*>
 Work allreduce(T* ptr, int64_t s, ReduceOp op) {
   return globalContext()->allreduce(ptr, s, op);
@@ -452,8 +684,11 @@ Work allreduce(std::vector<T>& v, ReduceOp op) {
 Work allreduce(torch::Tensor x, ReduceOp op) {
   return globalContext()->allreduce(x, op);
 }
-Work allreduceGradients(ag::Container const& x, ReduceOp op) {
-  return globalContext()->allreduceGradients(x, op);
+Work allreduceGradients(
+    ag::Container const& x,
+    ReduceOp op,
+    size_t bucketBytes) {
+  return globalContext()->allreduceGradients(x, op, bucketBytes);
 }
 
 template <typename T, IsTorchDType<T>*>
@@ -121,7 +121,12 @@ class Context {
   template <typename T, IsTorchDType<T>* = nullptr>
   Work allreduce(std::vector<T>& v, ReduceOp = ReduceOp::SUM);
   Work allreduce(torch::Tensor, ReduceOp = ReduceOp::SUM);
-  Work allreduceGradients(ag::Container const&, ReduceOp = ReduceOp::SUM);
+  /// Gradients are flattened into buckets of up to bucketBytes, in reverse
+  /// parameter order, and reduced with one allreduce per bucket
+  Work allreduceGradients(
+      ag::Container const&,
+      ReduceOp = ReduceOp::SUM,
+      size_t bucketBytes = kGradientBucketBytes);
 
   template <typename T, IsTorchDType<T>* = nullptr>
   Work broadcast(T* ptr, int64_t s, int root = 0);
@@ -138,19 +143,68 @@ class Context {
 
   Work barrier();
 
+  static size_t constexpr kGradientBucketBytes = 25 * 1024 * 1024;
+
  private:
   std::shared_ptr<ProcessGroup> glooPG_;
   std::shared_ptr<ProcessGroup> ncclPG_;
   std::shared_ptr<ProcessGroup> devicePG(torch::Tensor x);
 };
 
+/**
+ * Sums gradients over all workers while the backward pass is still running.
+ *
+ * Parameters are grouped into buckets of up to bucketBytes, in reverse
+ * registration order, which approximates the order in which their gradients
+ * become available. Hooks on the gradient accumulators launch the allreduce of
+ * a bucket as soon as all of its gradients have been computed, so that
+ * communication overlaps with the remainder of the backward pass. Buckets are
+ * launched in the same order on all workers.
+ *
+ * Every backward pass needs to be followed by a call to wait(), which launches
+ * any remaining buckets (gradients that haven't been computed count as zero),
+ * waits for all of them and writes the results back to the gradients:
+ ```
+  dist::GradientReducer reducer(model);
+  for (...) {
+    loss.backward();
+    reducer.wait();
+    optim->step();
+  }
+ ```
+ * If compress is true, floating point gradients are sent as half-precision
+ * floats. They are divided by the number of workers before the conversion to
+ * avoid overflows.
+ */
+class GradientReducer {
+ public:
+  GradientReducer(
+      ag::Container model,
+      size_t bucketBytes = Context::kGradientBucketBytes,
+      bool compress = false,
+      std::shared_ptr<Context> context = nullptr);
+  ~GradientReducer();
+  GradientReducer(GradientReducer const&) = delete;
+  GradientReducer& operator=(GradientReducer const&) = delete;
+
+  void wait();
+  size_t numBuckets() const;
+
+ private:
+  struct State;
+  std::shared_ptr<State> state_;
+};
+
 // Here are some functions that will automatically use the global context.
 template <typename T, IsTorchDType<T>* = nullptr>
 Work allreduce(T* ptr, int64_t s, ReduceOp = ReduceOp::SUM);
 template <typename T, IsTorchDType<T>* = nullptr>
 Work allreduce(std::vector<T>& v, ReduceOp = ReduceOp::SUM);
 Work allreduce(torch::Tensor, ReduceOp = ReduceOp::SUM);
-Work allreduceGradients(ag::Container const&, ReduceOp = ReduceOp::SUM);
+Work allreduceGradients(
+    ag::Container const&,
+    ReduceOp = ReduceOp::SUM,
+    size_t bucketBytes = Context::kGradientBucketBytes);
 
 template <typename T, IsTorchDType<T>* = nullptr>
 Work broadcast(T* ptr, int64_t s, int root = 0);
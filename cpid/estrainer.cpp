@@ -12,6 +12,7 @@
 #include "policygradienttrainer.h"
 #include "sampler.h"
 
+#include "common/language.h"
 #include "distributed.h"
 #include <ATen/CPUGenerator.h>
 #ifdef HAVE_CUDA
@@ -19,8 +20,102 @@
 #endif
 #include <math.h>
 
+#include <array>
+#include <cmath>
+#include <map>
+
 namespace cpid {
 
+namespace {
+uint32_t constexpr kPhiloxMul0 = 0xD2511F53;
+uint32_t constexpr kPhiloxMul1 = 0xCD9E8D57;
+uint32_t constexpr kPhiloxWeyl0 = 0x9E3779B9;
+uint32_t constexpr kPhiloxWeyl1 = 0xBB67AE85;
+
+/// Philox4x32-10 block function (Salmon et al., "Parallel Random Numbers: As
+/// Easy as 1, 2, 3"). Maps a 64-bit counter and a 64-bit key to four
+/// uniformly distributed 32-bit integers.
+std::array<uint32_t, 4> philox(uint64_t counter, uint64_t key) {
+  std::array<uint32_t, 4> c = {
+      uint32_t(counter), uint32_t(counter >> 32), 0, 0};
+  uint32_t k0 = uint32_t(key);
+  uint32_t k1 = uint32_t(key >> 32);
+  for (int round = 0; round < 10; round++) {
+    uint64_t p0 = uint64_t(kPhiloxMul0) * c[0];
+    uint64_t p1 = uint64_t(kPhiloxMul1) * c[2];
+    c = {uint32_t(p1 >> 32) ^ c[1] ^ k0,
+         uint32_t(p1),
+         uint32_t(p0 >> 32) ^ c[3] ^ k1,
+         uint32_t(p0)};
+    k0 += kPhiloxWeyl0;
+    k1 += kPhiloxWeyl1;
+  }
+  return c;
+}
+
+/// Four standard normal samples for the given counter (Box-Muller transform)
+std::array<float, 4> philoxNormal(uint64_t counter, uint64_t key) {
+  auto bits = philox(counter, key);
+  std::array<float, 4> out;
+  for (int i = 0; i < 4; i += 2) {
+    // Uniform samples in (0, 1)
+    auto u0 = (double(bits[i]) + 0.5) / 4294967296.0;
+    auto u1 = (double(bits[i + 1]) + 0.5) / 4294967296.0;
+    auto r = std::sqrt(-2.0 * std::log(u0));
+    out[i] = float(r * std::cos(2.0 * M_PI * u1));
+    out[i + 1] = float(r * std::sin(2.0 * M_PI * u1));
+  }
+  return out;
+}
+
+/// philox() for a tensor of counters, using element-wise operations on the
+/// tensor's device. 32-bit words are held in int64 tensors; multiplications
+/// are split into 16-bit halves so that products fit.
+std::array<torch::Tensor, 4> philox(torch::Tensor counter, uint64_t key) {
+  int64_t constexpr kLow32 = 0xFFFFFFFF;
+  auto mulhilo = [](torch::Tensor const& a, int64_t mul) {
+    auto pl = a.__and__(0xFFFF).mul_(mul);
+    auto ph = a.__rshift__(16).mul_(mul);
+    auto lo = ph.__and__(0xFFFF).__ilshift__(16).add_(pl).__iand__(kLow32);
+    auto hi = ph.add_(pl.__irshift__(16)).__irshift__(16);
+    return std::make_pair(hi, lo);
+  };
+  std::array<torch::Tensor, 4> c = {counter.__and__(kLow32),
+                                    counter.__rshift__(32),
+                                    torch::zeros_like(counter),
+                                    torch::zeros_like(counter)};
+  uint32_t k0 = uint32_t(key);
+  uint32_t k1 = uint32_t(key >> 32);
+  for (int round = 0; round < 10; round++) {
+    auto p0 = mulhilo(c[0], kPhiloxMul0);
+    auto p1 = mulhilo(c[2], kPhiloxMul1);
+    c = {p1.first.__ixor__(c[1]).__ixor__(int64_t(k0)),
+         p1.second,
+         p0.first.__ixor__(c[3]).__ixor__(int64_t(k1)),
+         p0.second};
+    k0 += kPhiloxWeyl0;
+    k1 += kPhiloxWeyl1;
+  }
+  return c;
+}
+
+/// philoxNormal() for a tensor of counters, returning a [counters, 4] tensor
+torch::Tensor philoxNormal(torch::Tensor counter, uint64_t key) {
+  auto bits = philox(counter, key);
+  auto uniform = [](torch::Tensor const& b) {
+    return b.to(at::kDouble).add_(0.5).div_(4294967296.0);
+  };
+  std::vector<torch::Tensor> out;
+  for (int i = 0; i < 4; i += 2) {
+    auto r = uniform(bits[i]).log_().mul_(-2.0).sqrt_();
+    auto theta = uniform(bits[i + 1]).mul_(2.0 * M_PI);
+    out.push_back(theta.cos() * r);
+    out.push_back(theta.sin_().mul_(r));
+  }
+  return torch::stack(out, 1).to(at::kFloat);
+}
+} // namespace
+
 ESTrainer::ESTrainer(
     ag::Container model,
     ag::Optimizer optim,
@@ -164,72 +259,78 @@ bool ESTrainer::update() {
             << gatherSize_ << ", consider increasing history length";
   }
 
-  for (size_t b = 0; b < gatherSize_; ++b) {
-    int generation = allGenerations_[b];
-    int64_t seed = allSeeds_[b];
-    float reward = rewardsTransformed[b].item<float>();
-
-    ag::Container originalModel;
-    {
-      if (oldestGeneration > generation) {
-        // we have an episode generated by perturbing a model that is too
-        // old to be stored in the history. We skip such an episode.
-        continue;
+  if (seedReplay_) {
+    meanGenerationsDelay =
+        accumulateSeedReplayGradients(rewardsTransformed, outdatedEpisodes);
+  } else {
+    for (size_t b = 0; b < gatherSize_; ++b) {
+      int generation = allGenerations_[b];
+      int64_t seed = allSeeds_[b];
+      float reward = rewardsTransformed[b].item<float>();
+
+      ag::Container originalModel;
+      {
+        if (oldestGeneration > generation) {
+          // we have an episode generated by perturbing a model that is too
+          // old to be stored in the history. We skip such an episode.
+          continue;
+        }
+        originalModel = modelsHistory_[generation - oldestGeneration].second;
       }
-      originalModel = modelsHistory_[generation - oldestGeneration].second;
-    }
 
-    // TODO: lookup in the cache for the local models
-    ag::Container perturbedModel = generateModel(generation, seed);
-    auto perturbedParams = perturbedModel->named_parameters();
-    double importanceWeight = 1.0;
-    if (generation != latestGeneration) {
-      if (onPolicy_) {
-        LOG(FATAL) << "While onPolicy, got episode of generation " << generation
-                   << "while the current one is " << latestGeneration;
+      // TODO: lookup in the cache for the local models
+      ag::Container perturbedModel = generateModel(generation, seed);
+      auto perturbedParams = perturbedModel->named_parameters();
+      double importanceWeight = 1.0;
+      if (generation != latestGeneration) {
+        if (onPolicy_) {
+          LOG(FATAL) << "While onPolicy, got episode of generation "
+                     << generation << "while the current one is "
+                     << latestGeneration;
+        }
+        meanGenerationsDelay += latestGeneration - generation;
+        // the perturbedModel was sampled from
+        // N(originalParams, std_), but we want to pretend it was sampled from
+        // N(model_, std_) importance weight would be iw = P(perturbed | model_,
+        // std_) / P(perturbed | originalModel, std_) => log(iw) = 0.5 *
+        // (-(perturbed - model_)^2 + (perturbed - originalModel_)^2) / std_^2
+        auto originalParams = originalModel->named_parameters();
+        double logImportanceWeight = 0.0;
+        for (auto& it : currentParams) {
+          auto& name = it.key();
+          auto& perturbedTensor = perturbedParams[name];
+          auto& originalTensor = originalParams[name];
+          auto& currentTensor = currentParams[name];
+
+          logImportanceWeight +=
+              -(perturbedTensor - currentTensor).pow_(2.0).sum().item<float>() +
+              (perturbedTensor - originalTensor).pow_(2.0).sum().item<float>();
+        }
+        logImportanceWeight *= 0.5 / std_ / std_;
+        importanceWeight = exp(logImportanceWeight);
+        importanceWeight = importanceWeight > 1.0 ? 1.0 : importanceWeight;
       }
-      meanGenerationsDelay += latestGeneration - generation;
-      // the perturbedModel was sampled from
-      // N(originalParams, std_), but we want to pretend it was sampled from
-      // N(model_, std_) importance weight would be iw = P(perturbed | model_,
-      // std_) / P(perturbed | originalModel, std_) => log(iw) = 0.5 *
-      // (-(perturbed - model_)^2 + (perturbed - originalModel_)^2) / std_^2
-      auto originalParams = originalModel->named_parameters();
-      double logImportanceWeight = 0.0;
+
       for (auto& it : currentParams) {
         auto& name = it.key();
-        auto& perturbedTensor = perturbedParams[name];
-        auto& originalTensor = originalParams[name];
-        auto& currentTensor = currentParams[name];
-
-        logImportanceWeight +=
-            -(perturbedTensor - currentTensor).pow_(2.0).sum().item<float>() +
-            (perturbedTensor - originalTensor).pow_(2.0).sum().item<float>();
-      }
-      logImportanceWeight *= 0.5 / std_ / std_;
-      importanceWeight = exp(logImportanceWeight);
-      importanceWeight = importanceWeight > 1.0 ? 1.0 : importanceWeight;
-    }
-
-    for (auto& it : currentParams) {
-      auto& name = it.key();
-      auto& modelVar = it.value();
-      auto& modelValue = it.value();
-      auto& pertrubedValue = perturbedParams[name];
-      auto gradEstimate = pertrubedValue - modelValue;
-      // Need to flip the sign as we maximize; we also adjust the normalizer to
-      // account for outdated episodes which we have thrown away. In case if all
-      // episodes are outdated, this line is never executed.
-      gradEstimate.mul_(
-          -1.0 * reward / std_ * importanceWeight /
-          (gatherSize_ - outdatedEpisodes));
-      if (modelVar.grad().defined()) {
-        modelVar.grad().add_(gradEstimate);
-      } else {
-        modelVar.grad() = torch::Tensor(gradEstimate).set_requires_grad(true);
+        auto& modelVar = it.value();
+        auto& modelValue = it.value();
+        auto& pertrubedValue = perturbedParams[name];
+        auto gradEstimate = pertrubedValue - modelValue;
+        // Need to flip the sign as we maximize; we also adjust the normalizer
+        // to account for outdated episodes which we have thrown away. In case
+        // if all episodes are outdated, this line is never executed.
+        gradEstimate.mul_(
+            -1.0 * reward / std_ * importanceWeight /
+            (gatherSize_ - outdatedEpisodes));
+        if (modelVar.grad().defined()) {
+          modelVar.grad().add_(gradEstimate);
+        } else {
+          modelVar.grad() = torch::Tensor(gradEstimate).set_requires_grad(true);
+        }
       }
+      // end NoGradGuard
     }
-    // end NoGradGuard
   }
   {
     std::unique_lock<std::shared_timed_mutex> lock(currentModelMutex_);
@@ -274,6 +375,116 @@ bool ESTrainer::update() {
   return true;
 }
 
+float ESTrainer::accumulateSeedReplayGradients(
+    torch::Tensor const& rewards,
+    size_t outdatedEpisodes) {
+  int oldestGeneration = modelsHistory_.front().first;
+  int latestGeneration = modelsHistory_.back().first;
+  auto currentParams = model_->parameters();
+
+  // Coefficient of each episode's perturbation in the gradient estimate. As
+  // in the regular update, we flip the sign since we maximize and skip
+  // episodes from generations that are no longer in the history.
+  std::vector<int64_t> seeds;
+  std::vector<int> generations;
+  std::vector<double> coefs;
+  float generationsDelay = 0.0f;
+  for (size_t b = 0; b < gatherSize_; ++b) {
+    int generation = allGenerations_[b];
+    if (oldestGeneration > generation) {
+      continue;
+    }
+    if (generation != latestGeneration) {
+      if (onPolicy_) {
+        LOG(FATAL) << "While onPolicy, got episode of generation "
+                   << generation << "while the current one is "
+                   << latestGeneration;
+      }
+      generationsDelay += latestGeneration - generation;
+    }
+    seeds.push_back(allSeeds_[b]);
+    generations.push_back(generation);
+    coefs.push_back(
+        -1.0 * rewards[b].item<float>() / std_ /
+        (gatherSize_ - outdatedEpisodes));
+  }
+  if (seeds.empty()) {
+    return generationsDelay;
+  }
+
+  // Differences between the parameters of older generations and the current
+  // ones
+  std::map<int, std::vector<torch::Tensor>> diffs;
+  for (auto generation : generations) {
+    if (generation == latestGeneration || diffs.count(generation) > 0) {
+      continue;
+    }
+    auto originalParams = historyModel(generation)->parameters();
+    auto& diff = diffs[generation];
+    for (size_t i = 0; i < currentParams.size(); i++) {
+      diff.push_back(originalParams[i] - currentParams[i]);
+    }
+  }
+
+  // Importance weights for episodes of older generations (see update()).
+  // With d = original - current and delta = perturbed - original, we have
+  // log(iw) = -0.5 * (|d|^2 + 2 * <d, delta>) / std_^2.
+  if (!diffs.empty()) {
+    std::vector<double> logWeights(seeds.size(), 0.0);
+    int64_t offset = 0;
+    for (size_t i = 0; i < currentParams.size(); i++) {
+      auto numel = currentParams[i].numel();
+      for (size_t j = 0; j < seeds.size(); j++) {
+        if (generations[j] == latestGeneration) {
+          continue;
+        }
+        auto& d = diffs[generations[j]][i];
+        auto delta = seedNoise(seeds[j], offset, numel, d.device())
+                         .view(d.sizes())
+                         .mul_(std_);
+        logWeights[j] += d.pow(2.0).sum().item<double>() +
+            2.0 * (d * delta).sum().item<double>();
+      }
+      offset += numel;
+    }
+    for (size_t j = 0; j < seeds.size(); j++) {
+      if (generations[j] != latestGeneration) {
+        auto importanceWeight = std::exp(-0.5 * logWeights[j] / std_ / std_);
+        coefs[j] *= std::min(importanceWeight, 1.0);
+      }
+    }
+  }
+
+  // Single pass over the parameters, accumulating
+  // sum_j coef_j * (perturbed_j - current) without materializing any model
+  int64_t offset = 0;
+  for (size_t i = 0; i < currentParams.size(); i++) {
+    auto& param = currentParams[i];
+    auto numel = param.numel();
+    auto noiseSum = torch::zeros(
+        {numel}, at::TensorOptions(param.device()).dtype(at::kFloat));
+    std::map<int, double> diffCoefs;
+    for (size_t j = 0; j < seeds.size(); j++) {
+      noiseSum.add_(
+          seedNoise(seeds[j], offset, numel, param.device()), coefs[j] * std_);
+      if (generations[j] != latestGeneration) {
+        diffCoefs[generations[j]] += coefs[j];
+      }
+    }
+    auto gradEstimate = noiseSum.view(param.sizes());
+    for (auto const& it : diffCoefs) {
+      gradEstimate.add_(diffs[it.first][i], it.second);
+    }
+    if (param.grad().defined()) {
+      param.grad().add_(gradEstimate);
+    } else {
+      param.grad() = torch::Tensor(gradEstimate).set_requires_grad(true);
+    }
+    offset += numel;
+  }
+  return generationsDelay;
+}
+
 void ESTrainer::forceStopEpisode(EpisodeHandle const& handle) {
   {
     std::unique_lock<std::mutex> updateLock(updateMutex_);
@@ -329,10 +540,16 @@ Trainer::EpisodeHandle ESTrainer::startEpisode() {
     std::shared_lock<std::shared_timed_mutex> lock(currentModelMutex_);
     generation = modelsHistory_.back().first;
   }
+  auto generationSeed = std::make_pair(generation, seed);
+  if (seedReplay_) {
+    // The perturbation will be regenerated from the seed when needed
+    std::unique_lock<std::shared_timed_mutex> lock(modelStorageMutex_);
+    gameToGenerationSeed_[modelKey] = generationSeed;
+    return handle;
+  }
   auto model = generateModel(generation, seed);
   {
     std::unique_lock<std::shared_timed_mutex> lock(modelStorageMutex_);
-    auto generationSeed = std::make_pair(generation, seed);
     gameToGenerationSeed_[modelKey] = generationSeed;
     modelCache_[generationSeed] = model;
   }
@@ -346,16 +563,20 @@ ag::Container ESTrainer::getGameModel(
     return model_;
   }
   auto modelKey = std::make_pair(gameUID, key);
+  std::pair<int, int64_t> generationSeedPair;
   { // model was already generated
     std::shared_lock<std::shared_timed_mutex> lock(modelStorageMutex_);
     auto lookup = gameToGenerationSeed_.find(modelKey);
-    if (lookup != gameToGenerationSeed_.end()) {
-      auto generationSeedPair = lookup->second;
-      return modelCache_[generationSeedPair];
-    } else {
+    if (lookup == gameToGenerationSeed_.end()) {
       return model_;
     }
+    generationSeedPair = lookup->second;
+    if (!seedReplay_) {
+      return modelCache_[generationSeedPair];
+    }
   }
+  // Models aren't cached in seed replay mode
+  return generateModel(generationSeedPair.first, generationSeedPair.second);
 }
 
 /// Re-creates model based on its seed and the generation it was produced from.
@@ -364,21 +585,12 @@ ag::Container ESTrainer::getGameModel(
 /// variates.
 ag::Container ESTrainer::generateModel(int generation, int64_t seed) {
   torch::NoGradGuard guard;
-  ag::Container originalModel;
-  {
-    std::shared_lock<std::shared_timed_mutex> lock(currentModelMutex_);
-    auto oldestGeneration = modelsHistory_.front().first;
-    if (oldestGeneration > generation) {
-      // shouldn't happen that we call generateModel with a too old generation,
-      // the only unlikely case is that the whole historyLength_ was maxed
-      // during a single startEpisode call
-      throw std::runtime_error(
-          "Cannot generate a model from a too old generation, increase history "
-          "length!");
-    }
-    originalModel = modelsHistory_[generation - oldestGeneration].second;
-  }
+  ag::Container originalModel = historyModel(generation);
   auto perturbed = ag::clone(originalModel);
+  if (seedReplay_) {
+    perturb(perturbed, originalModel, seed);
+    return perturbed;
+  }
 
   std::shared_ptr<at::Generator> generator;
   if (perturbed->options().device().is_cuda()) {
@@ -401,11 +613,140 @@ ag::Container ESTrainer::generateModel(int generation, int64_t seed) {
   // END NoGradGuard
 }
 
+ag::Container ESTrainer::historyModel(int generation) {
+  std::shared_lock<std::shared_timed_mutex> lock(currentModelMutex_);
+  auto oldestGeneration = modelsHistory_.front().first;
+  if (oldestGeneration > generation) {
+    // shouldn't happen that we call generateModel with a too old generation,
+    // the only unlikely case is that the whole historyLength_ was maxed
+    // during a single startEpisode call
+    throw std::runtime_error(
+        "Cannot generate a model from a too old generation, increase history "
+        "length!");
+  }
+  return modelsHistory_[generation - oldestGeneration].second;
+}
+
+/// Sets the parameters of target to the ones of original, perturbed with the
+/// noise for the given seed (see seedNoise()).
+void ESTrainer::perturb(
+    ag::Container target,
+    ag::Container original,
+    int64_t seed) {
+  torch::NoGradGuard guard;
+  auto targetParams = target->parameters();
+  auto originalParams = original->parameters();
+  int64_t offset = 0;
+  for (size_t i = 0; i < targetParams.size(); i++) {
+    auto& tensor = targetParams[i];
+    auto noise = seedNoise(seed, offset, tensor.numel(), tensor.device());
+    tensor.copy_(originalParams[i]);
+    tensor.add_(noise.view(tensor.sizes()), std_);
+    offset += tensor.numel();
+  }
+}
+
+std::unique_ptr<ESTrainer::ScratchModel> ESTrainer::acquireScratchModel(
+    std::pair<int, int64_t> generationSeed) {
+  std::unique_ptr<ScratchModel> scratch;
+  {
+    std::lock_guard<std::mutex> lock(scratchMutex_);
+    // Prefer a model that holds the requested perturbation already. Models
+    // are released to the back, so the front holds the least recently used
+    // perturbation.
+    auto it = std::find_if(
+        scratchModels_.begin(), scratchModels_.end(), [&](auto const& m) {
+          return m->valid && m->generationSeed == generationSeed;
+        });
+    if (it == scratchModels_.end() && !scratchModels_.empty() &&
+        numScratchModels_ >= maxScratchModels_) {
+      it = scratchModels_.begin();
+    }
+    if (it != scratchModels_.end()) {
+      scratch = std::move(*it);
+      scratchModels_.erase(it);
+    } else {
+      numScratchModels_++;
+    }
+  }
+  if (!scratch) {
+    scratch = std::make_unique<ScratchModel>();
+    scratch->model = ag::clone(model_);
+  }
+  if (!scratch->valid || scratch->generationSeed != generationSeed) {
+    MetricsContext::Timer perturbTimer(
+        metricsContext_, "trainer:scratch_perturb", kFwdMetricsSubsampling);
+    perturb(
+        scratch->model,
+        historyModel(generationSeed.first),
+        generationSeed.second);
+    scratch->valid = true;
+    scratch->generationSeed = generationSeed;
+  }
+  return scratch;
+}
+
+void ESTrainer::releaseScratchModel(std::unique_ptr<ScratchModel> scratch) {
+  std::lock_guard<std::mutex> lock(scratchMutex_);
+  scratchModels_.push_back(std::move(scratch));
+}
+
+torch::Tensor ESTrainer::seedNoise(
+    int64_t seed,
+    int64_t offset,
+    int64_t numel,
+    torch::Device device) {
+  uint64_t key = seed < 0 ? -uint64_t(seed) : uint64_t(seed);
+  float sign = seed < 0 ? -1.0f : 1.0f;
+  if (device.is_cuda() && numel > 0) {
+    // Generate on the device rather than copying noise from the host
+    auto firstBlock = offset / 4;
+    auto lastBlock = (offset + numel - 1) / 4;
+    auto counter = torch::arange(
+        firstBlock, lastBlock + 1, at::TensorOptions(device).dtype(at::kLong));
+    return philoxNormal(counter, key)
+        .view({-1})
+        .narrow(0, offset - firstBlock * 4, numel)
+        .mul_(sign);
+  }
+
+  // On the CPU, a single pass is faster than separate element-wise ops
+  auto noise = torch::empty({numel}, torch::kFloat);
+  auto data = noise.data<float>();
+  std::array<float, 4> block;
+  int64_t blockIndex = -1;
+  for (int64_t i = 0; i < numel; i++) {
+    auto index = offset + i;
+    if (index / 4 != blockIndex) {
+      blockIndex = index / 4;
+      block = philoxNormal(blockIndex, key);
+    }
+    data[i] = sign * block[index % 4];
+  }
+  return noise.to(device);
+}
+
 ag::Variant ESTrainer::forward(ag::Variant inp, EpisodeHandle const& handle) {
   MetricsContext::Timer forwardTimer(
       metricsContext_, "trainer:forward", kFwdMetricsSubsampling);
-  ag::Container model = getGameModel(handle.gameID(), handle.episodeKey());
   torch::NoGradGuard g;
+  if (seedReplay_ && train_) {
+    auto modelKey = std::make_pair(handle.gameID(), handle.episodeKey());
+    std::pair<int, int64_t> generationSeed;
+    {
+      std::shared_lock<std::shared_timed_mutex> lock(modelStorageMutex_);
+      auto lookup = gameToGenerationSeed_.find(modelKey);
+      if (lookup == gameToGenerationSeed_.end()) {
+        return forwardUnbatched(inp, model_);
+      }
+      generationSeed = lookup->second;
+    }
+    auto scratch = acquireScratchModel(generationSeed);
+    auto release = common::makeGuard(
+        [&]() { releaseScratchModel(std::move(scratch)); });
+    return forwardUnbatched(inp, scratch->model);
+  }
+  ag::Container model = getGameModel(handle.gameID(), handle.episodeKey());
   return forwardUnbatched(inp, model);
 }
 
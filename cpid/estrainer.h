@@ -10,6 +10,7 @@
 #include "metrics.h"
 #include "policygradienttrainer.h"
 #include "sampler.h"
+#include <deque>
 #include <shared_mutex>
 
 #include "distributed.h"
@@ -83,9 +84,44 @@ class ESTrainer : public Trainer {
       EpisodeKey const&,
       ReplayBuffer::Episode&) override;
 
+  /// Perturbed models that are used for forward passes in seed replay mode.
+  /// There is one per concurrent forward pass rather than one per game.
+  struct ScratchModel {
+    ag::Container model;
+    bool valid = false;
+    // (generation, seed) of the perturbation the model currently holds
+    std::pair<int, int64_t> generationSeed;
+  };
+  std::mutex scratchMutex_;
+  /// Released scratch models, least recently used first
+  std::deque<std::unique_ptr<ScratchModel>> scratchModels_;
+  size_t numScratchModels_ = 0;
+
   ag::Container generateModel(int generation, int64_t seed);
+  ag::Container historyModel(int generation);
+  void perturb(ag::Container target, ag::Container original, int64_t seed);
+  std::unique_ptr<ScratchModel> acquireScratchModel(
+      std::pair<int, int64_t> generationSeed);
+  void releaseScratchModel(std::unique_ptr<ScratchModel> scratch);
+  /// Adds the gradient estimate for the gathered episodes to the gradients
+  /// of model_ without materializing perturbed models. Returns the summed
+  /// generation delay of the episodes that were used.
+  float accumulateSeedReplayGradients(
+      torch::Tensor const& rewards,
+      size_t outdatedEpisodes);
   void populateSeedQueue();
 
+  /// Standard normal noise for the elements [offset, offset + numel) of the
+  /// concatenated model parameters. It is produced with a counter-based RNG
+  /// keyed by abs(seed), so any slice can be generated independently. The
+  /// noise is negated for negative seeds (antithetic sampling). For CUDA
+  /// devices, noise is generated on the device.
+  static torch::Tensor seedNoise(
+      int64_t seed,
+      int64_t offset,
+      int64_t numel,
+      torch::Device device = torch::kCPU);
+
  public:
   ESTrainer(
       ag::Container model,
@@ -119,6 +155,16 @@ class ESTrainer : public Trainer {
   // If set to true, after successful update() worker threads would remain
   // blocked until the next update() call.
   TORCH_ARG(bool, waitUpdate) = false;
+  // If set to true, perturbed models are not stored for every game. Forward
+  // passes regenerate the perturbation from the episode's seed into a
+  // temporary model, and update() accumulates the gradient estimate from the
+  // seeds in a single pass over the parameters.
+  TORCH_ARG(bool, seedReplay) = false;
+  // In seed replay mode, keep up to this many perturbed models around so that
+  // episodes played in an interleaved fashion don't need to regenerate their
+  // perturbation for every forward pass. By default, there is one model per
+  // concurrent forward pass.
+  TORCH_ARG(size_t, maxScratchModels) = 0;
 };
 
 } // namespace cpid
@@ -6,50 +6,372 @@
  */
 
 #include "metrics.h"
+
+#include <algorithm>
+#include <cmath>
+#include <deque>
 #include <fstream>
+#include <numeric>
+#include <shared_mutex>
+#include <sstream>
+
 #include <nlohmann/json.hpp>
 
 using namespace cpid;
 
+namespace {
+size_t constexpr kNumShards = 16;
+
+/// Process-wide table of interned metric names. Id 0 is the empty name.
+struct KeyRegistry {
+  std::shared_mutex mutex;
+  std::unordered_map<std::string, uint32_t> ids{{std::string(), 0}};
+  /// Deque since references need to remain valid on insertion
+  std::deque<std::string> names{std::string()};
+};
+
+KeyRegistry& keyRegistry() {
+  static KeyRegistry registry;
+  return registry;
+}
+
+size_t threadShardIndex() {
+  // Round-robin assignment spreads threads evenly over the shards
+  static std::atomic<size_t> next{0};
+  thread_local size_t index = next++ % kNumShards;
+  return index;
+}
+
+MetricsContext::Timestamp timestamp() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+nlohmann::json summaryToJson(MetricSummary const& summary) {
+  // Only store non-empty buckets as (index, count) pairs
+  auto buckets = nlohmann::json::array();
+  auto const& counts = summary.buckets();
+  for (size_t i = 0; i < counts.size(); i++) {
+    if (counts[i] > 0) {
+      buckets.push_back({i, counts[i]});
+    }
+  }
+  return nlohmann::json{
+      {"count", summary.count()},
+      {"sum", summary.sum()},
+      {"min", summary.min()},
+      {"max", summary.max()},
+      {"ewma", summary.ewma()},
+      {"ewma_alpha", summary.ewmaAlpha()},
+      {"p50", summary.quantile(0.5f)},
+      {"p90", summary.quantile(0.9f)},
+      {"p99", summary.quantile(0.99f)},
+      {"buckets", buckets},
+  };
+}
+} // namespace
+
+void MetricSummary::add(float value) {
+  if (buckets_.empty()) {
+    buckets_.assign(kNumBuckets, 0);
+  }
+  buckets_[bucketIndex(value)]++;
+  if (count_ == 0) {
+    min_ = max_ = ewma_ = value;
+  } else {
+    min_ = std::min(min_, value);
+    max_ = std::max(max_, value);
+    ewma_ += ewmaAlpha_ * (value - ewma_);
+  }
+  sum_ += value;
+  count_++;
+}
+
+void MetricSummary::merge(MetricSummary const& other) {
+  if (other.count_ == 0) {
+    return;
+  }
+  if (count_ == 0) {
+    min_ = other.min_;
+    max_ = other.max_;
+    ewma_ = other.ewma_;
+  } else {
+    min_ = std::min(min_, other.min_);
+    max_ = std::max(max_, other.max_);
+    ewma_ = (double(ewma_) * count_ + double(other.ewma_) * other.count_) /
+        (count_ + other.count_);
+  }
+  if (buckets_.empty()) {
+    buckets_.assign(kNumBuckets, 0);
+  }
+  for (size_t i = 0; i < kNumBuckets; i++) {
+    buckets_[i] += other.buckets_[i];
+  }
+  sum_ += other.sum_;
+  count_ += other.count_;
+}
+
+float MetricSummary::quantile(float q) const {
+  if (count_ == 0) {
+    return 0.0f;
+  }
+  if (q <= 0.0f) {
+    return min_;
+  }
+  if (q >= 1.0f) {
+    return max_;
+  }
+  auto rank = double(q) * (count_ - 1);
+  double seen = 0;
+  for (size_t i = 0; i < buckets_.size(); i++) {
+    seen += buckets_[i];
+    if (seen > rank) {
+      return std::min(std::max(bucketValue(i), min_), max_);
+    }
+  }
+  return max_;
+}
+
+bool MetricSummary::operator==(MetricSummary const& o) const {
+  return count_ == o.count_ && sum_ == o.sum_ && min_ == o.min_ &&
+      max_ == o.max_ && ewma_ == o.ewma_ && ewmaAlpha_ == o.ewmaAlpha_ &&
+      buckets_ == o.buckets_;
+}
+
+size_t MetricSummary::bucketIndex(float value) {
+  if (std::isnan(value)) {
+    return kZeroBucket;
+  }
+  size_t offset;
+  if (std::isinf(value)) {
+    offset = kZeroBucket - 1;
+  } else {
+    int exp = 0;
+    // mantissa is in [0.5, 1), i.e. |value| is in [2^(exp-1), 2^exp)
+    auto mantissa = std::frexp(std::abs(value), &exp);
+    auto octave = exp - 1 - kMinExponent;
+    if (value == 0.0f || octave < 0) {
+      return kZeroBucket;
+    }
+    if (size_t(octave) >= kNumOctaves) {
+      offset = kZeroBucket - 1;
+    } else {
+      auto sub = std::min(
+          int((mantissa - 0.5f) * 2 * kSubBuckets), int(kSubBuckets) - 1);
+      offset = octave * kSubBuckets + sub;
+    }
+  }
+  return value > 0 ? kZeroBucket + 1 + offset : kZeroBucket - 1 - offset;
+}
+
+float MetricSummary::bucketValue(size_t index) {
+  if (index == kZeroBucket) {
+    return 0.0f;
+  }
+  auto offset =
+      index > kZeroBucket ? index - kZeroBucket - 1 : kZeroBucket - 1 - index;
+  int octave = offset / kSubBuckets;
+  int sub = offset % kSubBuckets;
+  // Center of the bucket
+  auto mantissa = 0.5f + (sub + 0.5f) / (2 * kSubBuckets);
+  auto value = std::ldexp(mantissa, octave + kMinExponent + 1);
+  return index > kZeroBucket ? value : -value;
+}
+
+/// Data for a single key in a single shard
+struct MetricsContext::Metric {
+  std::vector<Event> events;
+  std::unique_ptr<MetricSummary> eventSummary;
+  bool hasEvent = false;
+  Event lastEvent;
+  uint64_t lastEventSeq = 0;
+
+  std::vector<Events> multiEvents;
+
+  bool hasCounter = false;
+  float counter = 0.0f;
+
+  std::vector<TimeInterval> intervals;
+  std::unique_ptr<MetricSummary> intervalSummary;
+  bool hasInterval = false;
+  TimeInterval lastInterval = 0;
+  uint64_t lastIntervalSeq = 0;
+
+  void setRetention(Retention retention) {
+    if (retention == Retention::Summary) {
+      if (!eventSummary) {
+        eventSummary = std::make_unique<MetricSummary>();
+        intervalSummary = std::make_unique<MetricSummary>();
+      }
+      // Fold stored events into the summaries
+      for (auto const& ev : events) {
+        eventSummary->add(ev.second);
+      }
+      for (auto iv : intervals) {
+        intervalSummary->add(iv);
+      }
+      events = std::vector<Event>();
+      intervals = std::vector<TimeInterval>();
+    } else if (retention == Retention::Full) {
+      eventSummary.reset();
+      intervalSummary.reset();
+    }
+  }
+};
+
+struct MetricsContext::Shard {
+  std::mutex mutex;
+  /// Indexed by key id
+  std::vector<std::unique_ptr<Metric>> metrics;
+
+  Metric* find(Key key) const {
+    if (key.id_ >= metrics.size()) {
+      return nullptr;
+    }
+    return metrics[key.id_].get();
+  }
+};
+
+std::string const& MetricsContext::Key::name() const {
+  auto& registry = keyRegistry();
+  std::shared_lock<std::shared_mutex> lock(registry.mutex);
+  return registry.names[id_];
+}
+
+MetricsContext::MetricsContext() {
+  for (size_t i = 0; i < kNumShards; i++) {
+    shards_.push_back(std::make_unique<Shard>());
+  }
+}
+
+MetricsContext::~MetricsContext() {}
+
+MetricsContext::Key MetricsContext::key(std::string const& name) {
+  // Ids never change, so they can be cached without synchronization
+  thread_local std::unordered_map<std::string, uint32_t> cache;
+  auto cit = cache.find(name);
+  if (cit != cache.end()) {
+    return Key(cit->second);
+  }
+
+  auto& registry = keyRegistry();
+  std::unique_lock<std::shared_mutex> lock(registry.mutex);
+  auto it = registry.ids.emplace(name, registry.names.size()).first;
+  if (it->second == registry.names.size()) {
+    registry.names.push_back(name);
+  }
+  cache.emplace(name, it->second);
+  return Key(it->second);
+}
+
+void MetricsContext::setRetention(
+    std::string const& key,
+    Retention retention) {
+  auto k = MetricsContext::key(key);
+  {
+    std::lock_guard<std::mutex> lock(configMutex_);
+    retention_[k.id_] = retention;
+  }
+  // Convert data that has been recorded already
+  forEachMetric(k, [&](Metric& m) { m.setRetention(retention); });
+}
+
+void MetricsContext::setDefaultRetention(Retention retention) {
+  std::unordered_map<uint32_t, Retention> explicitRetention;
+  {
+    std::lock_guard<std::mutex> lock(configMutex_);
+    defaultRetention_ = retention;
+    explicitRetention = retention_;
+  }
+  // Convert data that has been recorded already for keys that follow the
+  // default
+  for (auto& shard : shards_) {
+    std::lock_guard<std::mutex> lock(shard->mutex);
+    for (size_t id = 0; id < shard->metrics.size(); id++) {
+      auto& m = shard->metrics[id];
+      if (m && explicitRetention.find(id) == explicitRetention.end()) {
+        m->setRetention(retention);
+      }
+    }
+  }
+}
+
 void MetricsContext::pushEvent(std::string const& key, float value) {
-  Timestamp now = std::chrono::duration_cast<std::chrono::milliseconds>(
-                      hires_clock::now().time_since_epoch())
-                      .count();
-  std::lock_guard<std::mutex> lock(mutex_);
-  timeSeries_[key].emplace_back(now, value);
+  pushEvent(MetricsContext::key(key), value);
+}
+
+void MetricsContext::pushEvent(Key key, float value) {
+  auto now = timestamp();
+  auto seq = seq_.fetch_add(1, std::memory_order_relaxed);
+  auto& shard = localShard();
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  auto& m = metric(shard, key);
+  if (m.eventSummary) {
+    m.eventSummary->add(value);
+  } else {
+    m.events.emplace_back(now, value);
+  }
+  m.hasEvent = true;
+  m.lastEvent = Event(now, value);
+  m.lastEventSeq = seq;
 }
 
 void MetricsContext::pushEvents(
     std::string const& key,
     std::vector<float> values) {
-  Timestamp now = std::chrono::duration_cast<std::chrono::milliseconds>(
-                      hires_clock::now().time_since_epoch())
-                      .count();
-  std::lock_guard<std::mutex> lock(mutex_);
-  timeSeriesS_[key].emplace_back(now, std::move(values));
+  auto k = MetricsContext::key(key);
+  auto now = timestamp();
+  auto& shard = localShard();
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  metric(shard, k).multiEvents.emplace_back(now, std::move(values));
 }
 
 MetricsContext::Event MetricsContext::getLastEvent(
     std::string const& key) const {
-  std::lock_guard<std::mutex> lock(mutex_);
-  auto it = timeSeries_.find(key);
-  if (it == timeSeries_.end()) {
+  bool found = false;
+  Event last;
+  uint64_t seq = 0;
+  forEachMetric(MetricsContext::key(key), [&](Metric const& m) {
+    if (m.hasEvent && (!found || m.lastEventSeq > seq)) {
+      found = true;
+      last = m.lastEvent;
+      seq = m.lastEventSeq;
+    }
+  });
+  if (!found) {
     throw std::runtime_error("No such event: " + key);
   }
-  return it->second.back();
+  return last;
 }
 
 std::vector<MetricsContext::Event> MetricsContext::getLastEvents(
     std::string const& key,
     size_t n) const {
-  std::lock_guard<std::mutex> lock(mutex_);
-  auto it = timeSeries_.find(key);
-  if (it == timeSeries_.end()) {
-    return std::vector<MetricsContext::Event>();
+  std::vector<Event> events;
+  size_t numShards = 0;
+  forEachMetric(MetricsContext::key(key), [&](Metric const& m) {
+    if (!m.hasEvent) {
+      return;
+    }
+    numShards++;
+    if (m.eventSummary) {
+      events.push_back(m.lastEvent);
+      return;
+    }
+    auto count = std::min(m.events.size(), n);
+    events.insert(events.end(), m.events.end() - count, m.events.end());
+  });
+  if (numShards > 1) {
+    std::stable_sort(
+        events.begin(), events.end(), [](Event const& a, Event const& b) {
+          return a.first < b.first;
+        });
+  }
+  if (events.size() > n) {
+    events.erase(events.begin(), events.end() - n);
   }
-  auto itsize = it->second.size() < n ? it->second.size() : n;
-  return std::vector<MetricsContext::Event>(
-      it->second.end() - itsize, it->second.end());
+  return events;
 }
 
 float MetricsContext::getLastEventValue(std::string const& key) const {
@@ -57,136 +379,235 @@ float MetricsContext::getLastEventValue(std::string const& key) const {
 }
 
 bool MetricsContext::hasEvent(std::string const& key) const {
-  std::lock_guard<std::mutex> lock(mutex_);
-  return timeSeries_.count(key) > 0;
+  bool found = false;
+  forEachMetric(MetricsContext::key(key), [&](Metric const& m) {
+    found = found || m.hasEvent;
+  });
+  return found;
 }
 
 std::unordered_map<std::string, float> MetricsContext::getMeanEventValues()
     const {
-  std::lock_guard<std::mutex> lock(mutex_);
+  auto locks = lockShards();
   std::unordered_map<std::string, float> means;
-  for (auto const& it : timeSeries_) {
-    if (it.second.empty()) {
-      continue;
+  forEachKey([&](Key key, std::vector<Metric const*> const& metrics) {
+    double sum = 0.0;
+    size_t count = 0;
+    for (auto* m : metrics) {
+      if (m->eventSummary) {
+        sum += m->eventSummary->sum();
+        count += m->eventSummary->count();
+      } else {
+        for (auto const& ev : m->events) {
+          sum += ev.second;
+        }
+        count += m->events.size();
+      }
     }
-    float val = 0.0f;
-    for (auto const& ev : it.second) {
-      val += ev.second;
+    if (count > 0) {
+      means[key.name()] = sum / count;
     }
-    means[it.first] = val / it.second.size();
-  }
+  });
   return means;
 }
 
 std::unordered_map<std::string, float> MetricsContext::reduceEventValues(
     const Reducer& reducer,
     float initValue) const {
-  std::lock_guard<std::mutex> lock(mutex_);
+  auto locks = lockShards();
   std::unordered_map<std::string, float> reduced;
-  for (auto const& it : timeSeries_) {
-    if (it.second.empty()) {
-      continue;
+  auto eventReducer = [&](float a, const Event& b) {
+    return reducer(a, b.second);
+  };
+  forEachKey([&](Key key, std::vector<Metric const*> const& metrics) {
+    std::vector<Event> merged;
+    MetricSummary summary;
+    for (auto* m : metrics) {
+      if (m->eventSummary) {
+        summary.merge(*m->eventSummary);
+      } else if (!m->events.empty()) {
+        merged.insert(merged.end(), m->events.begin(), m->events.end());
+      }
     }
-    auto eventReducer = [&](float a, const Event& b) {
-      return reducer(a, b.second);
-    };
-    reduced[it.first] = std::accumulate(
-        it.second.begin(), it.second.end(), initValue, eventReducer);
-  }
+    if (summary.count() > 0) {
+      // Shards may disagree on retention if it was changed concurrently
+      for (auto const& ev : merged) {
+        summary.add(ev.second);
+      }
+      reduced[key.name()] =
+          reducer(reducer(initValue, summary.min()), summary.max());
+    } else if (!merged.empty()) {
+      // Restore the order in which events were pushed from different threads
+      std::stable_sort(
+          merged.begin(), merged.end(), [](Event const& a, Event const& b) {
+            return a.first < b.first;
+          });
+      reduced[key.name()] = std::accumulate(
+          merged.begin(), merged.end(), initValue, eventReducer);
+    }
+  });
   return reduced;
 }
 
+MetricSummary MetricsContext::getEventSummary(std::string const& key) const {
+  MetricSummary summary;
+  forEachMetric(MetricsContext::key(key), [&](Metric const& m) {
+    if (m.eventSummary) {
+      summary.merge(*m.eventSummary);
+    } else {
+      for (auto const& ev : m.events) {
+        summary.add(ev.second);
+      }
+    }
+  });
+  return summary;
+}
+
 void MetricsContext::incCounter(std::string const& key, float amount) {
-  std::lock_guard<std::mutex> lock(mutex_);
-  counters_[key] += amount;
+  incCounter(MetricsContext::key(key), amount);
+}
+
+void MetricsContext::incCounter(Key key, float amount) {
+  auto& shard = localShard();
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  auto& m = metric(shard, key);
+  m.hasCounter = true;
+  m.counter += amount;
 }
 
 bool MetricsContext::hasCounter(std::string const& key) const {
-  std::lock_guard<std::mutex> lock(mutex_);
-  return counters_.count(key) > 0;
+  bool found = false;
+  forEachMetric(MetricsContext::key(key), [&](Metric const& m) {
+    found = found || m.hasCounter;
+  });
+  return found;
 }
 
 float MetricsContext::getCounter(std::string const& key) const {
-  std::lock_guard<std::mutex> lock(mutex_);
-  auto it = counters_.find(key);
-  if (it == counters_.end()) {
+  bool found = false;
+  float value = 0.0f;
+  forEachMetric(MetricsContext::key(key), [&](Metric const& m) {
+    if (m.hasCounter) {
+      found = true;
+      value += m.counter;
+    }
+  });
+  if (!found) {
     throw std::runtime_error("No such counter: " + key);
   }
-  return it->second;
+  return value;
 }
 
 void MetricsContext::setCounter(std::string const& key, float amount) {
-  std::lock_guard<std::mutex> lock(mutex_);
-  counters_[key] = amount;
+  auto k = MetricsContext::key(key);
+  auto& local = localShard();
+  auto locks = lockShards();
+  for (auto& shard : shards_) {
+    if (auto* m = shard->find(k)) {
+      m->counter = 0.0f;
+    }
+  }
+  auto& m = metric(local, k);
+  m.hasCounter = true;
+  m.counter = amount;
 }
 
 float MetricsContext::getCounter(std::string const& key, float defaultValue)
     const {
-  std::lock_guard<std::mutex> lock(mutex_);
-  auto it = counters_.find(key);
-  if (it == counters_.end()) {
+  if (!hasCounter(key)) {
     return defaultValue;
   }
-  return it->second;
+  return getCounter(key);
 }
 
 void MetricsContext::snapshotCounter(
     std::string const& counterKey,
     std::string const& eventKey,
     float defaultValue) {
-  Timestamp now = std::chrono::duration_cast<std::chrono::milliseconds>(
-                      hires_clock::now().time_since_epoch())
-                      .count();
-  std::lock_guard<std::mutex> lock(mutex_);
-  float value = defaultValue;
-  auto it = counters_.find(counterKey);
-  if (it != counters_.end()) {
-    value = it->second;
-  }
-  timeSeries_[eventKey].emplace_back(now, value);
+  pushEvent(eventKey, getCounter(counterKey, defaultValue));
 }
 
 MetricsContext::TimeInterval MetricsContext::getLastInterval(
     std::string const& key) const {
-  std::lock_guard<std::mutex> lock(mutex_);
-  auto it = intervals_.find(key);
-  if (it == intervals_.end()) {
+  bool found = false;
+  TimeInterval last = 0;
+  uint64_t seq = 0;
+  forEachMetric(MetricsContext::key(key), [&](Metric const& m) {
+    if (m.hasInterval && (!found || m.lastIntervalSeq > seq)) {
+      found = true;
+      last = m.lastInterval;
+      seq = m.lastIntervalSeq;
+    }
+  });
+  if (!found) {
     throw std::runtime_error("No such interval: " + key);
   }
-  return it->second.back();
+  return last;
 }
 
 std::unordered_map<std::string, float> MetricsContext::getMeanIntervals()
     const {
-  std::lock_guard<std::mutex> lock(mutex_);
+  auto locks = lockShards();
   std::unordered_map<std::string, float> means;
-  for (auto const& it : intervals_) {
-    if (it.second.empty()) {
-      continue;
+  forEachKey([&](Key key, std::vector<Metric const*> const& metrics) {
+    double sum = 0.0;
+    size_t count = 0;
+    for (auto* m : metrics) {
+      if (m->intervalSummary) {
+        sum += m->intervalSummary->sum();
+        count += m->intervalSummary->count();
+      } else {
+        sum = std::accumulate(m->intervals.begin(), m->intervals.end(), sum);
+        count += m->intervals.size();
+      }
     }
-    float val = 0.0f;
-    for (double ev : it.second) {
-      val += ev;
+    if (count > 0) {
+      means[key.name()] = sum / count;
     }
-    means[it.first] = val / it.second.size();
-  }
+  });
   return means;
 }
 
 std::unordered_map<std::string, float> MetricsContext::reduceIntervals(
     const Reducer& reducer,
     float initValue) const {
-  std::lock_guard<std::mutex> lock(mutex_);
+  auto locks = lockShards();
   std::unordered_map<std::string, float> reduced;
-  for (auto const& it : intervals_) {
-    if (it.second.empty()) {
-      continue;
+  forEachKey([&](Key key, std::vector<Metric const*> const& metrics) {
+    bool found = false;
+    float value = initValue;
+    for (auto* m : metrics) {
+      if (m->intervalSummary && m->intervalSummary->count() > 0) {
+        value = reducer(value, m->intervalSummary->min());
+        value = reducer(value, m->intervalSummary->max());
+        found = true;
+      } else if (!m->intervals.empty()) {
+        value = std::accumulate(
+            m->intervals.begin(), m->intervals.end(), value, reducer);
+        found = true;
+      }
     }
-    reduced[it.first] =
-        std::accumulate(it.second.begin(), it.second.end(), initValue, reducer);
-  }
+    if (found) {
+      reduced[key.name()] = value;
+    }
+  });
   return reduced;
 }
+
+MetricSummary MetricsContext::getIntervalSummary(std::string const& key) const {
+  MetricSummary summary;
+  forEachMetric(MetricsContext::key(key), [&](Metric const& m) {
+    if (m.intervalSummary) {
+      summary.merge(*m.intervalSummary);
+    } else {
+      for (auto iv : m.intervals) {
+        summary.add(iv);
+      }
+    }
+  });
+  return summary;
+}
+
 void MetricsContext::dumpJson(std::string const& path) const {
   std::ofstream o(path);
   dumpJson(o);
@@ -194,12 +615,75 @@ void MetricsContext::dumpJson(std::string const& path) const {
 
 void MetricsContext::dumpJson(std::ostream& o) const {
   auto metrics = [&]() {
-    std::lock_guard<std::mutex> lock(mutex_);
+    auto locks = lockShards();
+    std::unordered_map<std::string, float> counters;
+    std::unordered_map<std::string, std::vector<Event>> timeSeries;
+    std::unordered_map<std::string, std::vector<Events>> timeSeriesS;
+    std::unordered_map<std::string, std::vector<TimeInterval>> intervals;
+    auto summaries = nlohmann::json::object();
+    auto intervalSummaries = nlohmann::json::object();
+    auto byTime = [](auto const& a, auto const& b) {
+      return a.first < b.first;
+    };
+    forEachKey([&](Key key, std::vector<Metric const*> const& metrics) {
+      auto const& name = key.name();
+      MetricSummary summary, intervalSummary;
+      Metric const* lastEvent = nullptr;
+      Metric const* lastInterval = nullptr;
+      for (auto* m : metrics) {
+        if (m->hasCounter) {
+          counters[name] += m->counter;
+        }
+        if (m->hasEvent && !m->eventSummary) {
+          auto& ts = timeSeries[name];
+          ts.insert(ts.end(), m->events.begin(), m->events.end());
+        }
+        if (!m->multiEvents.empty()) {
+          auto& ts = timeSeriesS[name];
+          ts.insert(ts.end(), m->multiEvents.begin(), m->multiEvents.end());
+        }
+        if (m->hasInterval && !m->intervalSummary) {
+          auto& iv = intervals[name];
+          iv.insert(iv.end(), m->intervals.begin(), m->intervals.end());
+        }
+        if (m->hasEvent && m->eventSummary) {
+          summary.merge(*m->eventSummary);
+          if (!lastEvent || m->lastEventSeq > lastEvent->lastEventSeq) {
+            lastEvent = m;
+          }
+        }
+        if (m->hasInterval && m->intervalSummary) {
+          intervalSummary.merge(*m->intervalSummary);
+          if (!lastInterval ||
+              m->lastIntervalSeq > lastInterval->lastIntervalSeq) {
+            lastInterval = m;
+          }
+        }
+      }
+      if (timeSeries.count(name)) {
+        auto& ts = timeSeries[name];
+        std::stable_sort(ts.begin(), ts.end(), byTime);
+      }
+      if (timeSeriesS.count(name)) {
+        auto& ts = timeSeriesS[name];
+        std::stable_sort(ts.begin(), ts.end(), byTime);
+      }
+      if (lastEvent) {
+        summaries[name] = summaryToJson(summary);
+        summaries[name]["last"] = lastEvent->lastEvent;
+      }
+      if (lastInterval) {
+        intervalSummaries[name] = summaryToJson(intervalSummary);
+        intervalSummaries[name]["last"] = lastInterval->lastInterval;
+      }
+    });
     return nlohmann::json{
-        {"counters", counters_},
-        {"time_series", timeSeries_},
-        {"time_series_s", timeSeriesS_},
-        {"intervals", intervals_},
+        {"counters", counters},
+        {"time_series", timeSeries},
+        {"time_series_s", timeSeriesS},
+        {"intervals", intervals},
+        {"summaries", summaries},
+        {"interval_summaries", intervalSummaries},
     };
   }();
   o << metrics;
@@ -213,32 +697,189 @@ void MetricsContext::loadJson(std::string const& path) {
 void MetricsContext::loadJson(std::istream& is) {
   nlohmann::json metrics;
   is >> metrics;
-  std::lock_guard<std::mutex> lock(mutex_);
-  counters_ = metrics.at("counters").get<decltype(counters_)>();
-  timeSeries_ = metrics.at("time_series").get<decltype(timeSeries_)>();
-  timeSeriesS_ = metrics.at("time_series_s").get<decltype(timeSeriesS_)>();
-  intervals_ = metrics.at("intervals").get<decltype(intervals_)>();
+  auto loadSummary = [](nlohmann::json const& j, MetricSummary& s) {
+    s = MetricSummary(j.at("ewma_alpha").get<float>());
+    s.count_ = j.at("count").get<size_t>();
+    s.sum_ = j.at("sum").get<double>();
+    s.min_ = j.at("min").get<float>();
+    s.max_ = j.at("max").get<float>();
+    s.ewma_ = j.at("ewma").get<float>();
+    s.buckets_.assign(MetricSummary::kNumBuckets, 0);
+    for (auto const& b : j.at("buckets")) {
+      s.buckets_.at(b.at(0).get<size_t>()) = b.at(1).get<uint32_t>();
+    }
+  };
+
+  clear();
+  // Summaries are absent in dumps from older versions
+  auto summaries = metrics.value("summaries", nlohmann::json::object());
+  auto intervalSummaries =
+      metrics.value("interval_summaries", nlohmann::json::object());
+  for (auto it = summaries.begin(); it != summaries.end(); ++it) {
+    setRetention(it.key(), Retention::Summary);
+  }
+  for (auto it = intervalSummaries.begin(); it != intervalSummaries.end();
+       ++it) {
+    setRetention(it.key(), Retention::Summary);
+  }
+
+  using Counters = std::unordered_map<std::string, float>;
+  using TimeSeries = std::unordered_map<std::string, std::vector<Event>>;
+  using TimeSeriesS = std::unordered_map<std::string, std::vector<Events>>;
+  using Intervals =
+      std::unordered_map<std::string, std::vector<TimeInterval>>;
+  auto& shard = localShard();
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  auto seq = seq_.fetch_add(1, std::memory_order_relaxed);
+  for (auto const& it : metrics.at("counters").get<Counters>()) {
+    auto& m = metric(shard, key(it.first));
+    m.hasCounter = true;
+    m.counter = it.second;
+  }
+  for (auto& it : metrics.at("time_series").get<TimeSeries>()) {
+    if (it.second.empty()) {
+      continue;
+    }
+    auto& m = metric(shard, key(it.first));
+    m.hasEvent = true;
+    m.lastEvent = it.second.back();
+    m.lastEventSeq = seq;
+    m.events = std::move(it.second);
+    if (m.eventSummary) {
+      m.setRetention(Retention::Summary);
+    }
+  }
+  for (auto& it : metrics.at("time_series_s").get<TimeSeriesS>()) {
+    metric(shard, key(it.first)).multiEvents = std::move(it.second);
+  }
+  for (auto& it : metrics.at("intervals").get<Intervals>()) {
+    if (it.second.empty()) {
+      continue;
+    }
+    auto& m = metric(shard, key(it.first));
+    m.hasInterval = true;
+    m.lastInterval = it.second.back();
+    m.lastIntervalSeq = seq;
+    m.intervals = std::move(it.second);
+    if (m.intervalSummary) {
+      m.setRetention(Retention::Summary);
+    }
+  }
+  for (auto it = summaries.begin(); it != summaries.end(); ++it) {
+    auto& m = metric(shard, key(it.key()));
+    loadSummary(it.value(), *m.eventSummary);
+    m.hasEvent = true;
+    m.lastEvent = it.value().at("last").get<Event>();
+    m.lastEventSeq = seq;
+  }
+  for (auto it = intervalSummaries.begin(); it != intervalSummaries.end();
+       ++it) {
+    auto& m = metric(shard, key(it.key()));
+    loadSummary(it.value(), *m.intervalSummary);
+    m.hasInterval = true;
+    m.lastInterval = it.value().at("last").get<TimeInterval>();
+    m.lastIntervalSeq = seq;
+  }
 }
 
 void MetricsContext::clear() {
-  std::lock_guard<std::mutex> lock(mutex_);
-  timeSeries_.clear();
-  timeSeriesS_.clear();
-  counters_.clear();
-  intervals_.clear();
+  auto locks = lockShards();
+  for (auto& shard : shards_) {
+    shard->metrics.clear();
+  }
 }
 
 bool MetricsContext::operator==(const MetricsContext& o) const {
-  return (
-      timeSeries_ == o.timeSeries_ && timeSeriesS_ == o.timeSeriesS_ &&
-      counters_ == o.counters_ && intervals_ == o.intervals_);
+  // JSON objects are ordered by key so dumps can be compared directly
+  std::ostringstream a, b;
+  dumpJson(a);
+  o.dumpJson(b);
+  return a.str() == b.str();
+}
+
+MetricsContext::Shard& MetricsContext::localShard() {
+  return *shards_[threadShardIndex()];
+}
+
+MetricsContext::Metric& MetricsContext::metric(Shard& shard, Key key) {
+  if (key.id_ >= shard.metrics.size()) {
+    shard.metrics.resize(key.id_ + 1);
+  }
+  auto& m = shard.metrics[key.id_];
+  if (!m) {
+    m = std::make_unique<Metric>();
+    std::lock_guard<std::mutex> lock(configMutex_);
+    auto it = retention_.find(key.id_);
+    m->setRetention(it != retention_.end() ? it->second : defaultRetention_);
+  }
+  return *m;
+}
+
+void MetricsContext::pushInterval(Key key, TimeInterval value) {
+  auto seq = seq_.fetch_add(1, std::memory_order_relaxed);
+  auto& shard = localShard();
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  auto& m = metric(shard, key);
+  if (m.intervalSummary) {
+    m.intervalSummary->add(value);
+  } else {
+    m.intervals.push_back(value);
+  }
+  m.hasInterval = true;
+  m.lastInterval = value;
+  m.lastIntervalSeq = seq;
+}
+
+std::vector<std::unique_lock<std::mutex>> MetricsContext::lockShards() const {
+  std::vector<std::unique_lock<std::mutex>> locks;
+  locks.reserve(shards_.size());
+  for (auto& shard : shards_) {
+    locks.emplace_back(shard->mutex);
+  }
+  return locks;
+}
+
+template <typename F>
+void MetricsContext::forEachMetric(Key key, F&& fn) const {
+  for (auto& shard : shards_) {
+    std::lock_guard<std::mutex> lock(shard->mutex);
+    if (auto* m = shard->find(key)) {
+      fn(*m);
+    }
+  }
+}
+
+template <typename F>
+void MetricsContext::forEachKey(F&& fn) const {
+  size_t numKeys = 0;
+  for (auto& shard : shards_) {
+    numKeys = std::max(numKeys, shard->metrics.size());
+  }
+  std::vector<Metric const*> metrics;
+  for (size_t id = 0; id < numKeys; id++) {
+    metrics.clear();
+    for (auto& shard : shards_) {
+      if (auto* m = shard->find(Key(id))) {
+        metrics.push_back(m);
+      }
+    }
+    if (!metrics.empty()) {
+      fn(Key(id), metrics);
+    }
+  }
 }
 
 MetricsContext::Timer::Timer(
     std::shared_ptr<MetricsContext> metrics,
-    std::string key,
+    std::string const& key,
+    float subsampleRatio)
+    : Timer(std::move(metrics), MetricsContext::key(key), subsampleRatio) {}
+
+MetricsContext::Timer::Timer(
+    std::shared_ptr<MetricsContext> metrics,
+    Key key,
     float subsampleRatio)
-    : metrics_(metrics), key_(std::move(key)) {
+    : metrics_(metrics), key_(key) {
   if (subsampleRatio < 0.0f || subsampleRatio > 1.0f) {
     throw std::runtime_error("subsampleRatio should be within [0;1].");
   }
@@ -258,7 +899,6 @@ MetricsContext::Timer::~Timer() {
   if (metrics_ && subsampleFactor_ > 0 &&
       (end.time_since_epoch().count() % subsampleFactor_ == 0)) {
     std::chrono::duration<double, std::milli> duration_ms = end - start_;
-    std::lock_guard<std::mutex> lock(metrics_->mutex_);
-    metrics_->intervals_[key_].push_back(duration_ms.count());
+    metrics_->pushInterval(key_, duration_ms.count());
   }
 }
@@ -7,16 +7,109 @@
 
 #pragma once
 
+#include <atomic>
 #include <chrono>
 #include <cstdio>
 #include <functional>
 #include <memory>
 #include <mutex>
+#include <string>
 #include <unordered_map>
 #include <valarray>
 #include <vector>
 
 namespace cpid {
+
+/**
+ * Fixed-memory summary of a stream of values.
+ *
+ * Keeps count, sum, extrema, an exponentially weighted moving average and a
+ * log-linear histogram (similar to HdrHistogram) from which quantiles can be
+ * estimated. Each power of two is split into kSubBuckets buckets, so quantile
+ * estimates are within 1/(2 * kSubBuckets) of the true value, relatively.
+ * Magnitudes below 2^kMinExponent are counted as zero and magnitudes above
+ * 2^kMaxExponent are clamped to the largest bucket.
+ */
+class MetricSummary {
+ public:
+  static int constexpr kSubBuckets = 16;
+  static int constexpr kMinExponent = -24;
+  static int constexpr kMaxExponent = 40;
+  static float constexpr kDefaultEwmaAlpha = 0.05f;
+
+  explicit MetricSummary(float ewmaAlpha = kDefaultEwmaAlpha)
+      : ewmaAlpha_(ewmaAlpha) {}
+
+  void add(float value);
+  /// Merges another summary into this one. The resulting moving average is
+  /// the average of both, weighted by their counts.
+  void merge(MetricSummary const& other);
+
+  size_t count() const {
+    return count_;
+  }
+  double sum() const {
+    return sum_;
+  }
+  float min() const {
+    return min_;
+  }
+  float max() const {
+    return max_;
+  }
+  float mean() const {
+    return count_ > 0 ? float(sum_ / count_) : 0.0f;
+  }
+  float ewma() const {
+    return ewma_;
+  }
+  float ewmaAlpha() const {
+    return ewmaAlpha_;
+  }
+  /// Estimates the q-quantile, 0 <= q <= 1
+  float quantile(float q) const;
+
+  /// Bucket counts from the most negative to the most positive bucket; empty
+  /// if no value has been added yet
+  std::vector<uint32_t> const& buckets() const {
+    return buckets_;
+  }
+
+  bool operator==(MetricSummary const& o) const;
+
+ private:
+  friend class MetricsContext;
+  static size_t constexpr kNumOctaves = kMaxExponent - kMinExponent;
+  static size_t constexpr kZeroBucket = kNumOctaves * kSubBuckets;
+  static size_t constexpr kNumBuckets = 2 * kZeroBucket + 1;
+
+  static size_t bucketIndex(float value);
+  static float bucketValue(size_t index);
+
+  float ewmaAlpha_;
+  size_t count_ = 0;
+  double sum_ = 0;
+  float min_ = 0;
+  float max_ = 0;
+  float ewma_ = 0;
+  std::vector<uint32_t> buckets_;
+};
+
+/**
+ * Collects events, counters and timings during training.
+ *
+ * Writes go to one of several lock-protected shards, selected by the calling
+ * thread, so that threads reporting metrics concurrently rarely contend for
+ * the same lock. Reads merge all shards. Metric names can be interned via
+ * key() once; the resulting handles make subsequent updates cheaper than
+ * using strings.
+ *
+ * By default, every event (and every timing) is stored. For high-frequency
+ * metrics, setRetention() can be used to keep a MetricSummary instead, which
+ * requires a fixed amount of memory per key. For such keys, getLastEvents()
+ * returns the last event only and reduceEventValues() applies the reducer to
+ * the minimum and maximum value.
+ */
 class MetricsContext {
   using hires_clock = std::chrono::steady_clock;
 
@@ -26,7 +119,37 @@ class MetricsContext {
   using Events = std::pair<Timestamp, std::vector<float>>;
   using TimeInterval = double; // ms
 
+  enum class Retention {
+    /// Store every event
+    Full,
+    /// Store a MetricSummary and the last event only
+    Summary,
+  };
+
+  /// Interned metric name. Handles are valid for all contexts.
+  class Key {
+   public:
+    Key() = default;
+    std::string const& name() const;
+
+   private:
+    friend class MetricsContext;
+    explicit Key(uint32_t id) : id_(id) {}
+    uint32_t id_ = 0;
+  };
+
+  MetricsContext();
+  ~MetricsContext();
+
+  static Key key(std::string const& name);
+
+  void setRetention(std::string const& key, Retention retention);
+  /// Retention for keys without a call to setRetention(). Data recorded for
+  /// such keys is converted as in setRetention().
+  void setDefaultRetention(Retention retention);
+
   void pushEvent(std::string const& key, float value = 1.0);
+  void pushEvent(Key key, float value = 1.0);
   void pushEvents(std::string const& key, std::vector<float> values);
   Event getLastEvent(std::string const& key) const;
   std::vector<Event> getLastEvents(std::string const& key, size_t n) const;
@@ -38,7 +161,10 @@ class MetricsContext {
   std::unordered_map<std::string, float> reduceEventValues(
       const Reducer& reducer,
       float initValue) const;
+  /// Summary of all events for the given key, regardless of its retention
+  MetricSummary getEventSummary(std::string const& key) const;
   void incCounter(std::string const& key, float amount = 1.0);
+  void incCounter(Key key, float amount = 1.0);
   void setCounter(std::string const& key, float amount);
 
   bool hasCounter(std::string const& key) const;
@@ -54,6 +180,8 @@ class MetricsContext {
   std::unordered_map<std::string, float> reduceIntervals(
       const Reducer& reducer,
       float initValue) const;
+  /// Summary of all intervals for the given key, regardless of its retention
+  MetricSummary getIntervalSummary(std::string const& key) const;
   void dumpJson(std::string const& path) const;
   void dumpJson(std::ostream&) const;
   void loadJson(std::string const& path);
@@ -66,7 +194,7 @@ class MetricsContext {
   class Timer {
     hires_clock::time_point start_;
     std::shared_ptr<MetricsContext> metrics_;
-    std::string key_;
+    Key key_;
     unsigned long subsampleFactor_;
 
    public:
@@ -74,16 +202,36 @@ class MetricsContext {
     // 0 <= subsampleRatio <= 1.
     Timer(
         std::shared_ptr<MetricsContext> metrics,
-        std::string key,
+        std::string const& key,
+        float subsampleRatio = 1);
+    Timer(
+        std::shared_ptr<MetricsContext> metrics,
+        Key key,
         float subsampleRatio = 1);
     ~Timer();
   };
 
  protected:
-  std::unordered_map<std::string, std::vector<Event>> timeSeries_;
-  std::unordered_map<std::string, std::vector<Events>> timeSeriesS_;
-  std::unordered_map<std::string, float> counters_;
-  std::unordered_map<std::string, std::vector<TimeInterval>> intervals_;
-  mutable std::mutex mutex_;
+  struct Metric;
+  struct Shard;
+
+  Shard& localShard();
+  Metric& metric(Shard& shard, Key key);
+  void pushInterval(Key key, TimeInterval value);
+  std::vector<std::unique_lock<std::mutex>> lockShards() const;
+  /// Calls fn(metric) for every shard that has an entry for key, with the
+  /// respective shard lock held
+  template <typename F>
+  void forEachMetric(Key key, F&& fn) const;
+  /// Calls fn(key, metrics) for every key with the entries of all shards.
+  /// All shards need to be locked.
+  template <typename F>
+  void forEachKey(F&& fn) const;
+
+  std::vector<std::unique_ptr<Shard>> shards_;
+  std::atomic<uint64_t> seq_{0};
+  mutable std::mutex configMutex_;
+  std::unordered_map<uint32_t, Retention> retention_;
+  Retention defaultRetention_ = Retention::Full;
 };
 } // namespace cpid
@@ -12,6 +12,8 @@
 #include "distributed.h"
 #include "sampler.h"
 
+#include <cmath>
+
 namespace {
 constexpr const float kImportanceRatioTruncation = 1.f;
 std::string const kValueKey = "V";
@@ -89,16 +91,43 @@ void BatchedPGTrainer::updateModel() {
   float policyLossSum = 0.0f;
   float valueLossSum = 0.0f;
   float meanBatchReward = 0.0f;
+  // For prioritized replay: episodes are sampled once for the remainder of
+  // the batch, and priorities are updated after the batch is done.
+  PrioritizedReplay<ReplayBuffer::Episode>::Sample replay;
+  size_t replayPos = 0;
+  std::vector<uint64_t> priorityIds;
+  std::vector<float> priorities;
   for (auto b = 0; b < batchSize_; b++) {
     std::vector<BatchedPGReplayBufferFrame const*> episode;
+    float weight = 1.0f;
+    // Whether the episode is tracked in the prioritized store
+    bool prioritize = false;
     {
       std::lock_guard<std::mutex> lock(newGamesMutex_);
-      if (newGames_.size() == 0) {
+      // Prioritized replay may have been enabled after episodes have been
+      // consumed; sample uniformly until it knows about some.
+      if (newGames_.size() == 0 && prioritized_ &&
+          prioritized_->size() > 0) {
+        if (replayPos >= replay.items.size()) {
+          replay = prioritized_->sample(batchSize_ - b);
+          replayPos = 0;
+        }
+        episode = cast<BatchedPGReplayBufferFrame>(replay.items[replayPos]);
+        weight = replay.weights[replayPos];
+        priorityIds.push_back(replay.ids[replayPos]);
+        prioritize = true;
+        replayPos++;
+      } else if (newGames_.size() == 0) {
         auto eps = replayer_.sample()[0];
         episode = cast<BatchedPGReplayBufferFrame>(eps.second.get());
       } else {
-        episode = cast<BatchedPGReplayBufferFrame>(
-            replayer_.get(newGames_.back().first, newGames_.back().second));
+        auto& ep =
+            replayer_.get(newGames_.back().first, newGames_.back().second);
+        episode = cast<BatchedPGReplayBufferFrame>(ep);
+        if (prioritized_) {
+          priorityIds.push_back(prioritized_->add(ep));
+          prioritize = true;
+        }
         seenGames_.push(std::move(newGames_.back()));
         newGames_.pop_back();
         episodes_++;
@@ -106,6 +135,9 @@ void BatchedPGTrainer::updateModel() {
     }
     if (episode.size() == 0) {
       LOG(WARNING) << "Empty episode selected for update; skipping";
+      if (prioritize) {
+        priorities.push_back(0.0f);
+      }
       continue;
     }
 
@@ -121,6 +153,7 @@ void BatchedPGTrainer::updateModel() {
 
     // The second reward is associated with the first action
     ag::Variant prevOut;
+    float absAdvantageSum = 0.0f;
     for (std::size_t i = 0; i < rturns.size(); i++) {
       auto state = common::applyTransform(
           episode[i]->state,
@@ -159,12 +192,20 @@ void BatchedPGTrainer::updateModel() {
       auto policyLoss = -importanceRatio * a * newProba.log();
       auto valueLoss =
           at::mse_loss(value, torch::tensor(rturn, value.options()));
-      (policyLoss + valueLoss).backward();
+      (weight * (policyLoss + valueLoss)).backward();
+      absAdvantageSum += std::abs(a);
 
       policyLossSum += policyLoss.item<float>();
       valueLossSum += valueLoss.item<float>();
       std::swap(out, prevOut);
     }
+    if (prioritize) {
+      priorities.push_back(
+          rturns.empty() ? 0.0f : absAdvantageSum / rturns.size());
+    }
+  }
+  if (prioritized_) {
+    prioritized_->updatePriorities(priorityIds, priorities);
   }
 
   if (metricsContext_) {
@@ -180,15 +221,15 @@ void BatchedPGTrainer::updateModel() {
 
   {
     std::lock_guard<std::mutex> lock(modelWriteMutex_);
+    {
+      MetricsContext::Timer timeAllreduce(
+          metricsContext_, "trainer:network_time");
+      dist::allreduceGradients(model_);
+    }
     for (auto& var : model_->parameters()) {
       if (!var.grad().defined()) {
         continue;
       }
-      {
-        MetricsContext::Timer timeAllreduce(
-            metricsContext_, "trainer:network_time");
-        dist::allreduce(var.grad());
-      }
       var.grad().div_(dist::globalContext()->size);
     }
     {
@@ -217,6 +258,15 @@ void BatchedPGTrainer::doOnlineUpdatesInstead() {
   onlineUpdates_ = true;
 }
 
+void BatchedPGTrainer::setPrioritizedReplay(
+    size_t capacity,
+    float alpha,
+    float beta) {
+  std::lock_guard<std::mutex> lock(newGamesMutex_);
+  prioritized_ = std::make_unique<PrioritizedReplay<ReplayBuffer::Episode>>(
+      capacity, alpha, beta);
+}
+
 std::shared_ptr<Evaluator> BatchedPGTrainer::makeEvaluator(
     size_t n,
     std::unique_ptr<BaseSampler> sampler) {
@@ -8,6 +8,7 @@
 #pragma once
 
 #include "metrics.h"
+#include "prioritizedreplay.h"
 #include "sampler.h"
 #include "trainer.h"
 #include <autogradpp/autograd.h>
@@ -49,6 +50,10 @@ struct BatchedPGReplayBufferFrame : ReplayBufferFrame {
  * episodes it has already updated over reaches maxBatchSize, it will remove
  * the oldest episode it's seen.
  *
+ * With setPrioritizedReplay(), episodes are replayed according to their
+ * priority (the mean absolute advantage over the episode) instead of
+ * uniformly, and losses are scaled by importance-sampling weights.
+ *
  * Replayer format:
  *   state, action, p(action), reward
  *
@@ -72,6 +77,7 @@ class BatchedPGTrainer : public Trainer {
   std::mutex newGamesMutex_;
   bool enoughEpisodes_ = false;
   int episodes_ = 0;
+  std::unique_ptr<PrioritizedReplay<ReplayBuffer::Episode>> prioritized_;
 
   void updateModel();
 
@@ -83,6 +89,11 @@ class BatchedPGTrainer : public Trainer {
   ag::Variant forward(ag::Variant inp, EpisodeHandle const&) override;
   bool update() override;
   void doOnlineUpdatesInstead();
+  /// Replays up to \param{capacity} episodes according to their priority
+  void setPrioritizedReplay(
+      size_t capacity,
+      float alpha = 0.6,
+      float beta = 0.4);
 
   inline int episodes() {
     return episodes_;
@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2017-present, Facebook, Inc.
+ *
+ * This source code is licensed under the MIT license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "prioritizedreplay.h"
+
+#include <algorithm>
+
+namespace cpid {
+
+SumTree::SumTree(size_t capacity) : capacity_(capacity), leaves_(1) {
+  while (leaves_ < capacity_) {
+    leaves_ *= 2;
+  }
+  nodes_.resize(2 * leaves_, 0.0);
+}
+
+void SumTree::set(size_t index, double value) {
+  if (index >= capacity_) {
+    throw std::out_of_range("SumTree: index out of range");
+  }
+  if (value < 0) {
+    throw std::invalid_argument("SumTree: values must be non-negative");
+  }
+  // Recompute sums rather than propagating deltas so that rounding errors
+  // don't accumulate over many updates
+  auto node = leaves_ + index;
+  nodes_[node] = value;
+  for (node /= 2; node > 0; node /= 2) {
+    nodes_[node] = nodes_[2 * node] + nodes_[2 * node + 1];
+  }
+}
+
+size_t SumTree::find(double mass) const {
+  size_t node = 1;
+  while (node < leaves_) {
+    auto left = 2 * node;
+    // Rounding errors may send us into an empty subtree otherwise
+    if (mass < nodes_[left] || nodes_[left + 1] <= 0) {
+      node = left;
+    } else {
+      mass -= nodes_[left];
+      node = left + 1;
+    }
+  }
+  return std::min(node - leaves_, capacity_ - 1);
+}
+
+void SumTree::clear() {
+  std::fill(nodes_.begin(), nodes_.end(), 0.0);
+}
+
+} // namespace cpid
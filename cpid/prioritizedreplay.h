@@ -0,0 +1,196 @@
+/*
+ * Copyright (c) 2017-present, Facebook, Inc.
+ *
+ * This source code is licensed under the MIT license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include "common/rand.h"
+
+#include <algorithm>
+#include <cmath>
+#include <mutex>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+namespace cpid {
+
+/**
+ * A complete binary tree over a fixed number of non-negative values in which
+ * every inner node holds the sum of its children.
+ *
+ * Updating a value and finding the leaf for a given prefix sum are both
+ * O(log n). Sums are accumulated in double precision.
+ */
+class SumTree {
+ public:
+  explicit SumTree(size_t capacity);
+
+  size_t capacity() const {
+    return capacity_;
+  }
+  double total() const {
+    return nodes_[1];
+  }
+  double get(size_t index) const {
+    return nodes_[leaves_ + index];
+  }
+  void set(size_t index, double value);
+  /// Returns the index i such that sum(0..i-1) <= mass < sum(0..i). Leaves
+  /// with a value of zero are never returned unless the tree is empty.
+  size_t find(double mass) const;
+  void clear();
+
+ private:
+  size_t capacity_;
+  size_t leaves_;
+  /// 1-based heap layout; leaves start at leaves_
+  std::vector<double> nodes_;
+};
+
+/**
+ * Fixed-size store for prioritized experience replay (Schaul et al., 2015).
+ *
+ * Items are sampled with probability p_i^alpha / sum_k p_k^alpha and come
+ * with importance-sampling weights (N * P(i))^-beta, normalized by the
+ * largest weight in the sampled batch. New items are inserted with the
+ * largest priority seen so far, so that they're sampled at least once with
+ * high probability. Once the store is full, the oldest items are replaced.
+ *
+ * sample() returns IDs that can be used to update priorities after an update
+ * has been computed. Updates for items that have been replaced in the
+ * meantime are ignored.
+ *
+ * All public functions are thread-safe.
+ */
+template <typename T>
+class PrioritizedReplay {
+ public:
+  struct Sample {
+    std::vector<uint64_t> ids;
+    std::vector<T> items;
+    std::vector<float> weights;
+  };
+
+  PrioritizedReplay(
+      size_t capacity,
+      float alpha = 0.6,
+      float beta = 0.4,
+      float epsilon = 1e-6)
+      : items_(capacity), tree_(capacity), alpha_(alpha), beta_(beta),
+        epsilon_(epsilon) {
+    if (capacity == 0) {
+      throw std::invalid_argument("PrioritizedReplay: capacity must be > 0");
+    }
+  }
+
+  /// Adds an item with maximum priority and returns its ID
+  uint64_t add(T item) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto id = next_++;
+    auto slot = id % items_.size();
+    items_[slot] = std::move(item);
+    tree_.set(slot, std::pow(maxPriority_, alpha_));
+    size_ = std::min(size_ + 1, items_.size());
+    return id;
+  }
+
+  /// Stratified sampling: the total priority mass is divided into num
+  /// segments and one item is drawn from each of them.
+  template <typename RandomGenerator>
+  Sample sample(RandomGenerator& g, size_t num) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (size_ == 0) {
+      throw std::runtime_error("PrioritizedReplay: no items to sample");
+    }
+    Sample s;
+    s.ids.reserve(num);
+    s.items.reserve(num);
+    s.weights.reserve(num);
+    auto total = tree_.total();
+    auto segment = total / num;
+    std::uniform_real_distribution<double> dist(0.0, 1.0);
+    float maxWeight = 0.0f;
+    for (size_t i = 0; i < num; i++) {
+      auto slot = tree_.find(segment * (i + dist(g)));
+      auto p = tree_.get(slot) / total;
+      auto w = float(std::pow(size_ * p, -beta_));
+      maxWeight = std::max(maxWeight, w);
+      s.ids.push_back(idForSlot(slot));
+      s.items.push_back(items_[slot]);
+      s.weights.push_back(w);
+    }
+    for (auto& w : s.weights) {
+      w /= maxWeight;
+    }
+    return s;
+  }
+  Sample sample(size_t num) {
+    auto engine = common::Rand::makeRandEngine<std::mt19937>();
+    return sample(engine, num);
+  }
+
+  /// Sets new (raw) priorities, e.g. absolute TD errors, for sampled items
+  void updatePriorities(
+      std::vector<uint64_t> const& ids,
+      std::vector<float> const& priorities) {
+    if (ids.size() != priorities.size()) {
+      throw std::invalid_argument(
+          "PrioritizedReplay: need one priority per ID");
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (size_t i = 0; i < ids.size(); i++) {
+      if (ids[i] >= next_ || ids[i] + size_ < next_) {
+        continue; // Replaced
+      }
+      auto p = std::abs(priorities[i]) + epsilon_;
+      maxPriority_ = std::max(maxPriority_, p);
+      tree_.set(ids[i] % items_.size(), std::pow(p, alpha_));
+    }
+  }
+
+  void setBeta(float beta) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    beta_ = beta;
+  }
+  size_t size() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return size_;
+  }
+  size_t capacity() const {
+    return items_.size();
+  }
+  void clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& item : items_) {
+      item = T();
+    }
+    tree_.clear();
+    // Keep next_ so that outstanding IDs become invalid
+    size_ = 0;
+    maxPriority_ = 1.0f;
+  }
+
+ private:
+  uint64_t idForSlot(size_t slot) const {
+    // The newest item in the ring buffer has ID next_ - 1
+    auto newestSlot = (next_ - 1) % items_.size();
+    auto age = (newestSlot + items_.size() - slot) % items_.size();
+    return next_ - 1 - age;
+  }
+
+  std::vector<T> items_;
+  SumTree tree_;
+  float alpha_;
+  float beta_;
+  float epsilon_;
+  float maxPriority_ = 1.0f;
+  uint64_t next_ = 0;
+  size_t size_ = 0;
+  mutable std::mutex mutex_;
+};
+
+} // namespace cpid
@@ -20,6 +20,9 @@
 namespace {
 size_t constexpr kMaxEndpointLength = 4096;
 uint32_t const kWakeupSignal = 0xFEED;
+// Requests smaller than this are copied into ZeroMQ messages; for larger ones,
+// ZeroMQ will reference our buffer instead.
+size_t constexpr kMinZeroCopySize = 4096;
 } // namespace
 
 namespace cpid {
@@ -60,13 +63,46 @@ size_t recvMultipart(
   return partsReceived;
 }
 
+/// Constructs a message that references data instead of copying it (unless
+/// it's small). ZeroMQ holds a reference to the buffer until it's done
+/// sending, which might be after the message has been destroyed.
+zmq::message_t makeMessage(std::shared_ptr<std::vector<char> const> data) {
+  if (data->size() < kMinZeroCopySize) {
+    return zmq::message_t(data->data(), data->size());
+  }
+  using Ref = std::shared_ptr<std::vector<char> const>;
+  auto ref = new Ref(data);
+  try {
+    return zmq::message_t(
+        const_cast<char*>(data->data()),
+        data->size(),
+        [](void*, void* hint) { delete static_cast<Ref*>(hint); },
+        ref);
+  } catch (...) {
+    delete ref;
+    throw;
+  }
+}
+
 } // namespace
 
 ReqRepServer::ReqRepServer(
     CallbackFn callback,
     size_t numThreads,
     std::string endpoint)
-    : callback_(callback), numThreads_(numThreads) {
+    : ReqRepServer(
+          [callback](
+              std::shared_ptr<char const> buf, size_t len, ReplyFn reply) {
+            callback(buf.get(), len, std::move(reply));
+          },
+          numThreads,
+          std::move(endpoint)) {}
+
+ReqRepServer::ReqRepServer(
+    SharedCallbackFn callback,
+    size_t numThreads,
+    std::string endpoint)
+    : callback_(std::move(callback)), numThreads_(numThreads) {
   context_ = std::make_shared<zmq::context_t>();
   std::promise<std::string> endpointP;
   endpointF_ = endpointP.get_future();
@@ -104,14 +140,15 @@ void ReqRepServer::listen(
       // Bind to local IP on random port
       auto iface = netutils::getInterfaceAddresses()[0];
       frontend.bind(fmt::format("tcp://{}:0", iface));
-      endpoint.resize(kMaxEndpointLength);
-      size_t epsize = endpoint.size();
-      frontend.getsockopt(
-          ZMQ_LAST_ENDPOINT, const_cast<char*>(endpoint.c_str()), &epsize);
-      endpoint.resize(epsize - 1);
     } else {
       frontend.bind(endpoint);
     }
+    // Query actual endpoint in case a wildcard port was specified
+    endpoint.resize(kMaxEndpointLength);
+    size_t epsize = endpoint.size();
+    frontend.getsockopt(
+        ZMQ_LAST_ENDPOINT, const_cast<char*>(endpoint.c_str()), &epsize);
+    endpoint.resize(epsize - 1);
     VLOG(1) << "ReqRepServer bound to " << endpoint;
   } catch (...) {
     endpointP.set_exception(std::current_exception());
@@ -217,8 +254,13 @@ void ReqRepServer::runWorker(std::string const& endpoint) {
 
     VLOG(2) << "ReqRepServer received " << msg.size() << " bytes from request "
             << std::string_view(idR.data<const char>(), idR.size());
+    // Hand over the message so that callbacks can hold on to its data. msg
+    // will be empty again after the move.
+    auto owner = std::make_shared<zmq::message_t>(std::move(msg));
+    auto size = owner->size();
+    auto data = owner->data<char const>();
     replySent = false;
-    callback_(msg.data<void>(), msg.size(), reply);
+    callback_(std::shared_ptr<char const>(std::move(owner), data), size, reply);
     if (terminated) {
       break;
     }
@@ -259,6 +301,11 @@ ReqRepClient::~ReqRepClient() {
 }
 
 std::future<std::vector<char>> ReqRepClient::request(std::vector<char> msg) {
+  return request(std::make_shared<Blob const>(std::move(msg)));
+}
+
+std::future<std::vector<char>> ReqRepClient::request(
+    std::shared_ptr<Blob const> msg) {
   auto lock = std::unique_lock(queueM_);
   queue_.emplace(std::move(msg));
   signalSocket_->send(&kWakeupSignal, sizeof(kWakeupSignal));
@@ -446,12 +493,13 @@ void ReqRepClient::run() {
           if (socket.send(id.data(), id.size(), ZMQ_SNDMORE) == 0) {
             throw zmq::error_t();
           }
-          if (socket.send(item.msg.data(), item.msg.size(), 0) == 0) {
+          auto msg = makeMessage(item.msg);
+          if (socket.send(msg, 0) == false) {
             throw zmq::error_t();
           }
           VLOG(2) << fmt::format(
               "ReqRepClient sent {} bytes via request '{}'",
-              item.msg.size(),
+              item.msg->size(),
               id);
           Request req;
           req.item = std::move(item);
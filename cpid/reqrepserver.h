@@ -40,6 +40,11 @@ class ReqRepServer final {
   using ReplyFn = std::function<void(void const* buf, size_t len)>;
   using CallbackFn =
       std::function<void(void const* buf, size_t len, ReplyFn reply)>;
+  /// Callback that receives ownership of the request data. The buffer is the
+  /// one that ZeroMQ received the message into and can be retained after
+  /// returning from the callback, i.e. it does not need to be copied.
+  using SharedCallbackFn = std::function<
+      void(std::shared_ptr<char const> buf, size_t len, ReplyFn reply)>;
 
   /// Constructor.
   /// This instance will handle up to numThreads replies concurrently.
@@ -50,6 +55,10 @@ class ReqRepServer final {
       CallbackFn callback,
       size_t numThreads = 1,
       std::string endpoint = std::string());
+  ReqRepServer(
+      SharedCallbackFn callback,
+      size_t numThreads = 1,
+      std::string endpoint = std::string());
   ~ReqRepServer();
 
   std::string endpoint() const;
@@ -58,7 +67,7 @@ class ReqRepServer final {
   void listen(std::string endpoint, std::promise<std::string>&& endpointP);
   void runWorker(std::string const& endpoint);
 
-  CallbackFn callback_;
+  SharedCallbackFn callback_;
   size_t numThreads_;
   std::shared_ptr<zmq::context_t> context_;
   std::mutex contextM_;
@@ -98,6 +107,11 @@ class ReqRepClient final {
   ~ReqRepClient();
 
   std::future<std::vector<char>> request(std::vector<char> msg);
+  /// Sends a request without copying its data. The buffer will be referenced
+  /// until a reply has been received and ZeroMQ is done with it; it must not
+  /// be modified in the meantime. Use this if you want to keep the data
+  /// around, e.g. for resending it.
+  std::future<std::vector<char>> request(std::shared_ptr<Blob const> msg);
   /// Returns true if the endpoints changed
   bool updateEndpoints(std::vector<std::string> endpoints);
 
@@ -111,10 +125,10 @@ class ReqRepClient final {
   void run();
 
   struct QueueItem {
-    Blob msg;
+    std::shared_ptr<Blob const> msg;
     std::promise<Blob> promise;
     size_t retries = 0;
-    QueueItem(Blob msg) : msg(std::move(msg)) {}
+    QueueItem(std::shared_ptr<Blob const> msg) : msg(std::move(msg)) {}
     QueueItem() = default;
     QueueItem(QueueItem&&) = default;
     QueueItem& operator=(QueueItem&&) = default;
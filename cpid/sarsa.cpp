@@ -83,6 +83,11 @@ void Sarsa::doUpdate(
   common::assertSize("discounted_reward", discounted_reward, {batchSize});
 
   common::assertSize("notterminal", notTerminal, {returnsLength_, batchSize});
+  // Mean absolute TD error per sequence, for prioritized replay
+  torch::Tensor tdError;
+  if (sampleWeights_.defined()) {
+    tdError = torch::zeros({batchSize}, Q.options());
+  }
   for (int i = (int)seq.size() - 2; i >= 0; --i) {
     auto currentFrame = std::static_pointer_cast<BatchedFrame>(seq[i]);
     // ag::tensor_list currentOut = model_->forward(currentFrame->state);
@@ -93,11 +98,23 @@ void Sarsa::doUpdate(
     discounted_reward =
         (discounted_reward * discount_ * notTerminal[i]) + currentFrame->reward;
 
-    auto valueLoss = at::smooth_l1_loss(currentQ, discounted_reward);
+    torch::Tensor valueLoss;
+    if (sampleWeights_.defined()) {
+      valueLoss = (at::smooth_l1_loss(
+                       currentQ, discounted_reward, at::Reduction::None) *
+                   sampleWeights_)
+                      .mean();
+      tdError.add_((currentQ.detach() - discounted_reward).abs());
+    } else {
+      valueLoss = at::smooth_l1_loss(currentQ, discounted_reward);
+    }
     totValueLoss = totValueLoss + valueLoss;
   }
   metricsContext_->pushEvent("value_loss", totValueLoss.item<float>());
   totValueLoss.backward();
+  if (tdError.defined()) {
+    updatePriorities(tdError / float(seq.size() - 1));
+  }
 
   doOptimStep();
 }
@@ -178,6 +178,19 @@ void SyncTrainer::createBatch(
     const std::vector<size_t>& selectedBuffers,
     std::vector<std::shared_ptr<SyncFrame>>& seq,
     torch::Tensor& terminal) {
+  std::vector<Sequence> columns;
+  columns.reserve(selectedBuffers.size());
+  for (auto idx : selectedBuffers) {
+    auto& frames = buffers_[idx]->frames;
+    columns.emplace_back(frames.begin(), frames.begin() + returnsLength_);
+  }
+  createBatch(columns, seq, terminal);
+}
+
+void SyncTrainer::createBatch(
+    const std::vector<Sequence>& columns,
+    std::vector<std::shared_ptr<SyncFrame>>& seq,
+    torch::Tensor& terminal) {
   MetricsContext::Timer batchTimer(metricsContext_, "trainer:batch_creation");
 
   seq.resize(returnsLength_);
@@ -190,8 +203,8 @@ void SyncTrainer::createBatch(
       };
   for (int i = 0; i < returnsLength_; ++i) {
     std::vector<std::shared_ptr<SyncFrame>> currentFrame;
-    for (size_t j = 0; j < selectedBuffers.size(); ++j) {
-      auto& f = buffers_[selectedBuffers[j]]->frames[i];
+    for (size_t j = 0; j < columns.size(); ++j) {
+      auto& f = columns[j][i];
       currentFrame.push_back(f.first);
       terminal[i][j] = f.second;
     }
@@ -207,6 +220,50 @@ void SyncTrainer::createBatch(
   }
 }
 
+void SyncTrainer::setPrioritizedReplay(
+    size_t capacity,
+    int replayBatchSize,
+    float alpha,
+    float beta) {
+  priority_lock lk(stepMutex_, 1);
+  lk.lock();
+  prioritized_ =
+      std::make_unique<PrioritizedReplay<Sequence>>(capacity, alpha, beta);
+  replayBatchSize_ = replayBatchSize;
+}
+
+void SyncTrainer::setOverlapGradientReduction(bool enable, bool compress) {
+  if (enable && !reduceGradients_) {
+    throw std::runtime_error(
+        "SyncTrainer: overlapping gradient reduction requires reduceGradients");
+  }
+  priority_lock lk(stepMutex_, 1);
+  lk.lock();
+  if (enable) {
+    gradientReducer_ = std::make_shared<distributed::GradientReducer>(
+        model_, distributed::Context::kGradientBucketBytes, compress);
+  } else {
+    gradientReducer_.reset();
+  }
+}
+
+void SyncTrainer::updatePriorities(torch::Tensor priorities) {
+  if (!prioritized_) {
+    return;
+  }
+  torch::NoGradGuard g_;
+  auto p = priorities.detach().to(torch::kCPU, at::kFloat).contiguous();
+  if (size_t(p.numel()) != batchIds_.size()) {
+    throw std::runtime_error(fmt::format(
+        "SyncTrainer: got {} priorities for {} sequences",
+        p.numel(),
+        batchIds_.size()));
+  }
+  auto data = p.data<float>();
+  prioritized_->updatePriorities(
+      batchIds_, std::vector<float>(data, data + p.numel()));
+}
+
 bool SyncTrainer::update() {
   priority_lock lk(stepMutex_, 1); // high priority lock
   lk.lock();
@@ -256,12 +313,38 @@ bool SyncTrainer::update() {
   }
 
   updateCount_++;
-  int actualBatchSize = selectedBuffers.size();
-  metricsContext_->incCounter("sampleCount", actualBatchSize);
+  metricsContext_->incCounter("sampleCount", selectedBuffers.size());
+
+  std::vector<Sequence> columns;
+  for (auto idx : selectedBuffers) {
+    auto& frames = buffers_[idx]->frames;
+    columns.emplace_back(frames.begin(), frames.begin() + returnsLength_);
+  }
+  if (prioritized_) {
+    // Sample before adding the fresh sequences so that we don't replay them
+    // right away
+    std::vector<float> weights(columns.size(), 1.0f);
+    batchIds_.clear();
+    if (prioritized_->size() > 0 && replayBatchSize_ > 0) {
+      auto replay = prioritized_->sample(replayBatchSize_);
+      for (size_t i = 0; i < replay.items.size(); i++) {
+        columns.push_back(std::move(replay.items[i]));
+        weights.push_back(replay.weights[i]);
+      }
+      batchIds_ = std::move(replay.ids);
+    }
+    std::vector<uint64_t> freshIds;
+    for (size_t i = 0; i < selectedBuffers.size(); i++) {
+      freshIds.push_back(prioritized_->add(columns[i]));
+    }
+    batchIds_.insert(batchIds_.begin(), freshIds.begin(), freshIds.end());
+    sampleWeights_ = torch::tensor(weights).to(model_->options().device());
+  }
+  int actualBatchSize = columns.size();
 
   auto terminal = torch::zeros({returnsLength_, actualBatchSize}, at::kByte);
 
-  createBatch(selectedBuffers, seq, terminal);
+  createBatch(columns, seq, terminal);
 
   {
     std::unique_lock<std::shared_mutex> modelLock;
@@ -363,15 +446,20 @@ void SyncTrainer::computeAllForward(
 void SyncTrainer::doOptimStep() {
   namespace dist = distributed;
   if (reduceGradients_) {
+    {
+      MetricsContext::Timer timeAllreduce(
+          metricsContext_, "trainer:network_time");
+      if (gradientReducer_) {
+        // Most buckets have been sent during the backward pass already
+        gradientReducer_->wait();
+      } else {
+        dist::allreduceGradients(model_);
+      }
+    }
     for (auto& var : model_->parameters()) {
       if (!var.grad().defined()) {
         continue;
       }
-      {
-        MetricsContext::Timer timeAllreduce(
-            metricsContext_, "trainer:network_time");
-        dist::allreduce(var.grad());
-      }
       var.grad().div_(dist::globalContext()->size);
     }
   }
@@ -8,12 +8,16 @@
 #pragma once
 
 #include "checkpointer.h"
+#include "prioritizedreplay.h"
 #include "prioritymutex.h"
 #include "threadpool.h"
 #include "trainer.h"
 #include <mutex>
 
 namespace cpid {
+namespace distributed {
+class GradientReducer;
+} // namespace distributed
 
 struct SyncFrame : ReplayBufferFrame {
   ag::Variant state;
@@ -101,6 +105,13 @@ struct SingleFrame : SyncFrame {
  *
  * \param{maxGradientNorm}: if this parameter is positive, then the gradients
  * will be scaled down so that the inf norm is no greater than the one provided
+ *
+ * Prioritized experience replay can be enabled with setPrioritizedReplay().
+ * In that case, every sequence used for an update is retained and later
+ * updates are done on the fresh sequences plus a number of sequences sampled
+ * according to their priority. Subclasses should weight their losses with
+ * sampleWeights_ and report new priorities via updatePriorities() from
+ * doUpdate().
  */
 class SyncTrainer : public Trainer {
   using hires_clock = std::chrono::steady_clock;
@@ -146,6 +157,22 @@ class SyncTrainer : public Trainer {
     return updateCount_;
   }
 
+  /// Enables prioritized replay of up to \param{capacity} sequences, of which
+  /// \param{replayBatchSize} will be added to every update. Note that frames
+  /// are kept on the GPU unless gpuMemoryEfficient is set.
+  void setPrioritizedReplay(
+      size_t capacity,
+      int replayBatchSize,
+      float alpha = 0.6,
+      float beta = 0.4);
+
+  /// Reduces gradients across nodes while the backward pass is still running
+  /// (see distributed::GradientReducer) instead of once it is done. Requires
+  /// reduceGradients to be set. Every backward pass on the model needs to be
+  /// followed by doOptimStep(). If \param{compress} is true, gradients are
+  /// sent as half-precision floats.
+  void setOverlapGradientReduction(bool enable, bool compress = false);
+
   /// Constructs an evaluator
   std::shared_ptr<Evaluator> makeEvaluator(
       size_t n,
@@ -155,6 +182,7 @@ class SyncTrainer : public Trainer {
 
  protected:
   using Frame = std::pair<std::shared_ptr<SyncFrame>, bool>;
+  using Sequence = std::vector<Frame>;
   struct Buffer {
     std::deque<Frame> frames;
     double cumReward = 0.0;
@@ -180,6 +208,16 @@ class SyncTrainer : public Trainer {
       const std::vector<size_t>& selectedBuffers,
       std::vector<std::shared_ptr<SyncFrame>>& seq,
       torch::Tensor& terminal);
+  /// Same as above, with one sequence of returnsLength frames per column
+  void createBatch(
+      const std::vector<Sequence>& columns,
+      std::vector<std::shared_ptr<SyncFrame>>& seq,
+      torch::Tensor& terminal);
+
+  /// Sets the priorities of the sequences in the current batch, e.g. to the
+  /// absolute TD error per column. This is a no-op unless prioritized replay
+  /// is enabled.
+  void updatePriorities(torch::Tensor priorities);
 
   /// Given a sequence of consecutive frames, compute the forward for all the
   /// frames. This will fill the state_forwarded field of the frames
@@ -199,6 +237,10 @@ class SyncTrainer : public Trainer {
   bool reduceGradients_;
   float maxGradientNorm_ = -1;
 
+  /// Importance-sampling weights for the columns of the current batch, on the
+  /// model's device. Undefined unless prioritized replay is enabled.
+  torch::Tensor sampleWeights_;
+
  private:
   /** Retrieve the 'buffers_' index for the corresponding handle
    * If no buffer is assigned yet, will reuse a finished buffer if possible
@@ -226,6 +268,13 @@ class SyncTrainer : public Trainer {
   std::unordered_map<GameUID, size_t> gamesToBuffers_;
   std::vector<std::unique_ptr<Buffer>> buffers_;
 
+  std::unique_ptr<PrioritizedReplay<Sequence>> prioritized_;
+  int replayBatchSize_ = 0;
+
+  std::shared_ptr<distributed::GradientReducer> gradientReducer_;
+  // Replay IDs of the columns in the current batch
+  std::vector<uint64_t> batchIds_;
+
   bool train_ = true;
 };
 
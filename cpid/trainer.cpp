@@ -46,68 +46,106 @@ GameUID genGameUID() {
   return fmt::format("{}-{}-{}", hostname, getRandomPrefix(), id);
 }
 
+ReplayBuffer::ReplayBuffer(size_t numShards, size_t capacity)
+    : capacity_(capacity) {
+  if (numShards == 0) {
+    throw std::invalid_argument("ReplayBuffer requires at least one shard");
+  }
+  shards_.reserve(numShards);
+  for (size_t i = 0; i < numShards; i++) {
+    shards_.push_back(std::make_unique<Shard>());
+  }
+}
+
+ReplayBuffer::Shard& ReplayBuffer::shard(GameUID const& uid) const {
+  return *shards_[std::hash<GameUID>()(uid) % shards_.size()];
+}
+
 Episode& ReplayBuffer::append(
     GameUID uid,
     EpisodeKey key,
     std::shared_ptr<ReplayBufferFrame> value,
     bool isDone) {
-  std::lock_guard<std::shared_timed_mutex> lock(replayerRWMutex_);
-  auto done =
-      (dones_.find(uid) != dones_.end() &&
-       dones_[uid].find(key) != dones_[uid].end());
-  if (done) {
-    VLOG(0) << "Error: Trying to insert frame into finished episode";
-  }
-
-  auto& map = *(
-      storage_.insert({uid, std::unordered_map<EpisodeKey, Episode>()}).first);
-  auto& vec = *(map.second.insert({key, Episode()}).first);
-  vec.second.push_back(std::move(value));
+  auto& sh = shard(uid);
+  std::vector<EpisodeTuple> evicted;
+  Episode* episode;
+  {
+    std::lock_guard<std::shared_timed_mutex> lock(sh.mutex);
+    auto dit = sh.dones.find(uid);
+    auto done = (dit != sh.dones.end() && dit->second.count(key) > 0);
+    if (done) {
+      VLOG(0) << "Error: Trying to insert frame into finished episode";
+    }
 
-  if (isDone) {
-    auto doneset = dones_.insert({uid, std::unordered_set<EpisodeKey>()}).first;
-    doneset->second.insert(key);
+    auto& map = *(sh.storage
+                      .insert({uid, std::unordered_map<EpisodeKey, Episode>()})
+                      .first);
+    auto& vec = *(map.second.insert({key, Episode()}).first);
+    vec.second.push_back(std::move(value));
+    episode = &vec.second;
+
+    if (isDone && !done) {
+      sh.dones[uid].insert(key);
+      std::lock_guard<std::shared_timed_mutex> doneLock(doneMutex_);
+      evicted = addDone(EpisodeTuple{uid, key}, episode);
+    }
   }
-  return vec.second;
+
+  // Evicted episodes are always older than the one we just finished, so the
+  // reference we return stays valid.
+  dropEvicted(evicted);
+  return *episode;
 }
 
 std::size_t ReplayBuffer::size() const {
-  std::shared_lock<std::shared_timed_mutex> lock(replayerRWMutex_);
   std::size_t n = 0;
-  for (auto const& it : storage_) {
-    n += it.second.size();
+  for (auto const& sh : shards_) {
+    std::shared_lock<std::shared_timed_mutex> lock(sh->mutex);
+    for (auto const& it : sh->storage) {
+      n += it.second.size();
+    }
   }
   return n;
 }
 
 std::size_t ReplayBuffer::size(GameUID const& id) const {
-  std::shared_lock<std::shared_timed_mutex> lock(replayerRWMutex_);
-  return storage_.at(id).size();
+  auto& sh = shard(id);
+  std::shared_lock<std::shared_timed_mutex> lock(sh.mutex);
+  return sh.storage.at(id).size();
 }
 
 std::size_t ReplayBuffer::sizeDone() const {
-  std::shared_lock<std::shared_timed_mutex> lock(replayerRWMutex_);
-  std::size_t n = 0;
-  for (auto const& it : dones_) {
-    n += it.second.size();
-  }
-  return n;
+  std::shared_lock<std::shared_timed_mutex> lock(doneMutex_);
+  return doneIndex_.size();
 }
 
 std::size_t ReplayBuffer::sizeDone(GameUID const& id) const {
-  std::shared_lock<std::shared_timed_mutex> lock(replayerRWMutex_);
-  return dones_.at(id).size();
+  auto& sh = shard(id);
+  std::shared_lock<std::shared_timed_mutex> lock(sh.mutex);
+  return sh.dones.at(id).size();
 }
 
 Episode& ReplayBuffer::get(GameUID const& uid, EpisodeKey const& key) {
-  std::shared_lock<std::shared_timed_mutex> lock(replayerRWMutex_);
-  return storage_[uid][key];
+  auto& sh = shard(uid);
+  {
+    std::shared_lock<std::shared_timed_mutex> lock(sh.mutex);
+    auto it = sh.storage.find(uid);
+    if (it != sh.storage.end()) {
+      auto eit = it->second.find(key);
+      if (eit != it->second.end()) {
+        return eit->second;
+      }
+    }
+  }
+  std::lock_guard<std::shared_timed_mutex> lock(sh.mutex);
+  return sh.storage[uid][key];
 }
 
 bool ReplayBuffer::has(GameUID const& uid, EpisodeKey const& key) {
-  std::shared_lock<std::shared_timed_mutex> lock(replayerRWMutex_);
-  auto const& it = storage_.find(uid);
-  if (it == storage_.end()) {
+  auto& sh = shard(uid);
+  std::shared_lock<std::shared_timed_mutex> lock(sh.mutex);
+  auto const& it = sh.storage.find(uid);
+  if (it == sh.storage.end()) {
     return false;
   }
   if (it->second.find(key) == it->second.end()) {
@@ -117,9 +155,10 @@ bool ReplayBuffer::has(GameUID const& uid, EpisodeKey const& key) {
 }
 
 bool ReplayBuffer::isDone(GameUID const& uid, EpisodeKey const& key) {
-  std::shared_lock<std::shared_timed_mutex> lock(replayerRWMutex_);
-  auto const& it = dones_.find(uid);
-  if (it == dones_.end()) {
+  auto& sh = shard(uid);
+  std::shared_lock<std::shared_timed_mutex> lock(sh.mutex);
+  auto const& it = sh.dones.find(uid);
+  if (it == sh.dones.end()) {
     return false;
   }
   if (it->second.find(key) == it->second.end()) {
@@ -129,37 +168,160 @@ bool ReplayBuffer::isDone(GameUID const& uid, EpisodeKey const& key) {
 }
 
 void ReplayBuffer::erase(GameUID const& id, EpisodeKey const& key) {
-  std::lock_guard<std::shared_timed_mutex> lock(replayerRWMutex_);
-  storage_[id].erase(key);
-  dones_[id].erase(key);
-  if (dones_[id].size() == 0) {
-    dones_.erase(id);
+  auto& sh = shard(id);
+  std::lock_guard<std::shared_timed_mutex> lock(sh.mutex);
+  {
+    std::lock_guard<std::shared_timed_mutex> doneLock(doneMutex_);
+    removeDone(id, key);
   }
-  if (storage_[id].size() == 0) {
-    storage_.erase(id);
+  auto dit = sh.dones.find(id);
+  if (dit != sh.dones.end()) {
+    dit->second.erase(key);
+    if (dit->second.size() == 0) {
+      sh.dones.erase(dit);
+    }
+  }
+  auto sit = sh.storage.find(id);
+  if (sit != sh.storage.end()) {
+    sit->second.erase(key);
+    if (sit->second.size() == 0) {
+      sh.storage.erase(sit);
+    }
   }
 }
 
 void ReplayBuffer::clear() {
-  std::lock_guard<std::shared_timed_mutex> lock(replayerRWMutex_);
-  dones_.clear();
-  storage_.clear();
+  std::vector<std::unique_lock<std::shared_timed_mutex>> locks;
+  for (auto& sh : shards_) {
+    locks.emplace_back(sh->mutex);
+  }
+  std::lock_guard<std::shared_timed_mutex> doneLock(doneMutex_);
+  doneIndex_.clear();
+  donePos_.clear();
+  doneQueue_.clear();
+  for (auto& sh : shards_) {
+    sh->dones.clear();
+    sh->storage.clear();
+  }
 }
 
 std::vector<std::pair<EpisodeTuple, std::reference_wrapper<Episode>>>
 ReplayBuffer::getAllEpisodes() {
-  std::lock_guard<std::shared_timed_mutex> lock(replayerRWMutex_);
+  std::shared_lock<std::shared_timed_mutex> lock(doneMutex_);
   std::vector<std::pair<EpisodeTuple, std::reference_wrapper<Episode>>>
       episodes;
-  for (auto& game : dones_) {
-    for (auto& ep : game.second) {
-      episodes.push_back(std::make_pair(
-          EpisodeTuple{game.first, ep}, std::ref(storage_[game.first][ep])));
-    }
+  episodes.reserve(doneIndex_.size());
+  for (auto& entry : doneIndex_) {
+    episodes.push_back(std::make_pair(entry.key, std::ref(*entry.episode)));
   }
   return episodes;
 }
 
+void ReplayBuffer::setCapacity(size_t capacity) {
+  std::vector<EpisodeTuple> evicted;
+  {
+    std::lock_guard<std::shared_timed_mutex> lock(doneMutex_);
+    capacity_ = capacity;
+    evicted = evict();
+  }
+  dropEvicted(evicted);
+}
+
+size_t ReplayBuffer::capacity() const {
+  std::shared_lock<std::shared_timed_mutex> lock(doneMutex_);
+  return capacity_;
+}
+
+std::vector<EpisodeTuple> ReplayBuffer::addDone(
+    EpisodeTuple const& key,
+    Episode* episode) {
+  auto seq = doneSeq_++;
+  auto dkey = DoneKey(key.gameID, key.episodeKey);
+  donePos_[dkey] = doneIndex_.size();
+  doneIndex_.push_back(DoneEntry{key, episode, seq});
+  doneQueue_.emplace_back(std::move(dkey), seq);
+  return evict();
+}
+
+void ReplayBuffer::removeDone(GameUID const& uid, EpisodeKey const& key) {
+  auto it = donePos_.find(DoneKey(uid, key));
+  if (it == donePos_.end()) {
+    return;
+  }
+  // Swap with last entry; the corresponding element in doneQueue_ will be
+  // skipped during eviction since its sequence number won't match anymore.
+  auto pos = it->second;
+  donePos_.erase(it);
+  if (pos + 1 != doneIndex_.size()) {
+    doneIndex_[pos] = std::move(doneIndex_.back());
+    auto const& moved = doneIndex_[pos].key;
+    donePos_[DoneKey(moved.gameID, moved.episodeKey)] = pos;
+  }
+  doneIndex_.pop_back();
+
+  // Don't let stale queue entries pile up if episodes are mostly erased
+  // explicitly
+  if (doneQueue_.size() > 2 * doneIndex_.size() + 1024) {
+    std::deque<std::pair<DoneKey, uint64_t>> queue;
+    for (auto& q : doneQueue_) {
+      auto pit = donePos_.find(q.first);
+      if (pit != donePos_.end() && doneIndex_[pit->second].seq == q.second) {
+        queue.push_back(std::move(q));
+      }
+    }
+    doneQueue_ = std::move(queue);
+  }
+}
+
+std::vector<EpisodeTuple> ReplayBuffer::evict() {
+  std::vector<EpisodeTuple> evicted;
+  if (capacity_ == 0) {
+    return evicted;
+  }
+  while (doneIndex_.size() > capacity_ && !doneQueue_.empty()) {
+    auto q = std::move(doneQueue_.front());
+    doneQueue_.pop_front();
+    auto it = donePos_.find(q.first);
+    if (it == donePos_.end() || doneIndex_[it->second].seq != q.second) {
+      continue; // Stale
+    }
+    evicted.push_back(EpisodeTuple{q.first.first, q.first.second});
+    removeDone(q.first.first, q.first.second);
+  }
+  return evicted;
+}
+
+void ReplayBuffer::dropEvicted(std::vector<EpisodeTuple> const& evicted) {
+  for (auto const& key : evicted) {
+    auto& sh = shard(key.gameID);
+    std::lock_guard<std::shared_timed_mutex> lock(sh.mutex);
+    // The episode might have been erased (and possibly re-inserted) in the
+    // meantime
+    auto dit = sh.dones.find(key.gameID);
+    if (dit == sh.dones.end() || dit->second.count(key.episodeKey) == 0) {
+      continue;
+    }
+    {
+      std::shared_lock<std::shared_timed_mutex> doneLock(doneMutex_);
+      if (donePos_.find(DoneKey(key.gameID, key.episodeKey)) !=
+          donePos_.end()) {
+        continue;
+      }
+    }
+    dit->second.erase(key.episodeKey);
+    if (dit->second.size() == 0) {
+      sh.dones.erase(dit);
+    }
+    auto sit = sh.storage.find(key.gameID);
+    if (sit != sh.storage.end()) {
+      sit->second.erase(key.episodeKey);
+      if (sit->second.size() == 0) {
+        sh.storage.erase(sit);
+      }
+    }
+  }
+}
+
 std::vector<std::pair<EpisodeTuple, std::reference_wrapper<Episode>>>
 ReplayBuffer::sample(uint32_t num) {
   auto engine = common::Rand::makeRandEngine<std::mt19937>();
@@ -197,10 +359,10 @@ ag::Variant Trainer::forwardUnbatched(ag::Variant in, ag::Container model) {
     model = model_;
   }
   if (batcher_) {
-    auto out = model_->forward(batcher_->makeBatch({in}));
+    auto out = model->forward(batcher_->makeBatch({in}));
     return batcher_->unBatch(out, false, -1)[0];
   }
-  return model_->forward(in);
+  return model->forward(in);
 }
 
 void Trainer::step(
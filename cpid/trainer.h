@@ -11,6 +11,8 @@
 #include "common/rand.h"
 #include "metrics.h"
 
+#include <deque>
+#include <random>
 #include <shared_mutex>
 
 #include <glog/logging.h>
@@ -83,6 +85,14 @@ struct RewardBufferFrame : ReplayBufferFrame {
  * All the public functions here should be autolocking and therefore relatively
  * thread safe. However, things like size do no perfectly accurately represent
  * the size in a multithreaded environment.
+ *
+ * Episodes are distributed over a fixed number of shards by game ID, each
+ * guarded by its own lock, so that producers working on different games don't
+ * contend with each other. Finished episodes are additionally tracked in a
+ * flat index which provides O(1) uniform sampling. If a capacity is set, the
+ * oldest finished episodes will be evicted once there are more than
+ * `capacity` of them. References obtained for evicted or erased episodes are
+ * invalidated.
  */
 class ReplayBuffer {
  public:
@@ -93,6 +103,13 @@ class ReplayBuffer {
       std::unordered_map<GameUID, std::unordered_set<EpisodeKey>>;
   using SampleOutput = std::pair<EpisodeTuple, std::reference_wrapper<Episode>>;
 
+  static constexpr size_t kDefaultNumShards = 16;
+
+  /// A capacity of zero denotes an unbounded buffer
+  explicit ReplayBuffer(
+      size_t numShards = kDefaultNumShards,
+      size_t capacity = 0);
+
   Episode& append(
       GameUID uid,
       EpisodeKey key,
@@ -107,7 +124,12 @@ class ReplayBuffer {
   void erase(GameUID const&, EpisodeKey const& = kDefaultEpisodeKey);
   std::vector<SampleOutput> getAllEpisodes();
 
-  // Stupid sample for now, samples uniformly over games and then over episodes
+  /// Maximum number of finished episodes that will be retained. Setting a
+  /// smaller capacity evicts the oldest episodes right away.
+  void setCapacity(size_t capacity);
+  size_t capacity() const;
+
+  // Samples uniformly over finished episodes
   // No guarantee of uniqueness :)
   template <typename RandomGenerator>
   std::vector<SampleOutput> sample(RandomGenerator& g, uint32_t num = 1);
@@ -118,14 +140,45 @@ class ReplayBuffer {
   bool isDone(GameUID const&, EpisodeKey const& = kDefaultEpisodeKey);
 
  protected:
-  Store storage_;
-  UIDKeyStore dones_;
+  struct Shard {
+    Store storage;
+    UIDKeyStore dones;
+    // Can be replaced with shared_mutex in C++17
+    mutable std::shared_timed_mutex mutex;
+  };
+  struct DoneEntry {
+    EpisodeTuple key;
+    Episode* episode;
+    /// Insertion order, used to detect stale entries in doneQueue_
+    uint64_t seq;
+  };
+  using DoneKey = std::pair<GameUID, EpisodeKey>;
+
+  Shard& shard(GameUID const& uid) const;
+  /// Adds an episode to the done index and returns the episodes that need to
+  /// be evicted. Requires a lock on doneMutex_.
+  std::vector<EpisodeTuple> addDone(EpisodeTuple const& key, Episode* episode);
+  /// Requires a lock on doneMutex_
+  void removeDone(GameUID const& uid, EpisodeKey const& key);
+  /// Pops the oldest done episodes until we're within capacity. Requires a
+  /// lock on doneMutex_.
+  std::vector<EpisodeTuple> evict();
+  /// Removes evicted episodes from the shard storage. Must be called without
+  /// holding any locks.
+  void dropEvicted(std::vector<EpisodeTuple> const& evicted);
 
   template <typename RandomGenerator>
   SampleOutput sample_(RandomGenerator& g);
 
-  // Can be replaced with shared_mutex in C++17
-  mutable std::shared_timed_mutex replayerRWMutex_;
+  std::vector<std::unique_ptr<Shard>> shards_;
+  size_t capacity_;
+
+  // Index of finished episodes. Lock order is shard -> doneMutex_.
+  std::vector<DoneEntry> doneIndex_;
+  std::unordered_map<DoneKey, size_t, pairhash> donePos_;
+  std::deque<std::pair<DoneKey, uint64_t>> doneQueue_;
+  uint64_t doneSeq_ = 0;
+  mutable std::shared_timed_mutex doneMutex_;
 };
 
 class AsyncBatcher;
@@ -309,26 +362,23 @@ inline std::vector<ReplayBuffer::SampleOutput> ReplayBuffer::sample(
     RandomGenerator& g,
     uint32_t num) {
   std::vector<SampleOutput> samples;
+  samples.reserve(num);
+  std::shared_lock<std::shared_timed_mutex> lock(doneMutex_);
   for (uint32_t i = 0; i < num; i++) {
     samples.push_back(sample_(g));
   }
   return samples;
 }
 
+/// Requires a shared lock on doneMutex_
 template <typename RandomGenerator>
 inline ReplayBuffer::SampleOutput ReplayBuffer::sample_(RandomGenerator& g) {
-  std::shared_lock<std::shared_timed_mutex> lock(replayerRWMutex_);
-  if (dones_.size() == 0) {
+  if (doneIndex_.empty()) {
     throw std::runtime_error("No finished episodes yet...");
   }
-  auto& game = *common::select_randomly(dones_.begin(), dones_.end(), g);
-  if (game.second.size() == 0) {
-    LOG(FATAL) << "no episodes in game"; // This shouldn't ever happen...
-  }
-  auto& ep =
-      *common::select_randomly(game.second.begin(), game.second.end(), g);
-  return std::make_pair(
-      EpisodeTuple{game.first, ep}, std::ref(storage_[game.first][ep]));
+  std::uniform_int_distribution<size_t> dist(0, doneIndex_.size() - 1);
+  auto& entry = doneIndex_[dist(g)];
+  return std::make_pair(entry.key, std::ref(*entry.episode));
 }
 
 template <typename T>
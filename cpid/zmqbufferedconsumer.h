@@ -10,8 +10,39 @@
 #include "zmqbufferedproducer.h"
 
 #include <atomic>
+#include <list>
+#include <unordered_map>
 
 namespace cpid {
+namespace detail {
+/// Forwards output to another stream buffer and counts the number of bytes
+class CountingStreambuf : public std::streambuf {
+ public:
+  explicit CountingStreambuf(std::streambuf* sbuf) : sbuf_(sbuf) {}
+
+  size_t count() const {
+    return count_;
+  }
+
+ protected:
+  int_type overflow(int_type ch) override {
+    if (traits_type::eq_int_type(ch, traits_type::eof())) {
+      return traits_type::not_eof(ch);
+    }
+    count_++;
+    return sbuf_->sputc(traits_type::to_char_type(ch));
+  }
+  std::streamsize xsputn(char const* s, std::streamsize num) override {
+    auto n = sbuf_->sputn(s, num);
+    count_ += n;
+    return n;
+  }
+
+ private:
+  std::streambuf* sbuf_;
+  size_t count_ = 0;
+};
+} // namespace detail
 
 /** A buffered consumer that sends data via ZeroMQ.
  *
@@ -36,7 +67,21 @@ namespace cpid {
  * ZeroMQBufferedProducer instances have been bound to. Data will be send to
  * end-points in a round-robin fashion. If producer endpoints don't accept new
  * data (because their queue is full and items are not consumed fast enough),
- * `enqueue()` will eventually block and perform retries.
+ * `enqueue()` will eventually block.
+ *
+ * Items are serialized with cereal and compressed with zstd, unless their
+ * serialized size is below a threshold (see setMinCompressSize()). A leading
+ * byte marks whether an item is compressed. Items are serialized directly into
+ * the zstd stream if the previous item exceeded the threshold. The resulting
+ * buffers are handed to ZeroMQ without copying and are shared with
+ * pending retries.
+ *
+ * Sending is flow-controlled: producers report the number of items they can
+ * accept (their credit) with every reply, and requests will only be sent out
+ * if the combined credit of all producers allows for it. Once producers are
+ * known to support it, multiple small items will be coalesced into a single
+ * request (see setMaxBatchSize()). Denied requests are re-sent right away
+ * since producers hold back replies until they have space again.
  */
 template <typename T>
 class ZeroMQBufferedConsumer {
@@ -44,6 +89,14 @@ class ZeroMQBufferedConsumer {
   using Reply = std::vector<char>;
 
  public:
+  /// Status of a producer endpoint as of its most recent reply
+  struct EndpointStats {
+    size_t credit = 0;
+    size_t queueDepth = 0;
+    size_t numAccepted = 0;
+    size_t numDenied = 0;
+  };
+
   ZeroMQBufferedConsumer(
       uint8_t nthreads,
       size_t maxQueueSize,
@@ -55,12 +108,68 @@ class ZeroMQBufferedConsumer {
   bool enqueueOrReplaceOldest(T arg);
   void updateEndpoints(std::vector<std::string> endpoints);
 
+  /// Sets the zstd compression level for subsequently serialized items
+  void setCompressionLevel(int level) {
+    compressionLevel_.store(level);
+  }
+  /// Items with a smaller serialized size will be sent uncompressed.
+  /// Set this to zero to compress everything, or to SIZE_MAX to disable
+  /// compression.
+  void setMinCompressSize(size_t size) {
+    minCompressSize_.store(size);
+  }
+  /// Sets the maximum number of items that will be sent in a single request
+  void setMaxBatchSize(size_t size) {
+    maxBatchSize_.store(std::max(size, size_t(1)));
+  }
+
+  /// Returns flow control information for all endpoints that replied so far
+  std::unordered_map<std::string, EndpointStats> endpointStats() const;
+
+  static size_t constexpr kDefaultMinCompressSize = 4096;
+  static size_t constexpr kDefaultMaxBatchSize = 16;
+  /// Items will only be coalesced into requests up to this size
+  static size_t constexpr kMaxBatchBytes = 1 << 20;
+
  private:
+  struct Pending {
+    std::shared_ptr<Request const> request;
+    size_t numItems;
+    std::future<Reply> reply;
+  };
+
+  Request serialize(T const& data) const;
+  void send(Request data);
+  void runSender();
+  void checkPending();
+  size_t window() const;
+
+  size_t const maxQueueSize_;
   size_t const maxConcurrentRequests_;
-  std::list<std::pair<Request, std::future<Reply>>> pending_;
   std::atomic<bool> stop_{false};
+  std::atomic<int> compressionLevel_{common::zstd::cstream::defaultLevel};
+  std::atomic<size_t> minCompressSize_{kDefaultMinCompressSize};
+  /// Serialized size of the most recent item, used to decide whether to
+  /// compress the next one right away
+  mutable std::atomic<size_t> lastSize_{0};
+  std::atomic<size_t> maxBatchSize_{kDefaultMaxBatchSize};
   ReqRepClient client_;
-  std::unique_ptr<common::BufferedConsumer<Request>> bcsend_;
+
+  // Serialized items waiting to be sent
+  std::mutex sendM_;
+  std::condition_variable sendCv_;
+  std::deque<Request> sendQueue_;
+
+  // Only accessed from the sender thread
+  std::list<Pending> pending_;
+  size_t numInFlight_ = 0;
+  bool batching_ = false;
+  bool sawLegacyReply_ = false;
+
+  mutable std::mutex statsM_;
+  std::unordered_map<std::string, EndpointStats> stats_;
+
+  std::thread sender_;
   std::unique_ptr<common::BufferedConsumer<T>> bcser_;
 };
 
@@ -70,87 +179,22 @@ ZeroMQBufferedConsumer<T>::ZeroMQBufferedConsumer(
     size_t maxQueueSize,
     std::vector<std::string> endpoints,
     std::shared_ptr<zmq::context_t> context)
-    : maxConcurrentRequests_(std::min(maxQueueSize, size_t(64))),
+    : maxQueueSize_(std::max(maxQueueSize, size_t(1))),
+      maxConcurrentRequests_(std::min(maxQueueSize, size_t(64))),
       client_(maxConcurrentRequests_, endpoints, context) {
-  // BufferedConsumer for sending out data. With a single thread, this will
-  // simply run in the calling thread (protected by a mutex).
-  bcsend_ = std::make_unique<common::BufferedConsumer<Request>>(
-      0, 1, [this](Request ca) {
-        // Check pending requests. We'll keep on retrying with an exponential
-        // (bounded) backoff. For this implementation we're painfully reminded
-        // of the rawness of C++11's thread support library: we can't attach
-        // callbacks to futures (i.e. future::then()) or wait for multiple
-        // futures at once.
-        // This is the reason we limit the maximum queue size for ReqRepClient
-        // to 64 (tuned by manual monkeying).
-        int ntry = 0;
-        while (pending_.size() >= maxConcurrentRequests_ && !stop_.load()) {
-          if (ntry++ > 0) {
-            std::this_thread::sleep_for(std::chrono::milliseconds(
-                int(10 * std::pow(2, std::min(ntry, 5)))));
-          }
-
-          for (auto it = pending_.begin(); it != pending_.end();) {
-            auto& [req, fut] = *it;
-            if (fut.wait_for(std::chrono::seconds(0)) !=
-                std::future_status::ready) {
-              ++it;
-              continue;
-            }
-            Reply reply;
-            try {
-              reply = fut.get();
-            } catch (std::exception const& ex) {
-              // Something failed -- need to resend
-              VLOG(1)
-                  << "ZeroMQBufferedConsumer: got exception instead of reply: "
-                  << ex.what();
-              auto copy = req;
-              *it = std::make_pair(
-                  std::move(copy), client_.request(std::move(req)));
-              ++it;
-              continue;
-            }
-
-            // Recepient confirmed?
-            if (detail::kConfirm.compare(
-                    0, detail::kConfirm.size(), reply.data(), reply.size()) ==
-                0) {
-              it = pending_.erase(it);
-            } else {
-              VLOG(0) << "ZeroMQBufferedConsumer: got non-affirmative "
-                         "reply of size "
-                      << reply.size() << ", retrying";
-              auto copy = req;
-              *it = std::make_pair(
-                  std::move(copy), client_.request(std::move(req)));
-              ++it;
-            }
-          }
-        }
-
-        auto copy = ca;
-        pending_.emplace_back(std::move(copy), client_.request(std::move(ca)));
-      });
+  sender_ = std::thread(&ZeroMQBufferedConsumer<T>::runSender, this);
 
   // BufferedConsumer for data serialization
   bcser_ = std::make_unique<common::BufferedConsumer<T>>(
-      nthreads, maxQueueSize, [this](T data) {
-        common::OMembuf buf;
-        {
-          common::zstd::ostream os(&buf);
-          cereal::BinaryOutputArchive ar(os);
-          ar(data);
-        }
-        bcsend_->enqueue(buf.takeData());
-      });
+      nthreads, maxQueueSize, [this](T data) { send(serialize(data)); });
 }
 
 template <typename T>
 ZeroMQBufferedConsumer<T>::~ZeroMQBufferedConsumer() {
   stop_.store(true);
+  sendCv_.notify_all();
   bcser_.reset();
-  bcsend_.reset();
+  sender_.join();
 }
 
 template <typename T>
@@ -163,10 +207,207 @@ bool ZeroMQBufferedConsumer<T>::enqueueOrReplaceOldest(T arg) {
   return bcser_->enqueueOrReplaceOldest(std::move(arg));
 }
 
+template <typename T>
+auto ZeroMQBufferedConsumer<T>::serialize(T const& data) const -> Request {
+  auto minCompressSize = minCompressSize_.load();
+  if (lastSize_.load() >= minCompressSize) {
+    // Items are likely large enough to be compressed, so write them to zstd
+    // directly. We'll be off by a few small items if sizes vary.
+    common::OMembuf cbuf;
+    cbuf.sputc(detail::kItemZstd);
+    {
+      common::zstd::ostream zos(&cbuf, compressionLevel_.load());
+      detail::CountingStreambuf counter(zos.rdbuf());
+      std::ostream os(&counter);
+      {
+        cereal::BinaryOutputArchive ar(os);
+        ar(data);
+      }
+      lastSize_.store(counter.count());
+    }
+    return cbuf.takeData();
+  }
+
+  common::OMembuf buf;
+  buf.sputc(detail::kItemUncompressed);
+  {
+    std::ostream os(&buf);
+    cereal::BinaryOutputArchive ar(os);
+    ar(data);
+  }
+  auto size = buf.data().size() - 1;
+  lastSize_.store(size);
+  if (size < minCompressSize) {
+    return buf.takeData();
+  }
+
+  common::OMembuf cbuf;
+  cbuf.sputc(detail::kItemZstd);
+  {
+    common::zstd::ostream os(&cbuf, compressionLevel_.load());
+    os.write(buf.data().data() + 1, size);
+  }
+  return cbuf.takeData();
+}
+
+template <typename T>
+void ZeroMQBufferedConsumer<T>::send(Request data) {
+  std::unique_lock<std::mutex> lock(sendM_);
+  sendCv_.wait(lock, [&] {
+    return stop_.load() || sendQueue_.size() < maxQueueSize_;
+  });
+  if (stop_.load()) {
+    return;
+  }
+  sendQueue_.push_back(std::move(data));
+  lock.unlock();
+  sendCv_.notify_all();
+}
+
+template <typename T>
+void ZeroMQBufferedConsumer<T>::runSender() {
+  // Upper bound for waiting on replies, so that we notice denied requests
+  // while waiting for new data
+  auto constexpr kPollInterval = std::chrono::milliseconds(10);
+
+  while (!stop_.load()) {
+    checkPending();
+
+    // Items that producers can accept according to their last replies. We'll
+    // always send out one request if nothing is in flight; if producers are
+    // full they will hold it back until they have space.
+    auto credit = window();
+    auto blocked = pending_.size() >= maxConcurrentRequests_ ||
+        (!pending_.empty() && numInFlight_ >= credit);
+
+    std::unique_lock<std::mutex> lock(sendM_);
+    if (sendQueue_.empty() || blocked) {
+      if (!sendQueue_.empty()) {
+        // Replies generally arrive in order, so waiting for the oldest request
+        // is a good bet.
+        lock.unlock();
+        pending_.front().reply.wait_for(kPollInterval);
+      } else if (pending_.empty()) {
+        sendCv_.wait(
+            lock, [&] { return stop_.load() || !sendQueue_.empty(); });
+      } else {
+        sendCv_.wait_for(lock, kPollInterval, [&] {
+          return stop_.load() || !sendQueue_.empty();
+        });
+      }
+      continue;
+    }
+
+    // Coalesce items into a single request, respecting credit
+    size_t maxItems = 1;
+    if (batching_) {
+      auto avail = credit > numInFlight_ ? credit - numInFlight_ : 1;
+      maxItems = std::min(maxBatchSize_.load(), avail);
+    }
+    std::deque<Request> items;
+    size_t nbytes = 0;
+    while (!sendQueue_.empty() && items.size() < maxItems) {
+      auto size = sendQueue_.front().size();
+      if (!items.empty() && nbytes + size > kMaxBatchBytes) {
+        break;
+      }
+      nbytes += size;
+      items.push_back(std::move(sendQueue_.front()));
+      sendQueue_.pop_front();
+    }
+    lock.unlock();
+    sendCv_.notify_all();
+
+    // Single items are sent as-is to avoid copying them
+    auto numItems = items.size();
+    auto request = std::make_shared<Request const>(
+        numItems == 1 ? std::move(items.front()) : detail::packBatch(items));
+    // The request buffer is shared with ReqRepClient; we hold on to it for
+    // resending.
+    pending_.push_back({request, numItems, client_.request(request)});
+    numInFlight_ += numItems;
+  }
+}
+
+template <typename T>
+void ZeroMQBufferedConsumer<T>::checkPending() {
+  for (auto it = pending_.begin(); it != pending_.end();) {
+    if (it->reply.wait_for(std::chrono::seconds(0)) !=
+        std::future_status::ready) {
+      ++it;
+      continue;
+    }
+
+    detail::FlowControl fc;
+    try {
+      auto reply = it->reply.get();
+      fc = detail::parseReply(reply.data(), reply.size());
+    } catch (std::exception const& ex) {
+      // Something failed -- need to resend
+      VLOG(1) << "ZeroMQBufferedConsumer: got exception instead of reply: "
+              << ex.what();
+      it->reply = client_.request(it->request);
+      ++it;
+      continue;
+    }
+
+    if (fc.valid) {
+      std::lock_guard<std::mutex> lock(statsM_);
+      auto& stats = stats_[fc.endpoint];
+      stats.credit = fc.credit;
+      stats.queueDepth = fc.queueDepth;
+      if (fc.accepted) {
+        stats.numAccepted += it->numItems;
+      } else {
+        stats.numDenied += it->numItems;
+      }
+    } else {
+      sawLegacyReply_ = true;
+    }
+    // Only coalesce items if all producers we talked to can unpack them
+    batching_ = fc.valid && !sawLegacyReply_;
+
+    if (fc.accepted) {
+      numInFlight_ -= it->numItems;
+      it = pending_.erase(it);
+    } else {
+      VLOG(1) << "ZeroMQBufferedConsumer: request with " << it->numItems
+              << " items was denied, retrying";
+      it->reply = client_.request(it->request);
+      ++it;
+    }
+  }
+}
+
+template <typename T>
+size_t ZeroMQBufferedConsumer<T>::window() const {
+  std::lock_guard<std::mutex> lock(statsM_);
+  if (stats_.empty()) {
+    // No flow control information yet
+    return maxConcurrentRequests_ * maxBatchSize_.load();
+  }
+  size_t credit = 0;
+  for (auto const& it : stats_) {
+    credit += it.second.credit;
+  }
+  return credit;
+}
+
+template <typename T>
+auto ZeroMQBufferedConsumer<T>::endpointStats() const
+    -> std::unordered_map<std::string, EndpointStats> {
+  std::lock_guard<std::mutex> lock(statsM_);
+  return stats_;
+}
+
 template <typename T>
 void ZeroMQBufferedConsumer<T>::updateEndpoints(
     std::vector<std::string> endpoints) {
-  client_.updateEndpoints(std::move(endpoints));
+  if (client_.updateEndpoints(std::move(endpoints))) {
+    // Don't account for credit of producers we're not talking to any more
+    std::lock_guard<std::mutex> lock(statsM_);
+    stats_.clear();
+  }
 }
 
 } // namespace cpid
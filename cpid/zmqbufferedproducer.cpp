@@ -5,11 +5,119 @@
  * LICENSE file in the root directory of this source tree.
  */
 
-#include <string>
+#include "zmqbufferedproducer.h"
+
+#include <cstring>
+#include <stdexcept>
 
 namespace cpid {
 namespace detail {
 std::string kConfirm = "ACK";
 std::string kDeny = "DENY";
+std::string kBatchMagic = "CPIDBTCH";
+
+namespace {
+template <typename I>
+void append(std::vector<char>& buf, I value) {
+  auto p = reinterpret_cast<char const*>(&value);
+  buf.insert(buf.end(), p, p + sizeof(value));
+}
+
+template <typename I>
+I extract(char const* buf) {
+  I value;
+  std::memcpy(&value, buf, sizeof(value));
+  return value;
+}
+
+bool startsWith(char const* buf, size_t len, std::string const& prefix) {
+  return len >= prefix.size() &&
+      std::memcmp(buf, prefix.data(), prefix.size()) == 0;
+}
+} // namespace
+
+std::vector<char> makeReply(FlowControl const& fc) {
+  auto const& tag = fc.accepted ? kConfirm : kDeny;
+  std::vector<char> buf(tag.begin(), tag.end());
+  if (fc.valid) {
+    append(buf, fc.credit);
+    append(buf, fc.queueDepth);
+    buf.insert(buf.end(), fc.endpoint.begin(), fc.endpoint.end());
+  }
+  return buf;
+}
+
+FlowControl parseReply(char const* buf, size_t len) {
+  FlowControl fc;
+  size_t pos = 0;
+  if (startsWith(buf, len, kConfirm)) {
+    fc.accepted = true;
+    pos = kConfirm.size();
+  } else if (startsWith(buf, len, kDeny)) {
+    pos = kDeny.size();
+  } else {
+    return fc;
+  }
+  // Older producers send the tag only
+  if (len - pos < 2 * sizeof(uint32_t)) {
+    return fc;
+  }
+  fc.valid = true;
+  fc.credit = extract<uint32_t>(buf + pos);
+  fc.queueDepth = extract<uint32_t>(buf + pos + sizeof(uint32_t));
+  pos += 2 * sizeof(uint32_t);
+  fc.endpoint.assign(buf + pos, len - pos);
+  return fc;
+}
+
+// Layout: magic, number of items (u32), item sizes (u64 each), item data
+std::vector<char> packBatch(std::deque<std::vector<char>> const& items) {
+  size_t size = kBatchMagic.size() + sizeof(uint32_t);
+  for (auto const& item : items) {
+    size += sizeof(uint64_t) + item.size();
+  }
+  std::vector<char> buf;
+  buf.reserve(size);
+  buf.insert(buf.end(), kBatchMagic.begin(), kBatchMagic.end());
+  append(buf, uint32_t(items.size()));
+  for (auto const& item : items) {
+    append(buf, uint64_t(item.size()));
+  }
+  for (auto const& item : items) {
+    buf.insert(buf.end(), item.begin(), item.end());
+  }
+  return buf;
+}
+
+bool unpackBatch(
+    char const* buf,
+    size_t len,
+    std::vector<std::pair<size_t, size_t>>& items) {
+  if (!startsWith(buf, len, kBatchMagic)) {
+    return false;
+  }
+  size_t pos = kBatchMagic.size();
+  if (len - pos < sizeof(uint32_t)) {
+    throw std::runtime_error("Truncated batch header");
+  }
+  auto n = extract<uint32_t>(buf + pos);
+  pos += sizeof(uint32_t);
+  if ((len - pos) / sizeof(uint64_t) < n) {
+    throw std::runtime_error("Truncated batch header");
+  }
+  auto offset = pos + n * sizeof(uint64_t);
+  items.clear();
+  items.reserve(n);
+  for (uint32_t i = 0; i < n; i++) {
+    auto size = extract<uint64_t>(buf + pos + i * sizeof(uint64_t));
+    if (size > len - offset) {
+      throw std::runtime_error("Truncated batch data");
+    }
+    items.emplace_back(offset, size);
+    offset += size;
+  }
+  return true;
+}
+
 } // namespace detail
 } // namespace cpid
@@ -14,10 +14,46 @@
 #include <common/serialization.h>
 #include <common/zstdstream.h>
 
+#include <chrono>
+#include <deque>
+
 namespace cpid {
 namespace detail {
 extern std::string kConfirm;
 extern std::string kDeny;
+extern std::string kBatchMagic;
+
+/// Every serialized item starts with one of these bytes, followed by the
+/// item's cereal archive (optionally compressed with zstd)
+char constexpr kItemUncompressed = 0;
+char constexpr kItemZstd = 1;
+
+/**
+ * Flow control information that ZeroMQBufferedProducer appends to its
+ * replies.
+ */
+struct FlowControl {
+  bool accepted = false;
+  /// False if the reply did not contain the fields below
+  bool valid = false;
+  /// Number of items that the producer can accept right now
+  uint32_t credit = 0;
+  /// Number of items waiting to be deserialized
+  uint32_t queueDepth = 0;
+  std::string endpoint;
+};
+
+std::vector<char> makeReply(FlowControl const& fc);
+FlowControl parseReply(char const* buf, size_t len);
+
+/// Coalesces several serialized items into a single request
+std::vector<char> packBatch(std::deque<std::vector<char>> const& items);
+/// Returns false if buf does not contain a batch of items. Otherwise, fills
+/// items with the offsets and sizes of the individual items.
+bool unpackBatch(
+    char const* buf,
+    size_t len,
+    std::vector<std::pair<size_t, size_t>>& items);
 } // namespace detail
 
 /**
@@ -46,6 +82,15 @@ extern std::string kDeny;
  * Make sure that you're calling get() fast enough; if you expect delays for
  * consumption set maxQueueSize accordingly. If the queue runs full the server
  * will not accept new data from the network.
+ *
+ * Received messages are queued as-is and deserialized directly from the
+ * buffers that ZeroMQ received them into. Both compressed and uncompressed
+ * data is accepted, as well as batches of multiple items.
+ *
+ * If there's no space in the queue for a request, its reply will be held back
+ * for up to setMaxHoldTime() until items have been consumed. Replies contain
+ * the number of items that can currently be accepted (see detail::FlowControl)
+ * so that clients can limit the amount of data they send.
  */
 template <typename T>
 class ZeroMQBufferedProducer {
@@ -62,16 +107,30 @@ class ZeroMQBufferedProducer {
   }
   void stop();
 
+  /// Sets how long requests are held back if the queue is full before they
+  /// are denied
+  void setMaxHoldTime(std::chrono::milliseconds time) {
+    maxHoldMs_.store(time.count());
+  }
+
+  static size_t constexpr kDefaultMaxHoldMs = 1000;
+
  protected:
-  void handleRequest(void const* buf, size_t len, ReqRepServer::ReplyFn reply);
+  void handleRequest(
+      std::shared_ptr<char const> buf,
+      size_t len,
+      ReqRepServer::ReplyFn reply);
 
  private:
   std::optional<T> produce();
 
   std::mutex mutex_;
   std::condition_variable cv_;
-  std::queue<std::vector<char>> queue_;
+  std::condition_variable spaceCv_;
+  std::queue<std::pair<std::shared_ptr<char const>, size_t>> queue_;
   size_t const maxInQueue_;
+  std::string endpoint_;
+  std::atomic<size_t> maxHoldMs_{kDefaultMaxHoldMs};
   std::atomic<bool> stop_{false};
   std::unique_ptr<common::BufferedProducer<T>> bprod_;
   std::unique_ptr<ReqRepServer> rrs_;
@@ -86,11 +145,18 @@ ZeroMQBufferedProducer<T>::ZeroMQBufferedProducer(
   bprod_ = std::make_unique<common::BufferedProducer<T>>(
       nthreads, maxQueueSize, [this] { return produce(); });
   rrs_ = std::make_unique<ReqRepServer>(
-      [this](void const* buf, size_t len, ReqRepServer::ReplyFn reply) {
-        handleRequest(buf, len, reply);
+      [this](
+          std::shared_ptr<char const> buf,
+          size_t len,
+          ReqRepServer::ReplyFn reply) {
+        handleRequest(std::move(buf), len, reply);
       },
       1,
       std::move(endpoint));
+  // Included in replies so that clients can tell producers apart
+  auto ep = rrs_->endpoint();
+  std::lock_guard<std::mutex> lock(mutex_);
+  endpoint_ = std::move(ep);
 }
 
 template <typename T>
@@ -107,31 +173,62 @@ template <typename T>
 void ZeroMQBufferedProducer<T>::stop() {
   stop_.store(true);
   cv_.notify_all();
+  spaceCv_.notify_all();
 }
 
 template <typename T>
 void ZeroMQBufferedProducer<T>::handleRequest(
-    void const* buf,
+    std::shared_ptr<char const> buf,
     size_t len,
     ReqRepServer::ReplyFn reply) {
   VLOG(2) << "ZeroMQBufferedProducer: received " << len << " bytes";
+  std::vector<std::pair<size_t, size_t>> items;
+  try {
+    if (!detail::unpackBatch(buf.get(), len, items)) {
+      items.emplace_back(0, len);
+    }
+  } catch (std::exception const& ex) {
+    // Don't have the client re-send this
+    LOG(ERROR) << "ZeroMQBufferedProducer: dropping malformed batch: "
+               << ex.what();
+    items.clear();
+  }
+
+  detail::FlowControl fc;
   {
-    std::lock_guard<std::mutex> lock(mutex_);
-    if (queue_.size() >= maxInQueue_) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto fits = [&] {
+      return stop_.load() || queue_.empty() ||
+          queue_.size() + items.size() <= maxInQueue_;
+    };
+    // Rather than denying right away, wait for items to be consumed. This
+    // way, the client will get a reply as soon as we have space again.
+    auto holdTime = std::chrono::milliseconds(maxHoldMs_.load());
+    fc.accepted = spaceCv_.wait_for(lock, holdTime, fits) && !stop_.load();
+    if (fc.accepted) {
+      if (queue_.size() > 0) {
+        VLOG(1) << "ZeroMQBufferedProducer: queue size " << queue_.size();
+      }
+      // Place in queue; this keeps the message alive without copying it
+      for (auto const& [offset, size] : items) {
+        queue_.emplace(
+            std::shared_ptr<char const>(buf, buf.get() + offset), size);
+      }
+    } else {
       VLOG(0) << "ZeroMQBufferedProducer: queue is full, cannot accept message";
-      reply(detail::kDeny.c_str(), detail::kDeny.size());
-      return;
-    } else if (queue_.size() > 0) {
-      VLOG(1) << "ZeroMQBufferedProducer: queue size " << queue_.size();
     }
-    // Place in queue
-    queue_.emplace(
-        static_cast<char const*>(buf), static_cast<char const*>(buf) + len);
+    fc.valid = true;
+    fc.credit = maxInQueue_ > queue_.size() ? maxInQueue_ - queue_.size() : 0;
+    fc.queueDepth = queue_.size();
+    fc.endpoint = endpoint_;
   }
 
-  // Notify client that we received the message
-  reply(detail::kConfirm.c_str(), detail::kConfirm.size());
-  cv_.notify_one();
+  // Notify client whether we received the message
+  auto data = detail::makeReply(fc);
+  reply(data.data(), data.size());
+  if (fc.accepted) {
+    cv_.notify_all();
+  }
 }
 
 template <typename T>
@@ -142,15 +239,31 @@ std::optional<T> ZeroMQBufferedProducer<T>::produce() {
     return {};
   }
 
-  auto data = std::move(queue_.front());
+  auto [data, len] = std::move(queue_.front());
   queue_.pop();
   lock.unlock();
+  spaceCv_.notify_one();
 
-  common::IMembuf buf(data);
-  common::zstd::istream is(&buf);
-  cereal::BinaryInputArchive ar(is);
+  if (len < 1) {
+    throw std::runtime_error("ZeroMQBufferedProducer: empty item");
+  }
+  auto encoding = data.get()[0];
+  common::IMembuf buf(std::string_view(data.get() + 1, len - 1));
   T item;
-  ar(item);
+  if (encoding == detail::kItemZstd) {
+    common::zstd::istream is(&buf);
+    cereal::BinaryInputArchive ar(is);
+    ar(item);
+  } else if (encoding == detail::kItemUncompressed) {
+    // Uncompressed data can be read from the message directly
+    std::istream is(&buf);
+    cereal::BinaryInputArchive ar(is);
+    ar(item);
+  } else {
+    throw std::runtime_error(
+        "ZeroMQBufferedProducer: unknown item encoding " +
+        std::to_string(int(encoding)));
+  }
   return item;
 }
 
@@ -49,6 +49,15 @@ at::Tensor sumErrors(
   }
 };
 
+// Allocates a zero-filled buffer for batched inputs. Use page-locked memory
+// for buffers that will be copied to the GPU.
+torch::Tensor
+newInputBuffer(at::IntList sizes, at::TensorOptions options, bool pinned) {
+  auto buf = pinned ? common::emptyPinned(sizes, options)
+                    : torch::empty(sizes, options);
+  return buf.zero_();
+}
+
 } // namespace
 
 UpdateLoop::UpdateLoop(int batchSize, std::shared_ptr<visdom::Visdom> vs)
@@ -334,6 +343,7 @@ std::pair<ag::tensor_list, ag::tensor_list> BpttUpdateLoop::preproc(
     return (feature == BosFeature::Map || feature == BosFeature::Race);
   };
 
+  bool pinned = model->options().device().is_cuda();
   int64_t numEpisodes = episodes.size();
   int64_t maxLength = 0;
   for (auto const& episode : episodes) {
@@ -354,7 +364,7 @@ std::pair<ag::tensor_list, ag::tensor_list> BpttUpdateLoop::preproc(
         sizes.insert(sizes.begin(), numEpisodes); // batch dimension
         sizes.insert(
             sizes.begin(), timeConst ? 1 : maxLength); // time dimension
-        auto buf = inputs[i].clone().resize_(sizes).fill_(0);
+        auto buf = newInputBuffer(sizes, inputs[i].options(), pinned);
         buf[timeConst ? 0 : idxT][idxB].copy_(inputs[i]);
         buffers.push_back(buf);
       }
@@ -1163,6 +1173,7 @@ std::pair<ag::tensor_list, ag::tensor_list> LinearModelUpdateLoop::preproc(
     return considered;
   };
 
+  bool pinned = model->options().device().is_cuda();
   std::vector<std::set<int>> considered;
   int64_t numSamples = 0; // in macro batch
   for (auto const& episode : episodes) {
@@ -1178,7 +1189,7 @@ std::pair<ag::tensor_list, ag::tensor_list> LinearModelUpdateLoop::preproc(
       for (auto i = 0U; i < inputs.size(); i++) {
         auto sizes = inputs[i].sizes().vec();
         sizes.insert(sizes.begin(), numSamples); // batch dimension
-        auto buf = inputs[i].clone().resize_(sizes).fill_(0);
+        auto buf = newInputBuffer(sizes, inputs[i].options(), pinned);
         buf[idx].copy_(inputs[i]);
         buffers.push_back(buf);
       }
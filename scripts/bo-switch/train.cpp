@@ -128,6 +128,11 @@ DEFINE_string(
     ":420_Z_ZZZKBot",
     "Play against these opponents");
 DEFINE_string(sample_path, "samples", "Save samples here");
+DEFINE_bool(
+    sample_store,
+    false,
+    "For offline training, read episodes from memory-mapped sample stores. "
+    "Stores will be created next to the sample lists if they don't exist yet.");
 DEFINE_string(playoutput, "playoutput", "Output folder for play script");
 
 // Training options
@@ -197,6 +202,32 @@ namespace fsutils = common::fsutils;
 
 namespace {
 
+// Creates a data reader for this worker's partition of the given episode list
+common::DataReader<BosEpisodeData> makeEpisodeReader(std::string const& list) {
+  auto rank = dist::globalContext()->rank;
+  auto size = dist::globalContext()->size;
+  auto paths = fsutils::readLinesPartition(list, rank, size);
+  if (!FLAGS_sample_store) {
+    return common::DataReader<BosEpisodeData>(paths, 16, 4, FLAGS_sample_path);
+  }
+
+  auto store = fmt::format(
+      "{}/{}.{}-of-{}.store",
+      fsutils::dirname(list),
+      fsutils::basename(list, ".list"),
+      rank,
+      size);
+  if (!fsutils::exists(store)) {
+    VLOG(0) << "Creating sample store " << store << " from " << paths.size()
+            << " episodes";
+    auto n = common::writeSampleStore<BosEpisodeData>(
+        paths, store + ".tmp", FLAGS_sample_path);
+    fsutils::mv(store + ".tmp", store);
+    VLOG(0) << "Wrote " << n << " episodes to " << store;
+  }
+  return common::makeSampleStoreDataReader<BosEpisodeData>({store}, 16, 4);
+}
+
 class BosTrainer : public CentralTrainer {
  public:
   BosTrainer(
@@ -285,22 +316,8 @@ class BosTrainer : public CentralTrainer {
   void runOffline() {
     saveSamples = false;
 
-    auto trainDr = common::DataReader<BosEpisodeData>(
-        fsutils::readLinesPartition(
-            FLAGS_sample_path + "/train.list",
-            dist::globalContext()->rank,
-            dist::globalContext()->size),
-        16,
-        4,
-        FLAGS_sample_path);
-    auto validDr = common::DataReader<BosEpisodeData>(
-        fsutils::readLinesPartition(
-            FLAGS_sample_path + "/valid.list",
-            dist::globalContext()->rank,
-            dist::globalContext()->size),
-        16,
-        4,
-        FLAGS_sample_path);
+    auto trainDr = makeEpisodeReader(FLAGS_sample_path + "/train.list");
+    auto validDr = makeEpisodeReader(FLAGS_sample_path + "/valid.list");
 
     // Feed data to the training loop directly instead of putting it into the
     // replayer first
@@ -359,14 +376,7 @@ class BosTrainer : public CentralTrainer {
   void evaluateOffline() {
     saveSamples = false;
 
-    auto validDr = common::DataReader<BosEpisodeData>(
-        fsutils::readLinesPartition(
-            FLAGS_sample_path + "/valid.list",
-            dist::globalContext()->rank,
-            dist::globalContext()->size),
-        16,
-        4,
-        FLAGS_sample_path);
+    auto validDr = makeEpisodeReader(FLAGS_sample_path + "/valid.list");
 
     loop_->dumpPredictions = true;
     validateOffline(validDr, 0);
@@ -44,6 +44,11 @@ DEFINE_string(
     "Load samples from here");
 DEFINE_bool(gpu, common::gpuAvailable(), "Train on GPU");
 DEFINE_int32(num_data_threads, 4, "Number of data loader threads");
+DEFINE_bool(
+    sample_store,
+    false,
+    "Read samples from memory-mapped sample stores. Stores will be created "
+    "next to the sample lists if they don't exist yet.");
 DEFINE_int32(valid_every, -1, "Validate every n updates (or once per epoch)");
 DEFINE_bool(
     validate,
@@ -202,6 +207,35 @@ int dN(torch::Tensor output, torch::Tensor target, int n) {
   return diffX.gt(n).__or__(diffY.gt(n)).sum().item<int32_t>();
 }
 
+// Creates a data reader for this worker's partition of the given sample list
+common::DataReader<BuildingPlacerSample> makeSampleReader(
+    std::string const& list) {
+  auto rank = dist::globalContext()->rank;
+  auto size = dist::globalContext()->size;
+  auto paths = fsutils::readLinesPartition(list, rank, size);
+  if (!FLAGS_sample_store) {
+    return common::DataReader<BuildingPlacerSample>(
+        paths, FLAGS_num_data_threads, FLAGS_batch_size, FLAGS_sample_path);
+  }
+
+  auto store = fmt::format(
+      "{}/{}.{}-of-{}.store",
+      fsutils::dirname(list),
+      fsutils::basename(list, ".list"),
+      rank,
+      size);
+  if (!fsutils::exists(store)) {
+    VLOG(0) << "Creating sample store " << store << " from " << paths.size()
+            << " samples";
+    auto n = common::writeSampleStore<BuildingPlacerSample>(
+        paths, store + ".tmp", FLAGS_sample_path);
+    fsutils::mv(store + ".tmp", store);
+    VLOG(0) << "Wrote " << n << " samples to " << store;
+  }
+  return common::makeSampleStoreDataReader<BuildingPlacerSample>(
+      {store}, FLAGS_num_data_threads, FLAGS_batch_size);
+}
+
 void validate(
     std::shared_ptr<BuildingPlacerModel> model,
     common::DataReader<BuildingPlacerSample>& validData) {
@@ -529,12 +563,7 @@ int main(int argc, char** argv) {
 
     for (auto const& list : lists) {
       VLOG_MASTER(0) << "Validating model on " << list;
-      auto dr = common::DataReader<BuildingPlacerSample>(
-          fsutils::readLinesPartition(
-              list, dist::globalContext()->rank, dist::globalContext()->size),
-          FLAGS_num_data_threads,
-          FLAGS_batch_size,
-          FLAGS_sample_path);
+      auto dr = makeSampleReader(list);
 
       validate(model, dr);
       synchronizePerf();
@@ -553,22 +582,8 @@ int main(int argc, char** argv) {
     dist::broadcast(model);
 
     // Normal training
-    auto trainDr = common::DataReader<BuildingPlacerSample>(
-        fsutils::readLinesPartition(
-            FLAGS_sample_path + "/train.list",
-            dist::globalContext()->rank,
-            dist::globalContext()->size),
-        FLAGS_num_data_threads,
-        FLAGS_batch_size,
-        FLAGS_sample_path);
-    auto validDr = common::DataReader<BuildingPlacerSample>(
-        fsutils::readLinesPartition(
-            FLAGS_sample_path + "/valid.list",
-            dist::globalContext()->rank,
-            dist::globalContext()->size),
-        FLAGS_num_data_threads,
-        FLAGS_batch_size,
-        FLAGS_sample_path);
+    auto trainDr = makeSampleReader(FLAGS_sample_path + "/train.list");
+    auto validDr = makeSampleReader(FLAGS_sample_path + "/valid.list");
     trainLoop(model, trainDr, validDr, vs);
   }
 
@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2017-present, Facebook, Inc.
+ *
+ * This source code is licensed under the MIT license found in the
+ * LICENSE file in the root directory of this source tree.
+ *
+ * Packs a list of sample files, as written by e.g. the building placer's
+ * collect-replay-samples, into shard files that can be read with
+ * common::makeShardDataReader().
+ */
+
+#include <common/datashard.h>
+#include <common/fsutils.h>
+
+#include <fmt/format.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include <fstream>
+
+DEFINE_string(
+    sample_list,
+    "train.list",
+    "List of sample files, relative to its directory unless absolute");
+DEFINE_string(
+    output,
+    "",
+    "Output prefix for shards. A list of shards will be written to "
+    "<output>.list, with paths relative to its directory. Defaults to the "
+    "sample list without extension.");
+DEFINE_uint64(records_per_shard, 4096, "Maximum number of records per shard");
+
+namespace fsutils = common::fsutils;
+
+int main(int argc, char** argv) {
+  google::InitGoogleLogging(argv[0]);
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  FLAGS_logtostderr = true;
+
+  auto output = FLAGS_output;
+  if (output.empty()) {
+    output = fsutils::dirname(FLAGS_sample_list) + "/" +
+        fsutils::basename(FLAGS_sample_list, ".list");
+  }
+  auto outputDir = fsutils::dirname(output);
+  fsutils::mkdir(outputDir);
+
+  auto files = fsutils::readLines(FLAGS_sample_list);
+  LOG(INFO) << "Packing " << files.size() << " files from "
+            << FLAGS_sample_list;
+  auto shards = common::packShards(
+      files,
+      output,
+      FLAGS_records_per_shard,
+      fsutils::dirname(FLAGS_sample_list));
+
+  std::ofstream list(output + ".list");
+  for (auto const& shard : shards) {
+    list << fsutils::basename(shard) << std::endl;
+  }
+  LOG(INFO) << fmt::format(
+      "Wrote {} shards, listed in {}.list", shards.size(), output);
+  return list ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,523 @@
+/*
+ * Copyright (c) 2017-present, Facebook, Inc.
+ *
+ * This source code is licensed under the MIT license found in the
+ * LICENSE file in the root directory of this source tree.
+ *
+ * Benchmarks for the communication primitives used in distributed training:
+ * c10d collectives (via distributed::Context), BlobPublisher/BlobSubscriber,
+ * ReqRepServer/ReqRepClient and ZeroMQBufferedProducer/Consumer.
+ *
+ * For each benchmark, process count and message size, the requested number of
+ * processes is forked on the local machine. They communicate via gloo or
+ * ZeroMQ over TCP and use a c10d FileStore for setup. Results are written as
+ * one JSON object per line, e.g.
+ *
+ *   {"bench":"allreduce","procs":4,"size":65536,"iters":100,"mean_us":...}
+ *
+ * Timings are taken on rank 0 for collectives and on all clients otherwise.
+ * For the ZeroMQ benchmarks, rank 0 acts as the server (publisher, producer)
+ * and all other ranks as clients; with a single process, both run in the same
+ * process. Results can be compared against a previous run with --baseline.
+ */
+
+#include <common/fsutils.h>
+#include <common/str.h>
+#include <cpid/blobpubsub.h>
+#include <cpid/distributed.h>
+#include <cpid/reqrepserver.h>
+#include <cpid/zmqbufferedconsumer.h>
+#include <cpid/zmqbufferedproducer.h>
+
+#include <c10d/FileStore.hpp>
+#include <fmt/format.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <nlohmann/json.hpp>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <numeric>
+
+DEFINE_string(
+    benchmarks,
+    "allreduce,broadcast,allgather,pubsub,reqrep,prodcons",
+    "Comma-separated list of benchmarks to run");
+DEFINE_string(sizes, "1024,65536,1048576,16777216", "Message sizes in bytes");
+DEFINE_string(procs, "2,4", "Comma-separated list of process counts");
+DEFINE_int32(iters, 100, "Timed iterations per configuration");
+DEFINE_int32(warmup, 5, "Untimed iterations per configuration");
+DEFINE_bool(compress, false, "Use zstd compression for prodcons");
+DEFINE_string(output, "", "Append results to this file instead of stdout");
+DEFINE_string(
+    baseline,
+    "",
+    "Results of a previous run; report configurations that got slower");
+DEFINE_double(
+    max_regression,
+    0.2,
+    "Relative increase in mean time that counts as a regression");
+
+using namespace cpid;
+namespace dist = cpid::distributed;
+namespace fsutils = common::fsutils;
+using nlohmann::json;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+using Blob = std::vector<char>;
+
+struct Env {
+  int rank;
+  int size;
+  size_t msgSize;
+  std::shared_ptr<dist::Store> store;
+
+  bool isServer() const {
+    return rank == 0;
+  }
+  bool isClient() const {
+    return rank > 0 || size == 1;
+  }
+  int numClients() const {
+    return std::max(size - 1, 1);
+  }
+};
+
+/// Runs on every process; returns the results on rank 0
+using BenchFn = std::function<json(Env&)>;
+
+double elapsedUs(Clock::time_point start) {
+  return std::chrono::duration<double, std::micro>(Clock::now() - start)
+      .count();
+}
+
+void setString(dist::Store& store, std::string const& key, std::string value) {
+  store.set(key, std::vector<uint8_t>(value.begin(), value.end()));
+}
+
+/// Blocks until the key has been set
+std::string getString(dist::Store& store, std::string const& key) {
+  auto value = store.get(key);
+  return std::string(value.begin(), value.end());
+}
+
+void storeBarrier(dist::Store& store, std::string const& key, int n) {
+  store.add(key, 1);
+  while (store.add(key, 0) < n) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+}
+
+/// Summarizes per-iteration timings in microseconds
+json summarize(std::vector<double> times, size_t bytesPerIter) {
+  if (times.empty()) {
+    return json();
+  }
+  std::sort(times.begin(), times.end());
+  auto pct = [&](double p) {
+    return times[std::min(size_t(p * times.size()), times.size() - 1)];
+  };
+  auto mean =
+      std::accumulate(times.begin(), times.end(), 0.0) / times.size();
+  return json{
+      {"iters", times.size()},
+      {"mean_us", mean},
+      {"p50_us", pct(0.5)},
+      {"p90_us", pct(0.9)},
+      {"p99_us", pct(0.99)},
+      {"max_us", times.back()},
+      {"mb_per_s", bytesPerIter / mean},
+  };
+}
+
+template <typename F>
+std::vector<double> timeIterations(F&& f) {
+  for (auto i = 0; i < FLAGS_warmup; i++) {
+    f();
+  }
+  std::vector<double> times;
+  times.reserve(FLAGS_iters);
+  for (auto i = 0; i < FLAGS_iters; i++) {
+    auto start = Clock::now();
+    f();
+    times.push_back(elapsedUs(start));
+  }
+  return times;
+}
+
+/// Collects the timings of all clients on rank 0
+std::vector<double> gatherTimes(Env& env, std::vector<double> const& times) {
+  if (env.isClient() && !env.isServer()) {
+    setString(
+        *env.store, fmt::format("times/{}", env.rank), json(times).dump());
+    return {};
+  }
+  if (env.size == 1) {
+    return times;
+  }
+  std::vector<double> all;
+  for (auto i = 1; i < env.size; i++) {
+    auto t = json::parse(getString(*env.store, fmt::format("times/{}", i)))
+                 .get<std::vector<double>>();
+    all.insert(all.end(), t.begin(), t.end());
+  }
+  return all;
+}
+
+std::shared_ptr<dist::Context> makeContext(Env& env) {
+  return std::make_shared<dist::Context>(env.store, env.rank, env.size);
+}
+
+json benchAllreduce(Env& env) {
+  auto ctx = makeContext(env);
+  auto t = torch::ones({int64_t(env.msgSize / sizeof(float))});
+  auto times = timeIterations([&] { ctx->allreduce(t).wait(); });
+  return env.rank == 0 ? summarize(times, env.msgSize) : json();
+}
+
+json benchBroadcast(Env& env) {
+  auto ctx = makeContext(env);
+  auto t = torch::ones({int64_t(env.msgSize / sizeof(float))});
+  auto times = timeIterations([&] { ctx->broadcast(t, 0).wait(); });
+  return env.rank == 0 ? summarize(times, env.msgSize) : json();
+}
+
+json benchAllgather(Env& env) {
+  auto ctx = makeContext(env);
+  auto n = int64_t(env.msgSize / sizeof(float));
+  auto in = torch::ones({n});
+  auto out = torch::empty({env.size, n});
+  auto times = timeIterations([&] { ctx->allgather(out, in).wait(); });
+  return env.rank == 0 ? summarize(times, env.msgSize * env.size) : json();
+}
+
+/**
+ * Measures the time from publishing a blob until all subscribers received it.
+ * Subscribers acknowledge blobs via a ReqRepServer on the publisher, so
+ * timings include one small request.
+ */
+json benchPubSub(Env& env) {
+  std::mutex ackM;
+  std::condition_variable ackCV;
+  std::map<int64_t, int> acks;
+  std::promise<void> done;
+  std::unique_ptr<BlobPublisher> publisher;
+  std::unique_ptr<ReqRepServer> ackServer;
+  if (env.isServer()) {
+    publisher = std::make_unique<BlobPublisher>();
+    ackServer = std::make_unique<ReqRepServer>(
+        [&](void const* buf, size_t len, ReqRepServer::ReplyFn reply) {
+          int64_t tag;
+          std::memcpy(&tag, buf, sizeof(tag));
+          {
+            std::lock_guard<std::mutex> lock(ackM);
+            acks[tag]++;
+          }
+          ackCV.notify_all();
+          reply("ok", 2);
+        });
+    setString(*env.store, "pubsub/endpoint", publisher->endpoint());
+    setString(*env.store, "pubsub/ack", ackServer->endpoint());
+  }
+
+  std::unique_ptr<ReqRepClient> ackClient;
+  std::unique_ptr<BlobSubscriber> subscriber;
+  if (env.isClient()) {
+    ackClient = std::make_unique<ReqRepClient>(
+        16,
+        std::vector<std::string>{getString(*env.store, "pubsub/ack")});
+    int64_t lastTag = -2;
+    subscriber = std::make_unique<BlobSubscriber>(
+        [&, lastTag](void const*, size_t, int64_t tag) mutable {
+          // Blobs may be re-broadcast to new subscribers
+          if (tag == lastTag) {
+            return;
+          }
+          lastTag = tag;
+          if (tag < 0) {
+            done.set_value();
+            return;
+          }
+          Blob msg(sizeof(tag));
+          std::memcpy(msg.data(), &tag, sizeof(tag));
+          ackClient->request(std::move(msg));
+        },
+        std::vector<std::string>{getString(*env.store, "pubsub/endpoint")});
+  }
+
+  std::vector<double> times;
+  if (env.isServer()) {
+    Blob data(env.msgSize);
+    int64_t tag = 0;
+    auto publish = [&] {
+      auto start = Clock::now();
+      publisher->publish(data.data(), data.size(), tag);
+      std::unique_lock<std::mutex> lock(ackM);
+      ackCV.wait(lock, [&] { return acks[tag] >= env.numClients(); });
+      tag++;
+      return elapsedUs(start);
+    };
+    // The first blob waits for all subscribers to connect
+    for (auto i = 0; i < FLAGS_warmup + 1; i++) {
+      publish();
+    }
+    for (auto i = 0; i < FLAGS_iters; i++) {
+      times.push_back(publish());
+    }
+    publisher->publish(nullptr, 0, -1);
+  }
+  if (env.isClient()) {
+    done.get_future().wait();
+  }
+  storeBarrier(*env.store, "pubsub/done", env.size);
+  return env.isServer() ? summarize(times, env.msgSize) : json();
+}
+
+/// Measures request latency with a single outstanding request per client
+json benchReqRep(Env& env) {
+  std::unique_ptr<ReqRepServer> server;
+  if (env.isServer()) {
+    server = std::make_unique<ReqRepServer>(
+        [](void const*, size_t, ReqRepServer::ReplyFn reply) {
+          reply("ok", 2);
+        },
+        env.numClients());
+    setString(*env.store, "reqrep/endpoint", server->endpoint());
+  }
+
+  std::vector<double> times;
+  if (env.isClient()) {
+    ReqRepClient client(
+        1, std::vector<std::string>{getString(*env.store, "reqrep/endpoint")});
+    Blob data(env.msgSize);
+    times = timeIterations([&] { client.request(data).get(); });
+  }
+  times = gatherTimes(env, times);
+  storeBarrier(*env.store, "reqrep/done", env.size);
+  return env.isServer() ? summarize(times, env.msgSize) : json();
+}
+
+/// Measures the rate at which a producer receives items from all consumers
+json benchProdCons(Env& env) {
+  auto constexpr kQueueSize = 256;
+  size_t total = size_t(env.numClients()) * (FLAGS_warmup + FLAGS_iters);
+  std::unique_ptr<ZeroMQBufferedProducer<Blob>> producer;
+  if (env.isServer()) {
+    producer = std::make_unique<ZeroMQBufferedProducer<Blob>>(1, kQueueSize);
+    setString(*env.store, "prodcons/endpoint", producer->endpoint());
+  }
+
+  std::unique_ptr<ZeroMQBufferedConsumer<Blob>> consumer;
+  std::thread sender;
+  if (env.isClient()) {
+    consumer = std::make_unique<ZeroMQBufferedConsumer<Blob>>(
+        1,
+        kQueueSize,
+        std::vector<std::string>{getString(*env.store, "prodcons/endpoint")});
+    if (!FLAGS_compress) {
+      consumer->setMinCompressSize(std::numeric_limits<size_t>::max());
+    }
+    sender = std::thread([&] {
+      for (auto i = 0; i < FLAGS_warmup + FLAGS_iters; i++) {
+        consumer->enqueue(Blob(env.msgSize));
+      }
+    });
+  }
+
+  json result;
+  if (env.isServer()) {
+    // Start timing once every client delivered its warmup items
+    size_t warmup = size_t(env.numClients()) * FLAGS_warmup;
+    Clock::time_point start;
+    for (size_t i = 0; i < total; i++) {
+      if (i == warmup) {
+        start = Clock::now();
+      }
+      if (!producer->get()) {
+        throw std::runtime_error("Producer stopped unexpectedly");
+      }
+    }
+    auto n = total - warmup;
+    auto meanUs = elapsedUs(start) / n;
+    result = json{
+        {"iters", n},
+        {"mean_us", meanUs},
+        {"items_per_s", 1e6 / meanUs},
+        {"mb_per_s", env.msgSize / meanUs},
+    };
+  }
+  if (sender.joinable()) {
+    sender.join();
+  }
+  storeBarrier(*env.store, "prodcons/done", env.size);
+  return result;
+}
+
+/// Forks the given number of processes and returns the result of rank 0
+json runConfig(BenchFn const& fn, int procs, size_t size) {
+  auto storePath = fsutils::mktemp("distributed_bench.store");
+  int fds[2];
+  if (::pipe(fds) != 0) {
+    throw std::system_error(errno, std::system_category());
+  }
+  std::vector<pid_t> pids;
+  for (auto rank = 0; rank < procs; rank++) {
+    auto pid = ::fork();
+    if (pid < 0) {
+      throw std::system_error(errno, std::system_category());
+    }
+    if (pid > 0) {
+      pids.push_back(pid);
+      continue;
+    }
+
+    ::close(fds[0]);
+    auto status = EXIT_SUCCESS;
+    try {
+      Env env{rank,
+              procs,
+              size,
+              std::make_shared<dist::FileStore>(storePath, procs)};
+      auto result = fn(env).dump();
+      if (rank == 0 && ::write(fds[1], result.data(), result.size()) < 0) {
+        status = EXIT_FAILURE;
+      }
+    } catch (std::exception const& e) {
+      LOG(ERROR) << "Rank " << rank << " failed: " << e.what();
+      status = EXIT_FAILURE;
+    }
+    // Skip static destructors, which may not be fork-safe
+    ::_exit(status);
+  }
+
+  ::close(fds[1]);
+  std::string output;
+  char buf[4096];
+  ssize_t n;
+  while ((n = ::read(fds[0], buf, sizeof(buf))) > 0) {
+    output.append(buf, n);
+  }
+  ::close(fds[0]);
+  bool ok = true;
+  for (auto pid : pids) {
+    int status;
+    ::waitpid(pid, &status, 0);
+    ok = ok && WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS;
+  }
+  fsutils::rmrf(storePath);
+  if (!ok || output.empty()) {
+    return json();
+  }
+  return json::parse(output);
+}
+
+std::string configKey(json const& result) {
+  return fmt::format(
+      "{}/{}/{}",
+      result["bench"].get<std::string>(),
+      result["procs"].get<int>(),
+      result["size"].get<size_t>());
+}
+
+std::map<std::string, json> readBaseline(std::string const& path) {
+  std::map<std::string, json> results;
+  for (auto const& line : fsutils::readLines(path)) {
+    if (line.empty()) {
+      continue;
+    }
+    auto result = json::parse(line);
+    results[configKey(result)] = result;
+  }
+  return results;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+  google::InitGoogleLogging(argv[0]);
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  FLAGS_logtostderr = true;
+
+  std::map<std::string, BenchFn> benchmarks = {
+      {"allreduce", benchAllreduce},
+      {"broadcast", benchBroadcast},
+      {"allgather", benchAllgather},
+      {"pubsub", benchPubSub},
+      {"reqrep", benchReqRep},
+      {"prodcons", benchProdCons},
+  };
+  std::vector<size_t> sizes;
+  for (auto const& s : common::stringSplit(FLAGS_sizes, ',')) {
+    sizes.push_back(std::stoull(s));
+  }
+  std::vector<int> procs;
+  for (auto const& s : common::stringSplit(FLAGS_procs, ',')) {
+    procs.push_back(std::stoi(s));
+  }
+  auto names = common::stringSplit(FLAGS_benchmarks, ',');
+  for (auto const& name : names) {
+    if (benchmarks.find(name) == benchmarks.end()) {
+      LOG(ERROR) << "Unknown benchmark: " << name;
+      return EXIT_FAILURE;
+    }
+  }
+  std::map<std::string, json> baseline;
+  if (!FLAGS_baseline.empty()) {
+    baseline = readBaseline(FLAGS_baseline);
+  }
+
+  std::ofstream ofs;
+  if (!FLAGS_output.empty()) {
+    ofs.open(FLAGS_output, std::ios::app);
+  }
+  std::ostream& out = FLAGS_output.empty() ? std::cout : ofs;
+
+  int numFailed = 0;
+  int numRegressions = 0;
+  for (auto const& name : names) {
+    for (auto p : procs) {
+      for (auto size : sizes) {
+        auto result = runConfig(benchmarks[name], p, size);
+        if (result.is_null()) {
+          LOG(ERROR) << fmt::format(
+              "{} failed for {} procs, {} bytes", name, p, size);
+          numFailed++;
+          continue;
+        }
+        result["bench"] = name;
+        result["procs"] = p;
+        result["size"] = size;
+        out << result.dump() << std::endl;
+
+        auto it = baseline.find(configKey(result));
+        if (it == baseline.end()) {
+          continue;
+        }
+        auto before = it->second["mean_us"].get<double>();
+        auto after = result["mean_us"].get<double>();
+        if (after > before * (1 + FLAGS_max_regression)) {
+          LOG(WARNING) << fmt::format(
+              "Regression in {}: {:.1f}us -> {:.1f}us",
+              configKey(result),
+              before,
+              after);
+          numRegressions++;
+        }
+      }
+    }
+  }
+
+  if (numRegressions > 0) {
+    LOG(WARNING) << numRegressions << " regressions compared to "
+                 << FLAGS_baseline;
+  }
+  return numFailed + numRegressions > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -20,6 +20,7 @@
 #include <glog/logging.h>
 
 #include "modules/cherryvisdumper.h"
+#include "threadpool.h"
 
 namespace cherrypi {
 
@@ -114,14 +115,189 @@ void BasePlayer::setDraw(bool draw) {
   draw_ = draw;
 }
 
+void BasePlayer::setStepBudget(Duration budget) {
+  stepBudget_ = budget;
+}
+
+void BasePlayer::setParallelModules(bool parallel) {
+  parallelModules_ = parallel;
+}
+
 void BasePlayer::stepModules() {
-  // Call step on all modules
+  if (!parallelModules_ && !collectTimers_) {
+    // Call step on all modules
+    for (auto& module : modules_) {
+      stepModule(module);
+    }
+    steps_++;
+    return;
+  }
+
+  std::vector<std::optional<ModuleDependencies>> deps;
+  deps.reserve(modules_.size());
   for (auto& module : modules_) {
-    stepModule(module);
+    deps.push_back(module->dependencies(state_));
+  }
+
+  std::vector<Duration> durations(modules_.size());
+  if (parallelModules_) {
+    stepModulesConcurrently(deps, durations);
+  } else {
+    for (size_t i = 0; i < modules_.size(); i++) {
+      stepModule(modules_[i]);
+      durations[i] = moduleTimeSpent_[modules_[i]];
+    }
+  }
+  if (collectTimers_) {
+    updateCriticalPath(deps, durations);
   }
   steps_++;
 }
 
+void BasePlayer::stepModulesConcurrently(
+    std::vector<std::optional<ModuleDependencies>> const& deps,
+    std::vector<Duration>& durations) {
+  auto conflicting = [&](size_t i, size_t j) {
+    return !deps[i] || !deps[j] || deps[i]->conflictsWith(*deps[j]);
+  };
+
+  // Every module is stepped as soon as all previous modules it conflicts with
+  // are done, i.e. modules are scheduled along the dependency DAG. Modules
+  // without declared dependencies conflict with all others and are stepped
+  // on the calling thread.
+  size_t const n = modules_.size();
+  std::vector<std::vector<size_t>> preds(n);
+  size_t numDeclared = 0;
+  for (size_t i = 0; i < n; i++) {
+    for (size_t j = 0; j < i; j++) {
+      if (conflicting(j, i)) {
+        preds[i].push_back(j);
+      }
+    }
+    numDeclared += deps[i] ? 1 : 0;
+  }
+  if (numDeclared > modulePoolSize_) {
+    // Every module needs its own thread since modules may block until the
+    // modules they depend on, or all previous modules, are done.
+    modulePool_ = std::make_unique<ThreadPool>(numDeclared);
+    modulePoolSize_ = numDeclared;
+  }
+
+  auto board = state_->board();
+  auto timedStep = [&](size_t i) {
+    std::chrono::time_point<hires_clock> start;
+    if (collectTimers_) {
+      start = hires_clock::now();
+    }
+    modules_[i]->step(state_);
+    if (collectTimers_) {
+      durations[i] = hires_clock::now() - start;
+    }
+  };
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  size_t firstUnfinished = 0;
+  std::vector<char> finished(n, 0);
+  auto finish = [&](size_t i) {
+    std::lock_guard<std::mutex> lock(mutex);
+    finished[i] = 1;
+    while (firstUnfinished < n && finished[firstUnfinished]) {
+      firstUnfinished++;
+    }
+    cv.notify_all();
+  };
+  auto waitFor = [&](size_t i) {
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [&] {
+      for (auto j : preds[i]) {
+        if (!finished[j]) {
+          return false;
+        }
+      }
+      return true;
+    });
+  };
+
+  board->setConcurrent(true);
+  std::exception_ptr error;
+  std::vector<std::future<void>> futures;
+  for (size_t i = 0; i < n; i++) {
+    if (!deps[i]) {
+      waitFor(i);
+      try {
+        timedStep(i);
+      } catch (...) {
+        if (!error) {
+          error = std::current_exception();
+        }
+      }
+      finish(i);
+      continue;
+    }
+
+    futures.push_back(modulePool_->enqueue([&, i] {
+      waitFor(i);
+      // A module may mutate the Blackboard once all previous modules are
+      // done, so that UPC IDs and commands are in module order
+      Blackboard::setWriteHook([&, i]() {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&] { return firstUnfinished >= i; });
+      });
+      try {
+        timedStep(i);
+      } catch (...) {
+        Blackboard::setWriteHook(nullptr);
+        finish(i);
+        throw;
+      }
+      Blackboard::setWriteHook(nullptr);
+      finish(i);
+    }));
+  }
+  for (auto& future : futures) {
+    try {
+      future.get();
+    } catch (...) {
+      if (!error) {
+        error = std::current_exception();
+      }
+    }
+  }
+  board->setConcurrent(false);
+  if (error) {
+    std::rethrow_exception(error);
+  }
+
+  if (collectTimers_) {
+    for (size_t i = 0; i < modules_.size(); i++) {
+      moduleTimeSpent_[modules_[i]] = durations[i];
+      moduleTimeSpentAgg_[modules_[i]] += durations[i];
+    }
+  }
+}
+
+void BasePlayer::updateCriticalPath(
+    std::vector<std::optional<ModuleDependencies>> const& deps,
+    std::vector<Duration> const& durations) {
+  // Earliest finishing time of every module if all modules were stepped as
+  // soon as the modules they depend on are done
+  std::vector<Duration> finishTimes(modules_.size());
+  Duration criticalPath = Duration::zero();
+  for (size_t i = 0; i < modules_.size(); i++) {
+    Duration start = Duration::zero();
+    for (size_t j = 0; j < i; j++) {
+      if (!deps[i] || !deps[j] || deps[i]->conflictsWith(*deps[j])) {
+        start = std::max(start, finishTimes[j]);
+      }
+    }
+    finishTimes[i] = start + durations[i];
+    criticalPath = std::max(criticalPath, finishTimes[i]);
+  }
+  moduleCriticalPathTime_ = criticalPath;
+  moduleCriticalPathTimeAgg_ += criticalPath;
+}
+
 void BasePlayer::stepModule(std::shared_ptr<Module> module) {
   std::chrono::time_point<hires_clock> start;
   if (collectTimers_) {
@@ -151,6 +327,9 @@ void BasePlayer::step() {
   common::setLoggingFrame(client_->state()->frame_from_bwapi);
 
   auto start = hires_clock::now();
+  state_->setStepDeadline(
+      stepBudget_ > Duration::zero() ? start + stepBudget_
+                                     : hires_clock::time_point::max());
   auto commands = doStep();
   if (state_->gameEnded()) {
     return;
@@ -220,6 +399,11 @@ void BasePlayer::step() {
           moduleTimeSpent_[module]);
       LOG(WARNING) << "  " << module->name() << ": " << ms.count() << "ms";
     }
+    if (collectTimers_) {
+      ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+          moduleCriticalPathTime_);
+      LOG(WARNING) << "  Module critical path: " << ms.count() << "ms";
+    }
     for (auto& stat : taskTimeStats) {
       LOG(WARNING) << "      Task: " << std::get<0>(stat) << " from "
                    << std::get<1>(stat) << ": " << std::get<2>(stat).count()
@@ -247,9 +431,13 @@ void BasePlayer::step() {
           moduleTimeSpentAgg_[module]);
       VLOG(1) << "  " << module->name() << ": " << ms.count() << "ms";
     }
+    ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+        moduleCriticalPathTimeAgg_);
+    VLOG(1) << "  Module critical path: " << ms.count() << "ms";
 
     moduleTimeSpentAgg_.clear();
     stateUpdateTimeSpentAgg_ = Duration();
+    moduleCriticalPathTimeAgg_ = Duration();
   }
 
   lastStep_ = hires_clock::now();
@@ -9,6 +9,7 @@
 
 #include <condition_variable>
 #include <mutex>
+#include <optional>
 #include <thread>
 #include <vector>
 
@@ -16,6 +17,8 @@
 #include "module.h"
 #include "state.h"
 
+class ThreadPool;
+
 namespace cherrypi {
 
 /**
@@ -76,6 +79,30 @@ class BasePlayer {
   /// Defaults to true.
   void setDraw(bool draw);
 
+  /// Set whether to step modules with declared dependencies concurrently.
+  /// Modules are stepped on a thread pool as soon as the previous modules they
+  /// depend on (see Module::dependencies()) are done. Their Blackboard
+  /// mutations are applied in module order, so UPCs and commands are posted in
+  /// the same order as when stepping serially. Note that modules exchanging
+  /// UPCs or units (most of the default pipeline) depend on each other; only
+  /// modules with disjoint dependencies will actually overlap.
+  /// Defaults to false.
+  void setParallelModules(bool parallel);
+
+  /// Set the time budget for a single step.
+  /// Modules can query the remaining budget via State::remainingStepBudget()
+  /// and defer expensive work to later steps once it is exhausted. A zero
+  /// budget disables this.
+  /// Defaults to zero.
+  void setStepBudget(Duration budget);
+
+  /// Duration of the longest chain of dependent module steps in the last
+  /// step, i.e. the lower bound for stepping modules concurrently.
+  /// Only available if timers are collected.
+  Duration moduleCriticalPathTime() const {
+    return moduleCriticalPathTime_;
+  }
+
   virtual void stepModule(std::shared_ptr<Module> module);
   void stepModules();
   void step();
@@ -97,6 +124,12 @@ class BasePlayer {
   virtual void preStep();
   virtual void postStep();
   void logFailedCommands();
+  void stepModulesConcurrently(
+      std::vector<std::optional<ModuleDependencies>> const& deps,
+      std::vector<Duration>& durations);
+  void updateCriticalPath(
+      std::vector<std::optional<ModuleDependencies>> const& deps,
+      std::vector<Duration> const& durations);
 
   std::shared_ptr<tc::Client> client_;
   int frameskip_ = 1;
@@ -106,6 +139,8 @@ class BasePlayer {
   bool checkConsistency_ = false;
   bool collectTimers_ = false;
   bool logFailedCommands_ = false;
+  bool parallelModules_ = false;
+  Duration stepBudget_ = Duration::zero();
   int lastFrameStepped_ = 0;
   int framesDropped_ = 0;
   float realtimeFactor_ = -1.0f;
@@ -116,6 +151,10 @@ class BasePlayer {
   std::unordered_map<std::shared_ptr<Module>, Duration> moduleTimeSpentAgg_;
   Duration stateUpdateTimeSpent_;
   Duration stateUpdateTimeSpentAgg_;
+  Duration moduleCriticalPathTime_;
+  Duration moduleCriticalPathTimeAgg_;
+  std::unique_ptr<ThreadPool> modulePool_;
+  size_t modulePoolSize_ = 0;
   size_t steps_ = 0;
   bool initialized_ = false;
   bool firstStepDone_ = false;
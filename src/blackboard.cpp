@@ -13,6 +13,7 @@
 
 #include <glog/logging.h>
 
+#include <algorithm>
 #include <chrono>
 #include <iomanip>
 #include <sstream>
@@ -24,21 +25,25 @@ namespace cherrypi {
 
 namespace {
 
-template <typename UnaryPredicate>
-Blackboard::UPCMap selectUpcs(
-    std::map<int, UPCData> const& upcs,
-    UnaryPredicate pred) {
-  Blackboard::UPCMap result;
-  auto it = upcs.begin();
-  while (true) {
-    it = std::find_if(it, upcs.end(), pred);
-    if (it == upcs.end()) {
-      break;
+/// Position of a single command in Blackboard::upcsByCommand_, or
+/// numUpcCommands() for anything else
+int commandIndex(Command cmd) {
+  for (int i = 0; i < numUpcCommands(); i++) {
+    if (cmd == Command(uint64_t(1) << i)) {
+      return i;
     }
-    result.emplace(it->first, it->second.upc);
-    ++it;
   }
-  return result;
+  return numUpcCommands();
+}
+
+void eraseFromIndex(UPCView::Index& index, UpcId id) {
+  auto it = std::lower_bound(
+      index.begin(), index.end(), id, [](UPCView::Entry const* e, UpcId id) {
+        return e->first < id;
+      });
+  if (it != index.end() && (*it)->first == id) {
+    index.erase(it);
+  }
 }
 
 } // namespace
@@ -60,6 +65,9 @@ char const* Blackboard::kGathererMinGasWorkers = "gatherer_min_gas_workers";
 char const* Blackboard::kGathererMaxGasWorkers = "gatherer_max_gas_workers";
 char const* Blackboard::kBanditRootKey = "bandit_root";
 
+thread_local std::function<void()> Blackboard::writeHook_;
+thread_local int Blackboard::lockDepth_ = 0;
+
 Blackboard::Blackboard(State* state)
     : state_(state),
       commands_(16),
@@ -72,12 +80,15 @@ Blackboard::~Blackboard() {}
 void Blackboard::init() {}
 
 bool Blackboard::isTracked(UnitId uid) const {
+  auto lock = lockForRead();
   return tracked_.find(uid) != tracked_.end();
 }
 void Blackboard::track(UnitId uid) {
+  auto lock = lockForWrite();
   tracked_.insert(uid);
 }
 void Blackboard::untrack(UnitId uid) {
+  auto lock = lockForWrite();
   tracked_.erase(uid);
 }
 
@@ -85,11 +96,16 @@ void Blackboard::setCollectTimers(bool collect) {
   collectTimers_ = collect;
 }
 
+void Blackboard::setWriteHook(std::function<void()> hook) {
+  writeHook_ = std::move(hook);
+}
+
 UpcId Blackboard::postUPC(
     std::shared_ptr<UPCTuple>&& upc,
     UpcId sourceId,
     Module* origin,
     std::shared_ptr<UpcPostData> data) {
+  auto lock = lockForWrite();
   for (auto filter : upcFilters_) {
     bool valid = filter->filter(state_, upc, origin);
     if (!valid) {
@@ -107,52 +123,127 @@ UpcId Blackboard::postUPC(
   auto id = upcStorage_->addUpc(
       state_->currentFrame(), sourceId, origin, upc, std::move(data));
   activeUpcs_[id] = upc;
-  upcs_[id] = UPCData(upc, sourceId, origin);
+  auto it = upcs_.emplace(id, UPCData(upc, sourceId, origin)).first;
+  indexUpc(*it);
   VLOG(1) << "<- " << utils::upcString(upc, id) << " from " << origin->name()
           << " with source " << utils::upcString(sourceId);
   return id;
 }
 
 void Blackboard::consumeUPCs(std::vector<UpcId> const& ids, Module* consumer) {
+  auto lock = lockForWrite();
   for (auto id : ids) {
-    VLOG(1) << "-> " << utils::upcString(upcs_[id].upc, id) << " to "
-            << consumer->name();
-    upcs_.erase(id);
+    auto it = upcs_.find(id);
+    VLOG(1) << "-> "
+            << utils::upcString(
+                   it != upcs_.end() ? it->second.upc : nullptr, id)
+            << " to " << consumer->name();
+    if (it != upcs_.end()) {
+      unindexUpc(*it);
+      upcs_.erase(it);
+    }
   }
 }
 
 void Blackboard::removeUPCs(std::vector<int> const& ids) {
+  auto lock = lockForWrite();
   for (auto id : ids) {
-    if (upcs_.erase(id) > 0) {
+    auto it = upcs_.find(id);
+    if (it != upcs_.end()) {
+      unindexUpc(*it);
+      upcs_.erase(it);
       VLOG(1) << "-> upc " << id << " removed ";
     }
   }
 }
 
+void Blackboard::indexUpc(UPCView::Entry const& entry) {
+  // UPC IDs are increasing, so appending keeps the indexes sorted
+  upcIndex_.push_back(&entry);
+  upcsByOrigin_[entry.second.origin].push_back(&entry);
+  for (auto const& it : entry.second.upc->command) {
+    auto i = commandIndex(it.first);
+    if (it.second > 0 && i < numUpcCommands()) {
+      upcsByCommand_[i].push_back(&entry);
+    }
+  }
+}
+
+void Blackboard::unindexUpc(UPCView::Entry const& entry) {
+  auto id = entry.first;
+  eraseFromIndex(upcIndex_, id);
+  auto oit = upcsByOrigin_.find(entry.second.origin);
+  if (oit != upcsByOrigin_.end()) {
+    eraseFromIndex(oit->second, id);
+    if (oit->second.empty()) {
+      upcsByOrigin_.erase(oit);
+    }
+  }
+  // Don't rely on the command distribution being unchanged since posting
+  for (auto& index : upcsByCommand_) {
+    eraseFromIndex(index, id);
+  }
+}
+
+Blackboard::UPCMap Blackboard::toUPCMap(UPCView const& view) const {
+  UPCMap result;
+  for (auto const& entry : view) {
+    result.emplace_hint(result.end(), entry.first, entry.second.upc);
+  }
+  return result;
+}
+
 Blackboard::UPCMap Blackboard::upcs() const {
-  return selectUpcs(upcs_, [](std::pair<int, UPCData> const&) { return true; });
+  auto lock = lockForRead();
+  return toUPCMap(upcsView());
 }
 
 Blackboard::UPCMap Blackboard::upcsFrom(Module* origin) const {
-  return selectUpcs(upcs_, [origin](std::pair<int, UPCData> const& d) {
-    return d.second.origin == origin;
-  });
+  auto lock = lockForRead();
+  return toUPCMap(upcsFromView(origin));
 }
 
 Blackboard::UPCMap Blackboard::upcsWithSharpCommand(Command cmd) const {
-  return selectUpcs(upcs_, [cmd](std::pair<int, UPCData> const& d) {
-    return d.second.upc->commandProb(cmd) == 1.0f;
-  });
+  auto lock = lockForRead();
+  return toUPCMap(upcsWithSharpCommandView(cmd));
 }
 
 Blackboard::UPCMap Blackboard::upcsWithCommand(Command cmd, float minProb)
     const {
-  return selectUpcs(upcs_, [cmd, minProb](std::pair<int, UPCData> const& d) {
-    return d.second.upc->commandProb(cmd) >= minProb;
-  });
+  auto lock = lockForRead();
+  return toUPCMap(upcsWithCommandView(cmd, minProb));
+}
+
+UPCView Blackboard::upcsFromView(Module* origin) const {
+  static UPCView::Index const empty;
+  auto it = upcsByOrigin_.find(origin);
+  return UPCView(it != upcsByOrigin_.end() ? &it->second : &empty);
+}
+
+UPCView Blackboard::upcsWithSharpCommandView(Command cmd) const {
+  UPCView::Filter filter;
+  filter.enabled = true;
+  filter.command = cmd;
+  filter.sharp = true;
+  auto i = commandIndex(cmd);
+  return UPCView(
+      i < numUpcCommands() ? &upcsByCommand_[i] : &upcIndex_, filter);
+}
+
+UPCView Blackboard::upcsWithCommandView(Command cmd, float minProb) const {
+  UPCView::Filter filter;
+  filter.enabled = true;
+  filter.command = cmd;
+  filter.minProb = minProb;
+  // UPCs with zero probability for cmd are not in the command index
+  auto i = commandIndex(cmd);
+  return UPCView(
+      i < numUpcCommands() && minProb > 0 ? &upcsByCommand_[i] : &upcIndex_,
+      filter);
 }
 
 std::shared_ptr<UPCTuple> Blackboard::upcWithId(UpcId id) const {
+  auto lock = lockForRead();
   auto it = upcs_.find(id);
   if (it == upcs_.end()) {
     return nullptr;
@@ -165,10 +256,12 @@ UpcStorage* Blackboard::upcStorage() const {
 }
 
 void Blackboard::addUPCFilter(std::shared_ptr<UPCFilter> filter) {
+  auto lock = lockForWrite();
   upcFilters_.push_back(filter);
 }
 
 void Blackboard::removeUPCFilter(std::shared_ptr<UPCFilter> filter) {
+  auto lock = lockForWrite();
   upcFilters_.remove(filter);
 }
 
@@ -176,6 +269,7 @@ void Blackboard::postTask(
     std::shared_ptr<Task> task,
     Module* owner,
     bool autoRemove) {
+  auto lock = lockForWrite();
   if (tasksById_.find(task->upcId()) != tasksById_.end()) {
     throw std::runtime_error(
         "Existing task found for " + utils::upcString(task->upcId()));
@@ -190,6 +284,7 @@ void Blackboard::postTask(
 }
 
 std::shared_ptr<Task> Blackboard::taskForId(int id) const {
+  auto lock = lockForRead();
   auto it = tasksById_.find(id);
   if (it == tasksById_.end()) {
     return nullptr;
@@ -199,6 +294,7 @@ std::shared_ptr<Task> Blackboard::taskForId(int id) const {
 
 std::vector<std::shared_ptr<Task>> Blackboard::tasksOfModule(
     Module* module) const {
+  auto lock = lockForRead();
   std::vector<std::shared_ptr<Task>> result;
   auto range = tasksByModule_.equal_range(module);
   for (auto it = range.first; it != range.second; ++it) {
@@ -208,6 +304,7 @@ std::vector<std::shared_ptr<Task>> Blackboard::tasksOfModule(
 }
 
 std::shared_ptr<Task> Blackboard::taskWithUnit(Unit* unit) const {
+  auto lock = lockForRead();
   auto it = tasksByUnit_.find(unit);
   if (it == tasksByUnit_.end()) {
     return nullptr;
@@ -216,6 +313,7 @@ std::shared_ptr<Task> Blackboard::taskWithUnit(Unit* unit) const {
 }
 
 TaskData Blackboard::taskDataWithUnit(Unit* unit) const {
+  auto lock = lockForRead();
   auto it = tasksByUnit_.find(unit);
   if (it == tasksByUnit_.end()) {
     return TaskData();
@@ -226,6 +324,7 @@ TaskData Blackboard::taskDataWithUnit(Unit* unit) const {
 std::shared_ptr<Task> Blackboard::taskWithUnitOfModule(
     Unit* unit,
     Module* module) const {
+  auto lock = lockForRead();
   auto it = tasksByUnit_.find(unit);
   if (it == tasksByUnit_.end()) {
     return nullptr;
@@ -237,11 +336,13 @@ std::shared_ptr<Task> Blackboard::taskWithUnitOfModule(
 }
 
 void Blackboard::markTaskForRemoval(int upcId) {
+  auto lock = lockForWrite();
   // Mark for removal, but keep it around until the next update
   tasksToBeRemoved_.push_back(upcId);
 }
 
 TaskStatus Blackboard::lastStatusOfTask(UpcId id) const {
+  auto lock = lockForRead();
   auto it = lastTaskStatus_.find(id);
   if (it == lastTaskStatus_.end()) {
     return TaskStatus::Unknown;
@@ -250,6 +351,7 @@ TaskStatus Blackboard::lastStatusOfTask(UpcId id) const {
 }
 
 void Blackboard::updateUnitAccessCounts(tc::Client::Command const& command) {
+  auto lock = lockForWrite();
   // Make sure we got a command to a unit and the unit exists
   if (command.code == tc::BW::Command::CommandUnit && command.args.size() > 0) {
     const int unitId = command.args[0];
@@ -266,6 +368,7 @@ void Blackboard::updateUnitAccessCounts(tc::Client::Command const& command) {
 void Blackboard::postCommand(
     tc::Client::Command const& command,
     UpcId sourceId) {
+  auto lock = lockForWrite();
   updateUnitAccessCounts(command);
   commands_.at(0).push_back({command, sourceId});
 
@@ -293,7 +396,7 @@ void Blackboard::postCommand(
         break;
       }
 
-      for (auto& cit : it->second->command) {
+      for (auto const& cit : it->second->command) {
         if (cit.second >= Unit::kLastUpcCommandThreshold) {
           unit->lastUpcCommands |= cit.first;
 
@@ -317,6 +420,7 @@ void Blackboard::postCommand(
 }
 
 std::vector<tc::Client::Command> Blackboard::commands(int stepsBack) const {
+  auto lock = lockForRead();
   std::vector<tc::Client::Command> comms;
   for (auto& cpost :
        commands_.at(-std::min(stepsBack, int(commands_.size()) - 1))) {
@@ -326,6 +430,7 @@ std::vector<tc::Client::Command> Blackboard::commands(int stepsBack) const {
 }
 
 void Blackboard::updateTasksByUnit(Task* task) {
+  auto lock = lockForWrite();
   auto it = std::find_if(tasks_.begin(), tasks_.end(), [&](auto& v) {
     return v.task.get() == task;
   });
@@ -15,10 +15,15 @@
 #include "upc.h"
 #include "upcfilter.h"
 
+#include <array>
 #include <chrono>
+#include <deque>
+#include <functional>
+#include <iterator>
 #include <list>
 #include <map>
 #include <memory>
+#include <mutex>
 
 #include <gflags/gflags.h>
 #include <glog/logging.h>
@@ -64,6 +69,104 @@ struct TaskData {
         creationFrame(creationFrame) {}
 };
 
+/**
+ * A non-owning range of non-consumed UPCs, ordered by ID.
+ *
+ * Views are obtained via Blackboard::upcsView() and friends and refer to the
+ * Blackboard's internal indexes, so no UPCs are copied. A view is invalidated
+ * by any subsequent post, consumption or removal of UPCs; if you need to
+ * consume UPCs while iterating, use the copying functions like
+ * Blackboard::upcs() instead.
+ */
+class UPCView {
+ public:
+  using Entry = std::pair<UpcId const, UPCData>;
+  using Index = std::vector<Entry const*>;
+
+  /// Optional filter on command probabilities
+  struct Filter {
+    bool enabled = false;
+    Command command = Command::None;
+    float minProb = 0.0f;
+    bool sharp = false;
+
+    bool matches(Entry const& entry) const {
+      if (!enabled) {
+        return true;
+      }
+      auto prob = entry.second.upc->commandProb(command);
+      return sharp ? prob == 1.0f : prob >= minProb;
+    }
+  };
+
+  class iterator {
+   public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = Entry;
+    using difference_type = std::ptrdiff_t;
+    using pointer = Entry const*;
+    using reference = Entry const&;
+
+    iterator(
+        Index::const_iterator it,
+        Index::const_iterator end,
+        Filter const* filter)
+        : it_(it), end_(end), filter_(filter) {
+      skip();
+    }
+    reference operator*() const {
+      return **it_;
+    }
+    pointer operator->() const {
+      return *it_;
+    }
+    iterator& operator++() {
+      ++it_;
+      skip();
+      return *this;
+    }
+    bool operator==(iterator const& other) const {
+      return it_ == other.it_;
+    }
+    bool operator!=(iterator const& other) const {
+      return it_ != other.it_;
+    }
+
+   private:
+    void skip() {
+      while (it_ != end_ && !filter_->matches(**it_)) {
+        ++it_;
+      }
+    }
+
+    Index::const_iterator it_;
+    Index::const_iterator end_;
+    Filter const* filter_;
+  };
+
+  UPCView(Index const* index, Filter filter = Filter())
+      : index_(index), filter_(filter) {}
+
+  iterator begin() const {
+    return iterator(index_->begin(), index_->end(), &filter_);
+  }
+  iterator end() const {
+    return iterator(index_->end(), index_->end(), &filter_);
+  }
+  bool empty() const {
+    return begin() == end();
+  }
+  /// Number of UPCs in this view. This is linear in the size of the underlying
+  /// index if a filter is used.
+  size_t size() const {
+    return filter_.enabled ? std::distance(begin(), end()) : index_->size();
+  }
+
+ private:
+  Index const* index_;
+  Filter filter_;
+};
+
 /**
  * Game command are posted with an associated UPC ID.
  */
@@ -84,6 +187,10 @@ struct CommandPost {
  * The blackboard itself will only store active UPCTuple objects, i.e. UPCs
  * that have not been consumed and UPCs (as well as their sources) for which
  * there are active tasks.
+ *
+ * If modules are stepped concurrently (see setConcurrent()), all accesses are
+ * serialized and mutations are preceded by a call to the calling thread's
+ * write hook, which BasePlayer uses to apply them in module order.
  */
 class Blackboard {
  public:
@@ -131,33 +238,58 @@ class Blackboard {
   void update();
 
   void post(std::string const& key, Data const& data) {
+    auto lock = lockForWrite();
     map_[key] = data;
   }
   bool hasKey(std::string const& key) {
+    auto lock = lockForRead();
     return map_.find(key) != map_.end();
   }
+  /// If modules are stepped concurrently, values are copied so that the
+  /// result remains valid if another module overwrites the entry. These copies
+  /// are kept until concurrent stepping ends.
   Data const& get(std::string const& key) const {
-    return map_.at(key);
+    if (!concurrent_) {
+      return map_.at(key);
+    }
+    auto lock = lockForRead();
+    return snapshot(map_.at(key));
   }
   template <typename T>
   T const& get(std::string const& key) const {
-    return map_.at(key).get<T>();
+    return get(key).get<T>();
   }
   template <typename T>
   T const& get(std::string const& key, T const& defaultValue) const {
+    auto lock = lockForRead();
     auto it = map_.find(key);
     if (it == map_.end()) {
       return defaultValue;
     }
-    return it->second.get<T>();
+    return (concurrent_ ? snapshot(it->second) : it->second).get<T>();
   }
   void remove(std::string const& key) {
+    auto lock = lockForWrite();
     map_.erase(key);
   }
+  /// Calls f_do(key, value) for every entry. If modules are stepped
+  /// concurrently, f_do operates on a snapshot and is called without holding
+  /// the lock, so it may mutate the Blackboard.
   template <typename T>
   void iterValues(T f_do) const {
-    for (auto it = map_.begin(); it != map_.end(); ++it) {
-      f_do(it->first, it->second);
+    if (!concurrent_) {
+      for (auto it = map_.begin(); it != map_.end(); ++it) {
+        f_do(it->first, it->second);
+      }
+      return;
+    }
+    std::vector<std::pair<std::string, Data>> values;
+    {
+      auto lock = lockForRead();
+      values.assign(map_.begin(), map_.end());
+    }
+    for (auto const& kv : values) {
+      f_do(kv.first, kv.second);
     }
   }
 
@@ -205,6 +337,25 @@ class Blackboard {
   UPCMap upcsWithCommand(Command cmd, float minProb) const;
   /// Returns the non-consumed UPC with the given ID
   std::shared_ptr<UPCTuple> upcWithId(UpcId id) const;
+
+  // Non-copying variants of the UPC queries above. See UPCView regarding the
+  // lifetime of the returned views. UPCs are indexed by their command
+  // distribution when they are posted.
+  // If modules are stepped concurrently, views may only be used by modules
+  // that declare reading ModuleDependencies::kAllUpcs (or declare no
+  // dependencies at all), as the underlying indexes are not locked while
+  // iterating.
+
+  /// All non-consumed UPCs
+  UPCView upcsView() const {
+    return UPCView(&upcIndex_);
+  }
+  /// Non-consumed UPCs from a given module
+  UPCView upcsFromView(Module* origin) const;
+  /// Non-consumed UPCs with a Dirac command distribution on cmd
+  UPCView upcsWithSharpCommandView(Command cmd) const;
+  /// Non-consumed UPCs where cmd has at least a probability of minProb
+  UPCView upcsWithCommandView(Command cmd, float minProb) const;
   UpcStorage* upcStorage() const;
 
   // UPC filters
@@ -233,6 +384,7 @@ class Blackboard {
   void postCommand(tc::Client::Command const& command, UpcId sourceId);
   std::vector<tc::Client::Command> commands(int stepsBack = 0) const;
   size_t pastCommandsAvailable() const {
+    auto lock = lockForRead();
     return commands_.size();
   }
 
@@ -245,11 +397,25 @@ class Blackboard {
   void checkPostStep();
 
   std::vector<TaskTimeStats> getTaskTimeStats() const {
+    auto lock = lockForRead();
     return taskTimeStats_;
   }
 
   void setCollectTimers(bool collect);
 
+  /// Serialize accesses from multiple threads.
+  /// Only toggle this while no module is being stepped.
+  void setConcurrent(bool concurrent) {
+    concurrent_ = concurrent;
+    if (!concurrent) {
+      snapshots_.clear();
+    }
+  }
+  /// Set a function that will be called before the first mutating access
+  /// from the calling thread. The hook is called once, before any lock is
+  /// taken, and removed afterwards. Pass nullptr to remove it early.
+  static void setWriteHook(std::function<void()> hook);
+
   void setTraceDumper(std::shared_ptr<CherryVisDumperModule> tracer) {
     traceDumper_ = tracer;
   }
@@ -259,10 +425,72 @@ class Blackboard {
   }
 
  private:
+  /// Lock on mutex_ that keeps track of the number of locks held by the
+  /// calling thread
+  class Lock {
+   public:
+    explicit Lock(std::recursive_mutex* mutex) : mutex_(mutex) {
+      if (mutex_) {
+        mutex_->lock();
+        lockDepth_++;
+      }
+    }
+    Lock(Lock&& other) : mutex_(other.mutex_) {
+      other.mutex_ = nullptr;
+    }
+    Lock(Lock const&) = delete;
+    Lock& operator=(Lock const&) = delete;
+    ~Lock() {
+      if (mutex_) {
+        lockDepth_--;
+        mutex_->unlock();
+      }
+    }
+
+   private:
+    std::recursive_mutex* mutex_;
+  };
+
+  Lock lockForRead() const {
+    return Lock(concurrent_ ? &mutex_ : nullptr);
+  }
+  Lock lockForWrite() {
+    if (concurrent_ && writeHook_) {
+      // The hook may block until other modules are done, which could in turn
+      // be waiting for the lock
+      if (lockDepth_ > 0) {
+        throw std::logic_error(
+            "Blackboard: first mutation of a module while holding a lock");
+      }
+      auto hook = std::move(writeHook_);
+      writeHook_ = nullptr;
+      hook();
+    }
+    return lockForRead();
+  }
+
+  static thread_local int lockDepth_;
+  static thread_local std::function<void()> writeHook_;
+
+  void indexUpc(UPCView::Entry const& entry);
+  void unindexUpc(UPCView::Entry const& entry);
+  UPCMap toUPCMap(UPCView const& view) const;
+  /// Copy of a value that stays valid until setConcurrent(false).
+  /// Requires the lock.
+  Data const& snapshot(Data const& value) const {
+    snapshots_.push_back(value);
+    return snapshots_.back();
+  }
+
   State* state_;
   std::unordered_map<std::string, Data> map_;
   common::CircularBuffer<std::vector<CommandPost>> commands_;
   std::map<UpcId, UPCData> upcs_;
+  /// Indexes into upcs_, each ordered by UPC ID
+  UPCView::Index upcIndex_;
+  std::unordered_map<Module*, UPCView::Index> upcsByOrigin_;
+  /// UPCs with non-zero probability for the respective command
+  std::array<UPCView::Index, numUpcCommands()> upcsByCommand_;
   std::unique_ptr<UpcStorage> upcStorage_;
 
   /// UPCs that are on the Blackboard or have active tasks
@@ -282,6 +510,9 @@ class Blackboard {
   std::shared_ptr<CherryVisDumperModule> traceDumper_;
 
   bool collectTimers_ = false;
+  bool concurrent_ = false;
+  mutable std::recursive_mutex mutex_;
+  mutable std::deque<Data> snapshots_;
 };
 
 } // namespace cherrypi
@@ -54,6 +54,16 @@ DEFINE_string(
     "state. Disabled if empty");
 DECLARE_string(umm_path);
 DEFINE_bool(map_hack, false, "Enable map hack");
+DEFINE_int32(
+    step_budget_ms,
+    0,
+    "Time budget per bot step; expensive modules defer work once it is used "
+    "up. Disabled if 0");
+DEFINE_bool(
+    parallel_modules,
+    false,
+    "Step bot modules that declare independent data dependencies concurrently "
+    "(modules exchanging UPCs or units are still stepped in order)");
 
 namespace cherrypi {
 
@@ -68,6 +78,8 @@ void setupPlayerFromCli(Player* player) {
   player->setLogFailedCommands(FLAGS_log_failed_commands);
   player->setDraw(FLAGS_draw);
   player->setMapHack(FLAGS_map_hack);
+  player->setParallelModules(FLAGS_parallel_modules);
+  player->setStepBudget(std::chrono::milliseconds(FLAGS_step_budget_ms));
 
   // Add modules
   player->addModule(Module::make(kAutoTopModule));
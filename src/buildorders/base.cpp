@@ -77,16 +77,7 @@ Position ABBOBase::getStaticDefencePos(State* state, const BuildType* type) {
   // DG: Could we instead add an argument to findBuildLocation which ignores
   // reserved tiles?
   auto& tilesInfo = state->tilesInfo();
-  auto copy = tilesInfo.tiles;
-  size_t stride = TilesInfo::tilesWidth - tilesInfo.mapTileWidth();
-  Tile* ptr = tilesInfo.tiles.data();
-  for (unsigned tileY = 0; tileY != tilesInfo.mapTileHeight();
-       ++tileY, ptr += stride) {
-    for (unsigned tileX = 0; tileX != tilesInfo.mapTileWidth();
-         ++tileX, ++ptr) {
-      ptr->reservedAsUnbuildable = false;
-    }
-  }
+  auto reserved = tilesInfo.unreserveAll();
   constexpr int maxAllowableDistance = 4 * 7;
   VLOG(3) << "Looking for static defense position near " << naturalPos;
   Position r = builderhelpers::findBuildLocation(
@@ -110,7 +101,7 @@ Position ABBOBase::getStaticDefencePos(State* state, const BuildType* type) {
         }
         return r;
       });
-  state->tilesInfo().tiles = copy;
+  tilesInfo.restoreReserved(reserved);
   const auto distance = utils::distance(r.x, r.y, naturalPos.x, naturalPos.y);
   if (distance > maxAllowableDistance) {
     VLOG(3) << distance << " is too far: " << r;
@@ -204,17 +195,16 @@ void ABBOBase::calculateArmySupply(const BuildState& st) {
   armySupply = 0.0;
   airArmySupply = 0.0;
   groundArmySupply = 0.0;
-  for (auto& v : st.units) {
-    const BuildType* t = v.first;
+  st.units.forEach([&](const BuildType* t, auto const& units) {
     if (!t->isWorker) {
-      armySupply += t->supplyRequired * v.second.size();
+      armySupply += t->supplyRequired * units.size();
       if (t->isFlyer) {
-        airArmySupply += t->supplyRequired * v.second.size();
+        airArmySupply += t->supplyRequired * units.size();
       } else {
-        groundArmySupply += t->supplyRequired * v.second.size();
+        groundArmySupply += t->supplyRequired * units.size();
       }
     }
-  }
+  });
   for (auto& v : st.production) {
     const BuildType* t = v.second;
     if (!t->isWorker) {
@@ -233,16 +223,7 @@ Position ABBOBase::findHatcheryPosNear(Position seedPos) {
 
   // ugly hack. temporarily unset all reserved tiles
   auto& tilesInfo = state_->tilesInfo();
-  auto copy = tilesInfo.tiles;
-  size_t stride = TilesInfo::tilesWidth - tilesInfo.mapTileWidth();
-  Tile* ptr = tilesInfo.tiles.data();
-  for (unsigned tileY = 0; tileY != tilesInfo.mapTileHeight();
-       ++tileY, ptr += stride) {
-    for (unsigned tileX = 0; tileX != tilesInfo.mapTileWidth();
-         ++tileX, ++ptr) {
-      ptr->reservedAsUnbuildable = false;
-    }
-  }
+  auto reserved = tilesInfo.unreserveAll();
 
   std::vector<Position> seedPositions;
 
@@ -257,7 +238,7 @@ Position ABBOBase::findHatcheryPosNear(Position seedPos) {
         return 0.0f;
       });
 
-  state_->tilesInfo().tiles = copy;
+  tilesInfo.restoreReserved(reserved);
 
   return r;
 }
@@ -270,16 +251,7 @@ Position ABBOBase::findSunkenPosNear(
 
   // ugly hack. temporarily unset all reserved tiles
   auto& tilesInfo = state_->tilesInfo();
-  auto copy = tilesInfo.tiles;
-  size_t stride = TilesInfo::tilesWidth - tilesInfo.mapTileWidth();
-  Tile* ptr = tilesInfo.tiles.data();
-  for (unsigned tileY = 0; tileY != tilesInfo.mapTileHeight();
-       ++tileY, ptr += stride) {
-    for (unsigned tileX = 0; tileX != tilesInfo.mapTileWidth();
-         ++tileX, ++ptr) {
-      ptr->reservedAsUnbuildable = false;
-    }
-  }
+  auto reserved = tilesInfo.unreserveAll();
 
   float coverageRange = 4 * 5.5;
 
@@ -327,7 +299,7 @@ Position ABBOBase::findSunkenPosNear(
         return r;
       });
 
-  state_->tilesInfo().tiles = copy;
+  tilesInfo.restoreReserved(reserved);
 
   return r;
 }
@@ -340,16 +312,7 @@ Position ABBOBase::findSunkenPos(
 
   // ugly hack. temporarily unset all reserved tiles
   auto& tilesInfo = state_->tilesInfo();
-  auto copy = tilesInfo.tiles;
-  size_t stride = TilesInfo::tilesWidth - tilesInfo.mapTileWidth();
-  Tile* ptr = tilesInfo.tiles.data();
-  for (unsigned tileY = 0; tileY != tilesInfo.mapTileHeight();
-       ++tileY, ptr += stride) {
-    for (unsigned tileX = 0; tileX != tilesInfo.mapTileWidth();
-         ++tileX, ++ptr) {
-      ptr->reservedAsUnbuildable = false;
-    }
-  }
+  auto reserved = tilesInfo.unreserveAll();
 
   float coverageRange = 4 * 5.5;
 
@@ -419,7 +382,7 @@ Position ABBOBase::findSunkenPos(
         return r;
       });
 
-  state_->tilesInfo().tiles = copy;
+  tilesInfo.restoreReserved(reserved);
 
   return r;
 }
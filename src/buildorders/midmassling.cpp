@@ -38,16 +38,7 @@ class ABBOmidmassling : public ABBOBase {
 
     // ugly hack. temporarily unset all reserved tiles
     auto& tilesInfo = state_->tilesInfo();
-    auto copy = tilesInfo.tiles;
-    size_t stride = TilesInfo::tilesWidth - tilesInfo.mapTileWidth();
-    Tile* ptr = tilesInfo.tiles.data();
-    for (unsigned tileY = 0; tileY != tilesInfo.mapTileHeight();
-         ++tileY, ptr += stride) {
-      for (unsigned tileX = 0; tileX != tilesInfo.mapTileWidth();
-           ++tileX, ++ptr) {
-        ptr->reservedAsUnbuildable = false;
-      }
-    }
+    auto reserved = tilesInfo.unreserveAll();
 
     std::vector<Position> basePositions;
 
@@ -72,7 +63,7 @@ class ABBOmidmassling : public ABBOBase {
     }
 
     if (basePositions.empty()) {
-      state_->tilesInfo().tiles = copy;
+      tilesInfo.restoreReserved(reserved);
       return kInvalidPosition;
     }
 
@@ -95,7 +86,7 @@ class ABBOmidmassling : public ABBOBase {
           return r;
         });
 
-    state_->tilesInfo().tiles = copy;
+    tilesInfo.restoreReserved(reserved);
 
     return r;
   }
@@ -8,6 +8,10 @@
 #include "combatsim.h"
 #include "utils.h"
 
+#include <algorithm>
+#include <limits>
+#include <numeric>
+
 namespace {
 double damageTypeModifier(int damageType, int unitSize) {
   if (damageType == 1) {
@@ -222,3 +226,536 @@ void cherrypi::CombatSim::run(int frames) {
     t.endHp = hp;
   }
 }
+
+namespace {
+
+/// Branch-free variant of utils::disthelper() so that target scoring loops
+/// can be vectorized. Produces identical results.
+inline unsigned int disthelperBranchless(unsigned int dx, unsigned int dy) {
+  unsigned int a = std::max(dx, dy);
+  unsigned int b = std::min(dx, dy);
+  unsigned int approx = a - a / 16u + b * 3u / 8u - a / 64u + b * 3u / 256u;
+  return a / 4u < b ? approx : a;
+}
+
+/// Branch-free variant of utils::distance()
+inline float distanceBranchless(int x1, int y1, int x2, int y2) {
+  unsigned int dx = std::abs(x1 - x2) * unsigned(tc::BW::XYPixelsPerWalktile);
+  unsigned int dy = std::abs(y1 - y2) * unsigned(tc::BW::XYPixelsPerWalktile);
+  return float(disthelperBranchless(dx, dy)) / tc::BW::XYPixelsPerWalktile;
+}
+
+} // namespace
+
+void cherrypi::CombatSimBatch::run(std::vector<CombatSim>& sims, int frames) {
+  run(sims.data(), sims.size(), frames);
+}
+
+void cherrypi::CombatSimBatch::run(CombatSim* sims, size_t n, int frames) {
+  load(sims, n);
+  for (size_t i = 0; i < n; i++) {
+    simulate(i, frames);
+  }
+  store(sims, n);
+}
+
+void cherrypi::CombatSimBatch::load(CombatSim* sims, size_t n) {
+  teamBegin_.assign(1, 0);
+  size_t maxTeamSize = 0;
+  for (size_t i = 0; i < n; i++) {
+    for (auto& team : sims[i].teams) {
+      teamBegin_.push_back(teamBegin_.back() + team.units.size());
+      maxTeamSize = std::max(maxTeamSize, team.units.size());
+    }
+  }
+  size_t total = teamBegin_.back();
+
+  x_.resize(total);
+  y_.resize(total);
+  hp_.resize(total);
+  shields_.resize(total);
+  armor_.resize(total);
+  maxSpeed_.resize(total);
+  flying_.resize(total);
+  underDarkSwarm_.resize(total);
+  type_.resize(total);
+  target_.resize(total);
+  targetInRange_.resize(total);
+  cooldownUntil_.resize(total);
+  groundDamage_.resize(total);
+  airDamage_.resize(total);
+  groundDamageType_.resize(total);
+  airDamageType_.resize(total);
+  groundRange_.resize(total);
+  airRange_.resize(total);
+  startHp_.assign(2 * n, 0.0);
+  endHp_.assign(2 * n, 0.0);
+  scores_.resize(maxTeamSize);
+  scoresFast_.resize(maxTeamSize);
+
+  for (size_t i = 0; i < n; i++) {
+    for (size_t t = 0; t != 2; ++t) {
+      auto& units = sims[i].teams[t].units;
+      auto& enemies = sims[i].teams[t ^ 1].units;
+      size_t begin = teamBegin_[2 * i + t];
+      size_t enemyBegin = teamBegin_[2 * i + (t ^ 1)];
+      for (size_t j = 0; j < units.size(); j++) {
+        auto& su = units[j];
+        size_t k = begin + j;
+        x_[k] = su.x;
+        y_[k] = su.y;
+        hp_[k] = su.hp;
+        shields_[k] = su.shields;
+        armor_[k] = su.armor;
+        maxSpeed_[k] = su.maxSpeed;
+        flying_[k] = su.flying;
+        underDarkSwarm_[k] = su.underDarkSwarm;
+        type_[k] = su.type;
+        target_[k] = -1;
+        if (su.target >= enemies.data() &&
+            su.target < enemies.data() + enemies.size()) {
+          target_[k] = enemyBegin + (su.target - enemies.data());
+        }
+        targetInRange_[k] = su.targetInRange;
+        cooldownUntil_[k] = su.cooldownUntil;
+        groundDamage_[k] = su.groundDamage;
+        airDamage_[k] = su.airDamage;
+        groundDamageType_[k] = su.groundDamageType;
+        airDamageType_[k] = su.airDamageType;
+        groundRange_[k] = su.groundRange;
+        airRange_[k] = su.airRange;
+      }
+    }
+  }
+}
+
+void cherrypi::CombatSimBatch::store(CombatSim* sims, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    for (size_t t = 0; t != 2; ++t) {
+      auto& team = sims[i].teams[t];
+      auto& enemies = sims[i].teams[t ^ 1].units;
+      size_t begin = teamBegin_[2 * i + t];
+      size_t enemyBegin = teamBegin_[2 * i + (t ^ 1)];
+      team.startHp = startHp_[2 * i + t];
+      team.endHp = endHp_[2 * i + t];
+      for (size_t j = 0; j < team.units.size(); j++) {
+        auto& su = team.units[j];
+        size_t k = begin + j;
+        su.x = x_[k];
+        su.y = y_[k];
+        su.hp = hp_[k];
+        su.shields = shields_[k];
+        su.target =
+            target_[k] >= 0 ? &enemies[target_[k] - enemyBegin] : nullptr;
+        su.targetInRange = targetInRange_[k];
+        su.cooldownUntil = cooldownUntil_[k];
+      }
+    }
+  }
+}
+
+int cherrypi::CombatSimBatch::selectTarget(
+    size_t u,
+    size_t enemyBegin,
+    size_t enemyEnd) {
+  size_t n = enemyEnd - enemyBegin;
+  int const ux = x_[u];
+  int const uy = y_[u];
+  int const groundDamage = groundDamage_[u];
+  int const airDamage = airDamage_[u];
+  int const groundRange = groundRange_[u];
+  int const airRange = airRange_[u];
+  int const* ex = x_.data() + enemyBegin;
+  int const* ey = y_.data() + enemyBegin;
+  double const* ehp = hp_.data() + enemyBegin;
+  double const* eshields = shields_.data() + enemyBegin;
+  uint8_t const* eflying = flying_.data() + enemyBegin;
+
+  // Scores are computed for all enemies without early exits so that the
+  // compiler can vectorize this loop. Selection follows
+  // utils::getBestScorePointer(), i.e. the first enemy with the lowest score
+  // wins and enemies that we can't damage are skipped.
+  int best = -1;
+  if (mode_ == Mode::Reference) {
+    double* scores = scores_.data();
+    for (size_t j = 0; j < n; j++) {
+      int damage = ehp[j] > 0.0 ? eflying[j] ? airDamage : groundDamage : 0;
+      double range = eflying[j] ? airRange : groundRange;
+      double score =
+          std::max(
+              (double)distanceBranchless(ux, uy, ex[j], ey[j]) - range * 256,
+              0.0) *
+              100 +
+          (eshields[j] + ehp[j] - damage);
+      scores[j] = damage == 0 ? kdInfty : score;
+    }
+    double bestScore = kdInfty;
+    for (size_t j = 0; j < n; j++) {
+      if (scores[j] < bestScore) {
+        bestScore = scores[j];
+        best = j;
+      }
+    }
+  } else {
+    float constexpr kfInfty = std::numeric_limits<float>::infinity();
+    float* scores = scoresFast_.data();
+    for (size_t j = 0; j < n; j++) {
+      int damage = ehp[j] > 0.0 ? eflying[j] ? airDamage : groundDamage : 0;
+      float range = eflying[j] ? airRange : groundRange;
+      float distance = distanceBranchless(ux, uy, ex[j], ey[j]);
+      float score = std::max(distance - range * 256, 0.0f) * 100 +
+          float(eshields[j] + ehp[j] - damage);
+      scores[j] = damage == 0 ? kfInfty : score;
+    }
+    float bestScore = kfInfty;
+    for (size_t j = 0; j < n; j++) {
+      if (scores[j] < bestScore) {
+        bestScore = scores[j];
+        best = j;
+      }
+    }
+  }
+  return best < 0 ? -1 : int(enemyBegin) + best;
+}
+
+void cherrypi::CombatSimBatch::simulate(size_t sim, int frames) {
+  int frame = 0;
+  const int resolution = 2;
+  size_t const begin[2] = {teamBegin_[2 * sim], teamBegin_[2 * sim + 1]};
+  size_t const end[2] = {teamBegin_[2 * sim + 1], teamBegin_[2 * sim + 2]};
+
+  auto sumHp = [&](size_t t) {
+    double hp = 0.0;
+    for (size_t k = begin[t]; k != end[t]; ++k) {
+      hp += hp_[k] + shields_[k];
+    }
+    return hp;
+  };
+  startHp_[2 * sim] = sumHp(0);
+  startHp_[2 * sim + 1] = sumHp(1);
+
+  while (frame < frames) {
+    bool idle = true;
+
+    for (size_t i = 0; i != 2; ++i) {
+      for (size_t u = begin[i]; u != end[i]; ++u) {
+        if (hp_[u] <= 0.0) {
+          continue;
+        }
+
+        int target = selectTarget(u, begin[i ^ 1], end[i ^ 1]);
+        target_[u] = target;
+        targetInRange_[u] = false;
+        if (target < 0) {
+          continue;
+        }
+
+        int dx = x_[target] - x_[u];
+        int dy = y_[target] - y_[u];
+        int dxi = dx >> 8;
+        int dyi = dy >> 8;
+        bool targetFlying = flying_[target];
+        int range = 4 + (targetFlying ? airRange_[u] : groundRange_[u]);
+        if (dxi * dxi + dyi * dyi <= range * range) {
+          targetInRange_[u] = true;
+          if (frame >= cooldownUntil_[u]) {
+            double damage = targetFlying ? airDamage_[u] : groundDamage_[u];
+            double& shields = shields_[target];
+            if (shields) {
+              shields -= damage;
+              if (shields < 0.0) {
+                damage = -shields;
+                shields = 0.0;
+              } else {
+                damage = 0.0;
+              }
+            }
+            if (damage) {
+              damage *= damageTypeModifier(
+                  targetFlying ? airDamageType_[u] : groundDamageType_[u],
+                  type_[target]->size);
+              damage -= armor_[target];
+              if (damage < 0.5) {
+                damage = 0.5;
+              }
+              if (type_[u]->restrictedByDarkSwarm &&
+                  (underDarkSwarm_[u] || underDarkSwarm_[target])) {
+                damage = 0.0;
+              }
+              double& hp = hp_[target];
+              hp -= damage;
+              if (hp < 0.0) {
+                hp = 0.0;
+              }
+            }
+            BuildType const* type = type_[u];
+            int cooldown = targetFlying ? type->airWeaponCooldown
+                                        : type->groundWeaponCooldown;
+            if (type == buildtypes::Terran_Bunker) {
+              cooldown = 4;
+            } else if (type == buildtypes::Protoss_Interceptor) {
+              cooldown = 45;
+            } else if (type == buildtypes::Protoss_Reaver) {
+              cooldown = 60;
+            } else if (type == buildtypes::Zerg_Scourge) {
+              hp_[u] = 0.0;
+            }
+            cooldownUntil_[u] += cooldown;
+            if (cooldownUntil_[u] <= frame) {
+              cooldownUntil_[u] = frame + 1;
+            }
+          }
+        } else {
+          int d = utils::pxdistance(0, 0, dxi, dyi);
+          x_[u] += (dx * maxSpeed_[u] >> 8) / d * resolution;
+          y_[u] += (dy * maxSpeed_[u] >> 8) / d * resolution;
+        }
+        idle = false;
+      }
+    }
+    frame += resolution;
+    if (idle) {
+      break;
+    }
+  }
+
+  endHp_[2 * sim] = sumHp(0);
+  endHp_[2 * sim + 1] = sumHp(1);
+}
+
+namespace {
+
+int floorDiv(int a, int b) {
+  return a >= 0 ? a / b : -((-a + b - 1) / b);
+}
+
+int bucket(double value, int maxValue, int buckets) {
+  if (value <= 0.0) {
+    return -1;
+  }
+  return std::min(buckets, int(value * buckets / std::max(1, maxValue)));
+}
+
+} // namespace
+
+size_t cherrypi::CombatSimCache::SignatureHash::operator()(
+    Signature const& s) const {
+  size_t h = s.size();
+  for (auto v : s) {
+    h ^= std::hash<int32_t>()(v) + 0x9e3779b9 + (h << 6) + (h >> 2);
+  }
+  return h;
+}
+
+cherrypi::CombatSimCache::Signature cherrypi::CombatSimCache::signature(
+    CombatSim const& sim,
+    int frames,
+    std::array<std::vector<size_t>, 2>& order) const {
+  size_t constexpr kFields = 16;
+
+  // Positions are relative to the center of the engagement (in walktiles)
+  int64_t cx = 0;
+  int64_t cy = 0;
+  size_t n = 0;
+  for (auto& team : sim.teams) {
+    for (auto& u : team.units) {
+      cx += u.x >> 8;
+      cy += u.y >> 8;
+      ++n;
+    }
+  }
+  if (n > 0) {
+    cx /= int64_t(n);
+    cy /= int64_t(n);
+  }
+
+  Signature sig;
+  sig.reserve(3 + n * kFields);
+  sig.push_back(frames);
+  sig.push_back(sim.teams[0].units.size());
+  sig.push_back(sim.teams[1].units.size());
+  for (size_t t = 0; t != 2; ++t) {
+    auto& units = sim.teams[t].units;
+    std::vector<int32_t> keys;
+    keys.reserve(units.size() * kFields);
+    for (auto& u : units) {
+      int maxHp = u.type ? u.type->maxHp : 1;
+      int maxShields = u.type ? u.type->maxShields : 1;
+      keys.insert(
+          keys.end(),
+          {u.type ? u.type->unit : -1,
+           u.flying,
+           u.underDarkSwarm,
+           floorDiv((u.x >> 8) - int(cx), options_.positionTolerance),
+           floorDiv((u.y >> 8) - int(cy), options_.positionTolerance),
+           bucket(u.hp, maxHp, options_.hpBuckets),
+           bucket(u.shields, maxShields, options_.hpBuckets),
+           u.armor,
+           u.maxSpeed,
+           floorDiv(u.cooldownUntil, options_.cooldownTolerance),
+           u.groundDamage,
+           u.airDamage,
+           u.groundDamageType,
+           u.airDamageType,
+           u.groundRange,
+           u.airRange});
+    }
+
+    // Canonical unit order
+    order[t].resize(units.size());
+    std::iota(order[t].begin(), order[t].end(), 0);
+    std::stable_sort(order[t].begin(), order[t].end(), [&](size_t a, size_t b) {
+      return std::lexicographical_compare(
+          keys.begin() + a * kFields,
+          keys.begin() + (a + 1) * kFields,
+          keys.begin() + b * kFields,
+          keys.begin() + (b + 1) * kFields);
+    });
+    for (size_t i : order[t]) {
+      sig.insert(
+          sig.end(),
+          keys.begin() + i * kFields,
+          keys.begin() + (i + 1) * kFields);
+    }
+  }
+  return sig;
+}
+
+void cherrypi::CombatSimCache::apply(
+    Outcome const& outcome,
+    CombatSim& sim,
+    std::array<std::vector<size_t>, 2> const& order) const {
+  for (size_t t = 0; t != 2; ++t) {
+    auto& team = sim.teams[t];
+    double startHp = 0.0;
+    for (auto& u : team.units) {
+      startHp += u.hp + u.shields;
+    }
+    team.startHp = startHp;
+
+    for (size_t k = 0; k < order[t].size(); k++) {
+      auto& u = team.units[order[t][k]];
+      u.hp = outcome.dead[t][k] ? 0.0
+                                : std::max(u.hp - outcome.hpLoss[t][k], 0.0);
+      u.shields = std::max(u.shields - outcome.shieldsLoss[t][k], 0.0);
+      u.target = nullptr;
+      u.targetInRange = false;
+    }
+
+    double endHp = 0.0;
+    for (auto& u : team.units) {
+      endHp += u.hp + u.shields;
+    }
+    team.endHp = endHp;
+  }
+}
+
+void cherrypi::CombatSimCache::insert(Signature signature, Outcome outcome) {
+  auto it = entries_.find(signature);
+  if (it != entries_.end()) {
+    it->second->outcome = std::move(outcome);
+    lru_.splice(lru_.begin(), lru_, it->second);
+    return;
+  }
+  if (lru_.size() >= options_.capacity) {
+    entries_.erase(lru_.back().signature);
+    lru_.pop_back();
+    ++evictions_;
+  }
+  lru_.push_front(Entry{std::move(signature), std::move(outcome)});
+  entries_.emplace(lru_.front().signature, lru_.begin());
+}
+
+void cherrypi::CombatSimCache::run(std::vector<CombatSim>& sims, int frames) {
+  if (options_.capacity == 0) {
+    auto start = std::chrono::steady_clock::now();
+    batch_.run(sims, frames);
+    simulationTime_ += std::chrono::steady_clock::now() - start;
+    misses_ += sims.size();
+    return;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  std::vector<size_t> missIndices;
+  std::vector<CombatSim> missSims;
+  std::vector<Signature> missSignatures;
+  std::vector<std::array<std::vector<size_t>, 2>> missOrders;
+  for (size_t i = 0; i < sims.size(); i++) {
+    std::array<std::vector<size_t>, 2> order;
+    auto sig = signature(sims[i], frames, order);
+    auto it = entries_.find(sig);
+    if (it != entries_.end()) {
+      lru_.splice(lru_.begin(), lru_, it->second);
+      apply(it->second->outcome, sims[i], order);
+      ++hits_;
+    } else {
+      missIndices.push_back(i);
+      missSims.push_back(std::move(sims[i]));
+      missSignatures.push_back(std::move(sig));
+      missOrders.push_back(std::move(order));
+      ++misses_;
+    }
+  }
+  lookupTime_ += std::chrono::steady_clock::now() - start;
+  if (missSims.empty()) {
+    return;
+  }
+
+  // Record starting values so that we can store losses
+  std::vector<Outcome> outcomes(missSims.size());
+  for (size_t i = 0; i < missSims.size(); i++) {
+    for (size_t t = 0; t != 2; ++t) {
+      auto& units = missSims[i].teams[t].units;
+      for (size_t j : missOrders[i][t]) {
+        outcomes[i].hpLoss[t].push_back(units[j].hp);
+        outcomes[i].shieldsLoss[t].push_back(units[j].shields);
+      }
+    }
+  }
+
+  start = std::chrono::steady_clock::now();
+  batch_.run(missSims, frames);
+  simulationTime_ += std::chrono::steady_clock::now() - start;
+
+  for (size_t i = 0; i < missSims.size(); i++) {
+    auto& outcome = outcomes[i];
+    for (size_t t = 0; t != 2; ++t) {
+      auto& units = missSims[i].teams[t].units;
+      auto& order = missOrders[i][t];
+      outcome.dead[t].resize(order.size());
+      for (size_t k = 0; k < order.size(); k++) {
+        auto& u = units[order[k]];
+        outcome.hpLoss[t][k] -= u.hp;
+        outcome.shieldsLoss[t][k] -= u.shields;
+        outcome.dead[t][k] = u.hp <= 0.0;
+      }
+    }
+    insert(std::move(missSignatures[i]), std::move(outcome));
+    sims[missIndices[i]] = std::move(missSims[i]);
+  }
+}
+
+void cherrypi::CombatSimCache::clear() {
+  lru_.clear();
+  entries_.clear();
+}
+
+std::vector<std::pair<std::string, size_t>>
+cherrypi::CombatSimCache::getCounters() const {
+  return {
+      {"hits", hits_},
+      {"misses", misses_},
+      {"evictions", evictions_},
+      {"entries", lru_.size()},
+  };
+}
+
+std::vector<std::pair<std::string, std::chrono::milliseconds>>
+cherrypi::CombatSimCache::getTimes() const {
+  return {
+      {"lookup",
+       std::chrono::duration_cast<std::chrono::milliseconds>(lookupTime_)},
+      {"simulation",
+       std::chrono::duration_cast<std::chrono::milliseconds>(simulationTime_)},
+  };
+}
@@ -8,6 +8,13 @@
 #pragma once
 
 #include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 namespace cherrypi {
@@ -60,4 +67,168 @@ class CombatSim {
 
   void run(int frames);
 };
+
+/**
+ * Runs many independent CombatSim instances at once.
+ *
+ * Units of all simulations are stored as a structure of arrays so that target
+ * selection, which dominates the cost of a simulation, can be vectorized.
+ * This is useful for simulating several variants of one engagement (e.g. with
+ * different speed multipliers) or the engagements of all tactics groups in
+ * one go.
+ *
+ * In Reference mode, results are bit-identical to calling CombatSim::run() on
+ * every simulation. Fast mode scores targets in single precision, which may
+ * change target selection for near-ties.
+ */
+class CombatSimBatch {
+ public:
+  enum class Mode {
+    Reference,
+    Fast,
+  };
+
+  explicit CombatSimBatch(Mode mode = Mode::Reference) : mode_(mode) {}
+
+  /// Simulates all given fights for the given number of frames.
+  /// Results are written back to the simulations, as if by CombatSim::run().
+  void run(std::vector<CombatSim>& sims, int frames);
+  void run(CombatSim* sims, size_t n, int frames);
+
+ private:
+  void load(CombatSim* sims, size_t n);
+  void store(CombatSim* sims, size_t n);
+  void simulate(size_t sim, int frames);
+  int selectTarget(size_t u, size_t enemyBegin, size_t enemyEnd);
+
+  Mode mode_;
+
+  // Units of simulation i, team t are stored in
+  // [teamBegin_[2 * i + t], teamBegin_[2 * i + t + 1])
+  std::vector<size_t> teamBegin_;
+  std::vector<double> startHp_;
+  std::vector<double> endHp_;
+
+  std::vector<int> x_;
+  std::vector<int> y_;
+  std::vector<double> hp_;
+  std::vector<double> shields_;
+  std::vector<int> armor_;
+  std::vector<int> maxSpeed_;
+  std::vector<uint8_t> flying_;
+  std::vector<uint8_t> underDarkSwarm_;
+  std::vector<const BuildType*> type_;
+  std::vector<int> target_;
+  std::vector<uint8_t> targetInRange_;
+  std::vector<int> cooldownUntil_;
+  std::vector<int> groundDamage_;
+  std::vector<int> airDamage_;
+  std::vector<int> groundDamageType_;
+  std::vector<int> airDamageType_;
+  std::vector<int> groundRange_;
+  std::vector<int> airRange_;
+
+  // Scratch space for target scores
+  std::vector<double> scores_;
+  std::vector<float> scoresFast_;
+};
+
+/**
+ * Memoizes the outcome of combat simulations.
+ *
+ * Fights are identified by a quantized signature of the engagement: unit
+ * types and stats (which include upgrades), HP and shield buckets, weapon
+ * cooldowns and unit positions relative to the center of the engagement.
+ * Units are ordered canonically within each team, so the order in which units
+ * are added to a simulation does not matter.
+ *
+ * For a cache hit, the HP and shield losses of the cached simulation are
+ * applied to the units of the new simulation, and dead units stay dead. Only
+ * Team::startHp, Team::endHp and SimUnit::hp and SimUnit::shields are
+ * restored; unit positions and targets are not.
+ */
+class CombatSimCache {
+ public:
+  struct Options {
+    /// Maximum number of cached outcomes
+    size_t capacity = 1024;
+    /// Size of position buckets, in walktiles
+    int positionTolerance = 4;
+    /// Number of buckets for HP and shields (relative to their maximum)
+    int hpBuckets = 8;
+    /// Size of weapon cooldown buckets, in frames
+    int cooldownTolerance = 8;
+  };
+
+  CombatSimCache() = default;
+  explicit CombatSimCache(Options options) : options_(options) {}
+
+  /// Runs the given simulations, reusing cached outcomes where possible.
+  /// Cache misses are simulated in a single batch.
+  void run(std::vector<CombatSim>& sims, int frames);
+
+  void clear();
+  size_t size() const {
+    return lru_.size();
+  }
+  Options const& options() const {
+    return options_;
+  }
+
+  size_t hits() const {
+    return hits_;
+  }
+  size_t misses() const {
+    return misses_;
+  }
+  size_t evictions() const {
+    return evictions_;
+  }
+  /// Hit, miss and eviction counts
+  std::vector<std::pair<std::string, size_t>> getCounters() const;
+  /// Time spent computing signatures and looking up outcomes, and time spent
+  /// simulating cache misses
+  std::vector<std::pair<std::string, std::chrono::milliseconds>> getTimes()
+      const;
+
+ private:
+  using Signature = std::vector<int32_t>;
+  struct SignatureHash {
+    size_t operator()(Signature const& s) const;
+  };
+  struct Outcome {
+    /// HP loss, shield loss and death for each unit, in signature order
+    std::array<std::vector<double>, 2> hpLoss;
+    std::array<std::vector<double>, 2> shieldsLoss;
+    std::array<std::vector<uint8_t>, 2> dead;
+  };
+  struct Entry {
+    Signature signature;
+    Outcome outcome;
+  };
+
+  /// Computes the signature of a simulation and the canonical unit order
+  Signature signature(
+      CombatSim const& sim,
+      int frames,
+      std::array<std::vector<size_t>, 2>& order) const;
+  void apply(
+      Outcome const& outcome,
+      CombatSim& sim,
+      std::array<std::vector<size_t>, 2> const& order) const;
+  void insert(Signature signature, Outcome outcome);
+
+  Options options_;
+  std::list<Entry> lru_;
+  std::unordered_map<Signature, std::list<Entry>::iterator, SignatureHash>
+      entries_;
+  CombatSimBatch batch_;
+
+  size_t hits_ = 0;
+  size_t misses_ = 0;
+  size_t evictions_ = 0;
+  std::chrono::steady_clock::duration lookupTime_{0};
+  std::chrono::steady_clock::duration simulationTime_{0};
+};
+
 } // namespace cherrypi
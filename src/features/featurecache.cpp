@@ -0,0 +1,262 @@
+/*
+ * Copyright (c) 2017-present, Facebook, Inc.
+ *
+ * This source code is licensed under the MIT license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "featurecache.h"
+
+#include "state.h"
+
+#include <common/assert.h>
+
+namespace cherrypi {
+
+namespace featureimpl {
+
+// mapfeatures.cpp
+void extractGroundHeight(torch::Tensor, State*, Rect const&);
+void extractWalkability(torch::Tensor, State*, Rect const&);
+void extractBuildability(torch::Tensor, State*, Rect const&);
+void extractTallDoodad(torch::Tensor, State*, Rect const&);
+void extractStartLocations(torch::Tensor, State*, Rect const&);
+void extractXYGrid(torch::Tensor, State*, Rect const&);
+Rect unitFootprint(Unit*);
+bool isStructure(Unit*);
+void addFootprint(torch::Tensor, State*, Rect const&, Rect const&, float);
+void addFootprintBT(torch::Tensor, State*, Rect const&, Rect const&, float);
+
+} // namespace featureimpl
+
+namespace {
+
+bool sameRect(Rect const& a, Rect const& b) {
+  return a.x == b.x && a.y == b.y && a.w == b.w && a.h == b.h;
+}
+
+} // namespace
+
+FeatureCache::FeatureCache(State* state) : state_(state) {}
+
+bool FeatureCache::isCached(PlainFeatureType type, bool buildTiles) {
+  switch (type) {
+    case PlainFeatureType::FogOfWar:
+    case PlainFeatureType::Creep:
+    case PlainFeatureType::HasStructure:
+      return true;
+    case PlainFeatureType::ReservedAsUnbuildable:
+      return !buildTiles;
+    default:
+      return !buildTiles && isStatic(type);
+  }
+}
+
+bool FeatureCache::isStatic(PlainFeatureType type) {
+  switch (type) {
+    case PlainFeatureType::GroundHeight:
+    case PlainFeatureType::Walkability:
+    case PlainFeatureType::Buildability:
+    case PlainFeatureType::TallDoodad:
+    case PlainFeatureType::StartLocations:
+    case PlainFeatureType::XYGrid:
+      return true;
+    default:
+      return false;
+  }
+}
+
+void FeatureCache::extract(
+    PlainFeatureType type,
+    torch::Tensor t,
+    Rect const& r,
+    bool buildTiles) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto& l = layer(type, buildTiles);
+  ASSERT(t.size(0) == l.data.size(0));
+
+  t.fill_(l.padValue);
+  auto map = mapRect(buildTiles);
+  auto ir = r.intersected(map);
+  if (ir.empty()) {
+    return;
+  }
+  t.slice(1, ir.y - r.y, ir.y - r.y + ir.h)
+      .slice(2, ir.x - r.x, ir.x - r.x + ir.w)
+      .copy_(l.data.slice(1, ir.y - map.y, ir.y - map.y + ir.h)
+                 .slice(2, ir.x - map.x, ir.x - map.x + ir.w));
+}
+
+torch::Tensor FeatureCache::staticLayer(PlainFeatureType type) {
+  if (!isStatic(type)) {
+    throw std::runtime_error(
+        "Feature with ID " + std::to_string(static_cast<int>(type)) +
+        " is not static");
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  return layer(type, false).data;
+}
+
+void FeatureCache::clear() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  layers_.clear();
+  layersBT_.clear();
+}
+
+FeatureCache::Layer& FeatureCache::layer(
+    PlainFeatureType type,
+    bool buildTiles) {
+  if (!isCached(type, buildTiles)) {
+    throw std::runtime_error(
+        "Feature with ID " + std::to_string(static_cast<int>(type)) +
+        " is not cached");
+  }
+
+  auto& l = (buildTiles ? layersBT_ : layers_)[static_cast<int>(type)];
+  auto& tl = state_->tilesInfo().layers();
+  switch (type) {
+    case PlainFeatureType::FogOfWar:
+      updateTileLayer(l, tl.visible, tl.visibleVersion, 0.0f, 1.0f, buildTiles);
+      break;
+    case PlainFeatureType::Creep:
+      updateTileLayer(l, tl.creep, tl.creepVersion, 1.0f, 0.0f, buildTiles);
+      break;
+    case PlainFeatureType::ReservedAsUnbuildable:
+      updateTileLayer(
+          l, tl.reserved, tl.reservedVersion, 1.0f, 0.0f, buildTiles);
+      break;
+    case PlainFeatureType::HasStructure:
+      updateStructureLayer(l, buildTiles);
+      break;
+    default:
+      if (!l.data.defined()) {
+        initStaticLayer(l, type);
+      }
+      break;
+  }
+  return l;
+}
+
+void FeatureCache::initStaticLayer(Layer& layer, PlainFeatureType type) {
+  using Function = void (*)(torch::Tensor, State*, Rect const&);
+  Function fn = nullptr;
+  int nchannels = 1;
+  float padValue = -1.0f;
+  switch (type) {
+    case PlainFeatureType::GroundHeight:
+      fn = &featureimpl::extractGroundHeight;
+      break;
+    case PlainFeatureType::Walkability:
+      fn = &featureimpl::extractWalkability;
+      break;
+    case PlainFeatureType::Buildability:
+      fn = &featureimpl::extractBuildability;
+      break;
+    case PlainFeatureType::TallDoodad:
+      fn = &featureimpl::extractTallDoodad;
+      padValue = 0.0f;
+      break;
+    case PlainFeatureType::StartLocations:
+      fn = &featureimpl::extractStartLocations;
+      padValue = 0.0f;
+      break;
+    case PlainFeatureType::XYGrid:
+      fn = &featureimpl::extractXYGrid;
+      nchannels = 2;
+      break;
+    default:
+      throw std::runtime_error(
+          "No static feature with ID " +
+          std::to_string(static_cast<int>(type)));
+  }
+
+  auto map = mapRect(false);
+  layer.data = torch::zeros({nchannels, map.height(), map.width()});
+  layer.padValue = padValue;
+  fn(layer.data, state_, map);
+}
+
+void FeatureCache::updateTileLayer(
+    Layer& layer,
+    TileBitPlane const& plane,
+    uint64_t version,
+    float setValue,
+    float unsetValue,
+    bool buildTiles) {
+  if (!layer.data.defined()) {
+    // Start with an empty plane; the first update below will set all tiles
+    auto map = mapRect(buildTiles);
+    layer.data = torch::full({1, map.height(), map.width()}, unsetValue);
+    layer.padValue = -1.0f;
+    layer.plane.reset();
+    layer.version = version - 1;
+  }
+  if (layer.version == version) {
+    return;
+  }
+
+  auto changed = layer.plane;
+  changed ^= plane;
+  auto a = layer.data.accessor<float, 3>()[0];
+  int const scale = buildTiles ? 1 : tc::BW::XYWalktilesPerBuildtile;
+  changed.forEachSet([&](size_t index) {
+    int tileX = index % TileBitPlane::kWidth;
+    int tileY = index / TileBitPlane::kWidth;
+    float value = plane.test(index) ? setValue : unsetValue;
+    for (int y = tileY * scale; y < (tileY + 1) * scale; y++) {
+      auto row = a[y];
+      for (int x = tileX * scale; x < (tileX + 1) * scale; x++) {
+        row[x] = value;
+      }
+    }
+  });
+  layer.plane = plane;
+  layer.version = version;
+}
+
+void FeatureCache::updateStructureLayer(Layer& layer, bool buildTiles) {
+  auto map = mapRect(buildTiles);
+  if (!layer.data.defined()) {
+    layer.data = torch::zeros({1, map.height(), map.width()});
+    layer.padValue = 0.0f;
+    layer.footprints.clear();
+  } else if (layer.frame == state_->currentFrame()) {
+    return;
+  }
+
+  std::unordered_map<UnitId, Rect> footprints;
+  for (auto* u : state_->unitsInfo().liveUnits()) {
+    if (featureimpl::isStructure(u)) {
+      footprints.emplace(u->id, featureimpl::unitFootprint(u));
+    }
+  }
+
+  // Remove structures that are gone or that changed, then add new ones
+  auto add = buildTiles ? &featureimpl::addFootprintBT
+                        : &featureimpl::addFootprint;
+  for (auto const& it : layer.footprints) {
+    auto cur = footprints.find(it.first);
+    if (cur == footprints.end() || !sameRect(cur->second, it.second)) {
+      add(layer.data, state_, map, it.second, -1.0f);
+    }
+  }
+  for (auto const& it : footprints) {
+    auto prev = layer.footprints.find(it.first);
+    if (prev == layer.footprints.end() || !sameRect(prev->second, it.second)) {
+      add(layer.data, state_, map, it.second, 1.0f);
+    }
+  }
+  layer.footprints = std::move(footprints);
+  layer.frame = state_->currentFrame();
+}
+
+Rect FeatureCache::mapRect(bool buildTiles) const {
+  auto rect = state_->mapRect();
+  if (buildTiles) {
+    rect.w /= tc::BW::XYWalktilesPerBuildtile;
+    rect.h /= tc::BW::XYWalktilesPerBuildtile;
+  }
+  return rect;
+}
+
+} // namespace cherrypi
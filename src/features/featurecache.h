@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) 2017-present, Facebook, Inc.
+ *
+ * This source code is licensed under the MIT license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include "features.h"
+#include "tilesinfo.h"
+
+#include <mutex>
+#include <unordered_map>
+
+namespace cherrypi {
+
+/**
+ * Per-game cache of plain map features.
+ *
+ * Layers are kept for the whole map (in walktile or buildtile resolution) and
+ * are created on first use. Static layers (ground height, walkability,
+ * buildability, tall doodads, start locations and the XY grid) are computed
+ * once. Layers derived from TilesInfo::layers() (fog of war, creep and
+ * reserved tiles) are updated for the tiles that changed since the last
+ * request only, and HasStructure layers are updated for the structures that
+ * appeared, moved or disappeared.
+ *
+ * featurizePlain() and featurizePlainBT() use the cache that is owned by
+ * State. Features are cached at the resolution they are requested in, i.e.
+ * featurizePlainBT() does not pool cached walktile layers.
+ */
+class FeatureCache {
+ public:
+  explicit FeatureCache(State* state);
+  FeatureCache(FeatureCache const&) = delete;
+  FeatureCache& operator=(FeatureCache const&) = delete;
+
+  /// Whether the given feature type is cached in walktile or buildtile
+  /// resolution, respectively
+  static bool isCached(PlainFeatureType type, bool buildTiles = false);
+  /// Whether the feature is static, i.e. whether cached data never changes
+  static bool isStatic(PlainFeatureType type);
+
+  /**
+   * Fills `t` with the given feature for the bounding box `r`, producing the
+   * same result as the respective feature extractor. The feature needs to be
+   * cached at the requested resolution (see isCached()).
+   */
+  void extract(
+      PlainFeatureType type,
+      torch::Tensor t,
+      Rect const& r,
+      bool buildTiles = false);
+
+  /**
+   * Returns the cached walktile feature for the whole map.
+   * This tensor shares storage with the cache. It must not be modified and is
+   * only returned for static features (see isStatic()), which are never
+   * updated.
+   */
+  torch::Tensor staticLayer(PlainFeatureType type);
+
+  /// Drops all cached data
+  void clear();
+
+ private:
+  struct Layer {
+    torch::Tensor data;
+    /// Value of positions outside of the map
+    float padValue = 0.0f;
+    /// Copy of the tile plane the layer is currently reflecting
+    TileBitPlane plane;
+    uint64_t version = 0;
+    /// (unit id) => footprint for HasStructure layers
+    std::unordered_map<UnitId, Rect> footprints;
+    FrameNum frame = -1;
+  };
+
+  Layer& layer(PlainFeatureType type, bool buildTiles);
+  void initStaticLayer(Layer& layer, PlainFeatureType type);
+  void updateTileLayer(
+      Layer& layer,
+      TileBitPlane const& plane,
+      uint64_t version,
+      float setValue,
+      float unsetValue,
+      bool buildTiles);
+  void updateStructureLayer(Layer& layer, bool buildTiles);
+  Rect mapRect(bool buildTiles) const;
+
+  State* state_;
+  std::mutex mutex_;
+  std::unordered_map<int, Layer> layers_;
+  std::unordered_map<int, Layer> layersBT_;
+};
+
+} // namespace cherrypi
@@ -7,6 +7,7 @@
 
 #include "features.h"
 
+#include "featurecache.h"
 #include "state.h"
 
 #include <common/assert.h>
@@ -170,7 +171,24 @@ FeatureData featurizePlain(
   }
 
   auto& reg = featureRegistry();
+  auto& cache = state->featureCache();
   Rect crop = boundingBox;
+  auto mapRect = state->mapRect();
+  if (types.size() == 1 && FeatureCache::isStatic(types[0]) &&
+      crop.x == mapRect.x && crop.y == mapRect.y && crop.w == mapRect.w &&
+      crop.h == mapRect.h) {
+    // The cached tensor can be returned as-is
+    auto it = reg.find(static_cast<int>(types[0]));
+    ASSERT(it != reg.end());
+    FeatureData ret;
+    ret.tensor = cache.staticLayer(types[0]);
+    ret.scale = 1;
+    ret.offset.x = crop.left();
+    ret.offset.y = crop.top();
+    ret.desc.emplace_back(types[0], it->second.name, it->second.numChannels);
+    return ret;
+  }
+
   int nchannels = 0;
   for (auto& type : types) {
     auto it = reg.find(static_cast<int>(type));
@@ -199,7 +217,11 @@ FeatureData featurizePlain(
     auto& info = it->second;
 
     int nchan = info.numChannels;
-    info.fn(ret.tensor.slice(0, chan, chan + nchan), state, crop);
+    if (FeatureCache::isCached(type)) {
+      cache.extract(type, ret.tensor.slice(0, chan, chan + nchan), crop);
+    } else {
+      info.fn(ret.tensor.slice(0, chan, chan + nchan), state, crop);
+    }
     ret.desc.emplace_back(type, info.name, nchan);
     chan += nchan;
   }
@@ -217,6 +239,7 @@ FeatureData featurizePlainBT(
   }
 
   auto& reg = featureRegistryBT();
+  auto& cache = state->featureCache();
   Rect crop = boundingBoxBT;
   int nchannels = 0;
   for (auto& type : types) {
@@ -247,7 +270,12 @@ FeatureData featurizePlainBT(
     auto& info = it->second;
 
     int nchan = info.numChannels;
-    info.fn(ret.tensor.slice(0, chan, chan + nchan), state, crop);
+    if (FeatureCache::isCached(type, true)) {
+      cache.extract(
+          type, ret.tensor.slice(0, chan, chan + nchan), crop, true);
+    } else {
+      info.fn(ret.tensor.slice(0, chan, chan + nchan), state, crop);
+    }
     ret.desc.emplace_back(type, info.name, nchan);
     chan += nchan;
   }
@@ -226,6 +226,10 @@ enum class SubsampleMethod {
  * Extracts plain features from the current state.
  * boundingBox defaults to all available data, but can also be larger to have
  * constant-size features irrespective of actual map size, for example.
+ * Map features are served from the FeatureCache of the state.
+ * NOTE: If a single static feature (see FeatureCache::isStatic()) is
+ * requested for the whole map, the returned tensor shares storage with the
+ * cache and must not be modified in-place.
  */
 FeatureData featurizePlain(
     State* state,
@@ -17,6 +17,21 @@
 namespace cherrypi {
 namespace featureimpl {
 
+/// Area occupied by a unit, in pixels
+Rect unitFootprint(Unit* u) {
+  auto leftPx = u->unit.pixel_x - u->type->dimensionLeft;
+  auto topPx = u->unit.pixel_y - u->type->dimensionUp;
+  auto rightPx = u->unit.pixel_x + u->type->dimensionRight + 1;
+  auto bottomPx = u->unit.pixel_y + u->type->dimensionDown + 1;
+  return Rect(leftPx, topPx, rightPx - leftPx, bottomPx - topPx);
+}
+
+/// Whether a unit is considered for the HasStructure features
+bool isStructure(Unit* u) {
+  return !(u->type->isMinerals || u->type->isGas) &&
+      (u->type->isBuilding || u->type->isSpecialBuilding);
+}
+
 namespace {
 
 int constexpr kNumTerrainValues = 3;
@@ -67,17 +82,18 @@ void extractStaticMapDataHelper(
   }
 }
 
+/// Adds `weight` times the covered area (in pixels) of every tile (of size
+/// `scale` pixels) that intersects `footprint`.
 template <int scale>
 void fillBlocking(
     torch::TensorAccessor<float, 2>& a,
-    Unit* u,
-    FeaturePositionMapper& mapper) {
-  auto px = u->unit.pixel_x;
-  auto py = u->unit.pixel_y;
-  auto leftPx = px - u->type->dimensionLeft;
-  auto topPx = py - u->type->dimensionUp;
-  auto rightPx = px + u->type->dimensionRight + 1;
-  auto bottomPx = py + u->type->dimensionDown + 1;
+    Rect const& footprint,
+    FeaturePositionMapper& mapper,
+    float weight = 1.0f) {
+  auto leftPx = footprint.left();
+  auto topPx = footprint.top();
+  auto rightPx = footprint.right();
+  auto bottomPx = footprint.bottom();
   auto left = leftPx / scale;
   auto top = topPx / scale;
   auto right = rightPx / scale;
@@ -97,12 +113,20 @@ void fillBlocking(
             (left != right ? (x == left ? scale - leftPx + x * scale
                                         : std::min(scale, rightPx - x * scale))
                            : rightPx - leftPx);
-        a[mpos.y][mpos.x] += xpart * ypart;
+        a[mpos.y][mpos.x] += weight * (xpart * ypart);
       }
     }
   }
 }
 
+template <int scale>
+void fillBlocking(
+    torch::TensorAccessor<float, 2>& a,
+    Unit* u,
+    FeaturePositionMapper& mapper) {
+  fillBlocking<scale>(a, unitFootprint(u), mapper);
+}
+
 } // namespace
 
 /**
@@ -286,8 +310,7 @@ void extractHasStructure(torch::Tensor t, State* state, Rect const& r) {
   FeaturePositionMapper mapper(r, state->mapRect());
   auto a = t.accessor<float, 3>()[0];
   for (auto* u : state->unitsInfo().liveUnits()) {
-    if (!(u->type->isMinerals || u->type->isGas) &&
-        (u->type->isBuilding || u->type->isSpecialBuilding)) {
+    if (isStructure(u)) {
       fillBlocking<tc::BW::XYPixelsPerWalktile>(a, u, mapper);
     }
   }
@@ -304,13 +327,55 @@ void extractHasStructureBT(torch::Tensor t, State* state, Rect const& r) {
   FeaturePositionMapper mapper(r, mapRectBT);
   auto a = t.accessor<float, 3>()[0];
   for (auto* u : state->unitsInfo().liveUnits()) {
-    if (!(u->type->isMinerals || u->type->isGas) &&
-        (u->type->isBuilding || u->type->isSpecialBuilding)) {
+    if (isStructure(u)) {
       fillBlocking<tc::BW::XYPixelsPerBuildtile>(a, u, mapper);
     }
   }
   t /= (tc::BW::XYPixelsPerBuildtile * tc::BW::XYPixelsPerBuildtile);
 }
 
+/**
+ * Adds the fraction of every walktile covered by `footprint` (in pixels),
+ * times `weight`. This is the contribution of a single structure to
+ * extractHasStructure().
+ */
+void addFootprint(
+    torch::Tensor t,
+    State* state,
+    Rect const& r,
+    Rect const& footprint,
+    float weight) {
+  FeaturePositionMapper mapper(r, state->mapRect());
+  auto a = t.accessor<float, 3>()[0];
+  fillBlocking<tc::BW::XYPixelsPerWalktile>(
+      a,
+      footprint,
+      mapper,
+      weight / (tc::BW::XYPixelsPerWalktile * tc::BW::XYPixelsPerWalktile));
+}
+
+/**
+ * Adds the fraction of every buildtile covered by `footprint` (in pixels),
+ * times `weight`. This is the contribution of a single structure to
+ * extractHasStructureBT().
+ */
+void addFootprintBT(
+    torch::Tensor t,
+    State* state,
+    Rect const& r,
+    Rect const& footprint,
+    float weight) {
+  auto mapRectBT = state->mapRect();
+  mapRectBT.w /= tc::BW::XYWalktilesPerBuildtile;
+  mapRectBT.h /= tc::BW::XYWalktilesPerBuildtile;
+  FeaturePositionMapper mapper(r, mapRectBT);
+  auto a = t.accessor<float, 3>()[0];
+  fillBlocking<tc::BW::XYPixelsPerBuildtile>(
+      a,
+      footprint,
+      mapper,
+      weight / (tc::BW::XYPixelsPerBuildtile * tc::BW::XYPixelsPerBuildtile));
+}
+
 } // namespace featureimpl
 } // namespace cherrypi
@@ -17,17 +17,14 @@ namespace featureimpl {
 
 namespace {
 
-auto const cast = [](auto const& val) -> float {
-  return static_cast<float>(val);
-};
-
-template <typename T, typename F = decltype(cast)>
-void extractTilesInfoHelper(
+/// Fills `t` (walktile resolution) from a tile bit plane.
+void extractTileBitPlaneHelper(
     torch::Tensor t,
     Rect const& boundingBox,
     State* state,
-    T Tile::*field,
-    F castfn = cast) {
+    TileBitPlane const& plane,
+    float setValue,
+    float unsetValue) {
   t.fill_(-1);
 
   // This is the region we are able to fill
@@ -42,29 +39,27 @@ void extractTilesInfoHelper(
   int aymax = aymin + ir.h;
 
   auto a = t.accessor<float, 3>()[0];
-  auto& tilesInfo = state->tilesInfo();
-
-  // TODO: This could probably be optimized by leveraging the lower resolution
-  // of TilesInfo, e.g. by manually filling the tensor in 4x4 steps.
+  unsigned constexpr kBits = TileBitPlane::kBitsPerWord;
   for (int ay = aymin, wy = ir.y; ay < aymax; ay++, wy++) {
     auto row = a[ay];
-    unsigned tileOff = TilesInfo::tilesWidth *
-        (wy / (unsigned)tc::BW::XYWalktilesPerBuildtile);
+    auto* words = plane.row(wy / (unsigned)tc::BW::XYWalktilesPerBuildtile);
     for (int ax = axmin, wx = ir.x; ax < axmax; ax++, wx++) {
       unsigned tileX = wx / (unsigned)tc::BW::XYWalktilesPerBuildtile;
-      auto& tile = tilesInfo.tiles[tileOff + tileX];
-      row[ax] = castfn(tile.*field);
+      bool set = (words[tileX / kBits] >> (tileX % kBits)) & 1;
+      row[ax] = set ? setValue : unsetValue;
     }
   }
 }
 
-template <typename T, typename F = decltype(cast)>
-void extractTilesInfoHelperBT(
+/// Fills `t` (build tile resolution) from a tile bit plane, processing a word
+/// of 64 tiles at a time.
+void extractTileBitPlaneHelperBT(
     torch::Tensor t,
     Rect const& boundingBoxBT,
     State* state,
-    T Tile::*field,
-    F castfn = cast) {
+    TileBitPlane const& plane,
+    float setValue,
+    float unsetValue) {
   t.fill_(-1);
 
   // This is the region we are able to fill
@@ -77,19 +72,22 @@ void extractTilesInfoHelperBT(
   }
   // Index bounds on tensor
   int axmin = ir.x - boundingBoxBT.x;
-  int axmax = axmin + ir.w;
   int aymin = ir.y - boundingBoxBT.y;
   int aymax = aymin + ir.h;
 
   auto a = t.accessor<float, 3>()[0];
-  auto& tilesInfo = state->tilesInfo();
-
+  unsigned constexpr kBits = TileBitPlane::kBitsPerWord;
   for (int ay = aymin, wy = ir.y; ay < aymax; ay++, wy++) {
     auto row = a[ay];
-    unsigned tileOff = TilesInfo::tilesWidth * wy;
-    for (int ax = axmin, wx = ir.x; ax < axmax; ax++, wx++) {
-      auto& tile = tilesInfo.tiles[tileOff + wx];
-      row[ax] = castfn(tile.*field);
+    auto* words = plane.row(wy);
+    int wx = ir.x;
+    int ax = axmin;
+    while (wx < ir.x + ir.w) {
+      uint64_t word = words[wx / kBits];
+      int end = std::min<int>(ir.x + ir.w, (wx / kBits + 1) * kBits);
+      for (; wx < end; wx++, ax++) {
+        row[ax] = ((word >> (wx % kBits)) & 1) ? setValue : unsetValue;
+      }
     }
   }
 }
@@ -101,9 +99,8 @@ void extractTilesInfoHelperBT(
  * (as opposed to being in the fog of war).
  */
 void extractFogOfWar(torch::Tensor t, State* state, Rect const& r) {
-  extractTilesInfoHelper(t, r, state, &Tile::visible, [](bool visible) {
-    return visible ? 0.0f : 1.0f;
-  });
+  extractTileBitPlaneHelper(
+      t, r, state, state->tilesInfo().layers().visible, 0.0f, 1.0f);
 }
 
 /**
@@ -111,23 +108,24 @@ void extractFogOfWar(torch::Tensor t, State* state, Rect const& r) {
  * (as opposed to being in the fog of war).
  */
 void extractFogOfWarBT(torch::Tensor t, State* state, Rect const& r) {
-  extractTilesInfoHelperBT(t, r, state, &Tile::visible, [](bool visible) {
-    return visible ? 0.0f : 1.0f;
-  });
+  extractTileBitPlaneHelperBT(
+      t, r, state, state->tilesInfo().layers().visible, 0.0f, 1.0f);
 }
 
 /**
  * 2D tensor representation of whether a tile has creep
  */
 void extractCreep(torch::Tensor t, State* state, Rect const& r) {
-  extractTilesInfoHelper(t, r, state, &Tile::hasCreep);
+  extractTileBitPlaneHelper(
+      t, r, state, state->tilesInfo().layers().creep, 1.0f, 0.0f);
 }
 
 /**
  * 2D tensor representation of whether a tile has creep
  */
 void extractCreepBT(torch::Tensor t, State* state, Rect const& r) {
-  extractTilesInfoHelperBT(t, r, state, &Tile::hasCreep);
+  extractTileBitPlaneHelperBT(
+      t, r, state, state->tilesInfo().layers().creep, 1.0f, 0.0f);
 }
 
 /**
@@ -138,7 +136,8 @@ void extractReservedAsUnbuildable(
     torch::Tensor t,
     State* state,
     Rect const& r) {
-  extractTilesInfoHelper(t, r, state, &Tile::reservedAsUnbuildable);
+  extractTileBitPlaneHelper(
+      t, r, state, state->tilesInfo().layers().reserved, 1.0f, 0.0f);
 }
 
 } // namespace featureimpl
@@ -200,6 +200,15 @@ struct Sample {
     }
   }
 
+  /// Calls f for every tensor of this sample (see common::SampleStore)
+  template <typename F>
+  void forEachTensor(F&& f) {
+    if (staticData) {
+      f(staticData->map.tensor);
+    }
+    f(units.tensor);
+  }
+
   torch::Tensor featurize(
       BosFeature feature,
       torch::Tensor buffer = torch::Tensor()) const;
@@ -231,6 +240,16 @@ struct EpisodeData {
   cpid::EpisodeKey episodeKey;
   std::vector<std::shared_ptr<cpid::ReplayBufferFrame>> frames;
 
+  /// Calls f for every tensor of this episode (see common::SampleStore)
+  template <typename F>
+  void forEachTensor(F&& f) {
+    for (auto& frame : frames) {
+      if (auto bframe = std::dynamic_pointer_cast<ReplayBufferFrame>(frame)) {
+        bframe->sample.forEachTensor(f);
+      }
+    }
+  }
+
   template <class Archive>
   void serialize(Archive& ar) {
     ar(gameId);
@@ -288,13 +288,20 @@ ag::Variant BuildingPlacerModel::makeInputBatch(
     valids.push_back(inp[4]);
   }
 
+  // Gather inputs in page-locked memory so that they can be copied to the
+  // GPU asynchronously
+  bool pinned = device.is_cuda();
+  auto batch = [&](ag::tensor_list const& lst, double pad) {
+    return common::makeBatch(lst, pad, pinned).to(device, pinned);
+  };
+
   // Pad positions with -1; they'll be ignored in scatterSum()
   return ag::VariantDict{
-      {"map", torch::stack(maps).to(device)},
-      {"units_pos", common::makeBatch(unitsPs, -1).to(device)},
-      {"units_data", common::makeBatch(unitsDs, 0).to(device)},
+      {"map", batch(maps, 0)},
+      {"units_pos", batch(unitsPs, -1)},
+      {"units_data", batch(unitsDs, 0)},
       {"type", torch::cat(types).to(device)},
-      {"valid_mask", torch::stack(valids).to(device)}};
+      {"valid_mask", batch(valids, 0)}};
 }
 
 ag::Variant BuildingPlacerModel::makeInputBatch(
@@ -91,6 +91,15 @@ struct BuildingPlacerSample {
   /// features.
   Position offsetToAction(int64_t offset, int scale = 1) const;
 
+  /// Calls f for every tensor of this sample (see common::SampleStore)
+  template <typename F>
+  void forEachTensor(F&& f) {
+    f(features.map.tensor);
+    f(features.units.positions);
+    f(features.units.data);
+    f(features.validLocations);
+  }
+
   template <class Archive>
   void serialize(Archive& ar, uint32_t const version) {
     ar(CEREAL_NVP(features.map),
@@ -15,6 +15,39 @@
 
 namespace cherrypi {
 
+namespace {
+
+bool resourcesOverlap(std::string const& a, std::string const& b) {
+  auto matches = [](std::string const& pattern, std::string const& name) {
+    if (pattern.empty() || pattern.back() != '*') {
+      return false;
+    }
+    auto prefixLen = pattern.size() - 1;
+    return name.compare(0, prefixLen, pattern, 0, prefixLen) == 0;
+  };
+  return a == b || matches(a, b) || matches(b, a);
+}
+
+bool anyOverlap(
+    std::vector<std::string> const& as,
+    std::vector<std::string> const& bs) {
+  for (auto const& a : as) {
+    for (auto const& b : bs) {
+      if (resourcesOverlap(a, b)) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+} // namespace
+
+bool ModuleDependencies::conflictsWith(ModuleDependencies const& other) const {
+  return anyOverlap(writes, other.reads) || anyOverlap(writes, other.writes) ||
+      anyOverlap(reads, other.writes);
+}
+
 Module::Module() {}
 
 std::shared_ptr<Module> Module::make(std::string const& typeName) {
@@ -8,6 +8,9 @@
 #pragma once
 
 #include <list>
+#include <optional>
+#include <string>
+#include <vector>
 
 #include <torchcraft/client.h>
 
@@ -22,6 +25,56 @@ class Task;
 struct UPCTuple;
 struct UpcPostData;
 
+/**
+ * Data dependencies of a module's step() function.
+ *
+ * Used by BasePlayer to step modules concurrently (see
+ * BasePlayer::setParallelModules()). Resources are free-form names, e.g.
+ * Blackboard keys; a name ending with '*' refers to all resources with the
+ * given prefix. Two modules depend on each other if one of them writes a
+ * resource that the other one reads or writes.
+ *
+ * Blackboard mutations (UPCs, tasks, commands, key-value storage) of
+ * concurrently stepped modules are applied in module order, so modules do not
+ * have to declare writes that no other module reads during its step(). Modules
+ * that post UPCs do need to declare writing them (see upcsFrom()).
+ *
+ * Other parts of State (e.g. UnitsInfo) are not protected unless a resource
+ * name is provided for them below. Modules should only declare dependencies if
+ * their step() does not mutate unprotected state.
+ *
+ * Most modules of the main pipeline exchange UPCs and units through the
+ * Blackboard and will hence be stepped in order. Modules that only read the
+ * game state and post commands (e.g. StaticDefenceFocusFireModule) can be
+ * stepped alongside them.
+ */
+struct ModuleDependencies {
+  /// Task and unit assignment as tracked by the Blackboard
+  static char constexpr kTasks[] = "tasks";
+  /// UPCs posted by any module
+  static char constexpr kAllUpcs[] = "upcs/*";
+  /// All key-value pairs stored on the Blackboard
+  static char constexpr kAllKeys[] = "keys/*";
+  /// Tile reservations in TilesInfo (see TilesInfo::reserveArea())
+  static char constexpr kReservedTiles[] = "tiles/reserved";
+  /// The Blackboard's trace dumper
+  static char constexpr kTrace[] = "trace";
+
+  std::vector<std::string> reads;
+  std::vector<std::string> writes;
+
+  /// Resource name for UPCs posted by the module with the given name
+  static std::string upcsFrom(std::string const& moduleName) {
+    return "upcs/" + moduleName;
+  }
+  /// Resource name for the Blackboard key with the given name
+  static std::string key(std::string const& name) {
+    return "keys/" + name;
+  }
+
+  bool conflictsWith(ModuleDependencies const& other) const;
+};
+
 /**
  * Interface for bot modules.
  *
@@ -51,6 +104,13 @@ class Module {
 
   virtual void step(State* s) {}
   virtual void onGameStart(State* s) {}
+
+  /// Data dependencies of the next call to step().
+  /// Modules without declared dependencies are never stepped concurrently
+  /// with other modules.
+  virtual std::optional<ModuleDependencies> dependencies(State* s) {
+    return std::nullopt;
+  }
   virtual void onGameEnd(State* s) {}
 
  protected:
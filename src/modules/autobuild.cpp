@@ -51,6 +51,17 @@ namespace cherrypi {
 
 REGISTER_SUBCLASS_0(Module, AutoBuildModule);
 
+namespace {
+// Number of buildStep() invocations between step budget checks in evaluate()
+int constexpr kBuildStepsPerSlice = 8;
+// Number of game frames that a suspended evaluate() may lag behind before its
+// plan is considered stale and planning starts over
+FrameNum constexpr kMaxEvaluationStaleness = 48;
+// Number of times in a row that evaluate() may restart planning due to
+// staleness. Afterwards, the suspended plan is finished regardless of its age.
+int constexpr kMaxEvaluationRestarts = 3;
+} // namespace
+
 namespace autobuild {
 
 thread_local int buildLogDepth = 0;
@@ -59,11 +70,7 @@ std::string buildLogIndent() {
 }
 
 bool hasUnit(const BuildState& st, const BuildType* type) {
-  auto i = st.units.find(type);
-  if (i == st.units.end()) {
-    return false;
-  }
-  return !i->second.empty();
+  return !st.units.get(type).empty();
 }
 
 bool hasUpgrade(const BuildState& st, const BuildType* type) {
@@ -85,22 +92,16 @@ bool has(const BuildState& st, const BuildType* type) {
 int countUnits(const BuildState& st, const BuildType* type) {
   if (type == buildtypes::Zerg_Larva) {
     int r = 0;
-    for (auto& v : st.units) {
-      const BuildType* t = v.first;
-      if (t == buildtypes::Zerg_Hatchery || t == buildtypes::Zerg_Lair ||
-          t == buildtypes::Zerg_Hive) {
-        for (auto& u : v.second) {
-          r += larvaCount(st, u);
-        }
+    for (const BuildType* t : {buildtypes::Zerg_Hatchery,
+                               buildtypes::Zerg_Lair,
+                               buildtypes::Zerg_Hive}) {
+      for (auto& u : st.units.get(t)) {
+        r += larvaCount(st, u);
       }
     }
     return r;
   }
-  auto i = st.units.find(type);
-  if (i == st.units.end()) {
-    return 0;
-  }
-  return i->second.size();
+  return st.units.count(type);
 }
 
 bool isInProduction(const BuildState& st, const BuildType* type) {
@@ -412,7 +413,7 @@ const BuildType* advance(BuildState& st, BuildEntry thing, int endFrame) {
   while (true) {
     while (!st.production.empty() && st.frame >= st.production.front().first) {
       const BuildType* t = st.production.front().second;
-      st.production.pop_front();
+      st.production.erase(st.production.begin());
       if (t->isUnit()) {
         if (t->isAddon) {
           for (auto& v : st.units[t->builder]) {
@@ -958,7 +959,11 @@ void AutoBuildTask::postBlackboardKey(
     const std::string& key,
     const Blackboard::Data& data) {
   if (!isSimulation) {
-    state_->board()->post(key, data);
+    if (evaluation_.running) {
+      pendingBoardKeys_.emplace_back(key, data);
+    } else {
+      state_->board()->post(key, data);
+    }
   }
 }
 
@@ -1033,41 +1038,79 @@ void AutoBuildTask::update(State* state) {
   draw(state);
 }
 
-void AutoBuildTask::evaluate(State* state, Module* module) {
-  initialBuildState = autobuild::getMyState(state);
-  currentBuildState = initialBuildState;
-
-  int endFrame = initialBuildState.frame + 15 * 60 * 4;
-
-  int firstFrameToBuildHatchery = 0;
-
-  auto& st = currentBuildState;
-
-  isSimulation = false;
+bool AutoBuildTask::evaluate(State* state, Module* module) {
   if (!module_) {
     LOG(FATAL) << "module_ is null";
   }
 
-  state->board()->remove(Blackboard::kGathererMinGasWorkers);
-  state->board()->remove(Blackboard::kGathererMaxGasWorkers);
-  preBuild(currentBuildState);
-  auto previousToLastState = st;
-  while (currentBuildState.frame < endFrame) {
-    if (firstFrameToBuildHatchery == 0 && currentBuildState.minerals >= 300 &&
-        autobuild::countPlusProduction(
-            currentBuildState, buildtypes::Zerg_Larva) == 0) {
-      firstFrameToBuildHatchery = currentBuildState.frame;
-    }
+  isSimulation = false;
+  auto& ev = evaluation_;
+  if (ev.running &&
+      state->currentFrame() - ev.startFrame > kMaxEvaluationStaleness &&
+      ev.numRestarts < kMaxEvaluationRestarts) {
+    // The game has advanced too far since planning started, so the plan would
+    // be based on stale information.
+    VLOG(2) << "Restarting build order evaluation started at frame "
+            << ev.startFrame;
+    ev.running = false;
+    ev.numRestarts++;
+  }
+  if (!ev.running) {
+    initialBuildState = autobuild::getMyState(state);
+    currentBuildState = initialBuildState;
+    ev.running = true;
+    ev.startFrame = state->currentFrame();
+    ev.endFrame = initialBuildState.frame + 15 * 60 * 4;
+    ev.firstFrameToBuildHatchery = 0;
+    pendingBoardKeys_.clear();
+
+    preBuild(currentBuildState);
+    ev.previousToLastState = currentBuildState;
+  }
+
+  // Step through the build order in slices so that we can suspend planning
+  // if we run out of time in this frame.
+  auto slice = [&] {
+    for (int i = 0; i < kBuildStepsPerSlice; i++) {
+      if (currentBuildState.frame >= ev.endFrame) {
+        return true;
+      }
+      if (ev.firstFrameToBuildHatchery == 0 &&
+          currentBuildState.minerals >= 300 &&
+          autobuild::countPlusProduction(
+              currentBuildState, buildtypes::Zerg_Larva) == 0) {
+        ev.firstFrameToBuildHatchery = currentBuildState.frame;
+      }
 
-    queue = [](autobuild::BuildState&) { return false; };
-    buildStep(currentBuildState);
-    if (!queue(currentBuildState)) {
-      break;
-    }
+      queue = [](autobuild::BuildState&) { return false; };
+      buildStep(currentBuildState);
+      if (!queue(currentBuildState)) {
+        return true;
+      }
 
-    previousToLastState = currentBuildState;
+      ev.previousToLastState = currentBuildState;
+    }
+    return false;
+  };
+  if (!state->runWithinStepBudget(slice)) {
+    VLOG(2) << "Step budget exhausted, suspending build order evaluation at "
+            << "frame " << currentBuildState.frame << " of " << ev.endFrame;
+    return false;
   }
   postBuild(currentBuildState);
+  ev.running = false;
+  ev.numRestarts = 0;
+
+  // Apply the Blackboard keys that the build order posted
+  state->board()->remove(Blackboard::kGathererMinGasWorkers);
+  state->board()->remove(Blackboard::kGathererMaxGasWorkers);
+  for (auto& entry : pendingBoardKeys_) {
+    state->board()->post(entry.first, entry.second);
+  }
+  pendingBoardKeys_.clear();
+
+  auto& previousToLastState = ev.previousToLastState;
+  auto firstFrameToBuildHatchery = ev.firstFrameToBuildHatchery;
 
   // Build macro hatcheries if needed.
   if (initialBuildState.autoBuildHatcheries &&
@@ -1085,7 +1128,8 @@ void AutoBuildTask::evaluate(State* state, Module* module) {
         autobuild::BuildEntry{t, {}});
   }
 
-  int frame = state->currentFrame();
+  // Planning may have been resumed, so refer to the frame it started at
+  int frame = initialBuildState.frame;
 
   // Figure out how many workers we need on gas based on how much gas we
   // actually spent in the simulation.
@@ -1231,6 +1275,7 @@ void AutoBuildTask::evaluate(State* state, Module* module) {
   }
 
   log(state);
+  return true;
 }
 
 void AutoBuildTask::simEvaluateFor(
@@ -1388,6 +1433,20 @@ class IncomeTrackerTask : public Task {
 };
 } // namespace
 
+std::optional<ModuleDependencies> AutoBuildModule::dependencies(
+    State* state) {
+  ModuleDependencies deps;
+  deps.reads = {ModuleDependencies::kAllUpcs,
+                ModuleDependencies::kTasks,
+                ModuleDependencies::kAllKeys,
+                ModuleDependencies::kReservedTiles};
+  deps.writes = {ModuleDependencies::kAllUpcs,
+                 ModuleDependencies::kTasks,
+                 ModuleDependencies::kAllKeys,
+                 ModuleDependencies::kReservedTiles};
+  return deps;
+}
+
 void AutoBuildModule::step(State* state) {
   checkForNewUPCs(state);
 
@@ -1414,9 +1473,11 @@ void AutoBuildModule::step(State* state) {
     auto abtask = std::dynamic_pointer_cast<AutoBuildTask>(task);
     if (abtask && abtask->status() == TaskStatus::Ongoing) {
       if (abtask->lastEvaluate == 0 || frame - abtask->lastEvaluate >= 15) {
-        // Time to replan!
-        abtask->evaluate(state, this);
-        abtask->lastEvaluate = frame;
+        // Time to replan! If planning does not finish within this step, it
+        // will be resumed in the next one.
+        if (abtask->evaluate(state, this)) {
+          abtask->lastEvaluate = frame;
+        }
       }
     }
   }
@@ -1501,8 +1562,10 @@ std::vector<std::string> AutoBuildTask::upgradesToString(State* state) {
 
 std::vector<std::vector<std::string>> AutoBuildTask::unitsToString(
     State* state) {
-  std::vector<BuildUnitPair> units{initialBuildState.units.begin(),
-                                   initialBuildState.units.end()};
+  std::vector<BuildUnitPair> units;
+  initialBuildState.units.forEach([&](const BuildType* type, auto const& list) {
+    units.emplace_back(type, list.vec());
+  });
   std::sort(units.begin(), units.end(), compareUnitsForDescription);
 
   std::vector<std::vector<std::string>> output;
@@ -1723,9 +1786,9 @@ void save(Archive& ar, BuildState const& st) {
   // We can't serialize BuildType pointers out of the box;
   // pack them into an integer instead
   std::unordered_map<BuildTypeId, std::vector<BuildStateUnit>> units;
-  for (auto const& it : st.units) {
-    units[buildTypeId(it.first)] = it.second;
-  }
+  st.units.forEach([&](const BuildType* type, auto const& list) {
+    units[buildTypeId(type)] = list.vec();
+  });
   std::unordered_set<BuildTypeId> upgradesAndTech;
   for (auto const& ut : st.upgradesAndTech) {
     upgradesAndTech.insert(buildTypeId(ut));
@@ -1736,7 +1799,7 @@ void save(Archive& ar, BuildState const& st) {
   }
   ar(units, upgradesAndTech, production);
 
-  ar(st.morphingHatcheries);
+  ar(st.morphingHatcheries.vec());
   ar(st.workers, st.refineries, st.availableGases);
   ar(st.autoBuildRefineries, st.autoBuildHatcheries, st.isExpanding);
 }
@@ -1757,7 +1820,7 @@ void load(Archive& ar, BuildState& st) {
   std::deque<std::pair<int, BuildTypeId>> production;
   ar(units, upgradesAndTech, production);
   for (auto const& it : units) {
-    st.units[buildTypeFromId(it.first)] = std::move(it.second);
+    st.units[buildTypeFromId(it.first)] = BuildStateUnits::List(it.second);
   }
   for (auto const& ut : upgradesAndTech) {
     st.upgradesAndTech.insert(buildTypeFromId(ut));
@@ -1766,7 +1829,10 @@ void load(Archive& ar, BuildState& st) {
     st.production.emplace_back(it.first, buildTypeFromId(it.second));
   }
 
-  ar(st.morphingHatcheries);
+  std::vector<BuildStateUnit> morphingHatcheries;
+  ar(morphingHatcheries);
+  st.morphingHatcheries =
+      common::CowVector<BuildStateUnit>(std::move(morphingHatcheries));
   ar(st.workers, st.refineries, st.availableGases);
   ar(st.autoBuildRefineries, st.autoBuildHatcheries, st.isExpanding);
 }
@@ -9,14 +9,18 @@
 
 #include "buildtype.h"
 #include "cherrypi.h"
+#include "common/assert.h"
+#include "common/cowvector.h"
 #include "module.h"
 #include "state.h"
 
+#include <algorithm>
 #include <array>
 #include <deque>
 #include <functional>
 #include <unordered_map>
 #include <unordered_set>
+#include <utility>
 #include <vector>
 
 namespace cherrypi {
@@ -43,6 +47,87 @@ struct BuildEntry {
   }
 };
 
+/**
+ * Units of a BuildState, grouped by type.
+ *
+ * Unit lists are kept in a flat table indexed by unit type id. The table and
+ * the lists are copy-on-write, so copying a BuildState does not copy any
+ * units; a list is only copied once it is modified. Prefer get() over
+ * operator[] for read-only access.
+ */
+class BuildStateUnits {
+ public:
+  using List = common::CowVector<BuildStateUnit>;
+
+  /// Units of the given type, which needs to be a unit type
+  List const& get(const BuildType* type) const {
+    static List const empty;
+    ASSERT(type->isUnit(), "BuildStateUnits requires a unit type");
+    auto i = size_t(type->unit);
+    return i < lists_.size() ? lists_[i] : empty;
+  }
+  /// Units of the given type, for modification
+  List& operator[](const BuildType* type) {
+    ASSERT(type->isUnit(), "BuildStateUnits requires a unit type");
+    auto i = size_t(type->unit);
+    if (i >= lists_.size()) {
+      lists_.resize(i + 1);
+    }
+    return lists_[i];
+  }
+  size_t count(const BuildType* type) const {
+    return get(type).size();
+  }
+
+  /// Calls f(type, units) for every type with at least one unit
+  template <typename F>
+  void forEach(F&& f) const {
+    for (size_t i = 0; i < lists_.size(); i++) {
+      if (!lists_[i].empty()) {
+        f(getUnitBuildType(i), lists_[i]);
+      }
+    }
+  }
+
+ private:
+  common::CowVector<List> lists_;
+};
+
+/// A set of BuildTypes, stored as a sorted copy-on-write vector
+class BuildTypeSet {
+ public:
+  using const_iterator = const BuildType* const*;
+
+  const_iterator begin() const {
+    return types_.begin();
+  }
+  const_iterator end() const {
+    return types_.end();
+  }
+  const_iterator find(const BuildType* type) const {
+    auto it = std::lower_bound(begin(), end(), type);
+    return it != end() && *it == type ? it : end();
+  }
+  size_t count(const BuildType* type) const {
+    return find(type) != end() ? 1 : 0;
+  }
+  size_t size() const {
+    return types_.size();
+  }
+  bool empty() const {
+    return types_.empty();
+  }
+  void insert(const BuildType* type) {
+    auto it = std::lower_bound(begin(), end(), type);
+    if (it == end() || *it != type) {
+      types_.emplace(it, type);
+    }
+  }
+
+ private:
+  common::CowVector<const BuildType*> types_;
+};
+
 /**
  * Describes a state of the game, either now or in a hypothetical future,
  * for use in AutoBuilds.
@@ -50,6 +135,9 @@ struct BuildEntry {
  * At the start of an AutoBuild, this reflects the current game state.
  * At each buildStep(), the BuildState is updated to reflect the
  * units/upgrades/tech purchased in the previous buildSteps().
+ *
+ * BuildStates are copied frequently during planning to evaluate alternatives,
+ * so all containers are copy-on-write and copies are cheap.
  */
 struct BuildState {
   int frame = 0;
@@ -61,11 +149,12 @@ struct BuildState {
   std::array<double, 3> usedSupply{};
   std::array<double, 3> maxSupply{};
   std::array<double, 3> inprodSupply{};
-  std::unordered_map<const BuildType*, std::vector<BuildStateUnit>> units;
-  std::unordered_set<const BuildType*> upgradesAndTech;
-  std::deque<std::pair<int, const BuildType*>> production;
-  std::vector<std::pair<int, BuildEntry>> buildOrder;
-  std::vector<BuildStateUnit> morphingHatcheries;
+  BuildStateUnits units;
+  BuildTypeSet upgradesAndTech;
+  /// Items in production, ordered by completion frame
+  common::CowVector<std::pair<int, const BuildType*>> production;
+  common::CowVector<std::pair<int, BuildEntry>> buildOrder;
+  common::CowVector<BuildStateUnit> morphingHatcheries;
 
   int workers = 0;
   int refineries = 0;
@@ -135,7 +224,20 @@ class AutoBuildTask : public MultiProxyTask {
 
   virtual void update(State* state) override;
 
-  void evaluate(State* state, Module* module);
+  /**
+   * Plans the build order for the current game state and posts UPCs for the
+   * next items.
+   *
+   * If the step budget is exhausted while stepping through the build order
+   * (see State::runWithinStepBudget()), planning is suspended and resumed by
+   * the next call, which may happen in a later game frame. Plans are based on
+   * the game state at the time planning started, so suspended planning is
+   * restarted if it lags behind the game by more than a few seconds. After a
+   * few restarts, the suspended plan is finished regardless of its age. Every
+   * call does a bounded amount of work. Returns true once planning is finished
+   * and UPCs have been posted.
+   */
+  bool evaluate(State* state, Module* module);
 
   void simEvaluateFor(autobuild::BuildState& st, FrameNum frames);
 
@@ -242,6 +344,23 @@ class AutoBuildTask : public MultiProxyTask {
   }
 
  private:
+  /// Progress of a suspended evaluate()
+  struct Evaluation {
+    bool running = false;
+    /// Game frame that initialBuildState was obtained at
+    FrameNum startFrame = -1;
+    /// Number of times planning was restarted due to staleness since the last
+    /// finished plan
+    int numRestarts = 0;
+    int endFrame = 0;
+    int firstFrameToBuildHatchery = 0;
+    autobuild::BuildState previousToLastState;
+  };
+  Evaluation evaluation_;
+  /// Keys posted via postBlackboardKey() during evaluate(), posted once the
+  /// evaluation is finished
+  std::vector<std::pair<std::string, Blackboard::Data>> pendingBoardKeys_;
+
   std::string frameToString(State* state);
   std::vector<std::vector<std::string>> unitsToString(State* state);
   std::vector<std::vector<std::string>> productionToString(State* state);
@@ -268,6 +387,9 @@ class AutoBuildModule : public Module {
   virtual void checkForNewUPCs(State* state);
 
   virtual void step(State* state) override;
+  /// Build orders may access arbitrary Blackboard keys and tile reservations
+  virtual std::optional<ModuleDependencies> dependencies(
+      State* state) override;
 };
 
 /**
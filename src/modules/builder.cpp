@@ -22,6 +22,17 @@ namespace cherrypi {
 
 REGISTER_SUBCLASS_0(Module, BuilderModule);
 
+std::optional<ModuleDependencies> BuilderModule::dependencies(State* state) {
+  ModuleDependencies deps;
+  deps.reads = {ModuleDependencies::kAllUpcs,
+                ModuleDependencies::kTasks,
+                ModuleDependencies::kReservedTiles};
+  deps.writes = {ModuleDependencies::kAllUpcs,
+                 ModuleDependencies::kTasks,
+                 ModuleDependencies::kReservedTiles};
+  return deps;
+}
+
 void BuilderModule::step(State* state) {
   auto board = state->board();
   int frame = state->currentFrame();
@@ -55,6 +55,7 @@ class BuilderModule : public Module {
   virtual ~BuilderModule() = default;
 
   virtual void step(State* s) override;
+  virtual std::optional<ModuleDependencies> dependencies(State* s) override;
 
   // TODO: Get rid of remaining module state.
   std::shared_ptr<BuilderControllerData> bcdata_;
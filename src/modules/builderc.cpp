@@ -40,7 +40,7 @@ int pxDistanceOfUnit(Unit* unit, BuildType const* type, Position const& pos) {
 BuilderControllerBase::BuilderControllerBase(
     Module* module,
     BuildType const* type,
-    std::unordered_map<Unit*, float> unitProbs,
+    UPCTuple::UnitMap unitProbs,
     std::shared_ptr<BuilderControllerData> bcdata)
     : Controller(module),
       type_(type),
@@ -378,7 +378,7 @@ bool BuilderControllerBase::findBuilder(State* state, Position const& pos) {
 WorkerBuilderController::WorkerBuilderController(
     Module* module,
     BuildType const* type,
-    std::unordered_map<Unit*, float> unitProbs,
+    UPCTuple::UnitMap unitProbs,
     std::shared_ptr<BuilderControllerData> bcdata,
     Position pos)
     : BuilderControllerBase(
@@ -808,7 +808,7 @@ std::string WorkerBuilderController::logPrefix() const {
 BuilderController::BuilderController(
     Module* module,
     BuildType const* type,
-    std::unordered_map<Unit*, float> unitProbs,
+    UPCTuple::UnitMap unitProbs,
     std::shared_ptr<BuilderControllerData> bcdata)
     : BuilderControllerBase(
           module,
@@ -10,6 +10,7 @@
 #include "controller.h"
 
 #include "modules/builder.h"
+#include "upc.h"
 
 namespace cherrypi {
 
@@ -27,7 +28,7 @@ class BuilderControllerBase : public Controller {
   BuilderControllerBase(
       Module* module,
       BuildType const* type,
-      std::unordered_map<Unit*, float> unitProbs,
+      UPCTuple::UnitMap unitProbs,
       std::shared_ptr<BuilderControllerData> bcdata);
   virtual ~BuilderControllerBase() = default;
   virtual const char* getName() const override {
@@ -67,7 +68,7 @@ class BuilderControllerBase : public Controller {
  protected:
   BuildType const* type_;
   Unit* builder_ = nullptr;
-  std::unordered_map<Unit*, float> unitProbs_;
+  UPCTuple::UnitMap unitProbs_;
   std::shared_ptr<BuilderControllerData> bcdata_;
   bool succeeded_ = false;
   bool failed_ = false;
@@ -86,7 +87,7 @@ class WorkerBuilderController : public BuilderControllerBase {
   WorkerBuilderController(
       Module* module,
       BuildType const* type,
-      std::unordered_map<Unit*, float> unitProbs,
+      UPCTuple::UnitMap unitProbs,
       std::shared_ptr<BuilderControllerData> bcdata,
       Position pos);
   virtual ~WorkerBuilderController() = default;
@@ -126,7 +127,7 @@ class BuilderController : public BuilderControllerBase {
   BuilderController(
       Module* module,
       BuildType const* type,
-      std::unordered_map<Unit*, float> unitProbs,
+      UPCTuple::UnitMap unitProbs,
       std::shared_ptr<BuilderControllerData> bcdata);
   virtual ~BuilderController() = default;
 
@@ -23,6 +23,21 @@ namespace cherrypi {
 
 REGISTER_SUBCLASS_0(Module, GathererModule);
 
+std::optional<ModuleDependencies> GathererModule::dependencies(State* state) {
+  // The controller instance is stored on the Blackboard
+  auto controllerKey = ModuleDependencies::key("controller_" + name() + "/*");
+  ModuleDependencies deps;
+  deps.reads = {ModuleDependencies::kAllUpcs,
+                ModuleDependencies::kTasks,
+                ModuleDependencies::key(Blackboard::kGathererMinGasWorkers),
+                ModuleDependencies::key(Blackboard::kGathererMaxGasWorkers),
+                controllerKey};
+  deps.writes = {ModuleDependencies::kAllUpcs,
+                 ModuleDependencies::kTasks,
+                 controllerKey};
+  return deps;
+}
+
 void GathererModule::step(State* state) {
   auto board = state->board();
 
@@ -29,6 +29,7 @@ class GathererModule : public Module {
   virtual ~GathererModule() = default;
 
   virtual void step(State* s) override;
+  virtual std::optional<ModuleDependencies> dependencies(State* s) override;
 };
 
 } // namespace cherrypi
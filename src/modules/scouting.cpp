@@ -669,7 +669,7 @@ void ScoutingModule::step(State* state) {
 
 Unit* ScoutingModule::findUnit(
     State* state,
-    std::unordered_map<Unit*, float> const& candidates,
+    UPCTuple::UnitMap const& candidates,
     Position const& pos) {
   auto board = state->board();
 
@@ -10,6 +10,7 @@
 #include "buildtype.h"
 #include "module.h"
 #include "task.h"
+#include "upc.h"
 
 namespace cherrypi {
 
@@ -38,7 +39,7 @@ class ScoutingModule : public Module {
  protected:
   Unit* findUnit(
       State* state,
-      std::unordered_map<Unit*, float> const&,
+      UPCTuple::UnitMap const&,
       Position const& pos);
   bool postTask(
       State* state,
@@ -21,6 +21,10 @@ struct Unit;
 class StaticDefenceFocusFireModule : public Module {
  public:
   virtual void step(State* s) override;
+  /// Only reads the game state and posts commands
+  virtual std::optional<ModuleDependencies> dependencies(State* s) override {
+    return ModuleDependencies();
+  }
 };
 
 } // namespace cherrypi
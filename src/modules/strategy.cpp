@@ -128,8 +128,10 @@ void StrategyModule::stepBuildOrder(State* state) {
   }
 
   // Look for create UPCs with empty state
-  for (auto& upcs : state->board()->upcsWithSharpCommand(Command::Create)) {
-    if (!upcs.second->state.is<UPCTuple::Empty>()) {
+  // Note that the view is invalidated once we spawn the task
+  for (auto& upcs :
+       state->board()->upcsWithSharpCommandView(Command::Create)) {
+    if (!upcs.second.upc->state.is<UPCTuple::Empty>()) {
       continue;
     }
 
@@ -9,12 +9,14 @@
 #include "dummytactics.h"
 
 #include "combatsim.h"
+#include "modules/cherryvisdumper.h"
 #include "player.h"
 #include "utils.h"
 
 #include <bwem/map.h>
 #include <deque>
 #include <glog/logging.h>
+#include <limits>
 #include <memory>
 #include <vector>
 
@@ -23,6 +25,20 @@ DEFINE_uint64(
     3,
     "How often between fight or flee computations");
 
+DEFINE_uint64(
+    tactics_sim_cache_size,
+    0,
+    "Number of combat simulation outcomes to cache (0 to disable). Cached "
+    "outcomes are approximate and may change fight or flee decisions");
+DEFINE_int32(
+    tactics_sim_cache_position_tolerance,
+    4,
+    "Walktiles by which unit positions may differ for cached simulations");
+DEFINE_int32(
+    tactics_sim_cache_hp_buckets,
+    8,
+    "Number of HP and shield buckets for cached simulations");
+
 DEFINE_double(
     relative_vs_absolute,
     0.75,
@@ -46,6 +62,14 @@ float constexpr kMaxFleeSearchDistance = 4 * 20;
 // included in the combat simulation to determine fight or flight.
 float constexpr kNearbyUnitDistance = 4 * 30;
 uint16_t constexpr kDefaultFleeScore = 0xffff;
+// Number of tiles expanded between step budget checks when computing flee
+// scores
+size_t constexpr kFleeScoreNodesPerSlice = 4096;
+// Maximum number of frames that process() may be deferred if the step budget
+// is exhausted
+FrameNum constexpr kMaxProcessDeferral = 8;
+// Interval in which combat simulation cache counters are added to the trace
+FrameNum constexpr kSimCacheDumpInterval = 24 * 60;
 
 template <typename Units>
 double scoreTeam(Units&& units) {
@@ -94,77 +118,6 @@ double winRatio(OurUnits&& ourUnits, TheirUnits&& theirUnits) {
   return scoreTeam(ourUnits) * ourMult / (scoreTeam(theirUnits) * theirMult);
 }
 
-void updateFleeScore(State* state, std::vector<uint16_t>& fleeScore) {
-  std::fill(fleeScore.begin(), fleeScore.end(), kDefaultFleeScore);
-
-  auto& tilesInfo = state->tilesInfo();
-  auto* tilesData = tilesInfo.tiles.data();
-
-  const int mapWidth = state->mapWidth();
-  const int mapHeight = state->mapHeight();
-
-  struct OpenNode {
-    const Tile* tile;
-    uint16_t distance;
-  };
-
-  std::deque<OpenNode> open;
-  for (Unit* u : state->unitsInfo().myResourceDepots()) {
-    auto* tile = tilesInfo.tryGetTile(u->x, u->y);
-    if (tile) {
-      open.push_back({tile, 1});
-      fleeScore.at(tile - tilesData) = 0;
-    }
-  }
-  while (!open.empty()) {
-    OpenNode curNode = open.front();
-    open.pop_front();
-
-    auto add = [&](const Tile* ntile) {
-      if (!curNode.tile->entirelyWalkable) {
-        return;
-      }
-
-      auto& v = fleeScore[ntile - tilesData];
-      if (v != kDefaultFleeScore) {
-        return;
-      }
-      v = curNode.distance;
-      open.push_back({ntile, (uint16_t)(curNode.distance + 1)});
-    };
-
-    const Tile* tile = curNode.tile;
-
-    if (tile->x > 0) {
-      add(tile - 1);
-      if (tile->y > 0) {
-        add(tile - 1 - TilesInfo::tilesWidth);
-        add(tile - TilesInfo::tilesWidth);
-      }
-      if (tile->y < mapHeight - tc::BW::XYWalktilesPerBuildtile) {
-        add(tile - 1 + TilesInfo::tilesHeight);
-        add(tile + TilesInfo::tilesHeight);
-      }
-    } else {
-      if (tile->y > 0) {
-        add(tile - TilesInfo::tilesWidth);
-      }
-      if (tile->y < mapHeight - tc::BW::XYWalktilesPerBuildtile) {
-        add(tile + TilesInfo::tilesHeight);
-      }
-    }
-    if (tile->x < mapWidth - tc::BW::XYWalktilesPerBuildtile) {
-      add(tile + 1);
-      if (tile->y > 0) {
-        add(tile + 1 - TilesInfo::tilesWidth);
-      }
-      if (tile->y < mapHeight - tc::BW::XYWalktilesPerBuildtile) {
-        add(tile + 1 + TilesInfo::tilesHeight);
-      }
-    }
-  }
-}
-
 double convertSimToScore(
     CombatSim sim,
     std::vector<Unit*> allies,
@@ -232,6 +185,87 @@ double convertSimToScore(
 
 } // namespace
 
+void TacticsFleeScoreJob::start(State* state) {
+  std::fill(fleeScore.begin(), fleeScore.end(), kDefaultFleeScore);
+  open.clear();
+  running = true;
+
+  auto& tilesInfo = state->tilesInfo();
+  auto* tilesData = tilesInfo.tiles.data();
+  for (Unit* u : state->unitsInfo().myResourceDepots()) {
+    auto* tile = tilesInfo.tryGetTile(u->x, u->y);
+    if (tile) {
+      open.push_back({size_t(tile - tilesData), 1});
+      fleeScore.at(tile - tilesData) = 0;
+    }
+  }
+}
+
+bool TacticsFleeScoreJob::step(State* state, size_t maxNodes) {
+  auto& tilesInfo = state->tilesInfo();
+  // Walkability is read from the packed layer so that the flood fill does not
+  // need to touch the Tile structs at all
+  auto& walkable = tilesInfo.layers().walkable;
+
+  const unsigned mapTileWidth = tilesInfo.mapTileWidth();
+  const unsigned mapTileHeight = tilesInfo.mapTileHeight();
+  const size_t stride = TilesInfo::tilesWidth;
+
+  for (size_t n = 0; n < maxNodes && !open.empty(); n++) {
+    auto curNode = open.front();
+    open.pop_front();
+    if (!walkable.test(curNode.index)) {
+      continue;
+    }
+
+    auto add = [&](size_t nindex) {
+      auto& v = fleeScore[nindex];
+      if (v != kDefaultFleeScore) {
+        return;
+      }
+      v = curNode.distance;
+      open.push_back({nindex, (uint16_t)(curNode.distance + 1)});
+    };
+
+    const size_t index = curNode.index;
+    const unsigned tileX = index % stride;
+    const unsigned tileY = index / stride;
+    const bool up = tileY > 0;
+    const bool down = tileY + 1 < mapTileHeight;
+
+    if (tileX > 0) {
+      add(index - 1);
+      if (up) {
+        add(index - 1 - stride);
+      }
+      if (down) {
+        add(index - 1 + stride);
+      }
+    }
+    if (up) {
+      add(index - stride);
+    }
+    if (down) {
+      add(index + stride);
+    }
+    if (tileX + 1 < mapTileWidth) {
+      add(index + 1);
+      if (up) {
+        add(index + 1 - stride);
+      }
+      if (down) {
+        add(index + 1 + stride);
+      }
+    }
+  }
+
+  if (open.empty()) {
+    running = false;
+    return true;
+  }
+  return false;
+}
+
 void TacticsState::addEnemyUnitToGroup(
     State* state,
     Unit* u,
@@ -1117,30 +1151,39 @@ std::pair<double, double> TacticsState::combatSimCalculateFightScoreMod(
     }
   }
 
+  // All variants are simulated in a single batch
   auto num_to_avg_over = 2;
+  std::vector<CombatSim> sims(num_to_avg_over);
+  std::vector<Unit*> allyTeam;
+  std::vector<Unit*> enemyTeam;
   for (int i = 0; i < num_to_avg_over; ++i) {
-    std::vector<Unit*> allyTeam;
-    std::vector<Unit*> enemyTeam;
-    CombatSim sim;
+    CombatSim& sim = sims[i];
     if (i == 1) {
       sim.speedMult = 0.5;
     }
+    // Units are accepted regardless of the speed multiplier, so the teams are
+    // the same for all variants
     for (Unit* u : nearbyAllies) {
       auto used = sim.addUnit(u);
-      if (used) {
+      if (used && i == 0) {
         allyTeam.emplace_back(u);
       }
     }
     for (Unit* u : nearbyEnemies) {
       if (!u->type->isWorker && u->type != buildtypes::Zerg_Overlord) {
         auto used = sim.addUnit(u);
-        if (used) {
+        if (used && i == 0) {
           enemyTeam.emplace_back(u);
         }
       }
     }
-    sim.run(10 * 24);
-
+  }
+  if (simCache_) {
+    simCache_->run(sims, 10 * 24);
+  } else {
+    CombatSimBatch().run(sims, 10 * 24);
+  }
+  for (auto& sim : sims) {
     score += convertSimToScore(sim, allyTeam, enemyTeam);
   }
 
@@ -1693,7 +1736,34 @@ Position TacticsState::findMoveAwayPos(
   return Position();
 }
 
-void TacticsModule::onGameEnd(State* state) {}
+void TacticsModule::onGameEnd(State* state) {
+  if (simCache_) {
+    dumpSimCacheStats(state);
+    for (auto& counter : simCache_->getCounters()) {
+      VLOG(1) << "Combat simulation cache " << counter.first << ": "
+              << counter.second;
+    }
+    for (auto& time : simCache_->getTimes()) {
+      VLOG(1) << "Combat simulation cache " << time.first << " time: "
+              << time.second.count() << "ms";
+    }
+  }
+}
+
+void TacticsModule::dumpSimCacheStats(State* state) {
+  auto dumper = state->board()->getTraceDumper();
+  if (!simCache_ || !dumper) {
+    return;
+  }
+  for (auto& counter : simCache_->getCounters()) {
+    dumper->dumpGameValue(
+        state, "tactics_sim_cache_" + counter.first, counter.second);
+  }
+  for (auto& time : simCache_->getTimes()) {
+    dumper->dumpGameValue(
+        state, "tactics_sim_cache_" + time.first + "_ms", time.second.count());
+  }
+}
 
 void TacticsModule::formGroups(
     State* state,
@@ -1980,8 +2050,18 @@ void TacticsModule::process(State* state, int srcUpcId) {
     return;
   }
 
+  if (!simCache_ && FLAGS_tactics_sim_cache_size > 0) {
+    CombatSimCache::Options options;
+    options.capacity = FLAGS_tactics_sim_cache_size;
+    options.positionTolerance =
+        std::max(1, FLAGS_tactics_sim_cache_position_tolerance);
+    options.hpBuckets = std::max(1, FLAGS_tactics_sim_cache_hp_buckets);
+    simCache_ = std::make_shared<CombatSimCache>(options);
+  }
+
   TacticsState tstate;
   tstate.srcUpcId_ = srcUpcId;
+  tstate.simCache_ = simCache_.get();
   std::vector<Unit*> leftoverWorkers;
   std::unordered_set<Unit*> wasInAGroup;
 
@@ -2042,14 +2122,27 @@ void TacticsModule::moveUnit(
 
 UpcId TacticsModule::findSourceUpc(State* state) {
   // Find 'Delete' UPC with unspecified (empty) units
-  for (auto& upcs : state->board()->upcsWithCommand(Command::Delete, 0.5)) {
-    if (upcs.second->unit.empty()) {
+  for (auto& upcs :
+       state->board()->upcsWithCommandView(Command::Delete, 0.5)) {
+    if (upcs.second.upc->unit.empty()) {
       return upcs.first;
     }
   }
   return -1;
 }
 
+std::optional<ModuleDependencies> TacticsModule::dependencies(State* state) {
+  ModuleDependencies deps;
+  deps.reads = {ModuleDependencies::kAllUpcs,
+                ModuleDependencies::kTasks,
+                ModuleDependencies::key("TacticsAttack"),
+                ModuleDependencies::key("TacticsDisabled")};
+  deps.writes = {ModuleDependencies::kAllUpcs,
+                 ModuleDependencies::kTasks,
+                 ModuleDependencies::kTrace};
+  return deps;
+}
+
 void TacticsModule::step(State* state) {
   auto board = state->board();
 
@@ -2061,24 +2154,58 @@ void TacticsModule::step(State* state) {
 
   board->consumeUPC(srcUpcId, this);
 
+  // Periodic map updates are postponed while the step budget is exhausted,
+  // except for the very first one.
   if (lastUpdateInBaseArea_ == 0 ||
-      state->currentFrame() - lastUpdateInBaseArea_ >= 60) {
+      (state->currentFrame() - lastUpdateInBaseArea_ >= 60 &&
+       !state->stepBudgetExhausted())) {
     lastUpdateInBaseArea_ = state->currentFrame();
     utils::updateInBaseArea(state, inBaseArea_);
   }
 
-  if (lastUpdateFleeScore_ == 0 ||
-      state->currentFrame() - lastUpdateFleeScore_ >= 122) {
-    lastUpdateFleeScore_ = state->currentFrame();
-    updateFleeScore(state, fleeScore_);
+  // Flee scores are computed in a separate buffer so that the flood fill can
+  // be resumed in later frames if we run out of time.
+  if (!fleeScoreJob_.running &&
+      (lastUpdateFleeScore_ == 0 ||
+       state->currentFrame() - lastUpdateFleeScore_ >= 122)) {
+    fleeScoreJob_.start(state);
+  }
+  if (fleeScoreJob_.running) {
+    auto slice = [&] {
+      return fleeScoreJob_.step(state, kFleeScoreNodesPerSlice);
+    };
+    bool done = lastUpdateFleeScore_ == 0
+        ? fleeScoreJob_.step(state, std::numeric_limits<size_t>::max())
+        : state->runWithinStepBudget(slice);
+    if (done) {
+      lastUpdateFleeScore_ = state->currentFrame();
+      std::swap(fleeScore_, fleeScoreJob_.fleeScore);
+    }
   }
 
   if (lastProcess_ == 0 ||
       (uint64_t)(state->currentFrame() - lastProcess_) >=
           FLAGS_tactics_fight_or_flee_interval) {
+    if (lastProcess_ != 0 && state->stepBudgetExhausted()) {
+      if (processDeferredSince_ < 0) {
+        processDeferredSince_ = state->currentFrame();
+      }
+      if (state->currentFrame() - processDeferredSince_ <
+          kMaxProcessDeferral) {
+        VLOG(2) << "Step budget exhausted, deferring fight/flee processing";
+        return;
+      }
+    }
+    processDeferredSince_ = -1;
     lastProcess_ = state->currentFrame();
     process(state, srcUpcId);
   }
+
+  if (simCache_ &&
+      state->currentFrame() - lastSimCacheDump_ >= kSimCacheDumpInterval) {
+    lastSimCacheDump_ = state->currentFrame();
+    dumpSimCacheStats(state);
+  }
 }
 
 } // namespace cherrypi
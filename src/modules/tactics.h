@@ -12,12 +12,15 @@
 #include "task.h"
 #include "tilesinfo.h"
 
+#include <deque>
 #include <random>
 
 DECLARE_uint64(tactics_fight_or_flee_interval);
+DECLARE_uint64(tactics_sim_cache_size);
 
 namespace cherrypi {
 
+class CombatSimCache;
 struct Unit;
 
 class TacticsTask : public Task {
@@ -91,9 +94,32 @@ struct TacticsFightScores {
   bool groundFight = true;
 };
 
+/// Flood fill from our resource depots that can be spread over several
+/// frames. Once done, `fleeScore` holds the distance of each tile to the
+/// nearest depot.
+struct TacticsFleeScoreJob {
+  struct OpenNode {
+    size_t index;
+    uint16_t distance;
+  };
+
+  std::vector<uint16_t> fleeScore =
+      std::vector<uint16_t>(TilesInfo::tilesWidth * TilesInfo::tilesHeight);
+  std::deque<OpenNode> open;
+  bool running = false;
+
+  /// Resets flee scores and seeds the flood fill with our resource depots
+  void start(State* state);
+  /// Expands up to maxNodes nodes of the flood fill; returns true once done
+  bool step(State* state, size_t maxNodes);
+};
+
 struct TacticsState {
  public:
   int srcUpcId_;
+  /// Outcomes of previous combat simulations, owned by the module. May be
+  /// null, in which case all fights are simulated.
+  CombatSimCache* simCache_ = nullptr;
   // The distance around each enemy unit that will be considered "inside" their
   // group. Any of our units in this area will be assigned to the group, and
   // this effectively ends up being the distance away from enemy units that
@@ -215,6 +241,13 @@ class TacticsModule : public Module {
  public:
   virtual void step(State* s) override;
   virtual void onGameEnd(State* s) override;
+  virtual std::optional<ModuleDependencies> dependencies(State* s) override;
+
+  /// Cache of combat simulation outcomes; null unless enabled via
+  /// -tactics_sim_cache_size
+  CombatSimCache* combatSimCache() const {
+    return simCache_.get();
+  }
 
  protected:
   UpcId findSourceUpc(State* s);
@@ -225,6 +258,9 @@ class TacticsModule : public Module {
 
   // Methods likely useful in all TacticsModule subclasses
 
+  /// Adds combat simulation cache counters to the CherryVis trace
+  void dumpSimCacheStats(State* state);
+
   /// Create groups based on distance rules, useful for the
   /// scouting/worker/search and destroy functionality.
   void formGroups(
@@ -287,6 +323,9 @@ class TacticsModule : public Module {
   std::vector<uint16_t> fleeScore_ =
       std::vector<uint16_t>(TilesInfo::tilesWidth * TilesInfo::tilesHeight);
   FrameNum lastUpdateFleeScore_ = 0;
+  TacticsFleeScoreJob fleeScoreJob_;
+  /// Frame of the first process() that was deferred due to the step budget
+  FrameNum processDeferredSince_ = -1;
 
   std::unordered_map<Unit*, std::pair<int, Position>> searchAndDestroyTarget_;
   std::unordered_map<Unit*, std::pair<int, Position>> scoutTarget_;
@@ -295,6 +334,9 @@ class TacticsModule : public Module {
   std::unordered_map<Unit*, int> lastTargetInRange_;
   std::unordered_map<Unit*, int> lastMove_;
 
+  std::shared_ptr<CombatSimCache> simCache_;
+  FrameNum lastSimCacheDump_ = 0;
+
   virtual bool alwaysFight() {
     return false;
   }
@@ -23,6 +23,11 @@ class TopModule : public Module {
   virtual ~TopModule() = default;
 
   virtual void step(State* s);
+  /// Only inspects and posts its own UPCs
+  virtual std::optional<ModuleDependencies> dependencies(State* s) override {
+    auto upcs = ModuleDependencies::upcsFrom(name());
+    return ModuleDependencies{{upcs}, {upcs}};
+  }
 };
 
 } // namespace cherrypi
@@ -249,6 +249,16 @@ void UPCToCommandModule::stepUPC(
   }
 }
 
+std::optional<ModuleDependencies> UPCToCommandModule::dependencies(
+    State* state) {
+  ModuleDependencies deps;
+  deps.reads = {ModuleDependencies::kAllUpcs,
+                ModuleDependencies::kReservedTiles};
+  // Consumes UPCs from all other modules
+  deps.writes = {ModuleDependencies::kAllUpcs};
+  return deps;
+}
+
 void UPCToCommandModule::step(State* state) {
   UPCToCommandState upcToCommandState;
 
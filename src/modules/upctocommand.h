@@ -26,6 +26,7 @@ class UPCToCommandModule : public Module {
   virtual ~UPCToCommandModule() = default;
 
   virtual void step(State* s);
+  virtual std::optional<ModuleDependencies> dependencies(State* s) override;
 
  private:
   struct UPCToCommandState {
@@ -7,6 +7,7 @@
 
 #include "state.h"
 
+#include "features/featurecache.h"
 #include "upcfilter.h"
 #include "utils.h"
 
@@ -43,7 +44,8 @@ State::State(std::shared_ptr<tc::Client> client, const StateConfig& config)
       config_(config),
       board_(new Blackboard(this)),
       mapWidth_(tcstate_->map_size[0]),
-      mapHeight_(tcstate_->map_size[1]) {
+      mapHeight_(tcstate_->map_size[1]),
+      featureCache_(std::make_unique<FeatureCache>(this)) {
   currentFrame_ = tcstate_->frame_from_bwapi;
   // Note that for replays, playerId_ will default to 0 until setPerspective()
   // is called.
@@ -115,6 +117,14 @@ void State::setCollectTimers(bool collect) {
   collectTimers_ = collect;
 }
 
+Duration State::remainingStepBudget() const {
+  if (stepDeadline_ == hires_clock::time_point::max()) {
+    return Duration::max();
+  }
+  return std::chrono::duration_cast<Duration>(
+      stepDeadline_ - hires_clock::now());
+}
+
 void State::update() {
   // Nuke before starting to collect timings
   stateUpdateTimeSpent_.clear();
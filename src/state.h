@@ -28,6 +28,8 @@ class TCGame;
 
 namespace cherrypi {
 
+class FeatureCache;
+
 /// Type to represent upgrade level values
 typedef int UpgradeLevel;
 
@@ -128,6 +130,10 @@ class State {
   AreaInfo& areaInfo() {
     return areaInfo_;
   }
+  /// Per-game cache used by featurizePlain() and featurizePlainBT()
+  FeatureCache& featureCache() {
+    return *featureCache_;
+  }
 
   std::vector<std::pair<std::string, std::chrono::milliseconds>>
   getStateUpdateTimes() const {
@@ -183,6 +189,42 @@ class State {
 
   void setCollectTimers(bool collect);
 
+  /// Point in time by which the current step should be done.
+  /// This is hires_clock::time_point::max() if no step budget has been set
+  /// (see BasePlayer::setStepBudget()).
+  hires_clock::time_point stepDeadline() const {
+    return stepDeadline_;
+  }
+  void setStepDeadline(hires_clock::time_point deadline) {
+    stepDeadline_ = deadline;
+  }
+  /// Time left until the deadline of the current step.
+  /// Negative if the deadline has passed already.
+  Duration remainingStepBudget() const;
+  /// Returns true if less than `reserve` is left until the deadline of the
+  /// current step, i.e. if deferrable work should be postponed.
+  bool stepBudgetExhausted(Duration reserve = Duration::zero()) const {
+    return remainingStepBudget() <= reserve;
+  }
+
+  /**
+   * Runs a resumable job within the budget of the current step.
+   *
+   * `slice` performs a bounded amount of work and returns true once the job is
+   * done. It is invoked at least once and then repeatedly until it either
+   * returns true or the step budget is exhausted. Returns whether the job is
+   * done; if not, it should be resumed in a later step.
+   */
+  template <typename F>
+  bool runWithinStepBudget(F&& slice, Duration reserve = Duration::zero()) {
+    do {
+      if (slice()) {
+        return true;
+      }
+    } while (!stepBudgetExhausted(reserve));
+    return false;
+  }
+
   UnitsInfo* unitsInfoPtr() {
     return &unitsInfo_;
   }
@@ -237,9 +279,11 @@ class State {
   UnitsInfo unitsInfo_{this};
   TilesInfo tilesInfo_{this};
   AreaInfo areaInfo_{this};
+  std::unique_ptr<FeatureCache> featureCache_;
 
   bool sawFirstEnemyUnit_ = false;
   bool collectTimers_ = false;
+  hires_clock::time_point stepDeadline_ = hires_clock::time_point::max();
 
   Tech2StatusMap tech2StatusMap_;
   Upgrade2LevelMap upgrade2LevelMap_;
@@ -11,6 +11,7 @@
 #include "state.h"
 #include "utils.h"
 
+#include <algorithm>
 #include <array>
 #include <glog/logging.h>
 #include <stdexcept>
@@ -19,6 +20,99 @@ namespace cherrypi {
 
 static const FogOfWar FOW;
 
+uint64_t TileBitPlane::wordMask(unsigned word, unsigned x0, unsigned x1) {
+  unsigned lo = std::max(x0, word * kBitsPerWord) - word * kBitsPerWord;
+  unsigned hi =
+      std::min(x1, (word + 1) * kBitsPerWord) - word * kBitsPerWord;
+  if (lo >= hi) {
+    return 0;
+  }
+  uint64_t mask = hi == kBitsPerWord ? ~uint64_t(0)
+                                     : (uint64_t(1) << hi) - uint64_t(1);
+  return mask & ~((uint64_t(1) << lo) - uint64_t(1));
+}
+
+size_t TileBitPlane::count() const {
+  size_t n = 0;
+  for (uint64_t w : words_) {
+    n += popcount(w);
+  }
+  return n;
+}
+
+size_t TileBitPlane::countInRect(
+    unsigned x0,
+    unsigned y0,
+    unsigned x1,
+    unsigned y1) const {
+  x1 = std::min(x1, kWidth);
+  y1 = std::min(y1, kHeight);
+  if (x0 >= x1 || y0 >= y1) {
+    return 0;
+  }
+  size_t n = 0;
+  unsigned w0 = x0 / kBitsPerWord;
+  unsigned w1 = (x1 - 1) / kBitsPerWord;
+  for (unsigned w = w0; w <= w1; w++) {
+    uint64_t mask = wordMask(w, x0, x1);
+    for (unsigned y = y0; y < y1; y++) {
+      n += popcount(row(y)[w] & mask);
+    }
+  }
+  return n;
+}
+
+bool TileBitPlane::anyInRect(
+    unsigned x0,
+    unsigned y0,
+    unsigned x1,
+    unsigned y1) const {
+  x1 = std::min(x1, kWidth);
+  y1 = std::min(y1, kHeight);
+  if (x0 >= x1 || y0 >= y1) {
+    return false;
+  }
+  unsigned w0 = x0 / kBitsPerWord;
+  unsigned w1 = (x1 - 1) / kBitsPerWord;
+  for (unsigned w = w0; w <= w1; w++) {
+    uint64_t mask = wordMask(w, x0, x1);
+    for (unsigned y = y0; y < y1; y++) {
+      if (row(y)[w] & mask) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+TileBitPlane& TileBitPlane::operator&=(TileBitPlane const& other) {
+  for (size_t i = 0; i < words_.size(); i++) {
+    words_[i] &= other.words_[i];
+  }
+  return *this;
+}
+
+TileBitPlane& TileBitPlane::operator|=(TileBitPlane const& other) {
+  for (size_t i = 0; i < words_.size(); i++) {
+    words_[i] |= other.words_[i];
+  }
+  return *this;
+}
+
+TileBitPlane& TileBitPlane::operator^=(TileBitPlane const& other) {
+  for (size_t i = 0; i < words_.size(); i++) {
+    words_[i] ^= other.words_[i];
+  }
+  return *this;
+}
+
+TileBitPlane& TileBitPlane::andNot(TileBitPlane const& other) {
+  for (size_t i = 0; i < words_.size(); i++) {
+    words_[i] &= ~other.words_[i];
+  }
+  return *this;
+}
+
 TilesInfo::TilesInfo(State* state) : state_(state) {
   mapTileWidth_ = state->mapWidth() / (unsigned)tc::BW::XYWalktilesPerBuildtile;
   mapTileHeight_ =
@@ -30,6 +124,8 @@ TilesInfo::TilesInfo(State* state) : state_(state) {
     throw std::runtime_error("bad map height");
   }
   tiles.resize(tilesHeight * tilesWidth);
+  layers_.lastSeen.resize(tilesHeight * tilesWidth, 0);
+  layers_.height.resize(tilesHeight * tilesWidth, 0);
 
   auto tcstate = state->tcstate();
   for (unsigned tileY = 0; tileY != mapTileHeight(); ++tileY) {
@@ -50,6 +146,11 @@ TilesInfo::TilesInfo(State* state) : state_(state) {
         }
       }
       t.entirelyWalkable = entirelyWalkable;
+
+      size_t index = tilesWidth * tileY + tileX;
+      layers_.buildable.set(index, t.buildable);
+      layers_.walkable.set(index, t.entirelyWalkable);
+      layers_.height.at(index) = uint8_t(t.height);
     }
   }
 }
@@ -94,6 +195,8 @@ void TilesInfo::postUnitsUpdate() {
         t.hasCreep = (tcframe->creep_map[index / 8] >> (index % 8)) & 1;
       }
     });
+
+    syncDynamicLayers();
   }
 
   auto anticipateCreep = [&]() {
@@ -360,6 +463,43 @@ void TilesInfo::postUnitsUpdate() {
   }
 }
 
+void TilesInfo::syncDynamicLayers() {
+  // Assemble full words locally so that each plane is written once per 64
+  // tiles. Tiles outside of the map are never set.
+  uint64_t* visible = layers_.visible.data();
+  uint64_t* creep = layers_.creep.data();
+  uint64_t* reserved = layers_.reserved.data();
+  FrameNum* lastSeen = layers_.lastSeen.data();
+  bool visibleChanged = false, creepChanged = false, reservedChanged = false;
+  unsigned constexpr kBits = TileBitPlane::kBitsPerWord;
+  for (unsigned tileY = 0; tileY != mapTileHeight_; ++tileY) {
+    size_t rowOffset = size_t(tileY) * tilesWidth;
+    for (unsigned word = 0; word != TileBitPlane::kWordsPerRow; ++word) {
+      uint64_t v = 0, c = 0, r = 0;
+      unsigned begin = word * kBits;
+      unsigned end = std::min(begin + kBits, mapTileWidth_);
+      for (unsigned tileX = begin; tileX < end; ++tileX) {
+        Tile const& t = tiles[rowOffset + tileX];
+        uint64_t bit = uint64_t(1) << (tileX - begin);
+        v |= t.visible ? bit : 0;
+        c |= t.hasCreep ? bit : 0;
+        r |= t.reservedAsUnbuildable ? bit : 0;
+        lastSeen[rowOffset + tileX] = t.lastSeen;
+      }
+      size_t wi = size_t(tileY) * TileBitPlane::kWordsPerRow + word;
+      visibleChanged |= visible[wi] != v;
+      creepChanged |= creep[wi] != c;
+      reservedChanged |= reserved[wi] != r;
+      visible[wi] = v;
+      creep[wi] = c;
+      reserved[wi] = r;
+    }
+  }
+  layers_.visibleVersion += visibleChanged;
+  layers_.creepVersion += creepChanged;
+  layers_.reservedVersion += reservedChanged;
+}
+
 Tile& TilesInfo::getTile(int walkX, int walkY) {
   Tile* tile = tryGetTile(walkX, walkY);
   if (!tile) {
@@ -433,10 +573,51 @@ reserveAreaImpl(TilesInfo& tt, const BuildType* type, int walkX, int walkY) {
 
 void TilesInfo::reserveArea(const BuildType* type, int walkX, int walkY) {
   reserveAreaImpl<true>(*this, type, walkX, walkY);
+  setReservedLayer(type, walkX, walkY, true);
 }
 
 void TilesInfo::unreserveArea(const BuildType* type, int walkX, int walkY) {
   reserveAreaImpl<false>(*this, type, walkX, walkY);
+  setReservedLayer(type, walkX, walkY, false);
+}
+
+TileBitPlane TilesInfo::unreserveAll() {
+  TileBitPlane previous = layers_.reserved;
+  previous.forEachSet(
+      [&](size_t index) { tiles[index].reservedAsUnbuildable = false; });
+  if (previous.count() > 0) {
+    layers_.reserved.reset();
+    ++layers_.reservedVersion;
+  }
+  return previous;
+}
+
+void TilesInfo::restoreReserved(TileBitPlane const& reserved) {
+  layers_.reserved.forEachSet(
+      [&](size_t index) { tiles[index].reservedAsUnbuildable = false; });
+  reserved.forEachSet(
+      [&](size_t index) { tiles[index].reservedAsUnbuildable = true; });
+  bool changed = !std::equal(
+      reserved.data(),
+      reserved.data() + reserved.numWords(),
+      layers_.reserved.data());
+  layers_.reserved = reserved;
+  layers_.reservedVersion += changed;
+}
+
+void TilesInfo::setReservedLayer(
+    const BuildType* type,
+    int walkX,
+    int walkY,
+    bool reserved) {
+  unsigned beginX = walkX / (unsigned)tc::BW::XYWalktilesPerBuildtile;
+  unsigned beginY = walkY / (unsigned)tc::BW::XYWalktilesPerBuildtile;
+  for (unsigned y = beginY; y != beginY + type->tileHeight; ++y) {
+    for (unsigned x = beginX; x != beginX + type->tileWidth; ++x) {
+      layers_.reserved.set(x, y, reserved);
+    }
+  }
+  ++layers_.reservedVersion;
 }
 
 FrameNum Tile::expectsCreepBy() const {
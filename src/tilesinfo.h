@@ -9,6 +9,9 @@
 
 #include "basetypes.h"
 
+#include <algorithm>
+#include <bitset>
+#include <cstdint>
 #include <unordered_map>
 #include <vector>
 
@@ -75,6 +78,147 @@ struct Tile {
   FrameNum lastSlowUpdate = 0;
 };
 
+/**
+ * A packed bitset with one bit per tile.
+ *
+ * The layout matches TilesInfo::tiles (row-major, kWidth tiles per row), with
+ * 64 consecutive tiles of a row packed into a single word. This makes
+ * whole-map scans of a single flag cache-resident and lets callers operate on
+ * 64 tiles at a time.
+ */
+class TileBitPlane {
+ public:
+  static unsigned constexpr kWidth = 256;
+  static unsigned constexpr kHeight = 256;
+  static unsigned constexpr kBitsPerWord = 64;
+  static unsigned constexpr kWordsPerRow = kWidth / kBitsPerWord;
+
+  TileBitPlane() : words_(kWordsPerRow * kHeight, 0) {}
+
+  /// Test the bit of the tile at the given index into TilesInfo::tiles
+  bool test(size_t index) const {
+    return (words_[index / kBitsPerWord] >> (index % kBitsPerWord)) & 1;
+  }
+  /// Test the bit of the tile at the given build tile coordinates
+  bool test(unsigned tileX, unsigned tileY) const {
+    return test(size_t(tileY) * kWidth + tileX);
+  }
+  void set(size_t index, bool value) {
+    uint64_t bit = uint64_t(1) << (index % kBitsPerWord);
+    if (value) {
+      words_[index / kBitsPerWord] |= bit;
+    } else {
+      words_[index / kBitsPerWord] &= ~bit;
+    }
+  }
+  void set(unsigned tileX, unsigned tileY, bool value) {
+    set(size_t(tileY) * kWidth + tileX, value);
+  }
+  void reset() {
+    std::fill(words_.begin(), words_.end(), 0);
+  }
+
+  uint64_t const* data() const {
+    return words_.data();
+  }
+  uint64_t* data() {
+    return words_.data();
+  }
+  size_t numWords() const {
+    return words_.size();
+  }
+  /// The kWordsPerRow words covering the given row of build tiles
+  uint64_t const* row(unsigned tileY) const {
+    return words_.data() + size_t(tileY) * kWordsPerRow;
+  }
+
+  /// Number of tiles that are set
+  size_t count() const;
+  /// Number of tiles that are set in the given rectangle of build tiles (right
+  /// and bottom bounds are exclusive)
+  size_t countInRect(unsigned x0, unsigned y0, unsigned x1, unsigned y1) const;
+  /// Whether any tile is set in the given rectangle of build tiles (right and
+  /// bottom bounds are exclusive)
+  bool anyInRect(unsigned x0, unsigned y0, unsigned x1, unsigned y1) const;
+
+  TileBitPlane& operator&=(TileBitPlane const& other);
+  TileBitPlane& operator|=(TileBitPlane const& other);
+  TileBitPlane& operator^=(TileBitPlane const& other);
+  /// Clears all tiles that are set in `other`
+  TileBitPlane& andNot(TileBitPlane const& other);
+
+  /// Calls `f` with the index of every set tile, in increasing order
+  template <typename F>
+  void forEachSet(F&& f) const {
+    for (size_t i = 0; i < words_.size(); i++) {
+      uint64_t w = words_[i];
+      while (w) {
+        f(i * kBitsPerWord + countTrailingZeros(w));
+        w &= w - 1;
+      }
+    }
+  }
+
+  static unsigned popcount(uint64_t w) {
+#ifdef __GNUC__
+    return __builtin_popcountll(w);
+#else
+    return std::bitset<64>(w).count();
+#endif
+  }
+  static unsigned countTrailingZeros(uint64_t w) {
+#ifdef __GNUC__
+    return __builtin_ctzll(w);
+#else
+    unsigned n = 0;
+    while (!(w & 1)) {
+      w >>= 1;
+      n++;
+    }
+    return n;
+#endif
+  }
+
+ private:
+  /// Mask for the bits [x0, x1) of word `word` of a row
+  static uint64_t wordMask(unsigned word, unsigned x0, unsigned x1);
+
+  std::vector<uint64_t> words_;
+};
+
+/**
+ * Structure-of-arrays view of frequently scanned per-tile data.
+ *
+ * Mirrors fields of TilesInfo::tiles using the same indexing, but stores
+ * flags as TileBitPlane and scalars in dense arrays. Static layers are filled
+ * on construction; dynamic layers are synchronized in
+ * TilesInfo::postUnitsUpdate() whenever fog of war and creep are updated.
+ *
+ * Every dynamic plane has a version that is incremented whenever the plane
+ * changes. Consumers that derive data from a plane can skip work if the
+ * version did not change, and otherwise find the changed tiles by XOR-ing the
+ * plane with a copy taken previously.
+ */
+struct TileLayers {
+  /// Tile::visible
+  TileBitPlane visible;
+  /// Tile::buildable
+  TileBitPlane buildable;
+  /// Tile::entirelyWalkable
+  TileBitPlane walkable;
+  /// Tile::hasCreep
+  TileBitPlane creep;
+  /// Tile::reservedAsUnbuildable
+  TileBitPlane reserved;
+  uint64_t visibleVersion = 0;
+  uint64_t creepVersion = 0;
+  uint64_t reservedVersion = 0;
+  /// Tile::lastSeen
+  std::vector<FrameNum> lastSeen;
+  /// Tile::height
+  std::vector<uint8_t> height;
+};
+
 /**
  * Manages and updates per-tile data.
  */
@@ -97,6 +241,10 @@ class TilesInfo {
 
   static const unsigned tilesWidth = 256;
   static const unsigned tilesHeight = 256;
+  static_assert(
+      tilesWidth == TileBitPlane::kWidth &&
+          tilesHeight == TileBitPlane::kHeight,
+      "TileBitPlane must match the layout of TilesInfo::tiles");
 
   Tile& getTile(int walkX, int walkY);
   const Tile& getTile(int walkX, int walkY) const;
@@ -109,11 +257,23 @@ class TilesInfo {
   void reserveArea(const BuildType* type, int walkX, int walkY);
   // Complements reserveArea.
   void unreserveArea(const BuildType* type, int walkX, int walkY);
+  /// Clears reservedAsUnbuildable for all tiles and returns the previous
+  /// reservations so that they can be reinstated with restoreReserved().
+  TileBitPlane unreserveAll();
+  /// Sets reservedAsUnbuildable for all tiles to the given reservations, as
+  /// returned by unreserveAll().
+  void restoreReserved(TileBitPlane const& reserved);
 
   /// All the tiles. Prefer to use getTile, this is only here in case it is
   /// needed for performance.
   std::vector<Tile> tiles;
 
+  /// Packed per-tile layers for fast whole-map scans. See TileLayers for when
+  /// these are synchronized with `tiles`.
+  TileLayers const& layers() const {
+    return layers_;
+  }
+
  protected:
   struct TileOccupyingBuilding {
     Unit* u;
@@ -123,9 +283,15 @@ class TilesInfo {
     std::vector<Tile*> tiles;
   };
 
+  void syncDynamicLayers();
+  void
+  setReservedLayer(const BuildType* type, int walkX, int walkY, bool reserved);
+
   unsigned mapTileWidth_ = 0;
   unsigned mapTileHeight_ = 0;
 
+  TileLayers layers_;
+
   std::unordered_map<const Unit*, TileOccupyingBuilding>
       tileOccupyingBuildings_;
 
@@ -31,6 +31,12 @@ DEFINE_double(
     "When an enemy unit is spotted, this is the chance of moving other enemy "
     "units that have been seen near it to a nearby location");
 
+DEFINE_bool(
+    unitsSpatialIndex,
+    true,
+    "Use the spatial index for computing per-unit proximity lists (units in "
+    "sight range, threatening enemies) instead of checking all pairs of units");
+
 namespace cherrypi {
 
 double Unit::damageMultiplier(int dtype, int usz) const {
@@ -213,12 +219,82 @@ Position Unit::getMovingTarget() const {
   return Position(-1, -1);
 }
 
+bool ProximityFilter::matches(Unit const* u) const {
+  if (u->dead || (u->gone && !gone) || (!u->visible && !hidden)) {
+    return false;
+  }
+  if (u->flying() ? !air : !ground) {
+    return false;
+  }
+  switch (owner) {
+    case Owner::Mine:
+      return u->isMine;
+    case Owner::Enemy:
+      return u->isEnemy;
+    case Owner::Neutral:
+      return u->isNeutral;
+    case Owner::Player:
+      return u->playerId == playerId;
+    default:
+      return true;
+  }
+}
+
+UnitsGrid::UnitsGrid() {
+  int constexpr maxWalktiles =
+      TilesInfo::tilesWidth * tc::BW::XYWalktilesPerBuildtile;
+  cellsX_ = (maxWalktiles + kCellSize - 1) / kCellSize;
+  cellsY_ = (maxWalktiles + kCellSize - 1) / kCellSize;
+  cells_.resize(cellsX_ * cellsY_);
+}
+
+void UnitsGrid::update(Unit* u, bool contain) {
+  int cell = -1;
+  if (contain) {
+    int cx = utils::clamp(u->x / kCellSize, 0, cellsX_ - 1);
+    int cy = utils::clamp(u->y / kCellSize, 0, cellsY_ - 1);
+    cell = cy * cellsX_ + cx;
+  }
+  if (cell == u->gridCell) {
+    return;
+  }
+
+  if (u->gridCell >= 0) {
+    auto& cont = cells_[u->gridCell];
+    if (u->gridIndex != cont.size() - 1) {
+      cont.back()->gridIndex = u->gridIndex;
+      std::swap(cont.back(), cont[u->gridIndex]);
+    }
+    cont.pop_back();
+    u->gridIndex = Unit::invalidIndex;
+    --size_;
+  }
+  u->gridCell = cell;
+  if (cell >= 0) {
+    auto& cont = cells_[cell];
+    u->gridIndex = cont.size();
+    cont.push_back(u);
+    ++size_;
+  }
+}
+
 UnitsInfo::UnitsInfo(State* state)
     : state_(state),
       rngEngine(common::Rand::makeRandEngine<std::minstd_rand>()) {
   if (FLAGS_inferEnemyPositions) {
     inferPositionsUnitAt.resize(TilesInfo::tilesWidth * TilesInfo::tilesHeight);
   }
+  auto numUnitTypes = (+tc::BW::UnitType::MAX)._to_integral();
+  myUnitsOfType_.resize(numUnitTypes);
+  myCompletedUnitsOfType_.resize(numUnitTypes);
+  for (auto* type : buildtypes::allUnitTypes) {
+    maxUnitDimension_ = std::max(
+        {maxUnitDimension_,
+         type->dimensionLeft,
+         type->dimensionRight,
+         type->dimensionUp,
+         type->dimensionDown});
+  }
 }
 
 UnitsInfo::~UnitsInfo() {}
@@ -232,11 +308,18 @@ Unit* UnitsInfo::getUnit(UnitId id) {
 }
 
 const UnitsInfo::Units& UnitsInfo::myUnitsOfType(const BuildType* type) {
+  if (type->unit < 0 || size_t(type->unit) >= myUnitsOfType_.size()) {
+    return emptyUnits_;
+  }
   return myUnitsOfType_[type->unit];
 }
 
 const UnitsInfo::Units& UnitsInfo::myCompletedUnitsOfType(
     const BuildType* type) {
+  if (type->unit < 0 ||
+      size_t(type->unit) >= myCompletedUnitsOfType_.size()) {
+    return emptyUnits_;
+  }
   return myCompletedUnitsOfType_[type->unit];
 }
 
@@ -284,6 +367,118 @@ UnitsInfo::inferredEnemyUnitTypes() {
   return memoizedEnemyUnitTypes_;
 }
 
+UnitsInfo::Units UnitsInfo::unitsInRadius(
+    Position const& pos,
+    float radius,
+    ProximityFilter const& filter) {
+  Units units;
+  int r = int(std::ceil(radius));
+  grid_.forEachUnitInCells(
+      pos.x - r, pos.y - r, pos.x + r, pos.y + r, [&](Unit* u) {
+        if (filter.matches(u) && utils::distance(u, pos) <= radius) {
+          units.push_back(u);
+        }
+      });
+  return units;
+}
+
+UnitsInfo::Units UnitsInfo::unitsInRect(
+    Rect const& rect,
+    ProximityFilter const& filter) {
+  Units units;
+  grid_.forEachUnitInCells(
+      rect.left(),
+      rect.top(),
+      rect.right() - 1,
+      rect.bottom() - 1,
+      [&](Unit* u) {
+        if (filter.matches(u) && rect.contains(u->pos())) {
+          units.push_back(u);
+        }
+      });
+  return units;
+}
+
+UnitsInfo::Units UnitsInfo::nearestUnits(
+    Position const& pos,
+    size_t k,
+    ProximityFilter const& filter,
+    float maxRadius) {
+  std::vector<std::pair<float, Unit*>> candidates;
+  if (k == 0) {
+    return Units();
+  }
+
+  // Visit rings of cells around the cell containing `pos`. Units outside of
+  // the rings visited so far are at least ring * kCellSize walktiles away
+  // (utils::distance() is never smaller than the Chebyshev distance), so we
+  // can stop once the k-th candidate is closer than that.
+  auto constexpr kCellSize = UnitsGrid::kCellSize;
+  int const ccx = utils::clamp(pos.x / kCellSize, 0, grid_.cellsX() - 1);
+  int const ccy = utils::clamp(pos.y / kCellSize, 0, grid_.cellsY() - 1);
+  int const maxRing = std::max(
+      {ccx, ccy, grid_.cellsX() - 1 - ccx, grid_.cellsY() - 1 - ccy});
+  auto visitCell = [&](int cx, int cy) {
+    if (cx < 0 || cy < 0 || cx >= grid_.cellsX() || cy >= grid_.cellsY()) {
+      return;
+    }
+    for (Unit* u : grid_.cell(cx, cy)) {
+      if (!filter.matches(u)) {
+        continue;
+      }
+      auto d = utils::distance(u, pos);
+      if (d <= maxRadius) {
+        candidates.emplace_back(d, u);
+      }
+    }
+  };
+  auto byDistance = [](auto const& a, auto const& b) {
+    return a.first < b.first ||
+        (a.first == b.first && a.second->id < b.second->id);
+  };
+
+  for (int ring = 0; ring <= maxRing; ring++) {
+    if (ring == 0) {
+      visitCell(ccx, ccy);
+    } else {
+      for (int cx = ccx - ring; cx <= ccx + ring; cx++) {
+        visitCell(cx, ccy - ring);
+        visitCell(cx, ccy + ring);
+      }
+      for (int cy = ccy - ring + 1; cy <= ccy + ring - 1; cy++) {
+        visitCell(ccx - ring, cy);
+        visitCell(ccx + ring, cy);
+      }
+    }
+
+    float const unvisitedDist = float(ring * kCellSize);
+    if (unvisitedDist > maxRadius) {
+      break;
+    }
+    if (candidates.size() >= k) {
+      std::nth_element(
+          candidates.begin(),
+          candidates.begin() + (k - 1),
+          candidates.end(),
+          byDistance);
+      if (candidates[k - 1].first <= unvisitedDist) {
+        break;
+      }
+    }
+  }
+
+  std::sort(candidates.begin(), candidates.end(), byDistance);
+  if (candidates.size() > k) {
+    candidates.resize(k);
+  }
+  Units units;
+  units.reserve(candidates.size());
+  for (auto& c : candidates) {
+    units.push_back(c.second);
+  }
+  return units;
+}
+
 void UnitsInfo::update() {
   newUnits_.clear();
   startedMorphingUnits_.clear();
@@ -295,8 +490,6 @@ void UnitsInfo::update() {
 
   FrameNum frame = state_->currentFrame();
 
-  bool updateMyGroups = false;
-
   if (state_->mapHack()) {
     for (auto& e : state_->tcstate()->frame->units) {
       for (auto& v : e.second) {
@@ -328,6 +521,10 @@ void UnitsInfo::update() {
     }
   }
 
+  // Proximity lists need to be cleared before any unit is updated since
+  // updateUnit() registers attackers with their targets. Remember the units
+  // so that we don't need to look them up again below.
+  frameUnits_.clear();
   for (auto& v : state_->units()) {
     Unit* u = &unitsMap_[v.first];
     u->threateningEnemies.clear();
@@ -336,10 +533,11 @@ void UnitsInfo::update() {
     u->obstaclesInSightRange.clear();
     u->enemyUnitsInSightRange.clear();
     u->allyUnitsInSightRange.clear();
+    frameUnits_.emplace_back(u, v.second);
   }
 
-  for (auto& v : state_->units()) {
-    Unit* u = &unitsMap_[v.first];
+  for (auto& v : frameUnits_) {
+    Unit* u = v.first;
     bool doUpdateGroups = false;
     if (!u->type) {
       u->firstSeen = frame;
@@ -358,6 +556,7 @@ void UnitsInfo::update() {
     auto* prevType = u->type;
 
     updateUnit(u, *v.second, state_->tcstate());
+    updateGrid(u);
 
     if (u->morphing() && (!wasMorphing || u->type != prevType)) {
       doUpdateGroups = true;
@@ -384,13 +583,6 @@ void UnitsInfo::update() {
 
     if (doUpdateGroups) {
       updateGroups(u);
-
-      if (!updateMyGroups) {
-        if (prevPlayerId == state_->playerId() ||
-            u->playerId == state_->playerId()) {
-          updateMyGroups = true;
-        }
-      }
     }
   }
 
@@ -401,9 +593,6 @@ void UnitsInfo::update() {
       u->goneFrame = frame;
       destroyUnits_.push_back(u);
       updateGroups(u);
-      if (u->isMine) {
-        updateMyGroups = true;
-      }
     }
   }
 
@@ -437,6 +626,7 @@ void UnitsInfo::update() {
                 inferMovePosition(u->lastSeenPos, u->flying(), 15 * 10);
             if (newPos != Position()) {
               inferMoveUnit(u, newPos);
+              updateGrid(u);
             } else {
               u->gone = true;
             }
@@ -449,34 +639,10 @@ void UnitsInfo::update() {
     }
   }
 
-  for (Unit* u : liveUnits_) {
-    if (u->gone || u->type->isGas || u->type->isMinerals || u->playerId < 0) {
-      continue;
-    }
-    u->threateningEnemies.clear();
-    u->unitsInSightRange.clear();
-
-    // should we really compute this for enemies ?
-    for (Unit* o : liveUnits_) {
-      if (o->gone || o->id == u->id) {
-        continue;
-      }
-
-      auto oSize = std::max(
-          std::abs(o->type->dimensionUp - o->type->dimensionDown),
-          std::abs(o->type->dimensionLeft - o->type->dimensionRight));
-      if (o->visible && utils::distance(o, u) <= u->sightRange + oSize / 8) {
-        u->unitsInSightRange.push_back(o);
-      }
-      if (o->playerId < 0)
-        continue;
-
-      if (u->playerId != o->playerId && u->inRangeOf(o, DFOASG(12, 24))) {
-        u->threateningEnemies.push_back(o);
-      }
-    }
-    VLOG(4) << utils::unitString(u) << " has threatening enemies: "
-            << utils::unitsString(u->threateningEnemies);
+  if (FLAGS_unitsSpatialIndex) {
+    updateProximityLists();
+  } else {
+    updateProximityListsFullScan();
   }
   for (Unit* u : liveUnits_) {
     auto distanceComp = [&u](Unit const* a, Unit const* b) {
@@ -506,23 +672,6 @@ void UnitsInfo::update() {
     }
   }
 
-  if (updateMyGroups) {
-    for (auto& v : myUnitsOfType_) {
-      v.second.clear();
-    }
-    for (Unit* u : myUnits()) {
-      myUnitsOfType_[u->type->unit].push_back(u);
-    }
-    for (auto& v : myCompletedUnitsOfType_) {
-      v.second.clear();
-    }
-    for (Unit* u : myUnits()) {
-      if (u->completed()) {
-        myCompletedUnitsOfType_[u->type->unit].push_back(u);
-      }
-    }
-  }
-
   if (FLAGS_inferEnemyPositions) {
     auto rng = std::bind(std::uniform_real_distribution<>(0.0, 1.0), rngEngine);
     for (Unit* u : getShowUnits()) {
@@ -546,6 +695,7 @@ void UnitsInfo::update() {
             inferMovePosition(Position(u->x, u->y), u2->flying(), 4);
         if (newPos != Position()) {
           inferMoveUnit(u2, newPos);
+          updateGrid(u2);
         }
       }
     }
@@ -556,6 +706,118 @@ void UnitsInfo::update() {
   }
 }
 
+void UnitsInfo::updateGrid(Unit* u) {
+  grid_.update(u, !u->dead);
+}
+
+bool UnitsInfo::hasProximityLists(Unit const* u) {
+  return !u->gone && !u->type->isGas && !u->type->isMinerals &&
+      u->playerId >= 0;
+}
+
+void UnitsInfo::updateProximityLists() {
+  // With position inference, hidden units may be placed away from the pixel
+  // position that Unit::inRangeOf() considers, so threats can't be bounded by
+  // grid position.
+  if (FLAGS_inferEnemyPositions) {
+    updateProximityListsFullScan();
+    return;
+  }
+
+  // Bounds for the extent of a unit's bounding box from its center, in
+  // walktiles (rounded up)
+  int const maxDim = (maxUnitDimension_ + tc::BW::XYPixelsPerWalktile - 1) /
+      tc::BW::XYPixelsPerWalktile;
+  auto constexpr kThreatFrames = DFOASG(12, 24);
+
+  for (Unit* u : liveUnits_) {
+    if (!hasProximityLists(u)) {
+      continue;
+    }
+    u->threateningEnemies.clear();
+    u->unitsInSightRange.clear();
+
+    int r = u->sightRange + maxDim + 1;
+    grid_.forEachUnitInCells(
+        u->x - r, u->y - r, u->x + r, u->y + r, [&](Unit* o) {
+          if (o->gone || o->id == u->id || !o->visible) {
+            return;
+          }
+          auto oSize = std::max(
+              std::abs(o->type->dimensionUp - o->type->dimensionDown),
+              std::abs(o->type->dimensionLeft - o->type->dimensionRight));
+          if (utils::distance(o, u) <= u->sightRange + oSize / 8) {
+            u->unitsInSightRange.push_back(o);
+          }
+        });
+  }
+
+  // Threats are determined by the attacker's range and speed, so query around
+  // each potential attacker and add it to the lists of units it threatens.
+  for (Unit* o : liveUnits_) {
+    if (o->gone || o->playerId < 0 ||
+        !(o->type->hasAirWeapon || o->type->hasGroundWeapon)) {
+      continue;
+    }
+    double pxReach = std::max(o->unit.groundRange, o->unit.airRange) *
+            tc::BW::XYPixelsPerWalktile +
+        kThreatFrames * o->topSpeed * tc::BW::XYPixelsPerWalktile;
+    int r = int(std::ceil(pxReach / tc::BW::XYPixelsPerWalktile)) +
+        2 * maxDim + 1;
+    grid_.forEachUnitInCells(
+        o->x - r, o->y - r, o->x + r, o->y + r, [&](Unit* u) {
+          if (u->id == o->id || u->playerId == o->playerId ||
+              !hasProximityLists(u)) {
+            return;
+          }
+          if (u->inRangeOf(o, kThreatFrames)) {
+            u->threateningEnemies.push_back(o);
+          }
+        });
+  }
+
+  if (VLOG_IS_ON(4)) {
+    for (Unit* u : liveUnits_) {
+      if (hasProximityLists(u)) {
+        VLOG(4) << utils::unitString(u) << " has threatening enemies: "
+                << utils::unitsString(u->threateningEnemies);
+      }
+    }
+  }
+}
+
+void UnitsInfo::updateProximityListsFullScan() {
+  for (Unit* u : liveUnits_) {
+    if (u->gone || u->type->isGas || u->type->isMinerals || u->playerId < 0) {
+      continue;
+    }
+    u->threateningEnemies.clear();
+    u->unitsInSightRange.clear();
+
+    // should we really compute this for enemies ?
+    for (Unit* o : liveUnits_) {
+      if (o->gone || o->id == u->id) {
+        continue;
+      }
+
+      auto oSize = std::max(
+          std::abs(o->type->dimensionUp - o->type->dimensionDown),
+          std::abs(o->type->dimensionLeft - o->type->dimensionRight));
+      if (o->visible && utils::distance(o, u) <= u->sightRange + oSize / 8) {
+        u->unitsInSightRange.push_back(o);
+      }
+      if (o->playerId < 0)
+        continue;
+
+      if (u->playerId != o->playerId && u->inRangeOf(o, DFOASG(12, 24))) {
+        u->threateningEnemies.push_back(o);
+      }
+    }
+    VLOG(4) << utils::unitString(u) << " has threatening enemies: "
+            << utils::unitsString(u->threateningEnemies);
+  }
+}
+
 static int unitSightRange(const Unit* u, tc::State* tcstate) {
   auto isMorphingBuilding = [&]() {
     if (u->type == buildtypes::Zerg_Hive) {
@@ -763,10 +1025,9 @@ void UnitsInfo::updateGroups(Unit* u) {
   updateUnitContainer(
       resourceUnits_, !u->dead && !u->gone && u->type->isResourceContainer);
 
-  updateUnitContainer(
-      myUnits_,
-      !u->dead && u->visible && u->playerId == state_->playerId() &&
-          u->powered());
+  bool const isMyUnit = !u->dead && u->visible &&
+      u->playerId == state_->playerId() && u->powered();
+  updateUnitContainer(myUnits_, isMyUnit);
   updateUnitContainer(
       myWorkers_,
       !u->dead && u->visible && u->playerId == state_->playerId() &&
@@ -784,6 +1045,50 @@ void UnitsInfo::updateGroups(Unit* u) {
   updateUnitContainer(visibleEnemyUnits_, !u->dead && u->visible && u->isEnemy);
 
   updateUnitContainer(neutralUnits_, !u->dead && u->isNeutral);
+
+  // Per-type containers are keyed by the unit's current type, so a unit is
+  // moved if its type changed since it was last stored.
+  auto updateTypeContainer = [&](std::vector<Units>& conts,
+                                 int Unit::*keyField,
+                                 size_t Unit::*indexField,
+                                 bool contain) {
+    int key = contain ? u->type->unit : -1;
+    if (key >= int(conts.size())) {
+      key = -1;
+    }
+    if (u->*keyField == key) {
+      return;
+    }
+    if (u->*keyField >= 0) {
+      auto& cont = conts[u->*keyField];
+      size_t uIndex = u->*indexField;
+      if (uIndex != cont.size() - 1) {
+        cont.back()->*indexField = uIndex;
+        std::swap(cont.back(), cont[uIndex]);
+      }
+      cont.pop_back();
+    }
+    u->*keyField = key;
+    if (key >= 0) {
+      u->*indexField = conts[key].size();
+      conts[key].push_back(u);
+    } else {
+      u->*indexField = Unit::invalidIndex;
+    }
+  };
+
+  updateTypeContainer(
+      myUnitsOfType_,
+      &Unit::myUnitsOfTypeKey,
+      &Unit::myUnitsOfTypeIndex,
+      isMyUnit);
+  updateTypeContainer(
+      myCompletedUnitsOfType_,
+      &Unit::myCompletedUnitsOfTypeKey,
+      &Unit::myCompletedUnitsOfTypeIndex,
+      isMyUnit && u->completed());
+
+  updateGrid(u);
 }
 
 size_t UnitsInfo::inferPositionsUnitAtIndex(Position pos) {
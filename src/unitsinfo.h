@@ -104,6 +104,15 @@ struct Unit {
 
   std::array<size_t, 16> containerIndices;
   static const size_t invalidIndex = (size_t)-1;
+  /// Cell and index within cell of this unit in the UnitsInfo spatial index
+  int gridCell = -1;
+  size_t gridIndex = invalidIndex;
+  /// Type under which this unit is stored in UnitsInfo::myUnitsOfType() and
+  /// myCompletedUnitsOfType() (-1 if not stored), and its index there
+  int myUnitsOfTypeKey = -1;
+  size_t myUnitsOfTypeIndex = invalidIndex;
+  int myCompletedUnitsOfTypeKey = -1;
+  size_t myCompletedUnitsOfTypeIndex = invalidIndex;
 
   Unit() {
     containerIndices.fill((size_t)invalidIndex);
@@ -288,6 +297,84 @@ struct Unit {
   double damageMultiplier(int damageType, int unitSize) const;
 };
 
+/**
+ * A uniform grid over walktiles that buckets units by position.
+ *
+ * Units are stored in the cell containing their (x, y) position and are moved
+ * between cells with swap-removal, so insertions, moves and removals are O(1).
+ * Queries visit whole cells; callers are expected to do exact distance checks.
+ */
+class UnitsGrid {
+ public:
+  /// Width and height of a grid cell, in walktiles
+  static int constexpr kCellSize = 16;
+
+  UnitsGrid();
+
+  /// Places the unit in the cell containing its current position, or removes
+  /// it from the grid if `contain` is false.
+  void update(Unit* u, bool contain);
+
+  int cellsX() const {
+    return cellsX_;
+  }
+  int cellsY() const {
+    return cellsY_;
+  }
+  /// Number of units in the grid
+  size_t size() const {
+    return size_;
+  }
+
+  std::vector<Unit*> const& cell(int cx, int cy) const {
+    return cells_[cy * cellsX_ + cx];
+  }
+
+  /// Calls `f` for every unit in a cell overlapping the given walktile area
+  /// (bounds are inclusive).
+  template <typename F>
+  void forEachUnitInCells(int x0, int y0, int x1, int y1, F&& f) const {
+    int cx0 = std::max(0, x0) / kCellSize;
+    int cy0 = std::max(0, y0) / kCellSize;
+    int cx1 = std::min(cellsX_ - 1, std::max(0, x1) / kCellSize);
+    int cy1 = std::min(cellsY_ - 1, std::max(0, y1) / kCellSize);
+    for (int cy = cy0; cy <= cy1; cy++) {
+      for (int cx = cx0; cx <= cx1; cx++) {
+        for (Unit* u : cells_[cy * cellsX_ + cx]) {
+          f(u);
+        }
+      }
+    }
+  }
+
+ private:
+  int cellsX_ = 0;
+  int cellsY_ = 0;
+  size_t size_ = 0;
+  std::vector<std::vector<Unit*>> cells_;
+};
+
+/**
+ * Restricts the units returned by UnitsInfo's proximity queries.
+ * Dead units are never returned.
+ */
+struct ProximityFilter {
+  enum class Owner { Any, Mine, Enemy, Neutral, Player };
+  Owner owner = Owner::Any;
+  /// Player to match if owner is Owner::Player
+  PlayerId playerId = -1;
+  /// Include flying units
+  bool air = true;
+  /// Include non-flying units
+  bool ground = true;
+  /// Include units that are not visible right now
+  bool hidden = true;
+  /// Include units that are flagged as gone
+  bool gone = false;
+
+  bool matches(Unit const* u) const;
+};
+
 /**
  * Updates and organizes information about all the units in the game.
  */
@@ -399,12 +486,38 @@ class UnitsInfo {
 
   const std::unordered_map<const BuildType*, int>& inferredEnemyUnitTypes();
 
+  /// Live units whose position is within `radius` walktiles of `pos`.
+  Units unitsInRadius(
+      Position const& pos,
+      float radius,
+      ProximityFilter const& filter = ProximityFilter());
+  /// Live units whose position is inside the given walktile rectangle.
+  Units unitsInRect(
+      Rect const& rect,
+      ProximityFilter const& filter = ProximityFilter());
+  /// Up to `k` live units closest to `pos`, sorted by distance. Only units
+  /// within `maxRadius` walktiles are considered.
+  Units nearestUnits(
+      Position const& pos,
+      size_t k,
+      ProximityFilter const& filter = ProximityFilter(),
+      float maxRadius = kfInfty);
+
+  /// Spatial index over all live units
+  UnitsGrid const& grid() const {
+    return grid_;
+  }
+
   void update();
 
  protected:
   State* state_ = nullptr;
   void updateUnit(Unit*, const tc::Unit&, tc::State*, bool maphack = false);
   void updateGroups(Unit* i);
+  void updateGrid(Unit* u);
+  static bool hasProximityLists(Unit const* u);
+  void updateProximityLists();
+  void updateProximityListsFullScan();
   size_t inferPositionsUnitAtIndex(Position pos);
   Position
   inferMovePosition(Position source, bool flying, int tileVisibiltyAge);
@@ -433,8 +546,10 @@ class UnitsInfo {
 
   Units& neutralUnits_ = unitContainers_[12];
 
-  std::unordered_map<int, Units> myUnitsOfType_;
-  std::unordered_map<int, Units> myCompletedUnitsOfType_;
+  /// Indexed by BuildType::unit
+  std::vector<Units> myUnitsOfType_;
+  std::vector<Units> myCompletedUnitsOfType_;
+  Units const emptyUnits_;
 
   Units newUnits_;
   Units startedMorphingUnits_;
@@ -443,6 +558,8 @@ class UnitsInfo {
   Units hideUnits_;
   Units destroyUnits_;
   std::unordered_map<const BuildType*, int> memoizedEnemyUnitTypes_;
+  /// Units reported by TorchCraft in the current frame, reused across updates
+  std::vector<std::pair<Unit*, tc::Unit const*>> frameUnits_;
 
   std::vector<uint8_t> inferPositionsUnitAt;
   FrameNum lastInferUpdateNearbyUnits;
@@ -451,6 +568,10 @@ class UnitsInfo {
 
   std::unordered_map<UnitId, Unit> mapHackUnitsMap_;
   Units& mapHackUnits_ = unitContainers_[15];
+
+  UnitsGrid grid_;
+  /// Largest bounding box extent from center over all unit types, in pixels
+  int maxUnitDimension_ = 0;
 };
 
 } // namespace cherrypi
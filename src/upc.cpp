@@ -10,8 +10,92 @@
 #include "state.h"
 #include "utils.h"
 
+#include <stdexcept>
+#include <string>
+
 namespace cherrypi {
 
+size_t CommandMap::size() const {
+  size_t n = 0;
+  for (auto m = mask_; m != 0; m &= m - 1) {
+    n++;
+  }
+  return n;
+}
+
+float& CommandMap::at(Command c) {
+  auto bit = bitFor(c);
+  if ((mask_ & bit) == 0) {
+    throw std::out_of_range("CommandMap::at: no such command");
+  }
+  return probs_[lowestBit(bit)];
+}
+
+float const& CommandMap::at(Command c) const {
+  auto bit = bitFor(c);
+  if ((mask_ & bit) == 0) {
+    throw std::out_of_range("CommandMap::at: no such command");
+  }
+  return probs_[lowestBit(bit)];
+}
+
+float& CommandMap::operator[](Command c) {
+  auto bit = bitFor(c);
+  if (bit == 0) {
+    throw std::invalid_argument(
+        "CommandMap: invalid command " + std::to_string(uint64_t(c)));
+  }
+  if ((mask_ & bit) == 0) {
+    mask_ |= bit;
+    probs_[lowestBit(bit)] = 0.0f;
+  }
+  return probs_[lowestBit(bit)];
+}
+
+std::pair<CommandMap::iterator, bool> CommandMap::emplace(
+    Command c,
+    float prob) {
+  bool inserted = count(c) == 0;
+  auto& p = (*this)[c];
+  if (inserted) {
+    p = prob;
+  }
+  return std::make_pair(find(c), inserted);
+}
+
+size_t CommandMap::erase(Command c) {
+  auto bit = bitFor(c);
+  if ((mask_ & bit) == 0) {
+    return 0;
+  }
+  mask_ &= ~bit;
+  return 1;
+}
+
+uint64_t CommandMap::sharpMask() const {
+  uint64_t sharp = 0;
+  for (auto m = uint32_t(mask_); m != 0; m &= m - 1) {
+    auto i = lowestBit(m);
+    if (probs_[i] == 1.0f) {
+      sharp |= uint64_t(1) << i;
+    }
+  }
+  return sharp;
+}
+
+bool CommandMap::operator==(CommandMap const& other) const {
+  if (mask_ != other.mask_) {
+    return false;
+  }
+  for (auto m = uint32_t(mask_); m != 0; m &= m - 1) {
+    auto i = lowestBit(m);
+    if (probs_[i] != other.probs_[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
 std::pair<Position, float> UPCTuple::positionArgMax() const {
   return position.match(
       [&](Empty const&) { return std::make_pair(Position(-1, -1), 0.0f); },
@@ -99,11 +183,7 @@ float UPCTuple::positionProb(int x, int y) const {
 }
 
 float UPCTuple::commandProb(Command c) const {
-  auto it = command.find(c);
-  if (it != command.end()) {
-    return it->second;
-  }
-  return 0.;
+  return command.get(c);
 }
 
 torch::Tensor UPCTuple::positionTensor(State* state) const {
@@ -186,7 +266,7 @@ std::pair<BuildType const*, float> UPCTuple::createTypeArgMax() const {
 
 UPCTuple::CommandT UPCTuple::uniformCommand() {
   float constexpr v = 1.0f / numUpcCommands();
-  std::unordered_map<Command, float> command;
+  CommandMap command;
   for (std::underlying_type<Command>::type i = 1; i < Command::MAX; i <<= 1) {
     command[static_cast<Command>(i)] = v;
   }
@@ -10,10 +10,18 @@
 #include "buildtype.h"
 #include "cherrypi.h"
 
+#include "common/smallmap.h"
+
 #include <autogradpp/autograd.h>
 #include <mapbox/variant.hpp>
 
+#include <array>
+#include <cstdint>
+#include <initializer_list>
+#include <iterator>
+#include <type_traits>
 #include <unordered_map>
+#include <utility>
 
 namespace cherrypi {
 
@@ -22,6 +30,174 @@ struct Area;
 struct BuildType;
 struct Unit;
 
+/**
+ * A distribution over UPC commands.
+ *
+ * This is a compact replacement for a std::unordered_map<Command, float>.
+ * Probabilities are stored in a fixed-size array indexed by command and
+ * present entries are tracked in a bitmask, so no heap allocations are
+ * required. Iteration is in order of command values and yields
+ * (command, probability reference) pairs by value; use `auto&&` or
+ * `auto const&` in range-based for loops.
+ */
+class CommandMap {
+ public:
+  using key_type = Command;
+  using mapped_type = float;
+  using value_type = std::pair<Command, float>;
+  using size_type = size_t;
+
+  template <bool Const>
+  class Iterator {
+   public:
+    using Prob = typename std::conditional<Const, float const, float>::type;
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = std::pair<Command, float>;
+    using difference_type = std::ptrdiff_t;
+    using reference = std::pair<Command, Prob&>;
+    struct pointer {
+      reference ref;
+      reference const* operator->() const {
+        return &ref;
+      }
+    };
+
+    Iterator(Prob* probs, uint32_t mask) : probs_(probs), mask_(mask) {}
+    /// Conversion from iterator to const_iterator
+    template <bool C, typename = std::enable_if_t<Const && !C>>
+    Iterator(Iterator<C> const& other)
+        : probs_(other.probs_), mask_(other.mask_) {}
+
+    reference operator*() const {
+      auto i = lowestBit(mask_);
+      return reference(Command(uint64_t(1) << i), probs_[i]);
+    }
+    pointer operator->() const {
+      return pointer{**this};
+    }
+    Iterator& operator++() {
+      mask_ &= mask_ - 1;
+      return *this;
+    }
+    Iterator operator++(int) {
+      auto it = *this;
+      ++*this;
+      return it;
+    }
+    bool operator==(Iterator const& other) const {
+      return mask_ == other.mask_;
+    }
+    bool operator!=(Iterator const& other) const {
+      return mask_ != other.mask_;
+    }
+
+   private:
+    template <bool>
+    friend class Iterator;
+
+    Prob* probs_;
+    /// Remaining entries
+    uint32_t mask_;
+  };
+  using iterator = Iterator<false>;
+  using const_iterator = Iterator<true>;
+
+  CommandMap() = default;
+  CommandMap(std::initializer_list<value_type> init) {
+    for (auto const& entry : init) {
+      (*this)[entry.first] = entry.second;
+    }
+  }
+
+  size_t size() const;
+  bool empty() const {
+    return mask_ == 0;
+  }
+
+  iterator begin() {
+    return iterator(probs_.data(), mask_);
+  }
+  iterator end() {
+    return iterator(probs_.data(), 0);
+  }
+  const_iterator begin() const {
+    return const_iterator(probs_.data(), mask_);
+  }
+  const_iterator end() const {
+    return const_iterator(probs_.data(), 0);
+  }
+
+  iterator find(Command c) {
+    auto bit = bitFor(c);
+    return iterator(probs_.data(), (mask_ & bit) ? maskFrom(bit) : 0);
+  }
+  const_iterator find(Command c) const {
+    auto bit = bitFor(c);
+    return const_iterator(probs_.data(), (mask_ & bit) ? maskFrom(bit) : 0);
+  }
+  size_t count(Command c) const {
+    return (mask_ & bitFor(c)) ? 1 : 0;
+  }
+  /// Returns the probability for the given command, or zero if not present
+  float get(Command c) const {
+    auto bit = bitFor(c);
+    return (mask_ & bit) ? probs_[lowestBit(bit)] : 0.0f;
+  }
+  float& at(Command c);
+  float const& at(Command c) const;
+  float& operator[](Command c);
+
+  std::pair<iterator, bool> emplace(Command c, float prob);
+  std::pair<iterator, bool> insert(value_type const& entry) {
+    return emplace(entry.first, entry.second);
+  }
+  size_t erase(Command c);
+  void clear() {
+    mask_ = 0;
+  }
+
+  /// Bitmask of all commands present in this distribution
+  uint64_t mask() const {
+    return mask_;
+  }
+  /// Bitmask of all commands with a probability of one
+  uint64_t sharpMask() const;
+
+  bool operator==(CommandMap const& other) const;
+  bool operator!=(CommandMap const& other) const {
+    return !(*this == other);
+  }
+
+ private:
+  /// Bit of the given command in mask_, or 0 for invalid commands
+  static uint32_t bitFor(Command c) {
+    return (c > Command::None && c < Command::MAX && (c & (c - 1)) == 0)
+        ? uint32_t(c)
+        : 0;
+  }
+  /// Mask of entries starting at the given bit
+  uint32_t maskFrom(uint32_t bit) const {
+    return mask_ & ~(bit - 1);
+  }
+  /// Index of the lowest set bit of a non-zero mask
+  static int lowestBit(uint32_t mask) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctz(mask);
+#else
+    int i = 0;
+    while ((mask & 1) == 0) {
+      mask >>= 1;
+      i++;
+    }
+    return i;
+#endif
+  }
+
+  static_assert(numUpcCommands() <= 16, "Command mask too small");
+  std::array<float, numUpcCommands()> probs_{};
+  uint16_t mask_ = 0;
+};
+
 /**
  * (Unit, Position, Command) tuple.
  * Specifies the (who, where, what) of an action
@@ -43,9 +219,11 @@ struct Unit;
 struct UPCTuple {
   /// An empty default item for the variants defined below
   using Empty = char; // Any better options here?
-  using UnitMap = std::unordered_map<Unit*, float>;
-  using CommandMap = std::unordered_map<Command, float>;
-  using BuildTypeMap = std::unordered_map<BuildType const*, float>;
+  // Most UPCs refer to a single unit and type, so the maps below store one
+  // entry inline.
+  using UnitMap = common::SmallMap<Unit*, float, 1>;
+  using CommandMap = cherrypi::CommandMap;
+  using BuildTypeMap = common::SmallMap<BuildType const*, float, 1>;
 
   using SetCreatePriorityState = std::tuple<UpcId, float>;
 
@@ -48,7 +48,7 @@ template <typename T>
 bool fixProba(
     T& map,
     std::function<std::string(decltype(map.begin()->first))> printer) {
-  for (auto& u : map) {
+  for (auto&& u : map) {
     if (u.second < 0 || u.second > 1) {
       LOG(WARNING) << "Probability value for " << printer(u.first)
                    << " is invalid (" << u.second << "). Clamping to [0,1]";
@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2017-present, Facebook, Inc.
+ *
+ * This source code is licensed under the MIT license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "test.h"
+
+#include "common/cowvector.h"
+
+#include <utility>
+
+using common::CowVector;
+
+CASE("cowvector/copies_share_storage") {
+  CowVector<int> a{1, 2, 3};
+  EXPECT(!a.shared());
+  auto b = a;
+  EXPECT(a.shared());
+  EXPECT(b.shared());
+  EXPECT(std::as_const(a).data() == std::as_const(b).data());
+
+  // Const access does not copy
+  int sum = 0;
+  for (int v : std::as_const(b)) {
+    sum += v;
+  }
+  EXPECT(sum == 6);
+  EXPECT(std::as_const(a).data() == std::as_const(b).data());
+
+  // Modifications do
+  b.push_back(4);
+  EXPECT(!a.shared());
+  EXPECT(!b.shared());
+  EXPECT(a.size() == 3u);
+  EXPECT(b.size() == 4u);
+  b[0] = 10;
+  EXPECT(a[0] == 1);
+  EXPECT(b[0] == 10);
+}
+
+CASE("cowvector/insert_and_erase") {
+  CowVector<int> a{1, 3, 5};
+  auto b = a;
+  // Positions obtained via const access remain usable
+  auto pos = std::as_const(b).begin() + 1;
+  auto it = b.emplace(pos, 2);
+  EXPECT(*it == 2);
+  EXPECT(b.vec() == std::vector<int>({1, 2, 3, 5}));
+  EXPECT(a.vec() == std::vector<int>({1, 3, 5}));
+
+  auto c = b;
+  it = c.erase(std::as_const(c).begin() + 2);
+  EXPECT(*it == 5);
+  EXPECT(c.vec() == std::vector<int>({1, 2, 5}));
+  EXPECT(b.vec() == std::vector<int>({1, 2, 3, 5}));
+
+  c.clear();
+  EXPECT(c.empty());
+  EXPECT(std::as_const(c).data() == nullptr);
+  EXPECT(b.size() == 4u);
+}
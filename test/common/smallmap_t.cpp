@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2017-present, Facebook, Inc.
+ *
+ * This source code is licensed under the MIT license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "test.h"
+
+#include "common/smallmap.h"
+
+#include <utility>
+
+using common::SmallMap;
+
+CASE("smallmap/inline_and_heap") {
+  SmallMap<int, float, 2> m;
+  EXPECT(m.empty());
+  m[3] = 0.5f;
+  m[1] = 1.0f;
+  EXPECT(m.size() == 2u);
+  EXPECT(m.count(3) == 1u);
+  EXPECT(m.count(2) == 0u);
+  EXPECT(m.at(1) == 1.0f);
+  EXPECT(m.find(2) == m.end());
+  EXPECT_THROWS(m.at(2));
+
+  // Insertion order is preserved when moving to the heap
+  EXPECT(m.emplace(7, 0.25f).second);
+  EXPECT(!m.emplace(7, 0.75f).second);
+  EXPECT(m.size() == 3u);
+  EXPECT(m[7] == 0.25f);
+  std::vector<int> keys;
+  for (auto const& it : m) {
+    keys.push_back(it.first);
+  }
+  EXPECT(keys == std::vector<int>({3, 1, 7}));
+
+  auto copy = m;
+  EXPECT(copy == m);
+  copy[7] = 1.0f;
+  EXPECT(copy != m);
+  EXPECT(m[7] == 0.25f);
+
+  // Back to inline storage
+  EXPECT(m.erase(3) == 1u);
+  EXPECT(m.erase(3) == 0u);
+  EXPECT(m.size() == 2u);
+  EXPECT(m.begin()->first == 1);
+  auto moved = std::move(copy);
+  EXPECT(moved.size() == 3u);
+  moved.clear();
+  EXPECT(moved.empty());
+}
+
+CASE("smallmap/pointer_keys") {
+  int a, b;
+  SmallMap<int*, float> m{{&a, 0.5f}, {nullptr, 1.0f}, {&b, 0.1f}};
+  EXPECT(m.size() == 3u);
+  EXPECT(m.count(nullptr) == 1u);
+  EXPECT(m.erase(nullptr) == 1u);
+  EXPECT(m.size() == 2u);
+  auto it = m.erase(m.begin());
+  EXPECT(it->first == &b);
+  EXPECT(m.size() == 1u);
+}
+
+CASE("smallmap/indexed_lookup") {
+  // Enough entries for lookups to go through the sorted index
+  std::vector<int> units(300);
+  SmallMap<int*, float> m;
+  for (size_t i = 0; i < units.size(); i++) {
+    m[&units[i]] = float(i);
+  }
+  EXPECT(m.size() == units.size());
+  for (size_t i = 0; i < units.size(); i++) {
+    EXPECT(m.at(&units[i]) == float(i));
+  }
+  EXPECT(m.find(nullptr) == m.end());
+  EXPECT(!m.emplace(&units[42], -1.0f).second);
+
+  // Insertion order is preserved
+  size_t i = 0;
+  for (auto const& it : m) {
+    EXPECT(it.first == &units[i++]);
+  }
+
+  // Same entries, inserted in reverse order
+  SmallMap<int*, float> reversed;
+  for (size_t i = units.size(); i > 0; i--) {
+    reversed[&units[i - 1]] = float(i - 1);
+  }
+  EXPECT(reversed == m);
+  reversed[&units[7]] = -1.0f;
+  EXPECT(reversed != m);
+
+  // Erase every other entry
+  for (size_t i = 0; i < units.size(); i += 2) {
+    EXPECT(m.erase(&units[i]) == 1u);
+  }
+  EXPECT(m.size() == units.size() / 2);
+  for (size_t i = 0; i < units.size(); i++) {
+    EXPECT(m.count(&units[i]) == i % 2);
+  }
+  EXPECT(m.begin()->first == &units[1]);
+  auto copy = m;
+  EXPECT(copy == m);
+  EXPECT(copy.at(&units[299]) == 299.0f);
+}
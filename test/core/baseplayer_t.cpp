@@ -0,0 +1,278 @@
+/*
+ * Copyright (c) 2017-present, Facebook, Inc.
+ *
+ * This source code is licensed under the MIT license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "gameutils/game.h"
+#include "test.h"
+
+#include "blackboard.h"
+#include "modules.h"
+#include "player.h"
+#include "utils.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+using namespace cherrypi;
+
+namespace {
+
+/// Ordering of module step begin and end events
+std::atomic<int> eventSeq{0};
+
+/// Blocks until a given number of threads have arrived, or a timeout passed
+class Latch {
+ public:
+  explicit Latch(int count) : count_(count) {}
+
+  /// Returns false on timeout
+  bool arriveAndWait(std::chrono::milliseconds timeout) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    arrived_++;
+    cv_.notify_all();
+    return cv_.wait_for(lock, timeout, [&] { return arrived_ >= count_; });
+  }
+  void reset() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    arrived_ = 0;
+  }
+
+ private:
+  int const count_;
+  int arrived_ = 0;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+};
+
+/// Simulates work, optionally waiting for other modules to run at the same
+/// time, then draws its name and posts an empty UPC
+class SlowPostingModule : public Module {
+ public:
+  SlowPostingModule(
+      std::chrono::milliseconds work,
+      std::optional<ModuleDependencies> deps,
+      std::shared_ptr<Latch> latch = nullptr)
+      : Module(),
+        work_(work),
+        deps_(std::move(deps)),
+        latch_(std::move(latch)) {}
+
+  void step(State* state) override {
+    begin = eventSeq++;
+    auto start = std::chrono::steady_clock::now();
+    std::this_thread::sleep_for(work_);
+    if (latch_) {
+      // Generous timeout; this only fails if modules don't overlap at all
+      overlapped = latch_->arriveAndWait(std::chrono::seconds(10));
+    }
+    duration = std::chrono::steady_clock::now() - start;
+    end = eventSeq++;
+    utils::drawTextScreen(state, 0, 0, name());
+    state->board()->postUPC(std::make_shared<UPCTuple>(), kRootUpcId, this);
+  }
+
+  std::optional<ModuleDependencies> dependencies(State* state) override {
+    auto deps = deps_;
+    if (deps) {
+      deps->writes.push_back(ModuleDependencies::upcsFrom(name()));
+    }
+    return deps;
+  }
+
+  int begin = -1;
+  int end = -1;
+  bool overlapped = true;
+  Duration duration;
+
+ private:
+  std::chrono::milliseconds work_;
+  std::optional<ModuleDependencies> deps_;
+  std::shared_ptr<Latch> latch_;
+};
+
+/// Writes to the Blackboard from within iterValues()
+class IterPostingModule : public Module {
+ public:
+  void step(State* state) override {
+    auto board = state->board();
+    board->iterValues([&](std::string const& key, Blackboard::Data const&) {
+      if (key == "iter_key") {
+        board->post("iter_posted", true);
+      }
+    });
+  }
+
+  std::optional<ModuleDependencies> dependencies(State* state) override {
+    return ModuleDependencies();
+  }
+};
+
+std::vector<std::shared_ptr<SlowPostingModule>> makeSlowModules(
+    std::vector<std::shared_ptr<Latch>>& latches) {
+  using namespace std::chrono_literals;
+  ModuleDependencies independent;
+  ModuleDependencies readsFirst;
+  readsFirst.reads.push_back(ModuleDependencies::upcsFrom("Slow0"));
+  // Slow0-2 and Slow6-7 can only finish if they run at the same time
+  latches = {std::make_shared<Latch>(3), std::make_shared<Latch>(2)};
+  std::vector<std::tuple<std::chrono::milliseconds,
+                         std::optional<ModuleDependencies>,
+                         std::shared_ptr<Latch>>>
+      specs = {
+          {5ms, independent, latches[0]},
+          {5ms, independent, latches[0]},
+          {5ms, independent, latches[0]},
+          {5ms, readsFirst, nullptr},
+          {5ms, independent, nullptr},
+          {5ms, std::nullopt, nullptr},
+          {5ms, independent, latches[1]},
+          {5ms, independent, latches[1]},
+      };
+  std::vector<std::shared_ptr<SlowPostingModule>> modules;
+  for (auto& spec : specs) {
+    auto module = Module::make<SlowPostingModule>(
+        std::get<0>(spec), std::get<1>(spec), std::get<2>(spec));
+    module->setName("Slow" + std::to_string(modules.size()));
+    modules.push_back(module);
+  }
+  return modules;
+}
+
+} // namespace
+
+CASE("baseplayer/module_dependencies") {
+  ModuleDependencies a, b;
+  EXPECT(!a.conflictsWith(b));
+  a.reads = {"foo"};
+  b.reads = {"foo"};
+  EXPECT(!a.conflictsWith(b));
+  b.writes = {"foo"};
+  EXPECT(a.conflictsWith(b));
+  EXPECT(b.conflictsWith(a));
+  b.writes = {ModuleDependencies::upcsFrom("Foo")};
+  EXPECT(!a.conflictsWith(b));
+  a.reads = {ModuleDependencies::kAllUpcs};
+  EXPECT(a.conflictsWith(b));
+  EXPECT(b.conflictsWith(a));
+}
+
+CASE("baseplayer/default_module_dependencies") {
+  // The main pipeline exchanges UPCs and units and is stepped in order
+  std::vector<std::shared_ptr<Module>> pipeline = {
+      Module::make<TopModule>(),
+      Module::make<GenericAutoBuildModule>(),
+      Module::make<BuilderModule>(),
+      Module::make<TacticsModule>(),
+      Module::make<GathererModule>(),
+      Module::make<UPCToCommandModule>(),
+  };
+  auto focusFire = Module::make<StaticDefenceFocusFireModule>();
+  auto focusFireDeps = focusFire->dependencies(nullptr);
+  EXPECT(focusFireDeps.has_value());
+  for (size_t i = 0; i < pipeline.size(); i++) {
+    auto deps = pipeline[i]->dependencies(nullptr);
+    EXPECT(deps.has_value());
+    EXPECT(!deps->conflictsWith(*focusFireDeps));
+    for (size_t j = 0; j < i; j++) {
+      EXPECT(deps->conflictsWith(*pipeline[j]->dependencies(nullptr)));
+    }
+  }
+}
+
+SCENARIO("baseplayer/parallel_modules") {
+  auto scenario = GameSinglePlayerUMS("test/maps/eco-base-zerg.scm", "Zerg");
+  Player bot(scenario.makeClient());
+  bot.setCollectTimers(true);
+  bot.setParallelModules(true);
+  std::vector<std::shared_ptr<Latch>> latches;
+  auto modules = makeSlowModules(latches);
+  bot.addModules(
+      std::vector<std::shared_ptr<Module>>(modules.begin(), modules.end()));
+  bot.init();
+
+  auto state = bot.state();
+  auto board = state->board();
+  for (int i = 0; i < 10; i++) {
+    for (auto& latch : latches) {
+      latch->reset();
+    }
+    auto stepStart = std::chrono::steady_clock::now();
+    bot.step();
+    auto stepTime = std::chrono::steady_clock::now() - stepStart;
+
+    // Commands and UPCs are posted in module order
+    auto commands = board->commands();
+    EXPECT(commands.size() == modules.size());
+    for (size_t j = 0; j < commands.size() && j < modules.size(); j++) {
+      EXPECT(commands[j].str == modules[j]->name());
+    }
+    UpcId lastId = kInvalidUpcId;
+    for (auto& module : modules) {
+      auto upcs = board->upcsFrom(module.get());
+      EXPECT(upcs.size() == size_t(i + 1));
+      EXPECT(upcs.rbegin()->first > lastId);
+      lastId = upcs.rbegin()->first;
+    }
+
+    // Independent modules run at the same time
+    for (auto& module : modules) {
+      EXPECT(module->overlapped);
+    }
+    // Slow3 waits for Slow0, and Slow5 waits for everything
+    EXPECT(modules[3]->begin > modules[0]->end);
+    for (size_t j = 0; j < modules.size(); j++) {
+      if (j < 5) {
+        EXPECT(modules[5]->begin > modules[j]->end);
+      } else if (j > 5) {
+        EXPECT(modules[j]->begin > modules[5]->end);
+      }
+    }
+
+    // The critical path includes Slow0 -> Slow3 -> Slow5 -> Slow6, but its
+    // modules were stepped one after another
+    auto chain = modules[0]->duration + modules[3]->duration +
+        modules[5]->duration + modules[6]->duration;
+    EXPECT(bot.moduleCriticalPathTime() >= chain);
+    EXPECT(bot.moduleCriticalPathTime() <= stepTime);
+  }
+}
+
+SCENARIO("baseplayer/parallel_modules_dag") {
+  using namespace std::chrono_literals;
+  auto scenario = GameSinglePlayerUMS("test/maps/eco-base-zerg.scm", "Zerg");
+  Player bot(scenario.makeClient());
+  bot.setParallelModules(true);
+
+  // Slow2 only depends on Slow1, so it can run while Slow0 is still busy. The
+  // last module writes from an iterValues() callback while Slow2 is pending.
+  ModuleDependencies independent;
+  ModuleDependencies readsSecond;
+  readsSecond.reads.push_back(ModuleDependencies::upcsFrom("Slow1"));
+  auto latch = std::make_shared<Latch>(2);
+  auto slow0 = Module::make<SlowPostingModule>(5ms, independent, latch);
+  auto slow1 = Module::make<SlowPostingModule>(5ms, independent);
+  auto slow2 = Module::make<SlowPostingModule>(5ms, readsSecond, latch);
+  slow0->setName("Slow0");
+  slow1->setName("Slow1");
+  slow2->setName("Slow2");
+  bot.addModules({slow0, slow1, slow2, Module::make<IterPostingModule>()});
+  bot.init();
+
+  auto board = bot.state()->board();
+  board->post("iter_key", true);
+  for (int i = 0; i < 5; i++) {
+    latch->reset();
+    bot.step();
+    EXPECT(slow0->overlapped);
+    EXPECT(slow2->overlapped);
+    EXPECT(slow2->begin > slow1->end);
+    EXPECT(board->get<bool>("iter_posted", false));
+    board->remove("iter_posted");
+  }
+}
@@ -93,6 +93,66 @@ CASE("blackboard/upc_storage") {
   EXPECT(board->upcsFrom(&module2).size() == size_t(0));
 }
 
+CASE("blackboard/upc_views") {
+  State state(std::make_shared<tc::Client>());
+  Blackboard* board = state.board();
+  MockModule module1, module2;
+
+  auto ids = [](auto const& range) {
+    std::vector<UpcId> result;
+    for (auto const& it : range) {
+      result.push_back(it.first);
+    }
+    return result;
+  };
+  auto check = [&] {
+    EXPECT(ids(board->upcsView()) == ids(board->upcs()));
+    EXPECT(board->upcsView().size() == board->upcs().size());
+    for (auto* module : {&module1, &module2}) {
+      EXPECT(ids(board->upcsFromView(module)) == ids(board->upcsFrom(module)));
+    }
+    for (auto cmd : {Command::Move, Command::Delete}) {
+      EXPECT(
+          ids(board->upcsWithSharpCommandView(cmd)) ==
+          ids(board->upcsWithSharpCommand(cmd)));
+      for (float minProb : {0.0f, 0.5f, 0.9f}) {
+        EXPECT(
+            ids(board->upcsWithCommandView(cmd, minProb)) ==
+            ids(board->upcsWithCommand(cmd, minProb)));
+      }
+    }
+  };
+
+  std::vector<UpcId> posted;
+  for (int i = 0; i < 10; i++) {
+    auto upc = std::make_shared<UPCTuple>();
+    if (i % 3 == 0) {
+      upc->command[Command::Move] = 1.0f;
+    } else if (i % 3 == 1) {
+      upc->command[Command::Move] = 0.7f;
+      upc->command[Command::Delete] = 0.3f;
+    }
+    auto* origin = i % 2 == 0 ? &module1 : &module2;
+    posted.push_back(board->postUPC(std::move(upc), kRootUpcId, origin));
+  }
+  check();
+  EXPECT(board->upcsView().size() == size_t(10));
+  EXPECT(board->upcsWithSharpCommandView(Command::Move).size() == size_t(4));
+  EXPECT(board->upcsWithCommandView(Command::Delete, 0.2f).size() == size_t(3));
+  EXPECT(board->upcsWithCommandView(Command::Move, 0.0f).size() == size_t(10));
+
+  board->consumeUPC(posted[0], &module1);
+  board->consumeUPCs({posted[3], posted[4]}, &module1);
+  check();
+  EXPECT(board->upcsView().size() == size_t(7));
+  EXPECT(board->upcsWithSharpCommandView(Command::Move).size() == size_t(2));
+
+  board->removeUPCs({posted[1], posted[9]});
+  check();
+  EXPECT(board->upcsFromView(&module2).size() == size_t(2));
+  EXPECT(!board->upcsFromView(&module1).empty());
+}
+
 CASE("blackboard/command_storage") {
   State state(std::make_shared<tc::Client>());
   Blackboard* board = state.board();
@@ -0,0 +1,205 @@
+/*
+ * Copyright (c) 2017-present, Facebook, Inc.
+ *
+ * This source code is licensed under the MIT license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "test.h"
+
+#include "buildtype.h"
+#include "cherrypi.h"
+#include "combatsim.h"
+
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+
+using namespace cherrypi;
+
+namespace {
+
+/// Random engagement between two armies, each spread around its own center
+CombatSim makeRandomSim(std::mt19937& rng, int unitsPerTeam) {
+  static std::vector<BuildType const*> const types = {
+      buildtypes::Zerg_Zergling,
+      buildtypes::Zerg_Hydralisk,
+      buildtypes::Zerg_Mutalisk,
+      buildtypes::Zerg_Scourge,
+      buildtypes::Terran_Marine,
+      buildtypes::Terran_Bunker,
+      buildtypes::Protoss_Zealot,
+      buildtypes::Protoss_Dragoon,
+      buildtypes::Protoss_Reaver,
+  };
+  auto rand = [&](int lo, int hi) {
+    return std::uniform_int_distribution<int>(lo, hi)(rng);
+  };
+
+  CombatSim sim;
+  for (size_t t = 0; t != 2; ++t) {
+    int cx = rand(64, 512);
+    int cy = rand(64, 512);
+    for (int i = 0; i < unitsPerTeam; i++) {
+      CombatSim::SimUnit su;
+      su.type = types[rand(0, types.size() - 1)];
+      su.x = (cx + rand(-24, 24)) << 8;
+      su.y = (cy + rand(-24, 24)) << 8;
+      su.hp = rand(1, std::max(1, su.type->maxHp));
+      su.shields = rand(0, su.type->maxShields);
+      su.armor = rand(0, 2);
+      su.maxSpeed = rand(0, 6 * 256);
+      su.flying = su.type->isFlyer;
+      su.underDarkSwarm = rand(0, 9) == 0;
+      su.cooldownUntil = rand(0, 20);
+      su.groundDamage = su.type->hasGroundWeapon ? rand(5, 20) : 0;
+      su.airDamage = su.type->hasAirWeapon ? rand(5, 20) : 0;
+      su.groundDamageType = rand(0, 3);
+      su.airDamageType = rand(0, 3);
+      su.groundRange = rand(1, 28);
+      su.airRange = rand(1, 28);
+      sim.teams[t].units.push_back(su);
+    }
+  }
+  return sim;
+}
+
+std::vector<CombatSim> makeRandomSims(int numSims, int unitsPerTeam) {
+  std::mt19937 rng(42);
+  std::vector<CombatSim> sims;
+  for (int i = 0; i < numSims; i++) {
+    sims.push_back(makeRandomSim(rng, unitsPerTeam));
+  }
+  return sims;
+}
+
+} // namespace
+
+CASE("combatsim/batch_matches_scalar") {
+  for (int unitsPerTeam : {1, 5, 30}) {
+    auto expected = makeRandomSims(50, unitsPerTeam);
+    auto actual = expected;
+    for (auto& sim : expected) {
+      sim.run(10 * 24);
+    }
+    CombatSimBatch(CombatSimBatch::Mode::Reference).run(actual, 10 * 24);
+
+    for (size_t i = 0; i < expected.size(); i++) {
+      for (size_t t = 0; t != 2; ++t) {
+        auto& eteam = expected[i].teams[t];
+        auto& ateam = actual[i].teams[t];
+        EXPECT(ateam.startHp == eteam.startHp);
+        EXPECT(ateam.endHp == eteam.endHp);
+        auto& eenemies = expected[i].teams[t ^ 1].units;
+        auto& aenemies = actual[i].teams[t ^ 1].units;
+        for (size_t j = 0; j < eteam.units.size(); j++) {
+          auto& eu = eteam.units[j];
+          auto& au = ateam.units[j];
+          EXPECT(au.x == eu.x);
+          EXPECT(au.y == eu.y);
+          EXPECT(au.hp == eu.hp);
+          EXPECT(au.shields == eu.shields);
+          EXPECT(au.cooldownUntil == eu.cooldownUntil);
+          EXPECT(au.targetInRange == eu.targetInRange);
+          EXPECT(
+              (au.target ? au.target - aenemies.data() : -1) ==
+              (eu.target ? eu.target - eenemies.data() : -1));
+        }
+      }
+    }
+  }
+}
+
+CASE("combatsim/batch_fast_mode") {
+  auto sims = makeRandomSims(50, 10);
+  CombatSimBatch(CombatSimBatch::Mode::Fast).run(sims, 10 * 24);
+  for (auto& sim : sims) {
+    for (auto& team : sim.teams) {
+      EXPECT(team.endHp >= 0.0);
+      EXPECT(team.endHp <= team.startHp);
+    }
+  }
+}
+
+CASE("combatsim/cache") {
+  CombatSimCache::Options options;
+  options.capacity = 4;
+  CombatSimCache cache(options);
+  auto sims = makeRandomSims(6, 8);
+
+  auto expected = sims;
+  CombatSimBatch().run(expected, 10 * 24);
+  auto actual = sims;
+  cache.run(actual, 10 * 24);
+  EXPECT(cache.misses() == 6u);
+  EXPECT(cache.hits() == 0u);
+  EXPECT(cache.evictions() == 2u);
+  EXPECT(cache.size() == 4u);
+  for (size_t i = 0; i < sims.size(); i++) {
+    for (size_t t = 0; t != 2; ++t) {
+      EXPECT(actual[i].teams[t].endHp == expected[i].teams[t].endHp);
+    }
+  }
+
+  // Recently used simulations are hits, even if units are shuffled and
+  // slightly moved
+  std::vector<CombatSim> again(sims.end() - 4, sims.end());
+  std::mt19937 rng(0);
+  for (auto& sim : again) {
+    for (auto& team : sim.teams) {
+      std::shuffle(team.units.begin(), team.units.end(), rng);
+      for (auto& u : team.units) {
+        u.x += 1 << 8;
+      }
+    }
+  }
+  cache.run(again, 10 * 24);
+  EXPECT(cache.hits() == 4u);
+  for (size_t i = 0; i < again.size(); i++) {
+    auto& exp = expected[sims.size() - 4 + i];
+    for (size_t t = 0; t != 2; ++t) {
+      EXPECT(again[i].teams[t].startHp == exp.teams[t].startHp);
+      EXPECT(again[i].teams[t].endHp == exp.teams[t].endHp);
+    }
+  }
+
+  // The first simulations have been evicted
+  std::vector<CombatSim> evicted(sims.begin(), sims.begin() + 2);
+  cache.run(evicted, 10 * 24);
+  EXPECT(cache.hits() == 4u);
+  EXPECT(cache.misses() == 8u);
+}
+
+CASE("combatsim/benchmark[hide]") {
+  for (int unitsPerTeam : {5, 20, 60}) {
+    int constexpr kSims = 200;
+    auto sims = makeRandomSims(kSims, unitsPerTeam);
+
+    auto simsPerSecond = [&](auto&& run) {
+      auto copy = sims;
+      auto start = hires_clock::now();
+      run(copy);
+      auto duration = hires_clock::now() - start;
+      return kSims /
+          std::chrono::duration_cast<std::chrono::duration<double>>(duration)
+              .count();
+    };
+    auto scalar = simsPerSecond([](std::vector<CombatSim>& s) {
+      for (auto& sim : s) {
+        sim.run(10 * 24);
+      }
+    });
+    auto reference = simsPerSecond([](std::vector<CombatSim>& s) {
+      CombatSimBatch(CombatSimBatch::Mode::Reference).run(s, 10 * 24);
+    });
+    auto fast = simsPerSecond([](std::vector<CombatSim>& s) {
+      CombatSimBatch(CombatSimBatch::Mode::Fast).run(s, 10 * 24);
+    });
+    VLOG(0) << unitsPerTeam << " vs " << unitsPerTeam
+            << " units: simulations per second: " << scalar << " scalar, "
+            << reference << " batched, " << fast << " batched (fast)";
+    EXPECT(scalar > 0);
+  }
+}
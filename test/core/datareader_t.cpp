@@ -44,6 +44,25 @@ std::pair<std::string, std::vector<std::string>> createTestDataNoPrefix(
   return std::make_pair(res.first, std::move(paths));
 }
 
+struct TensorDatum {
+  int id = 0;
+  torch::Tensor data;
+  torch::Tensor labels;
+  torch::Tensor none;
+
+  template <typename F>
+  void forEachTensor(F&& f) {
+    f(data);
+    f(labels);
+    f(none);
+  }
+
+  template <typename Archive>
+  void serialize(Archive& ar) {
+    ar(id, data, labels, none);
+  }
+};
+
 } // namespace
 
 CASE("datareader/simple") {
@@ -444,3 +463,203 @@ CASE("datareader/init_fn") {
   // 3 threads expected: 2 reader threads, one transform
   EXPECT(numThreadsSpawned == 3);
 }
+
+CASE("datareader/shards") {
+  auto dir = fsutils::mktempd();
+  auto cleanup = utils::makeGuard([&]() { fsutils::rmrf(dir); });
+  {
+    ShardWriter w1(dir + "/s0.shard");
+    ShardWriter w2(dir + "/s1.shard");
+    for (int i = 0; i < 5; i++) {
+      w1.write(i);
+    }
+    for (int i = 5; i < 11; i++) {
+      w2.write(i);
+    }
+    EXPECT(w1.size() == 5u);
+  }
+  // Empty and non-existing shards are fine
+  ShardWriter(dir + "/empty.shard").close();
+
+  ShardReader shard(dir + "/s1.shard");
+  EXPECT(shard.size() == 6u);
+  EXPECT(shard.read<int>(3) == 8);
+  EXPECT(shard.read<int>(0) == 5);
+  EXPECT_THROWS(shard.read<int>(6));
+
+  auto reader = makeShardDataReader<int>(
+      {"s0.shard", "empty.shard", "idontexist", "s1.shard"}, 3, 4, dir);
+  auto it = reader.iterator();
+  std::vector<int> data;
+  while (it->hasNext()) {
+    auto batch = it->next();
+    EXPECT(batch.size() <= 4u);
+    data.insert(data.end(), batch.begin(), batch.end());
+  }
+  EXPECT(data == std::vector<int>({0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10}));
+}
+
+CASE("datareader/pack_shards") {
+  auto paths = createTestData<int, zstd::ofstream>({
+      {"f0", 0},
+      {"f1", 1},
+      {"f2", 2},
+      {"f3", 3},
+      {"f4", 4},
+  });
+  auto cleanup = utils::makeGuard([&]() { fsutils::rmrf(paths.first); });
+  // Both compressed and uncompressed data is supported
+  {
+    std::ofstream os(paths.first + "/f5");
+    cereal::BinaryOutputArchive archive(os);
+    archive(5);
+  }
+  paths.second.push_back("f5");
+  paths.second.push_back("idontexist");
+
+  auto shards =
+      packShards(paths.second, paths.first + "/packed", 4, paths.first);
+  EXPECT(shards.size() == 2u);
+
+  auto reader = makeShardDataReader<int>(shards, 2, 4);
+  auto it = reader.iterator();
+  auto d = it->next();
+  EXPECT(d == std::vector<int>({0, 1, 2, 3}));
+  EXPECT((d = it->next(), true));
+  EXPECT(d == std::vector<int>({4, 5}));
+  EXPECT(it->hasNext() == false);
+}
+
+CASE("datareader/sample_store") {
+  auto dir = fsutils::mktempd();
+  auto cleanup = utils::makeGuard([&]() { fsutils::rmrf(dir); });
+  {
+    SampleStoreWriter writer(dir + "/s0.store");
+    for (int i = 0; i < 10; i++) {
+      TensorDatum d;
+      d.id = i;
+      d.data = torch::full({3, i + 1}, float(i));
+      d.labels = torch::arange(0, i, torch::kLong);
+      writer.write(d);
+      // Tensors are restored after writing
+      EXPECT(d.data.defined());
+      EXPECT(d.labels.size(0) == i);
+    }
+  }
+  SampleStoreWriter(dir + "/empty.store").close();
+
+  SampleStore store(dir + "/s0.store");
+  EXPECT(store.size() == 10u);
+  auto d = store.read<TensorDatum>(4);
+  EXPECT(d.id == 4);
+  EXPECT((d.data.sizes().vec() == std::vector<int64_t>({3, 5})));
+  EXPECT(d.data.sum().item<float>() == 60.0f);
+  EXPECT(d.labels.sum().item<int64_t>() == 6);
+  EXPECT(!d.none.defined());
+  EXPECT_THROWS(store.read<TensorDatum>(10));
+
+  // Tensors are aligned views into the mapped file
+  auto addr = reinterpret_cast<uintptr_t>(d.data.data_ptr());
+  EXPECT(addr % SampleStoreWriter::kAlignment == 0u);
+  EXPECT(store.read<TensorDatum>(4).data.data_ptr() == d.data.data_ptr());
+
+  auto reader = makeSampleStoreDataReader<TensorDatum>(
+      {"s0.store", "empty.store", "idontexist"}, 3, 4, dir);
+  auto readIds = [&] {
+    std::vector<int> ids;
+    auto it = reader.iterator();
+    while (it->hasNext()) {
+      for (auto const& datum : it->next()) {
+        EXPECT(datum.data.size(1) == datum.id + 1);
+        ids.push_back(datum.id);
+      }
+    }
+    return ids;
+  };
+  EXPECT(readIds() == std::vector<int>({0, 1, 2, 3, 4, 5, 6, 7, 8, 9}));
+  reader.shuffle();
+  auto ids = readIds();
+  EXPECT(ids.size() == 10u);
+  std::sort(ids.begin(), ids.end());
+  EXPECT(ids == std::vector<int>({0, 1, 2, 3, 4, 5, 6, 7, 8, 9}));
+}
+
+CASE("datareader/shuffle") {
+  std::vector<std::pair<std::string, int>> files;
+  std::vector<int> expected;
+  for (int i = 0; i < 50; i++) {
+    files.emplace_back("f" + std::to_string(i), i);
+    expected.push_back(i);
+  }
+  auto paths = createTestData<int, zstd::ofstream>(files);
+  auto cleanup = utils::makeGuard([&]() { fsutils::rmrf(paths.first); });
+  paths.second.push_back("idontexist");
+
+  auto readEpoch = [](ShuffleDataReader<int>& reader, size_t epoch) {
+    std::vector<int> data;
+    reader.startEpoch(epoch);
+    while (reader.hasNext()) {
+      auto batch = reader.next();
+      data.insert(data.end(), batch.begin(), batch.end());
+    }
+    return data;
+  };
+
+  // With a single thread and a buffer for a single batch, the order is
+  // determined by seed and epoch
+  auto r1 = makeShuffleDataReader<int>(paths.second, 1, 1, 1, 42, paths.first);
+  auto r2 = makeShuffleDataReader<int>(paths.second, 1, 1, 1, 42, paths.first);
+  auto d1 = readEpoch(*r1, 0);
+  EXPECT(d1.size() == 50u);
+  EXPECT(d1 != expected);
+  EXPECT(readEpoch(*r2, 0) == d1);
+  EXPECT(readEpoch(*r2, 1) != d1);
+  EXPECT(readEpoch(*r1, 0) == d1);
+
+  // For larger buffers, this requires reproducible mode
+  auto r3 = makeShuffleDataReader<int>(paths.second, 1, 4, 16, 42, paths.first);
+  auto r4 = makeShuffleDataReader<int>(paths.second, 1, 4, 16, 42, paths.first);
+  r3->setReproducible(true);
+  r4->setReproducible(true);
+  auto d3 = readEpoch(*r3, 0);
+  EXPECT(d3.size() == 50u);
+  EXPECT(readEpoch(*r4, 0) == d3);
+  EXPECT(readEpoch(*r3, 0) == d3);
+
+  auto reader =
+      makeShuffleDataReader<int>(paths.second, 4, 8, 16, 42, paths.first);
+  EXPECT(reader->hasNext() == false);
+  EXPECT_THROWS(reader->next());
+  EXPECT_THROWS(
+      makeShuffleDataReader<int>(paths.second, 4, 8, 4, 42, paths.first));
+  for (auto epoch = 0U; epoch < 4; epoch++) {
+    if (epoch == 1) {
+      // Abandon epoch early; remaining data will be discarded
+      reader->startEpoch(epoch);
+      EXPECT(reader->next().size() == 8u);
+      continue;
+    }
+    auto data = readEpoch(*reader, epoch);
+    std::sort(data.begin(), data.end());
+    EXPECT(data == expected);
+    EXPECT(reader->hasNext() == false);
+  }
+
+  // Restarting the same epoch discards reads that are still in flight
+  reader->startEpoch(3);
+  EXPECT(reader->next().size() == 8u);
+  auto data = readEpoch(*reader, 3);
+  std::sort(data.begin(), data.end());
+  EXPECT(data == expected);
+
+  auto stats = reader->stats();
+  EXPECT(stats.size() == 4u);
+  size_t numRead = 0;
+  size_t numErrors = 0;
+  for (auto const& s : stats) {
+    numRead += s.numRead;
+    numErrors += s.numErrors;
+  }
+  EXPECT(numRead >= 150u);
+  EXPECT(numErrors >= 3u);
+}
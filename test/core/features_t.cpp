@@ -9,6 +9,7 @@
 
 #include "common/serialization.h"
 #include "features/defoggerfeatures.h"
+#include "features/featurecache.h"
 #include "features/features.h"
 #include "features/unitsfeatures.h"
 #include "replayer.h"
@@ -22,6 +23,27 @@
 using namespace cherrypi;
 using namespace visdom;
 
+namespace cherrypi {
+namespace featureimpl {
+
+// Extractors registered in features.cpp
+void extractGroundHeight(torch::Tensor, State*, Rect const&);
+void extractWalkability(torch::Tensor, State*, Rect const&);
+void extractBuildability(torch::Tensor, State*, Rect const&);
+void extractTallDoodad(torch::Tensor, State*, Rect const&);
+void extractStartLocations(torch::Tensor, State*, Rect const&);
+void extractXYGrid(torch::Tensor, State*, Rect const&);
+void extractHasStructure(torch::Tensor, State*, Rect const&);
+void extractHasStructureBT(torch::Tensor, State*, Rect const&);
+void extractFogOfWar(torch::Tensor, State*, Rect const&);
+void extractFogOfWarBT(torch::Tensor, State*, Rect const&);
+void extractCreep(torch::Tensor, State*, Rect const&);
+void extractCreepBT(torch::Tensor, State*, Rect const&);
+void extractReservedAsUnbuildable(torch::Tensor, State*, Rect const&);
+
+} // namespace featureimpl
+} // namespace cherrypi
+
 namespace {
 std::string const kDefaultReplay = "test/maps/replays/TL_TvZ_IC420273.rep";
 
@@ -722,3 +744,78 @@ CASE("features/xygrid") {
   vs.heatmap(f4.tensor[1], makeOpts({{"title", "f3_x"}}));
   */
 }
+
+CASE("features/cache") {
+  auto replay = replayTo(10);
+  auto* state = replay->state();
+  auto bbox = Rect::centeredWithSize(state->mapRect().center(), 600, 600);
+  auto bboxBT = Rect(-2, -2, 100, 80);
+
+  // Static features for the whole map are served from the cache directly
+  auto fg1 = featurizePlain(state, {PlainFeatureType::GroundHeight});
+  auto fg2 = featurizePlain(state, {PlainFeatureType::GroundHeight});
+  EXPECT(fg1.tensor.data_ptr() == fg2.tensor.data_ptr());
+  EXPECT(
+      fg1.tensor.data_ptr() ==
+      state->featureCache()
+          .staticLayer(PlainFeatureType::GroundHeight)
+          .data_ptr());
+
+  // Cached features match the ones computed from scratch by the extractors
+  using Extractor = void (*)(torch::Tensor, State*, Rect const&);
+  std::vector<std::pair<PlainFeatureType, Extractor>> extractors = {
+      {PlainFeatureType::GroundHeight, &featureimpl::extractGroundHeight},
+      {PlainFeatureType::Walkability, &featureimpl::extractWalkability},
+      {PlainFeatureType::Buildability, &featureimpl::extractBuildability},
+      {PlainFeatureType::FogOfWar, &featureimpl::extractFogOfWar},
+      {PlainFeatureType::Creep, &featureimpl::extractCreep},
+      {PlainFeatureType::ReservedAsUnbuildable,
+       &featureimpl::extractReservedAsUnbuildable},
+      {PlainFeatureType::TallDoodad, &featureimpl::extractTallDoodad},
+      {PlainFeatureType::StartLocations, &featureimpl::extractStartLocations},
+      {PlainFeatureType::XYGrid, &featureimpl::extractXYGrid},
+      {PlainFeatureType::HasStructure, &featureimpl::extractHasStructure},
+  };
+  std::vector<std::pair<PlainFeatureType, Extractor>> extractorsBT = {
+      {PlainFeatureType::FogOfWar, &featureimpl::extractFogOfWarBT},
+      {PlainFeatureType::Creep, &featureimpl::extractCreepBT},
+      {PlainFeatureType::HasStructure, &featureimpl::extractHasStructureBT},
+  };
+  std::vector<PlainFeatureType> types, typesBT;
+  for (auto const& e : extractors) {
+    types.push_back(e.first);
+  }
+  for (auto const& e : extractorsBT) {
+    typesBT.push_back(e.first);
+  }
+  while (!state->gameEnded() && state->currentFrame() < 4500) {
+    for (auto i = 0; i < 250 && !state->gameEnded(); i++) {
+      replay->step();
+    }
+    for (auto rect : {bbox, state->mapRect()}) {
+      auto f = featurizePlain(state, types, rect);
+      EXPECT(f.desc.size() == extractors.size());
+      auto chan = 0;
+      for (auto i = 0U; i < extractors.size(); i++) {
+        auto const& desc = f.desc[i];
+        EXPECT(desc.type.get<PlainFeatureType>() == extractors[i].first);
+        auto expected = torch::zeros({desc.numChannels, rect.h, rect.w});
+        extractors[i].second(expected, state, rect);
+        auto actual = f.tensor.slice(0, chan, chan + desc.numChannels);
+        EXPECT(actual.equal(expected));
+        chan += desc.numChannels;
+      }
+    }
+
+    auto fbt = featurizePlainBT(state, typesBT, bboxBT);
+    for (auto i = 0U; i < extractorsBT.size(); i++) {
+      auto expected = torch::zeros({1, bboxBT.h, bboxBT.w});
+      extractorsBT[i].second(expected, state, bboxBT);
+      EXPECT(fbt.tensor.slice(0, i, i + 1).equal(expected));
+    }
+  }
+  EXPECT(
+      featurizePlain(state, {PlainFeatureType::HasStructure})
+          .tensor.sum()
+          .item<float>() > 0);
+}
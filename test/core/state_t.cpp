@@ -119,4 +119,28 @@ CASE("state/firstopponent_multiplayer_unitsnone") {
   EXPECT_THROWS(checkFirstOpponentStrictly(p1));
 }
 
+CASE("state/step_budget") {
+  State state(std::make_shared<tc::Client>());
+  // No budget by default
+  EXPECT(state.stepDeadline() == hires_clock::time_point::max());
+  EXPECT(!state.stepBudgetExhausted());
+  int slices = 0;
+  EXPECT(state.runWithinStepBudget([&] { return ++slices == 10; }));
+  EXPECT(slices == 10);
+
+  // Jobs make progress even if there is no time left
+  state.setStepDeadline(hires_clock::now() - std::chrono::milliseconds(1));
+  EXPECT(state.stepBudgetExhausted());
+  EXPECT(state.remainingStepBudget() < Duration::zero());
+  slices = 0;
+  EXPECT(!state.runWithinStepBudget([&] { return ++slices == 10; }));
+  EXPECT(slices == 1);
+
+  state.setStepDeadline(hires_clock::now() + std::chrono::seconds(60));
+  EXPECT(!state.stepBudgetExhausted());
+  EXPECT(state.stepBudgetExhausted(std::chrono::seconds(120)));
+  EXPECT(state.runWithinStepBudget([&] { return ++slices == 10; }));
+  EXPECT(slices == 10);
+}
+
 } // namespace
\ No newline at end of file
@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) 2017-present, Facebook, Inc.
+ *
+ * This source code is licensed under the MIT license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "test.h"
+
+#include "gameutils/game.h"
+#include "player.h"
+#include "state.h"
+#include "tilesinfo.h"
+
+using namespace cherrypi;
+
+CASE("tilesinfo/bitplane") {
+  TileBitPlane plane;
+  EXPECT(plane.count() == 0u);
+  EXPECT(!plane.anyInRect(0, 0, TileBitPlane::kWidth, TileBitPlane::kHeight));
+
+  plane.set(3u, 5u, true);
+  plane.set(63u, 5u, true);
+  plane.set(64u, 5u, true);
+  plane.set(255u, 255u, true);
+  EXPECT(plane.test(3u, 5u));
+  EXPECT(plane.test(5u * TileBitPlane::kWidth + 64));
+  EXPECT(!plane.test(4u, 5u));
+  EXPECT(plane.count() == 4u);
+  EXPECT(plane.countInRect(0, 0, 64, 6) == 2u);
+  EXPECT(plane.countInRect(63, 5, 65, 6) == 2u);
+  EXPECT(plane.countInRect(4, 0, 63, 256) == 0u);
+  EXPECT(plane.anyInRect(200, 200, 1000, 1000));
+  EXPECT(!plane.anyInRect(65, 0, 255, 255));
+
+  std::vector<size_t> indices;
+  plane.forEachSet([&](size_t i) { indices.push_back(i); });
+  EXPECT(
+      indices ==
+      std::vector<size_t>({5 * 256 + 3, 5 * 256 + 63, 5 * 256 + 64, 65535}));
+
+  TileBitPlane other;
+  other.set(3u, 5u, true);
+  other.set(10u, 10u, true);
+  TileBitPlane both = plane;
+  both &= other;
+  EXPECT(both.count() == 1u);
+  TileBitPlane either = plane;
+  either |= other;
+  EXPECT(either.count() == 5u);
+  TileBitPlane changed = plane;
+  changed ^= other;
+  EXPECT(changed.count() == 4u);
+  EXPECT(!changed.test(3u, 5u));
+  EXPECT(changed.test(10u, 10u));
+  plane.andNot(other);
+  EXPECT(plane.count() == 3u);
+  EXPECT(!plane.test(3u, 5u));
+
+  plane.set(64u, 5u, false);
+  EXPECT(plane.count() == 2u);
+  plane.reset();
+  EXPECT(plane.count() == 0u);
+}
+
+SCENARIO("tilesinfo/layers_match_tiles") {
+  auto scenario = GameSinglePlayerUMS("test/maps/eco-base-zerg.scm", "Zerg");
+  Player bot(scenario.makeClient());
+  bot.setWarnIfSlow(false);
+  bot.init();
+  auto state = bot.state();
+  for (int i = 0; i < 10; i++) {
+    bot.step();
+  }
+
+  auto& tilesInfo = state->tilesInfo();
+  auto& layers = tilesInfo.layers();
+  size_t mismatches = 0;
+  for (unsigned y = 0; y < tilesInfo.mapTileHeight(); y++) {
+    for (unsigned x = 0; x < tilesInfo.mapTileWidth(); x++) {
+      size_t i = y * TilesInfo::tilesWidth + x;
+      auto& tile = tilesInfo.tiles[i];
+      mismatches += layers.visible.test(i) != tile.visible;
+      mismatches += layers.buildable.test(i) != tile.buildable;
+      mismatches += layers.walkable.test(i) != tile.entirelyWalkable;
+      mismatches += layers.creep.test(i) != tile.hasCreep;
+      mismatches += layers.reserved.test(i) != tile.reservedAsUnbuildable;
+      mismatches += layers.lastSeen[i] != tile.lastSeen;
+      mismatches += layers.height[i] != tile.height;
+    }
+  }
+  EXPECT(mismatches == 0u);
+  EXPECT(layers.visible.count() > 0u);
+  EXPECT(layers.creep.count() > 0u);
+  EXPECT(layers.visibleVersion > 0u);
+
+  // Reservations are reflected immediately
+  auto* type = buildtypes::Zerg_Spawning_Pool;
+  int x = 4 * 10;
+  int y = 4 * 10;
+  size_t before = layers.reserved.count();
+  auto version = layers.reservedVersion;
+  tilesInfo.reserveArea(type, x, y);
+  EXPECT(layers.reservedVersion > version);
+  EXPECT(
+      layers.reserved.count() ==
+      before + type->tileWidth * type->tileHeight);
+  EXPECT(layers.reserved.test(10u, 10u));
+  tilesInfo.unreserveArea(type, x, y);
+  EXPECT(layers.reserved.count() == before);
+}
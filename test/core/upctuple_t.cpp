@@ -121,3 +121,42 @@ CASE("upctuple/position_tensor") {
   }
 }
 #endif // HAVE_ATEN
+
+CASE("upctuple/command_map") {
+  UPCTuple upc;
+  EXPECT(upc.command.empty());
+  EXPECT(upc.commandProb(Command::Move) == 0.0f);
+
+  upc.command[Command::Move] = 1.0f;
+  upc.command[Command::Create] = 0.5f;
+  EXPECT(upc.command.size() == 2u);
+  EXPECT(upc.commandProb(Command::Move) == 1.0f);
+  EXPECT(upc.commandProb(Command::Create) == 0.5f);
+  EXPECT(upc.commandProb(Command::Delete) == 0.0f);
+  EXPECT(upc.command.sharpMask() == uint64_t(Command::Move));
+  EXPECT(upc.command.mask() == uint64_t(Command::Move | Command::Create));
+
+  // Iteration is ordered by command and yields references
+  std::vector<Command> cmds;
+  for (auto&& it : upc.command) {
+    cmds.push_back(it.first);
+    it.second = 0.25f;
+  }
+  EXPECT(cmds == std::vector<Command>({Command::Create, Command::Move}));
+  EXPECT(upc.command.sharpMask() == 0u);
+  EXPECT(upc.command.find(Command::Move)->second == 0.25f);
+  EXPECT(upc.command.find(Command::Delete) == upc.command.end());
+
+  EXPECT(upc.command.erase(Command::Create) == 1u);
+  EXPECT(upc.command.erase(Command::Create) == 0u);
+  EXPECT(upc.command.size() == 1u);
+  EXPECT((upc.command == UPCTuple::CommandMap({{Command::Move, 0.25f}})));
+
+  auto uniform = UPCTuple::uniformCommand();
+  EXPECT(uniform.size() == size_t(numUpcCommands()));
+  float sum = 0.0f;
+  for (auto const& it : uniform) {
+    sum += it.second;
+  }
+  EXPECT(sum == lest::approx(1.0f));
+}
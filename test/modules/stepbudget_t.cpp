@@ -0,0 +1,183 @@
+/*
+ * Copyright (c) 2017-present, Facebook, Inc.
+ *
+ * This source code is licensed under the MIT license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "gameutils/game.h"
+#include "test.h"
+
+#include "modules.h"
+#include "player.h"
+
+#include <limits>
+
+using namespace cherrypi;
+DECLARE_double(rtfactor);
+
+namespace {
+
+std::shared_ptr<Player> createPlayer(
+    std::shared_ptr<tc::Client> client,
+    std::vector<std::shared_ptr<Module>> modules) {
+  auto bot = std::make_shared<Player>(client);
+  bot->setRealtimeFactor(FLAGS_rtfactor);
+  bot->addModules(modules);
+  bot->init();
+  return bot;
+}
+
+void exhaustStepBudget(State* state) {
+  state->setStepDeadline(hires_clock::now() - std::chrono::milliseconds(1));
+}
+
+} // namespace
+
+SCENARIO("stepbudget/autobuild_evaluate") {
+  auto scenario = GameMultiPlayer(
+      "maps/(4)Fighting Spirit.scx", tc::BW::Race::Zerg, tc::BW::Race::Zerg);
+  auto module = Module::make<AutoBuildModule>();
+  auto ourBot = createPlayer(
+      scenario.makeClient1(), {module, Module::make<UPCToCommandModule>()});
+  auto theirBot = createPlayer(scenario.makeClient2(), {});
+  auto state = ourBot->state();
+  auto step = [&] {
+    ourBot->step();
+    theirBot->step();
+  };
+  step();
+
+  std::vector<DefaultAutoBuildTask::Target> targets;
+  targets.emplace_back(buildtypes::Zerg_Drone, 40);
+  targets.emplace_back(buildtypes::Zerg_Zergling, 40);
+  auto task = std::make_shared<DefaultAutoBuildTask>(
+      kRootUpcId, state, module.get(), std::move(targets));
+
+  // Planning is suspended if there's no time left
+  exhaustStepBudget(state);
+  EXPECT(!task->evaluate(state, module.get()));
+  auto startFrame = state->currentFrame();
+  EXPECT(task->initialBuildState.frame == startFrame);
+  auto plannedFrame = task->currentBuildState.frame;
+
+  // ...and resumed within the same game frame
+  EXPECT(!task->evaluate(state, module.get()));
+  EXPECT(task->initialBuildState.frame == startFrame);
+  EXPECT(task->currentBuildState.frame > plannedFrame);
+  plannedFrame = task->currentBuildState.frame;
+
+  // ...or in a later one
+  step();
+  EXPECT(state->currentFrame() > startFrame);
+  exhaustStepBudget(state);
+  EXPECT(!task->evaluate(state, module.get()));
+  EXPECT(task->initialBuildState.frame == startFrame);
+  EXPECT(task->currentBuildState.frame > plannedFrame);
+
+  // Without a budget, planning is finished in a single call
+  step();
+  EXPECT(state->stepDeadline() == hires_clock::time_point::max());
+  EXPECT(task->evaluate(state, module.get()));
+  EXPECT(task->initialBuildState.frame == startFrame);
+
+  // The next evaluation starts over from the current state
+  EXPECT(task->evaluate(state, module.get()));
+  EXPECT(task->initialBuildState.frame == state->currentFrame());
+}
+
+SCENARIO("stepbudget/autobuild_module") {
+  auto scenario = GameMultiPlayer(
+      "maps/(4)Fighting Spirit.scx", tc::BW::Race::Zerg, tc::BW::Race::Zerg);
+  auto module = Module::make<AutoBuildModule>();
+  auto ourBot = createPlayer(
+      scenario.makeClient1(), {module, Module::make<UPCToCommandModule>()});
+  auto theirBot = createPlayer(scenario.makeClient2(), {});
+  auto state = ourBot->state();
+  auto step = [&] {
+    ourBot->step();
+    theirBot->step();
+  };
+  step();
+
+  std::vector<DefaultAutoBuildTask::Target> targets;
+  targets.emplace_back(buildtypes::Zerg_Drone, 40);
+  targets.emplace_back(buildtypes::Zerg_Zergling, 40);
+  auto board = state->board();
+  auto upcId =
+      board->postUPC(std::make_shared<UPCTuple>(), kRootUpcId, module.get());
+  auto task = std::make_shared<DefaultAutoBuildTask>(
+      upcId, state, module.get(), std::move(targets));
+  board->postTask(task, module.get(), true);
+
+  // With a minimal budget, every module step plans a single slice, and
+  // planning is resumed in subsequent steps
+  ourBot->setStepBudget(Duration(1));
+  step();
+  EXPECT(task->lastEvaluate == 0);
+  auto startFrame = task->initialBuildState.frame;
+  auto plannedFrame = task->currentBuildState.frame;
+  step();
+  EXPECT(task->lastEvaluate == 0);
+  EXPECT(state->currentFrame() > startFrame);
+  EXPECT(task->initialBuildState.frame == startFrame);
+  EXPECT(task->currentBuildState.frame > plannedFrame);
+
+  // Planning is finished eventually without blocking a step
+  int numSteps = 2;
+  while (task->lastEvaluate == 0 && numSteps < 1000) {
+    step();
+    numSteps++;
+  }
+  EXPECT(task->lastEvaluate > 0);
+  EXPECT(numSteps < 1000);
+}
+
+SCENARIO("stepbudget/tactics_flee_score") {
+  auto scenario = GameMultiPlayer(
+      "maps/(4)Fighting Spirit.scx", tc::BW::Race::Zerg, tc::BW::Race::Zerg);
+  auto ourBot = createPlayer(scenario.makeClient1(), {});
+  auto theirBot = createPlayer(scenario.makeClient2(), {});
+  auto state = ourBot->state();
+  for (int i = 0; i < 3; i++) {
+    ourBot->step();
+    theirBot->step();
+  }
+  EXPECT(!state->unitsInfo().myResourceDepots().empty());
+
+  auto constexpr kAllNodes = std::numeric_limits<size_t>::max();
+  TacticsFleeScoreJob full;
+  full.start(state);
+  EXPECT(full.running);
+  EXPECT(full.step(state, kAllNodes));
+  EXPECT(!full.running);
+
+  // Our depots have a score of zero, and scores spread out from there
+  auto* depot = state->unitsInfo().myResourceDepots().front();
+  auto* tile = state->tilesInfo().tryGetTile(depot->x, depot->y);
+  EXPECT(tile != nullptr);
+  auto depotIndex = tile - state->tilesInfo().tiles.data();
+  EXPECT(full.fleeScore[depotIndex] == 0);
+  EXPECT(full.fleeScore[depotIndex + 4] > 0);
+  EXPECT(full.fleeScore[depotIndex + 4] < 0xffff);
+
+  // Suspending and resuming the flood fill produces the same scores
+  TacticsFleeScoreJob sliced;
+  sliced.start(state);
+  int numSlices = 1;
+  while (!sliced.step(state, 256)) {
+    EXPECT(sliced.running);
+    numSlices++;
+  }
+  EXPECT(numSlices > 1);
+  EXPECT(!sliced.running);
+  EXPECT(sliced.fleeScore == full.fleeScore);
+
+  // Starting over discards partial results
+  TacticsFleeScoreJob restarted;
+  restarted.start(state);
+  EXPECT(!restarted.step(state, 256));
+  restarted.start(state);
+  EXPECT(restarted.step(state, kAllNodes));
+  EXPECT(restarted.fleeScore == full.fleeScore);
+}
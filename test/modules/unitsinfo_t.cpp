@@ -10,6 +10,8 @@
 
 #include <glog/logging.h>
 
+#include <set>
+
 #include "buildorderfixed.h"
 #include "common/rand.h"
 #include "modules.h"
@@ -18,6 +20,8 @@
 
 using namespace cherrypi;
 
+DECLARE_bool(unitsSpatialIndex);
+
 namespace {
 typedef std::shared_ptr<cherrypi::test::BuildOrderFixedModule> SpBoModule;
 
@@ -41,6 +45,49 @@ class MoveZerglingsModule : public Module {
     }
   }
 };
+
+std::unique_ptr<Player> makeArmiesPlayer(
+    GameSinglePlayer& scenario,
+    int perSide) {
+  using namespace tc::BW;
+  auto bot = std::make_unique<Player>(scenario.makeClient());
+  bot->setWarnIfSlow(false);
+  bot->addModule(OnceModule::makeWithSpawns(
+      {
+          {perSide / 2, UnitType::Terran_Marine, 500, 532, 24, 24},
+          {perSide - perSide / 2, UnitType::Terran_Wraith, 500, 532, 24, 24},
+      },
+      "MySpawns"));
+  bot->addModule(OnceModule::makeWithEnemySpawns(
+      {
+          {perSide / 2, UnitType::Zerg_Zergling, 540, 532, 24, 24},
+          {perSide - perSide / 2, UnitType::Zerg_Mutalisk, 540, 532, 24, 24},
+      },
+      "EnemySpawns"));
+  bot->addModule(Module::make<UPCToCommandModule>());
+  bot->init();
+  return bot;
+}
+
+std::map<UnitId, std::set<UnitId>> proximitySnapshot(
+    State* state,
+    std::vector<Unit*> Unit::*list) {
+  std::map<UnitId, std::set<UnitId>> snapshot;
+  for (Unit* u : state->unitsInfo().liveUnits()) {
+    for (Unit* o : u->*list) {
+      snapshot[u->id].insert(o->id);
+    }
+  }
+  return snapshot;
+}
+
+std::set<UnitId> idSet(std::vector<Unit*> const& units) {
+  std::set<UnitId> ids;
+  for (Unit* u : units) {
+    ids.insert(u->id);
+  }
+  return ids;
+}
 } // namespace
 
 SCENARIO("unitsinfo/topspeed") {
@@ -201,3 +248,148 @@ SCENARIO("unitsinfo/throw_on_nomaphack") {
   EXPECT_THROWS(s1->unitsInfo().mapHacked());
   EXPECT_THROWS(s2->unitsInfo().mapHacked());
 }
+
+SCENARIO("unitsinfo/units_of_type") {
+  auto scenario = GameMultiPlayer(
+      "maps/(4)Fighting Spirit.scx", tc::BW::Race::Zerg, tc::BW::Race::Zerg);
+
+  std::shared_ptr<Player> p1 = createPlayer(scenario.makeClient1(), false);
+  std::shared_ptr<Player> p2 = createPlayer(scenario.makeClient2(), false);
+
+  auto state = p1->state();
+  int const kMaxFrames = 6000;
+  // Per-type containers are maintained incrementally; they should always
+  // match a filter over myUnits()
+  auto check = [&]() {
+    auto& unitsInfo = state->unitsInfo();
+    size_t total = 0;
+    size_t totalCompleted = 0;
+    for (auto* type : buildtypes::allUnitTypes) {
+      auto& ofType = unitsInfo.myUnitsOfType(type);
+      auto& completedOfType = unitsInfo.myCompletedUnitsOfType(type);
+      std::set<Unit*> expected;
+      std::set<Unit*> expectedCompleted;
+      for (Unit* u : unitsInfo.myUnits()) {
+        if (u->type == type) {
+          expected.insert(u);
+          if (u->completed()) {
+            expectedCompleted.insert(u);
+          }
+        }
+      }
+      EXPECT(std::set<Unit*>(ofType.begin(), ofType.end()) == expected);
+      EXPECT(ofType.size() == expected.size());
+      EXPECT(
+          std::set<Unit*>(completedOfType.begin(), completedOfType.end()) ==
+          expectedCompleted);
+      EXPECT(completedOfType.size() == expectedCompleted.size());
+      total += ofType.size();
+      totalCompleted += completedOfType.size();
+    }
+    EXPECT(total == unitsInfo.myUnits().size());
+    EXPECT(totalCompleted <= total);
+    EXPECT(unitsInfo.myUnitsOfType(buildtypes::Metabolic_Boost).empty());
+  };
+
+  do {
+    p1->step();
+    p2->step();
+    if (state->currentFrame() % 50 == 0) {
+      check();
+    }
+  } while (!state->gameEnded() && state->currentFrame() < kMaxFrames);
+  check();
+}
+
+SCENARIO("unitsinfo/spatial_index") {
+  auto scenario = GameSinglePlayerUMS("test/maps/micro-big.scm", "Terran");
+  auto bot = makeArmiesPlayer(scenario, 40);
+  auto state = bot->state();
+  auto& unitsInfo = state->unitsInfo();
+
+  for (int i = 0; i < 40; i++) {
+    bot->step();
+  }
+  EXPECT(unitsInfo.grid().size() == unitsInfo.liveUnits().size());
+
+  // Proximity lists computed via the grid should match a full scan
+  auto sight = proximitySnapshot(state, &Unit::unitsInSightRange);
+  auto threats = proximitySnapshot(state, &Unit::threateningEnemies);
+  FLAGS_unitsSpatialIndex = false;
+  unitsInfo.update();
+  FLAGS_unitsSpatialIndex = true;
+  EXPECT(sight == proximitySnapshot(state, &Unit::unitsInSightRange));
+  EXPECT(threats == proximitySnapshot(state, &Unit::threateningEnemies));
+  EXPECT(!threats.empty());
+
+  // Queries should match brute-force filtering of all live units
+  ProximityFilter enemyAir;
+  enemyAir.owner = ProximityFilter::Owner::Enemy;
+  enemyAir.ground = false;
+  auto center = Position(520, 532);
+  for (float radius : {0.0f, 8.0f, 20.0f, 64.0f, 1000.0f}) {
+    auto expected = utils::filterUnits(unitsInfo.liveUnits(), [&](Unit* u) {
+      return !u->gone && utils::distance(u, center) <= radius;
+    });
+    EXPECT(idSet(unitsInfo.unitsInRadius(center, radius)) == idSet(expected));
+
+    expected = utils::filterUnits(expected, [](Unit* u) {
+      return u->isEnemy && u->flying();
+    });
+    EXPECT(
+        idSet(unitsInfo.unitsInRadius(center, radius, enemyAir)) ==
+        idSet(expected));
+  }
+
+  auto rect = Rect(490, 520, 40, 20);
+  auto expected = utils::filterUnits(unitsInfo.liveUnits(), [&](Unit* u) {
+    return !u->gone && rect.contains(u->pos());
+  });
+  EXPECT(idSet(unitsInfo.unitsInRect(rect)) == idSet(expected));
+
+  for (size_t k : {1, 5, 30}) {
+    auto nearest = unitsInfo.nearestUnits(center, k);
+    EXPECT(nearest.size() == std::min(k, unitsInfo.liveUnits().size()));
+    auto sorted = unitsInfo.liveUnits();
+    std::sort(sorted.begin(), sorted.end(), [&](Unit* a, Unit* b) {
+      auto da = utils::distance(a, center);
+      auto db = utils::distance(b, center);
+      return da < db || (da == db && a->id < b->id);
+    });
+    for (size_t i = 0; i < nearest.size(); i++) {
+      EXPECT(
+          utils::distance(nearest[i], center) ==
+          utils::distance(sorted[i], center));
+    }
+  }
+}
+
+SCENARIO("unitsinfo/spatial_index/benchmark[hide]") {
+  for (int numUnits : {50, 200, 400}) {
+    auto scenario = GameSinglePlayerUMS("test/maps/micro-big.scm", "Terran");
+    auto bot = makeArmiesPlayer(scenario, numUnits / 2);
+    auto state = bot->state();
+    for (int i = 0; i < 40; i++) {
+      bot->step();
+    }
+
+    int constexpr kUpdates = 200;
+    auto timeUpdates = [&](bool useIndex) {
+      FLAGS_unitsSpatialIndex = useIndex;
+      auto start = hires_clock::now();
+      for (int i = 0; i < kUpdates; i++) {
+        state->unitsInfo().update();
+      }
+      auto duration = hires_clock::now() - start;
+      return std::chrono::duration_cast<std::chrono::microseconds>(duration)
+                 .count() /
+          kUpdates;
+    };
+    auto fullScanUs = timeUpdates(false);
+    auto gridUs = timeUpdates(true);
+    VLOG(0) << state->unitsInfo().liveUnits().size()
+            << " units: UnitsInfo::update() takes " << fullScanUs
+            << "us with full scan, " << gridUs << "us with spatial index";
+    EXPECT(gridUs >= 0);
+  }
+}
@@ -75,6 +75,83 @@ CASE("batcher[.flaky]") {
   }
 }
 
+CASE("batcher/deadline_policy") {
+  auto runner = std::make_shared<BatchMock>();
+  auto metrics = std::make_shared<MetricsContext>();
+  AsyncBatcher batcher(runner, 8);
+  batcher.setMetricsContext(metrics);
+
+  auto query = [&](int value) {
+    auto state = torch::zeros({2}, at::kInt).fill_(value);
+    auto result = batcher.batchedForward(ag::Variant(state))["result"];
+    EXPECT((result == state + 1).all().item<uint8_t>());
+  };
+
+  // Wait (for a long time) until the target batch size is reached
+  AsyncBatcher::BatchingPolicy policy;
+  policy.maxWait = std::chrono::seconds(30);
+  policy.targetBatchSize = 4;
+  batcher.setBatchingPolicy(policy);
+  std::vector<std::thread> workers;
+  for (int i = 0; i < 4; i++) {
+    workers.emplace_back(query, i);
+  }
+  for (auto& worker : workers) {
+    worker.join();
+  }
+  EXPECT(batcher.lastBatchSize() == 4u);
+  EXPECT(metrics->getLastEventValue("batcher:batch_size") == 4.0f);
+  EXPECT(metrics->getMeanIntervals().count("batcher:forward") == 1u);
+
+  // Incomplete batches are forwarded once the deadline has passed
+  policy.maxWait = std::chrono::milliseconds(20);
+  batcher.setBatchingPolicy(policy);
+  auto start = std::chrono::steady_clock::now();
+  query(42);
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  EXPECT(elapsed >= std::chrono::milliseconds(20));
+  EXPECT(batcher.lastBatchSize() == 1u);
+  EXPECT(metrics->getLastEventValue("batcher:batch_size") == 1.0f);
+
+  // The adaptive policy never exceeds the maximum wait time
+  policy.adaptive = true;
+  batcher.setBatchingPolicy(policy);
+  for (int i = 0; i < 5; i++) {
+    query(i);
+    EXPECT(batcher.currentWait() <= policy.maxWait);
+  }
+}
+
+CASE("batcher/inference_pool") {
+  for (bool replicate : {false, true}) {
+    auto runner = std::make_shared<BatchMock>();
+    AsyncBatcher batcher(runner, 4);
+    batcher.setInferencePool(3, replicate);
+
+    auto worker = [&](int seed) {
+      for (int i = 0; i < 10; ++i) {
+        auto state = torch::zeros({seed + 1}, at::kInt).fill_(seed * 100 + i);
+        auto result = batcher.batchedForward(ag::Variant(state));
+        EXPECT((result["result"] == state + 1).all().item<uint8_t>());
+        EXPECT((result["result2"] == state * 10 + 1).all().item<uint8_t>());
+      }
+    };
+
+    std::vector<std::thread> workers;
+    for (int i = 0; i < 16; i++) {
+      workers.emplace_back(worker, i);
+      if (i == 8) {
+        // Switching models is fine while forwarding
+        batcher.setModel(std::make_shared<BatchMock>());
+      }
+    }
+    for (auto& w : workers) {
+      w.join();
+    }
+    EXPECT(batcher.lastBatchSize() > 0u);
+  }
+}
+
 SCENARIO("batcher.SubBatchAsyncBatcher") {
   std::shared_ptr<AsyncBatcher> batcher =
       std::make_unique<SubBatchAsyncBatcher>(4);
@@ -0,0 +1,110 @@
+/*
+ * Copyright (c) 2017-present, Facebook, Inc.
+ *
+ * This source code is licensed under the MIT license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "test.h"
+
+#include <cpid/checkpointer.h>
+#include <cpid/sampler.h>
+#include <cpid/trainer.h>
+
+#include <common/fsutils.h>
+#include <common/language.h>
+
+using namespace cpid;
+namespace fsutils = common::fsutils;
+
+namespace {
+class DummyTrainer : public Trainer {
+ public:
+  using Trainer::Trainer;
+  bool update() override {
+    return false;
+  }
+  std::shared_ptr<ReplayBufferFrame> makeFrame(ag::Variant, ag::Variant, float)
+      override {
+    return nullptr;
+  }
+};
+
+std::shared_ptr<Trainer> makeTrainer() {
+  auto model = ag::Sequential()
+                   .append(ag::Linear(4, 8).make())
+                   .append(ag::Linear(8, 2).make())
+                   .make();
+  auto optim = std::make_shared<torch::optim::SGD>(
+      model->parameters(), torch::optim::SGDOptions(0.1));
+  return std::make_shared<DummyTrainer>(
+      model, optim, std::make_unique<BaseSampler>());
+}
+
+bool sameParameters(ag::Container a, ag::Container b) {
+  auto pa = a->named_parameters();
+  auto pb = b->named_parameters();
+  for (auto& it : pa) {
+    if (!it.value().equal(pb[it.key()])) {
+      return false;
+    }
+  }
+  return pa.size() == pb.size();
+}
+} // namespace
+
+CASE("checkpointer/async_delta") {
+  auto dir = fsutils::mktempd();
+  auto cleanup = common::makeGuard([&] { fsutils::rmrf(dir); });
+  auto trainer = makeTrainer();
+  // Copies share the background writer
+  auto checkpointer = Checkpointer(trainer)
+                          .epochLength(1)
+                          .printMetricsSummary(false)
+                          .asyncCheckpoints(true)
+                          .fullCheckpointInterval(2)
+                          .checkpointPath(dir);
+  auto latestPath = checkpointer.getModelPath();
+  auto deltaPath = checkpointer.checkpointPath() + "trainer_latest.delta.bin";
+
+  // First epoch writes a full checkpoint
+  checkpointer.updateDone(1);
+  checkpointer.waitForCheckpoints();
+  EXPECT(fsutils::exists(latestPath));
+  EXPECT(!fsutils::exists(deltaPath));
+  EXPECT(!fsutils::exists(latestPath + ".tmp"));
+
+  // Second epoch only stores the tensor that changed
+  {
+    torch::NoGradGuard guard;
+    auto params = trainer->model()->named_parameters();
+    params[params.keys().back()].add_(1);
+  }
+  checkpointer.updateDone(2);
+  checkpointer.waitForCheckpoints();
+  EXPECT(fsutils::exists(deltaPath));
+  std::unordered_map<std::string, torch::Tensor> delta;
+  {
+    std::ifstream is(deltaPath, std::ios::binary);
+    cereal::BinaryInputArchive archive(is);
+    archive(delta);
+  }
+  EXPECT(delta.size() == 1u);
+
+  auto restored = makeTrainer();
+  EXPECT(!sameParameters(trainer->model(), restored->model()));
+  auto restoredPtr = restored.get();
+  ag::load(latestPath, restoredPtr);
+  EXPECT(!sameParameters(trainer->model(), restored->model()));
+  Checkpointer::loadDelta(restored, deltaPath);
+  EXPECT(sameParameters(trainer->model(), restored->model()));
+
+  // Next full checkpoint invalidates the delta
+  checkpointer.updateDone(3);
+  checkpointer.waitForCheckpoints();
+  EXPECT(!fsutils::exists(deltaPath));
+  restored = makeTrainer();
+  restoredPtr = restored.get();
+  ag::load(latestPath, restoredPtr);
+  EXPECT(sameParameters(trainer->model(), restored->model()));
+}
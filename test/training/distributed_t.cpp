@@ -15,6 +15,7 @@
 #include <c10d/FileStore.hpp>
 
 #include <autogradpp/autograd.h>
+#include <fmt/format.h>
 #include <common/autograd/utils.h>
 #include <common/fsutils.h>
 #include <cpid/distributed.h>
@@ -249,4 +250,174 @@ CASE("distributed/barrier_timeout_TSANUnsafe") {
   EXPECT(failed == nThreads);
 }
 
+namespace {
+ag::Container makeMLP(int64_t width, int depth) {
+  auto model = ag::Sequential();
+  for (auto i = 0; i < depth; i++) {
+    model.append(ag::Linear(width, width).make());
+  }
+  auto container = model.make();
+  // Identical parameters on all workers
+  torch::NoGradGuard guard;
+  int64_t n = 0;
+  for (auto& p : container->parameters()) {
+    p.copy_(torch::arange(n, n + p.numel(), at::kFloat)
+                .view_as(p)
+                .fmod_(7)
+                .sub_(3)
+                .div_(p.numel()));
+    n += p.numel();
+  }
+  return container;
+}
+
+void backward(ag::Container model, int rank) {
+  auto input = torch::ones({4, model->parameters()[0].size(1)}) * (rank + 1);
+  model->forward(input)[0].pow(2).sum().backward();
+}
+
+std::vector<torch::Tensor> cloneGrads(ag::Container model) {
+  std::vector<torch::Tensor> grads;
+  for (auto& p : model->parameters()) {
+    grads.push_back(p.grad().clone());
+    p.grad().zero_();
+  }
+  return grads;
+}
+} // namespace
+
+CASE("distributed/reduce_gradients_TSANUnsafe") {
+  auto file = fsutils::mktemp();
+  auto cleanup = utils::makeGuard([&]() { fsutils::rmrf(file); });
+  auto constexpr nThreads = 3;
+  // Layers have 1KB of weights and 64 bytes of biases
+  auto constexpr bucketBytes = 2048;
+
+  // Local gradients of each rank, followed by reduced ones
+  std::vector<std::vector<std::vector<torch::Tensor>>> grads(nThreads);
+  std::vector<size_t> numBuckets(nThreads);
+  auto test = [&](int rank) {
+    auto store = std::make_shared<dist::FileStore>(file, nThreads);
+    auto ctx = std::make_shared<dist::Context>(store, rank, nThreads);
+    auto model = makeMLP(16, 3);
+    backward(model, rank);
+    grads[rank].push_back(cloneGrads(model));
+
+    backward(model, rank);
+    ctx->allreduceGradients(model, dist::ReduceOp::SUM, bucketBytes);
+    grads[rank].push_back(cloneGrads(model));
+
+    {
+      dist::GradientReducer reducer(model, bucketBytes, false, ctx);
+      numBuckets[rank] = reducer.numBuckets();
+      for (auto i = 0; i < 2; i++) {
+        backward(model, rank);
+        reducer.wait();
+        grads[rank].push_back(cloneGrads(model));
+      }
+    }
+
+    dist::GradientReducer compressed(model, bucketBytes, true, ctx);
+    backward(model, rank);
+    compressed.wait();
+    grads[rank].push_back(cloneGrads(model));
+  };
+
+  std::vector<std::thread> threads;
+  for (auto i = 0; i < nThreads; i++) {
+    threads.emplace_back(test, i);
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  EXPECT(numBuckets[0] == 3u);
+  auto maxDiff = [](torch::Tensor a, torch::Tensor b) {
+    return (a - b).abs().max().item<float>();
+  };
+  for (size_t j = 0; j < grads[0][0].size(); j++) {
+    auto expected = torch::zeros_like(grads[0][0][j]);
+    for (auto rank = 0; rank < nThreads; rank++) {
+      expected += grads[rank][0][j];
+    }
+    auto scale = expected.abs().max().item<float>();
+    for (auto rank = 0; rank < nThreads; rank++) {
+      EXPECT(maxDiff(grads[rank][1][j], expected) <= scale * 1e-5);
+      EXPECT(maxDiff(grads[rank][2][j], expected) <= scale * 1e-5);
+      EXPECT(maxDiff(grads[rank][3][j], expected) <= scale * 1e-5);
+      EXPECT(maxDiff(grads[rank][4][j], expected) <= scale * 2e-3);
+    }
+  }
+}
+
+CASE("distributed/bench/reduce_gradients[hide]") {
+  auto constexpr numSteps = 20;
+  auto constexpr depth = 4;
+  for (auto nThreads : {2, 4}) {
+    for (auto width : {256, 1024, 2048}) {
+      for (auto mode : {"param", "bucketed", "overlapped", "fp16"}) {
+        auto file = fsutils::mktemp();
+        auto cleanup = utils::makeGuard([&]() { fsutils::rmrf(file); });
+        double stepMs = 0;
+        auto run = [&](int rank) {
+          auto store = std::make_shared<dist::FileStore>(file, nThreads);
+          auto ctx = std::make_shared<dist::Context>(store, rank, nThreads);
+          auto model = makeMLP(width, depth);
+          std::unique_ptr<dist::GradientReducer> reducer;
+          if (mode == std::string("overlapped")) {
+            reducer = std::make_unique<dist::GradientReducer>(
+                model, dist::Context::kGradientBucketBytes, false, ctx);
+          } else if (mode == std::string("fp16")) {
+            reducer = std::make_unique<dist::GradientReducer>(
+                model, dist::Context::kGradientBucketBytes, true, ctx);
+          }
+          auto step = [&] {
+            backward(model, rank);
+            if (reducer) {
+              reducer->wait();
+            } else if (mode == std::string("bucketed")) {
+              ctx->allreduceGradients(model);
+            } else {
+              for (auto& p : model->parameters()) {
+                ctx->allreduce(p.grad());
+              }
+            }
+            for (auto& p : model->parameters()) {
+              p.grad().zero_();
+            }
+          };
+          step();
+          ctx->barrier();
+          auto start = std::chrono::steady_clock::now();
+          for (auto i = 0; i < numSteps; i++) {
+            step();
+          }
+          ctx->barrier();
+          if (rank == 0) {
+            std::chrono::duration<double, std::milli> d =
+                std::chrono::steady_clock::now() - start;
+            stepMs = d.count() / numSteps;
+          }
+        };
+
+        std::vector<std::thread> threads;
+        for (auto i = 0; i < nThreads; i++) {
+          threads.emplace_back(run, i);
+        }
+        for (auto& thread : threads) {
+          thread.join();
+        }
+        auto paramMB = double(depth * (width + 1) * width * 4) / (1 << 20);
+        std::cerr << fmt::format(
+                         "workers {} params {:.1f}MB {:10s} {:8.2f}ms/step",
+                         nThreads,
+                         paramMB,
+                         mode,
+                         stepMs)
+                  << std::endl;
+      }
+    }
+  }
+}
+
 #endif // HAVE_CPID
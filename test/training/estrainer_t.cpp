@@ -0,0 +1,277 @@
+/*
+ * Copyright (c) 2017-present, Facebook, Inc.
+ *
+ * This source code is licensed under the MIT license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "test.h"
+
+#include <common/autograd/utils.h>
+#include <cpid/estrainer.h>
+#include <cpid/sampler.h>
+
+#include <fmt/format.h>
+
+#include <thread>
+
+using namespace cpid;
+
+namespace {
+class TestESTrainer : public ESTrainer {
+ public:
+  using ESTrainer::ESTrainer;
+  using ESTrainer::generateModel;
+  using ESTrainer::historyModel;
+  using ESTrainer::seedNoise;
+
+  std::pair<int, int64_t> generationSeed(EpisodeHandle const& handle) {
+    return gameToGenerationSeed_.at({handle.gameID(), handle.episodeKey()});
+  }
+  int latestGeneration() {
+    return modelsHistory_.back().first;
+  }
+  size_t numStoredModels() {
+    return modelCache_.size() + scratchModels_.size();
+  }
+};
+
+ag::Container makeMLP(int width, int depth) {
+  auto model = ag::Sequential();
+  for (auto i = 0; i < depth; i++) {
+    model.append(ag::Linear(width, width).make());
+  }
+  return model.make();
+}
+
+std::shared_ptr<TestESTrainer>
+makeTrainer(ag::Container model, size_t batchSize, bool seedReplay) {
+  auto optim = std::make_shared<torch::optim::SGD>(
+      model->parameters(), torch::optim::SGDOptions(1e-3));
+  auto trainer = std::make_shared<TestESTrainer>(
+      model,
+      optim,
+      std::make_unique<BaseSampler>(),
+      0.1,
+      batchSize,
+      4,
+      true,
+      ESTrainer::kNone,
+      false);
+  trainer->seedReplay(seedReplay);
+  return trainer;
+}
+
+/// Gradient estimate as computed by ESTrainer::update() without seed replay
+std::vector<torch::Tensor> referenceGradients(
+    std::shared_ptr<TestESTrainer> trainer,
+    std::vector<std::pair<int, int64_t>> const& generationSeeds,
+    std::vector<float> const& rewards,
+    float std) {
+  auto current = trainer->model()->parameters();
+  std::vector<torch::Tensor> grads;
+  for (auto& p : current) {
+    grads.push_back(torch::zeros_like(p));
+  }
+  for (size_t i = 0; i < generationSeeds.size(); i++) {
+    auto generation = generationSeeds[i].first;
+    auto perturbed =
+        trainer->generateModel(generation, generationSeeds[i].second)
+            ->parameters();
+    auto original = trainer->historyModel(generation)->parameters();
+    double importanceWeight = 1.0;
+    if (generation != trainer->latestGeneration()) {
+      double logImportanceWeight = 0.0;
+      for (size_t j = 0; j < current.size(); j++) {
+        logImportanceWeight +=
+            -(perturbed[j] - current[j]).pow(2.0).sum().item<double>() +
+            (perturbed[j] - original[j]).pow(2.0).sum().item<double>();
+      }
+      importanceWeight =
+          std::min(std::exp(0.5 * logImportanceWeight / std / std), 1.0);
+    }
+    for (size_t j = 0; j < current.size(); j++) {
+      grads[j].add_(
+          perturbed[j] - current[j],
+          -rewards[i] / std * importanceWeight / generationSeeds.size());
+    }
+  }
+  return grads;
+}
+
+float maxDiff(torch::Tensor a, torch::Tensor b) {
+  return (a - b).abs().max().item<float>();
+}
+} // namespace
+
+CASE("estrainer/seed_replay") {
+  torch::NoGradGuard guard;
+  auto constexpr batchSize = 4;
+  auto model = makeMLP(8, 2);
+  auto trainer = makeTrainer(model, batchSize, true);
+  auto input = torch::randn({1, 8});
+
+  // The second half of the episodes will be used after the first update,
+  // i.e. they will be off-policy
+  std::vector<Trainer::EpisodeHandle> episodes;
+  std::vector<std::pair<int, int64_t>> generationSeeds;
+  for (auto i = 0; i < 2 * batchSize; i++) {
+    episodes.push_back(trainer->startEpisode());
+    generationSeeds.push_back(trainer->generationSeed(episodes.back()));
+  }
+  EXPECT(trainer->numStoredModels() == 0u);
+
+  // Forward passes use the perturbation of the respective episode
+  std::vector<ag::Variant> outputs;
+  for (auto i = 0; i < 2 * batchSize; i++) {
+    auto& gs = generationSeeds[i];
+    auto expected = trainer->generateModel(gs.first, gs.second)
+                        ->forward(input)
+                        .getTensorList()[0];
+    outputs.push_back(trainer->forward(input, episodes[i]));
+    EXPECT(maxDiff(outputs.back().getTensorList()[0], expected) < 1e-6);
+  }
+  EXPECT(trainer->numStoredModels() == 1u);
+
+  // Antithetic pairs use opposite perturbations
+  EXPECT(generationSeeds[0].second == -generationSeeds[1].second);
+  auto p0 = trainer->generateModel(0, generationSeeds[0].second)->parameters();
+  auto p1 = trainer->generateModel(0, generationSeeds[1].second)->parameters();
+  auto original = model->parameters();
+  EXPECT(maxDiff(p0[0] + p1[0], 2 * original[0]) < 1e-6);
+  EXPECT(maxDiff(p0[0], original[0]) > 0.1);
+
+  std::vector<float> rewards = {1, 3, -2, 0.5, 2, -1, 0, 4};
+  auto finish = [&](int begin, int end) {
+    for (auto i = begin; i < end; i++) {
+      trainer->step(
+          episodes[i],
+          trainer->makeFrame(outputs[i], input, rewards[i]),
+          true);
+    }
+    auto expected = referenceGradients(
+        trainer,
+        std::vector<std::pair<int, int64_t>>(
+            generationSeeds.begin() + begin, generationSeeds.begin() + end),
+        std::vector<float>(rewards.begin() + begin, rewards.begin() + end),
+        0.1);
+    EXPECT(trainer->update());
+    auto params = model->parameters();
+    for (size_t j = 0; j < params.size(); j++) {
+      auto scale = expected[j].abs().max().item<float>();
+      EXPECT(maxDiff(params[j].grad(), expected[j]) <= scale * 1e-4);
+    }
+  };
+  finish(0, batchSize);
+  EXPECT(trainer->latestGeneration() == 1);
+  finish(batchSize, 2 * batchSize);
+  EXPECT(trainer->latestGeneration() == 2);
+}
+
+CASE("estrainer/scratch_models") {
+  torch::NoGradGuard guard;
+  auto constexpr numEpisodes = 4;
+  auto model = makeMLP(8, 2);
+  auto trainer = makeTrainer(model, numEpisodes, true);
+  trainer->maxScratchModels(numEpisodes);
+  auto input = torch::randn({1, 8});
+
+  std::vector<Trainer::EpisodeHandle> episodes;
+  for (auto i = 0; i < numEpisodes; i++) {
+    episodes.push_back(trainer->startEpisode());
+  }
+
+  // Interleaved episodes keep their perturbed models around
+  for (auto s = 0; s < 2; s++) {
+    for (auto i = 0; i < numEpisodes; i++) {
+      auto gs = trainer->generationSeed(episodes[i]);
+      auto expected = trainer->generateModel(gs.first, gs.second)
+                          ->forward(input)
+                          .getTensorList()[0];
+      auto output = trainer->forward(input, episodes[i]);
+      EXPECT(maxDiff(output.getTensorList()[0], expected) < 1e-6);
+    }
+  }
+  EXPECT(trainer->numStoredModels() == size_t(numEpisodes));
+
+  // Noise generated on the device matches the host version
+  if (common::gpuAvailable()) {
+    auto cpu = TestESTrainer::seedNoise(-1234, 5, 1000);
+    auto cuda = TestESTrainer::seedNoise(-1234, 5, 1000, torch::kCUDA);
+    EXPECT(maxDiff(cuda.to(torch::kCPU), cpu) < 1e-5);
+  }
+}
+
+CASE("estrainer/bench/seed_replay[hide]") {
+  torch::NoGradGuard guard;
+  auto constexpr numEpisodes = 64;
+  auto constexpr numThreads = 8;
+  auto constexpr numSteps = 8;
+  auto constexpr width = 512;
+  auto constexpr depth = 4;
+  // Materialized models, seed replay, and seed replay with a perturbed model
+  // per episode
+  for (auto mode : {0, 1, 2}) {
+    auto model = makeMLP(width, depth);
+    auto trainer = makeTrainer(model, numEpisodes, mode > 0);
+    if (mode == 2) {
+      trainer->maxScratchModels(numEpisodes);
+    }
+    auto input = torch::randn({1, width});
+    auto elapsedMs = [](auto start) {
+      std::chrono::duration<double, std::milli> d =
+          std::chrono::steady_clock::now() - start;
+      return d.count();
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<Trainer::EpisodeHandle> episodes;
+    for (auto i = 0; i < numEpisodes; i++) {
+      episodes.push_back(trainer->startEpisode());
+    }
+    auto startMs = elapsedMs(start);
+
+    // Every thread plays a fixed subset of the episodes, interleaving steps
+    start = std::chrono::steady_clock::now();
+    std::vector<ag::Variant> outputs(numEpisodes);
+    std::vector<std::thread> threads;
+    for (auto t = 0; t < numThreads; t++) {
+      threads.emplace_back([&, t] {
+        torch::NoGradGuard threadGuard;
+        for (auto s = 0; s < numSteps; s++) {
+          for (auto i = t; i < numEpisodes; i += numThreads) {
+            outputs[i] = trainer->forward(input, episodes[i]);
+          }
+        }
+      });
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+    auto forwardMs = elapsedMs(start);
+    auto numModels = trainer->numStoredModels();
+
+    for (auto i = 0; i < numEpisodes; i++) {
+      trainer->step(
+          episodes[i], trainer->makeFrame(outputs[i], input, i % 3), true);
+    }
+    start = std::chrono::steady_clock::now();
+    EXPECT(trainer->update());
+    auto updateMs = elapsedMs(start);
+
+    auto modelMB = double(depth * (width + 1) * width * 4) / (1 << 20);
+    std::cerr << fmt::format(
+                     "{:20s} episodes {} start {:8.2f}ms forward {:8.2f}ms "
+                     "update {:8.2f}ms stored models {} ({:.1f}MB)",
+                     mode == 0 ? "materialized"
+                               : mode == 1 ? "seed replay"
+                                           : "seed replay (pinned)",
+                     numEpisodes,
+                     startMs,
+                     forwardMs,
+                     updateMs,
+                     numModels,
+                     numModels * modelMB)
+              << std::endl;
+  }
+}
@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2017-present, Facebook, Inc.
+ *
+ * This source code is licensed under the MIT license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "test.h"
+
+#include "cpid/prioritizedreplay.h"
+
+#include <map>
+
+using namespace cpid;
+
+CASE("prioritizedreplay/sumtree") {
+  SumTree tree(5);
+  for (auto i = 0U; i < 5; i++) {
+    tree.set(i, i);
+  }
+  EXPECT(tree.total() == 10.0);
+  EXPECT(tree.find(0.0) == 1u);
+  EXPECT(tree.find(0.99) == 1u);
+  EXPECT(tree.find(1.0) == 2u);
+  EXPECT(tree.find(9.99) == 4u);
+  EXPECT(tree.find(100.0) == 4u);
+
+  tree.set(4, 0);
+  EXPECT(tree.total() == 6.0);
+  EXPECT(tree.find(9.99) == 3u);
+  EXPECT_THROWS(tree.set(5, 1));
+  EXPECT_THROWS(tree.set(0, -1));
+}
+
+CASE("prioritizedreplay/sample") {
+  PrioritizedReplay<int> pr(4, 1.0, 1.0);
+  for (int i = 0; i < 6; i++) {
+    EXPECT(pr.add(i) == uint64_t(i));
+  }
+  EXPECT(pr.size() == 4u);
+
+  // Oldest items have been replaced; IDs map back to items
+  auto rengine = common::Rand::makeRandEngine<std::mt19937>();
+  auto s = pr.sample(rengine, 8);
+  for (auto i = 0U; i < s.items.size(); i++) {
+    EXPECT(s.items[i] >= 2);
+    EXPECT(s.ids[i] == uint64_t(s.items[i]));
+  }
+
+  // Updates for replaced items are ignored
+  pr.updatePriorities({0, 2, 3, 4, 5}, {100, 1, 1, 1, 5});
+  std::map<int, int> counts;
+  s = pr.sample(rengine, 800);
+  for (auto item : s.items) {
+    counts[item]++;
+  }
+  EXPECT(counts.count(0) == 0u);
+  EXPECT(counts[5] > counts[2]);
+  // With alpha = beta = 1, weights are inversely proportional to priorities
+  for (auto i = 0U; i < s.items.size(); i++) {
+    if (s.items[i] == 5) {
+      EXPECT(s.weights[i] == lest::approx(0.2f));
+    } else {
+      EXPECT(s.weights[i] == lest::approx(1.0f));
+    }
+  }
+
+  pr.clear();
+  EXPECT(pr.size() == 0u);
+  EXPECT_THROWS(pr.sample(rengine, 1));
+}
@@ -0,0 +1,165 @@
+/*
+ * Copyright (c) 2017-present, Facebook, Inc.
+ *
+ * This source code is licensed under the MIT license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "test.h"
+
+#include "cpid/trainer.h"
+
+#include <common/rand.h>
+
+#include <fmt/format.h>
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+using namespace cpid;
+
+namespace {
+
+std::shared_ptr<ReplayBufferFrame> makeFrame(float reward = 0) {
+  return std::make_shared<RewardBufferFrame>(reward);
+}
+
+} // namespace
+
+CASE("replaybuffer/basic") {
+  ReplayBuffer rb(4);
+  rb.append("g1", "a", makeFrame());
+  rb.append("g1", "a", makeFrame(), true);
+  rb.append("g1", "b", makeFrame());
+  rb.append("g2", "", makeFrame(), true);
+
+  EXPECT(rb.size() == 3u);
+  EXPECT(rb.size("g1") == 2u);
+  EXPECT(rb.sizeDone() == 2u);
+  EXPECT(rb.sizeDone("g1") == 1u);
+  EXPECT(rb.has("g1", "b"));
+  EXPECT(!rb.isDone("g1", "b"));
+  EXPECT(rb.isDone("g1", "a"));
+  EXPECT(rb.get("g1", "a").size() == 2u);
+  EXPECT(rb.getAllEpisodes().size() == 2u);
+
+  // Only finished episodes are sampled
+  auto rengine = common::Rand::makeRandEngine<std::mt19937>();
+  for (auto const& sample : rb.sample(rengine, 20)) {
+    EXPECT(sample.first.episodeKey != "b");
+    EXPECT(&sample.second.get() ==
+           &rb.get(sample.first.gameID, sample.first.episodeKey));
+  }
+
+  rb.erase("g1", "a");
+  EXPECT(rb.sizeDone() == 1u);
+  EXPECT(!rb.has("g1", "a"));
+  EXPECT(rb.sample(rengine, 1)[0].first.gameID == "g2");
+
+  rb.clear();
+  EXPECT(rb.size() == 0u);
+  EXPECT(rb.sizeDone() == 0u);
+  EXPECT_THROWS(rb.sample(rengine, 1));
+}
+
+CASE("replaybuffer/capacity") {
+  ReplayBuffer rb(4, 3);
+  for (int i = 0; i < 5; i++) {
+    auto uid = std::to_string(i);
+    rb.append(uid, "", makeFrame());
+    rb.append(uid, "", makeFrame(), true);
+  }
+  // Episodes that are not done yet don't count towards the capacity
+  rb.append("running", "", makeFrame());
+
+  EXPECT(rb.sizeDone() == 3u);
+  EXPECT(rb.size() == 4u);
+  EXPECT(!rb.has("0"));
+  EXPECT(!rb.has("1"));
+  EXPECT(rb.isDone("2"));
+  EXPECT(rb.has("running"));
+
+  // Explicitly erased episodes are skipped when evicting
+  rb.erase("3");
+  rb.append("5", "", makeFrame(), true);
+  rb.append("6", "", makeFrame(), true);
+  EXPECT(rb.sizeDone() == 3u);
+  EXPECT(!rb.has("2"));
+  EXPECT(rb.isDone("4"));
+  rb.append("7", "", makeFrame(), true);
+  EXPECT(rb.sizeDone() == 3u);
+  EXPECT(!rb.has("4"));
+  EXPECT(rb.isDone("5"));
+
+  rb.setCapacity(1);
+  EXPECT(rb.sizeDone() == 1u);
+  EXPECT(rb.isDone("7"));
+  EXPECT(rb.has("running"));
+}
+
+CASE("replaybuffer/bench/contention[hide]") {
+  auto numProducers = std::max(2u, std::thread::hardware_concurrency());
+  auto constexpr kEpisodeLength = 50;
+  auto constexpr kGamesPerProducer = 4;
+
+  for (auto numShards : {1, 16, 64}) {
+    ReplayBuffer rb(numShards, 4096);
+    std::atomic<bool> stop{false};
+    std::atomic<size_t> numFrames{0};
+    std::atomic<size_t> numSamples{0};
+
+    std::vector<std::thread> threads;
+    for (auto i = 0U; i < numProducers; i++) {
+      threads.emplace_back([&, i] {
+        size_t n = 0;
+        std::vector<int> episodes(kGamesPerProducer, 0);
+        while (!stop.load()) {
+          auto game = n % kGamesPerProducer;
+          auto uid = fmt::format("{}-{}", i, game);
+          auto key = std::to_string(episodes[game]);
+          auto done = (n / kGamesPerProducer) % kEpisodeLength ==
+              kEpisodeLength - 1;
+          rb.append(uid, key, makeFrame(), done);
+          if (done) {
+            episodes[game]++;
+          }
+          n++;
+        }
+        numFrames += n;
+      });
+    }
+    // A single consumer, as in most trainers
+    threads.emplace_back([&] {
+      auto rengine = common::Rand::makeRandEngine<std::mt19937>();
+      size_t n = 0;
+      while (!stop.load()) {
+        if (rb.sizeDone() < 32) {
+          std::this_thread::yield();
+          continue;
+        }
+        n += rb.sample(rengine, 32).size();
+      }
+      numSamples += n;
+    });
+
+    auto start = std::chrono::steady_clock::now();
+    std::this_thread::sleep_for(std::chrono::seconds(2));
+    stop.store(true);
+    for (auto& th : threads) {
+      th.join();
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    auto ms =
+        std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count();
+    std::cerr << fmt::format(
+                     "{} producers, {} shards: {:.2f}M frames/s, "
+                     "{:.2f}M samples/s",
+                     numProducers,
+                     numShards,
+                     double(numFrames.load()) / (1e3 * ms),
+                     double(numSamples.load()) / (1e3 * ms))
+              << std::endl;
+    EXPECT(rb.sizeDone() <= 4096u);
+  }
+}
@@ -101,3 +101,101 @@ CASE("trainer/metrics/serialization") {
   ctx2->loadJson(ss);
   EXPECT(*ctx == *ctx2);
 }
+
+CASE("trainer/metrics/summary") {
+  auto ctx = std::make_shared<cpid::MetricsContext>();
+  ctx->pushEvent("event", 100);
+  ctx->setRetention("event", cpid::MetricsContext::Retention::Summary);
+  for (auto i = 1; i <= 1000; i++) {
+    ctx->pushEvent("event", i);
+  }
+  EXPECT(ctx->hasEvent("event"));
+  EXPECT(ctx->getLastEventValue("event") == 1000.0f);
+  EXPECT(ctx->getLastEvents("event", 10).size() == 1U);
+
+  auto summary = ctx->getEventSummary("event");
+  EXPECT(summary.count() == 1001U);
+  EXPECT(summary.min() == 1.0f);
+  EXPECT(summary.max() == 1000.0f);
+  EXPECT(summary.mean() == lest::approx(500600.0 / 1001));
+  EXPECT(std::abs(summary.quantile(0.5f) - 500) < 500 * 0.04);
+  EXPECT(std::abs(summary.quantile(0.99f) - 990) < 990 * 0.04);
+  EXPECT(summary.ewma() > 900.0f);
+
+  // Existing aggregations keep working
+  EXPECT(ctx->getMeanEventValues()["event"] == lest::approx(summary.mean()));
+  auto minRed = [](float a, float b) { return std::min(a, b); };
+  auto maxRed = [](float a, float b) { return std::max(a, b); };
+  EXPECT(ctx->reduceEventValues(minRed, 1e20)["event"] == 1.0f);
+  EXPECT(ctx->reduceEventValues(maxRed, -1e20)["event"] == 1000.0f);
+
+  // Summaries are serialized instead of the time series
+  ctx->pushEvent("other", 1.5);
+  std::stringstream ss;
+  ctx->dumpJson(ss);
+  auto ctx2 = std::make_shared<cpid::MetricsContext>();
+  ctx2->loadJson(ss);
+  EXPECT(*ctx == *ctx2);
+  EXPECT(ctx2->getEventSummary("event") == summary);
+  EXPECT(ctx2->getLastEvents("other", 10).size() == 1U);
+}
+
+CASE("trainer/metrics/default_retention") {
+  auto ctx = std::make_shared<cpid::MetricsContext>();
+  auto minRed = [](float a, float b) { return std::min(a, b); };
+  auto maxRed = [](float a, float b) { return std::max(a, b); };
+  ctx->setRetention("full", cpid::MetricsContext::Retention::Full);
+  ctx->pushEvent("event", 1);
+  ctx->pushEvent("event", 2);
+  ctx->pushEvent("full", 1);
+
+  // Existing events are kept in the summary
+  ctx->setDefaultRetention(cpid::MetricsContext::Retention::Summary);
+  ctx->pushEvent("event", 3);
+  ctx->pushEvent("event", 4);
+  ctx->pushEvent("full", 2);
+  EXPECT(ctx->getEventSummary("event").count() == 4U);
+  EXPECT(ctx->getLastEvents("event", 10).size() == 1U);
+  EXPECT(ctx->reduceEventValues(minRed, 1e20)["event"] == 1.0f);
+  EXPECT(ctx->reduceEventValues(maxRed, -1e20)["event"] == 4.0f);
+
+  // Keys with explicit retention are not affected
+  EXPECT(ctx->getLastEvents("full", 10).size() == 2U);
+}
+
+CASE("trainer/metrics/threads") {
+  auto ctx = std::make_shared<cpid::MetricsContext>();
+  auto const kThreads = 8;
+  auto const kEvents = 1000;
+  auto eventKey = cpid::MetricsContext::key("event");
+  auto counterKey = cpid::MetricsContext::key("ctr");
+  std::vector<std::thread> threads;
+  for (auto i = 0; i < kThreads; i++) {
+    threads.emplace_back([&, i] {
+      for (auto j = 0; j < kEvents; j++) {
+        ctx->pushEvent(eventKey, i);
+        ctx->incCounter(counterKey);
+        cpid::MetricsContext::Timer timer(ctx, "timer");
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  EXPECT(ctx->getCounter("ctr") == float(kThreads * kEvents));
+  EXPECT(
+      ctx->getLastEvents("event", kThreads * kEvents * 2).size() ==
+      size_t(kThreads * kEvents));
+  EXPECT(
+      ctx->getMeanEventValues()["event"] ==
+      lest::approx((kThreads - 1) / 2.0));
+  EXPECT(
+      ctx->getIntervalSummary("timer").count() == size_t(kThreads * kEvents));
+
+  ctx->setCounter("ctr", 2.0);
+  EXPECT(ctx->getCounter("ctr") == 2.0);
+  ctx->clear();
+  EXPECT(!ctx->hasEvent("event"));
+  EXPECT(!ctx->hasCounter("ctr"));
+}